@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures client prefix lookups: builds tables of -n IPv4 and -n IPv6
+ * prefixes with lengths spread roughly like a routing table, then looks up
+ * addresses inside random prefixes and random addresses. With -v every
+ * lookup is also checked against a linear scan of the prefixes, which is
+ * slow: use it with a few thousand prefixes.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "cidr.h"
+
+struct prefix {
+	uint8_t addr[16];
+	unsigned len;
+};
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n prefixes] [-l lookups] [-v]\n"
+			"  -n  prefixes of each family (default 1000000)\n"
+			"  -l  lookups of each kind (default 10000000)\n"
+			"  -v  check lookups against a linear scan\n",
+			prog);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+xorshift(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *s = x;
+}
+
+/* Mostly /24 and /48, like routing tables */
+static unsigned
+random_len(uint64_t *seed, bool v6)
+{
+	unsigned r = xorshift(seed) % 100;
+
+	if (!v6) {
+		return r < 60 ? 24 : r < 90 ? 16 + r % 8 : r < 95 ? 8 + r % 8 :
+				25 + r % 8;
+	}
+
+	return r < 60 ? 48 : r < 70 ? 32 : r < 90 ? 29 + r % 19 : 49 + r % 16;
+}
+
+static void
+random_prefix(uint64_t *seed, bool v6, struct prefix *p, char *buf,
+		size_t len)
+{
+	uint64_t r[2] = {xorshift(seed), xorshift(seed)};
+
+	memcpy(p->addr, r, 16);
+	p->len = random_len(seed, v6);
+
+	if (v6) {
+		/* Global unicast, 2000::/3 */
+		p->addr[0] = 0x20 | (p->addr[0] & 0x1f);
+		inet_ntop(AF_INET6, p->addr, buf, len);
+	}
+	else {
+		inet_ntop(AF_INET, p->addr, buf, len);
+	}
+
+	snprintf(buf + strlen(buf), len - strlen(buf), "/%u", p->len);
+}
+
+static bool
+contains(const struct prefix *p, const uint8_t *addr)
+{
+	unsigned i, len = p->len;
+
+	for (i = 0; len > 0; i ++, len = len > 8 ? len - 8 : 0) {
+		if ((p->addr[i] ^ addr[i]) & (0xff00 >> MIN(len, 8))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Value of the longest prefix containing the address, later ones win */
+static uint32_t
+scan(const struct prefix *p, size_t n, const uint8_t *addr)
+{
+	uint32_t v = 0;
+	unsigned best = 0;
+	size_t i;
+
+	for (i = 0; i < n; i ++) {
+		if (contains(&p[i], addr) && (v == 0 || p[i].len >= best)) {
+			v = i + 1;
+			best = p[i].len;
+		}
+	}
+
+	return v;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *kinds[] = {"in prefixes", "random"};
+	struct cidr_table *t;
+	struct prefix *p;
+	unsigned long n = 1000000, lookups = 10000000, i, found, errors = 0;
+	uint8_t (*addrs)[16];
+	uint64_t seed = 0x9e3779b97f4a7c15ULL, r[2];
+	uint32_t v, a4;
+	unsigned fam, k, j, added;
+	bool verify = false;
+	double start, elapsed;
+	char buf[64];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:l:vh")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			lookups = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verify = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (n == 0 || n >= (1UL << 31) || lookups == 0) {
+		usage(argv[0]);
+	}
+
+	p = malloc(n * sizeof(*p));
+	addrs = malloc(lookups * sizeof(*addrs));
+
+	if (p == NULL || addrs == NULL) {
+		abort();
+	}
+
+	printf("%6s %12s %10s %10s %14s %10s %10s\n", "family", "prefixes",
+			"build_s", "memory_mb", "lookups", "ns/lookup", "found");
+
+	for (fam = 0; fam < 2; fam ++) {
+		t = cidr_table_create();
+
+		/* Values are prefix indexes, duplicates keep the last */
+		for (i = 0; i < n; i ++) {
+			random_prefix(&seed, fam == 1, &p[i], buf, sizeof(buf));
+
+			if (!cidr_add(t, buf, i + 1)) {
+				fprintf(stderr, "cannot add %s\n", buf);
+				return EXIT_FAILURE;
+			}
+
+			/* Host bits are cleared, for the scan as well */
+			for (j = 0, added = p[i].len; j < 16; j ++,
+					added = added > 8 ? added - 8 : 0) {
+				p[i].addr[j] &= added >= 8 ? 0xff : 0xff00 >> added;
+			}
+		}
+
+		start = now();
+		cidr_table_build(t);
+		elapsed = now() - start;
+
+		for (k = 0; k < 2; k ++) {
+			for (i = 0; i < lookups; i ++) {
+				r[0] = xorshift(&seed);
+				r[1] = xorshift(&seed);
+				memcpy(addrs[i], r, 16);
+
+				if (k == 0) {
+					/* Host bits of some prefix */
+					const struct prefix *q = &p[r[0] % n];
+
+					for (j = 0; j < 16; j ++) {
+						unsigned bits = q->len > j * 8 ? q->len - j * 8 : 0;
+
+						if (bits >= 8) {
+							addrs[i][j] = q->addr[j];
+						}
+						else if (bits > 0) {
+							addrs[i][j] = (q->addr[j] & (0xff00 >> bits)) |
+									(addrs[i][j] & (0xff >> bits));
+						}
+					}
+				}
+			}
+
+			found = 0;
+			start = now();
+
+			for (i = 0; i < lookups; i ++) {
+				if (fam == 0) {
+					memcpy(&a4, addrs[i], 4);
+					v = cidr_lookup4(t, ntohl(a4));
+				}
+				else {
+					v = cidr_lookup6(t, addrs[i]);
+				}
+
+				found += v != 0;
+			}
+
+			printf("%6s %12lu %10.2f %10.1f %14s %10.1f %9.2f%%\n",
+					fam == 0 ? "ipv4" : "ipv6", n, elapsed,
+					cidr_table_memory(t) / 1048576.0, kinds[k],
+					(now() - start) * 1e9 / lookups, found * 100.0 / lookups);
+
+			if (!verify) {
+				continue;
+			}
+
+			for (i = 0; i < lookups; i ++) {
+				if (fam == 0) {
+					memcpy(&a4, addrs[i], 4);
+					v = cidr_lookup4(t, ntohl(a4));
+				}
+				else {
+					v = cidr_lookup6(t, addrs[i]);
+				}
+
+				if (v != scan(p, n, addrs[i])) {
+					errors ++;
+				}
+			}
+		}
+
+		cidr_table_free(t);
+	}
+
+	if (verify) {
+		printf("%lu mismatches\n", errors);
+	}
+
+	free(addrs);
+	free(p);
+
+	return errors == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,364 @@
+#!/usr/bin/env python3
+"""
+Regenerates the ClientHello fixtures in this directory.
+
+Every fixture follows the cipher suite list, extension order, group and key
+share layout of the named client, so the parser sees the same shapes and sizes
+as on the wire. Random fields, key shares and ECH payloads are filled from a
+PRNG seeded with the file name, which keeps the output stable.
+"""
+
+import os
+import random
+import struct
+import sys
+
+GREASE = [0x0a0a + 0x1010 * i for i in range(16)]
+
+# Sizes of hybrid key shares: X25519 (32) + ML-KEM-768 / Kyber768 (1184)
+MLKEM_SHARE = 32 + 1184
+
+
+def u8(v):
+    return struct.pack('>B', v)
+
+
+def u16(v):
+    return struct.pack('>H', v)
+
+
+def vec8(data):
+    return u8(len(data)) + data
+
+
+def vec16(data):
+    return u16(len(data)) + data
+
+
+def u16list(vals):
+    return b''.join(u16(v) for v in vals)
+
+
+class Hello:
+    def __init__(self, name):
+        self.rng = random.Random(name)
+        self.grease = self.rng.sample(GREASE, 4)
+
+    def rand(self, n):
+        return bytes(self.rng.getrandbits(8) for _ in range(n))
+
+    def ext(self, t, data=b''):
+        return u16(t) + vec16(data)
+
+    def sni(self, host):
+        h = host.encode()
+        return self.ext(0x0000, vec16(u8(0) + vec16(h)))
+
+    def alpn(self, protos):
+        return self.ext(0x0010, vec16(b''.join(vec8(p.encode()) for p in protos)))
+
+    def groups(self, groups):
+        return self.ext(0x000a, vec16(u16list(groups)))
+
+    def sigalgs(self, algs, t=0x000d):
+        return self.ext(t, vec16(u16list(algs)))
+
+    def versions(self, vers):
+        return self.ext(0x002b, vec8(u16list(vers)))
+
+    def key_share(self, shares):
+        body = b''
+        for group, size in shares:
+            body += u16(group) + vec16(self.rand(size) if size > 1 else b'\0' * size)
+        return self.ext(0x0033, vec16(body))
+
+    def ech_outer(self, payload_len):
+        body = u8(0) + u16(0x0001) + u16(0x0001) + u8(self.rng.getrandbits(8))
+        body += vec16(self.rand(32)) + vec16(self.rand(payload_len))
+        return self.ext(0xfe0d, body)
+
+    def build(self, ciphers, exts, record_version=0x0301, session_id=32,
+              pad=False):
+        body = u16(0x0303) + self.rand(32) + vec8(self.rand(session_id))
+        body += vec16(u16list(ciphers)) + vec8(b'\0')
+        ext_data = b''.join(exts)
+
+        if pad:
+            # BoringSSL/OpenSSL F5 workaround: no handshake of 256-511 bytes
+            hs_len = 4 + len(body) + 2 + len(ext_data)
+            if 0xff < hs_len < 0x200:
+                plen = 0x200 - hs_len
+                plen = plen - 4 if plen >= 5 else 1
+                ext_data += self.ext(0x0015, b'\0' * plen)
+
+        body += vec16(ext_data)
+        hs = u8(1) + struct.pack('>I', len(body))[1:] + body
+        return u8(0x16) + u16(record_version) + vec16(hs)
+
+
+CHROME_CIPHERS = [0x1301, 0x1302, 0x1303, 0xc02b, 0xc02f, 0xc02c, 0xc030,
+                  0xcca9, 0xcca8, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f,
+                  0x0035]
+CHROME_SIGALGS = [0x0403, 0x0804, 0x0401, 0x0503, 0x0805, 0x0501, 0x0806,
+                  0x0601]
+
+
+def chrome(name, host, ech_public=None, psk=False):
+    h = Hello(name)
+    g = h.grease
+    exts = [
+        h.sni(ech_public or host),
+        h.ext(0x0017),
+        h.ext(0xff01, b'\0'),
+        h.groups([g[1], 0x11ec, 0x001d, 0x0017, 0x0018]),
+        h.ext(0x000b, vec8(b'\0')),
+        h.ext(0x0023),
+        h.alpn(['h2', 'http/1.1']),
+        h.ext(0x0005, u8(1) + u16(0) + u16(0)),
+        h.sigalgs(CHROME_SIGALGS),
+        h.ext(0x0012),
+        h.key_share([(g[1], 1), (0x11ec, MLKEM_SHARE), (0x001d, 32)]),
+        h.ext(0x002d, vec8(b'\1')),
+        h.versions([g[2], 0x0304, 0x0303]),
+        h.ext(0x001b, vec8(u16(0x0002))),
+        h.ext(0x44cd, vec16(vec8(b'h2'))),
+        h.ech_outer(h.rng.choice([144, 176, 208, 240]) if ech_public is None
+                    else 240),
+    ]
+    # Chrome permutes everything between the GREASE extensions
+    h.rng.shuffle(exts)
+    if psk:
+        ident = vec16(h.rand(192)) + struct.pack('>I', h.rng.getrandbits(32))
+        binder = vec8(h.rand(32))
+        exts.append(h.ext(0x0029, vec16(ident) + vec16(binder)))
+    return h.build([g[0]] + CHROME_CIPHERS,
+                   [h.ext(g[0])] + exts + [h.ext(g[3], b'\0')])
+
+
+def firefox(name, host):
+    h = Hello(name)
+    ciphers = [0x1301, 0x1303, 0x1302, 0xc02b, 0xc02f, 0xcca9, 0xcca8, 0xc02c,
+               0xc030, 0xc00a, 0xc009, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f,
+               0x0035]
+    exts = [
+        h.sni(host),
+        h.ext(0x0017),
+        h.ext(0xff01, b'\0'),
+        h.groups([0x11ec, 0x001d, 0x0017, 0x0018, 0x0019, 0x0100, 0x0101]),
+        h.ext(0x000b, vec8(b'\0')),
+        h.ext(0x0023),
+        h.alpn(['h2', 'http/1.1']),
+        h.ext(0x0005, u8(1) + u16(0) + u16(0)),
+        h.ext(0x0022, vec16(u16list([0x0403, 0x0503, 0x0603, 0x0203]))),
+        h.ext(0x0012),
+        h.key_share([(0x11ec, MLKEM_SHARE), (0x001d, 32), (0x0017, 65)]),
+        h.versions([0x0304, 0x0303]),
+        h.sigalgs([0x0403, 0x0503, 0x0603, 0x0804, 0x0805, 0x0806, 0x0401,
+                   0x0501, 0x0601, 0x0203, 0x0201]),
+        h.ext(0x002d, vec8(b'\1')),
+        h.ext(0x001c, u16(0x4001)),
+        h.ext(0x001b, vec8(u16list([0x0001, 0x0002, 0x0003]))),
+        h.ech_outer(h.rng.choice([185, 217, 249, 281])),
+    ]
+    return h.build(ciphers, exts)
+
+
+def safari(name, host, alpn=('h2', 'http/1.1')):
+    h = Hello(name)
+    g = h.grease
+    ciphers = [g[0], 0x1301, 0x1302, 0x1303, 0xc02c, 0xc02b, 0xcca9, 0xc030,
+               0xc02f, 0xcca8, 0xc00a, 0xc009, 0xc014, 0xc013, 0x009d, 0x009c,
+               0x0035, 0x002f, 0xc008, 0xc012, 0x000a]
+    exts = [
+        h.ext(g[0]),
+        h.sni(host),
+        h.ext(0x0017),
+        h.ext(0xff01, b'\0'),
+        h.groups([g[1], 0x001d, 0x0017, 0x0018, 0x0019]),
+        h.ext(0x000b, vec8(b'\0')),
+        h.alpn(list(alpn)),
+        h.ext(0x0005, u8(1) + u16(0) + u16(0)),
+        h.sigalgs([0x0403, 0x0804, 0x0401, 0x0503, 0x0203, 0x0805, 0x0805,
+                   0x0501, 0x0806, 0x0601, 0x0201]),
+        h.ext(0x0012),
+        h.key_share([(g[1], 1), (0x001d, 32)]),
+        h.ext(0x002d, vec8(b'\1')),
+        h.versions([g[2], 0x0304, 0x0303, 0x0302, 0x0301]),
+        h.ext(0x001b, vec8(u16(0x0001))),
+        h.ext(g[3], b'\0'),
+    ]
+    return h.build(ciphers, exts, pad=True)
+
+
+OPENSSL3_CIPHERS = [0x1302, 0x1303, 0x1301, 0xc02c, 0xc030, 0x009f, 0xcca9,
+                    0xcca8, 0xccaa, 0xc02b, 0xc02f, 0x009e, 0xc024, 0xc028,
+                    0x006b, 0xc023, 0xc027, 0x0067, 0xc00a, 0xc014, 0x0039,
+                    0xc009, 0xc013, 0x0033, 0x009d, 0x009c, 0x003d, 0x003c,
+                    0x0035, 0x002f, 0x00ff]
+OPENSSL3_SIGALGS = [0x0403, 0x0503, 0x0603, 0x0807, 0x0808, 0x081a, 0x081b,
+                    0x081c, 0x0809, 0x080a, 0x080b, 0x0804, 0x0805, 0x0806,
+                    0x0401, 0x0501, 0x0601, 0x0303, 0x0301, 0x0302, 0x0402,
+                    0x0502, 0x0602]
+
+
+def openssl3(name, host, pq=False):
+    h = Hello(name)
+    groups = [0x001d, 0x0017, 0x001e, 0x0019, 0x0018, 0x0100, 0x0101,
+              0x0102, 0x0103, 0x0104]
+    shares = [(0x001d, 32)]
+    if pq:
+        groups = [0x11ec] + groups
+        shares = [(0x11ec, MLKEM_SHARE)] + shares
+    exts = []
+    if host:
+        exts.append(h.sni(host))
+    exts += [
+        h.ext(0x000b, vec8(b'\0\1\2')),
+        h.groups(groups),
+        h.ext(0x0023),
+        h.alpn(['h2', 'http/1.1']),
+        h.ext(0x0016),
+        h.ext(0x0017),
+        h.sigalgs(OPENSSL3_SIGALGS),
+        h.versions([0x0304, 0x0303]),
+        h.ext(0x002d, vec8(b'\1')),
+        h.key_share(shares),
+    ]
+    return h.build(OPENSSL3_CIPHERS, exts, pad=True)
+
+
+def openssl102(name, host):
+    h = Hello(name)
+    ciphers = [0xc030, 0xc02c, 0xc028, 0xc024, 0xc014, 0xc00a, 0x00a5, 0x00a3,
+               0x00a1, 0x009f, 0x006b, 0x006a, 0x0069, 0x0068, 0x0039, 0x0038,
+               0x0037, 0x0036, 0x0088, 0x0087, 0x0086, 0x0085, 0xc032, 0xc02e,
+               0xc02a, 0xc026, 0xc00f, 0xc005, 0x009d, 0x003d, 0x0035, 0x0084,
+               0xc02f, 0xc02b, 0xc027, 0xc023, 0xc013, 0xc009, 0x00a4, 0x00a2,
+               0x00a0, 0x009e, 0x0067, 0x0040, 0x003f, 0x003e, 0x0033, 0x0032,
+               0x0031, 0x0030, 0x009a, 0x0099, 0x0098, 0x0097, 0x0045, 0x0044,
+               0x0043, 0x0042, 0xc031, 0xc02d, 0xc029, 0xc025, 0xc00e, 0xc004,
+               0x009c, 0x003c, 0x002f, 0x0096, 0x0041, 0x00ff]
+    exts = [
+        h.sni(host),
+        h.ext(0x000b, vec8(b'\0\1\2')),
+        h.groups([0x0017, 0x0019, 0x001c, 0x001b, 0x0018, 0x001a, 0x0016,
+                  0x000e, 0x000d, 0x000b, 0x000c, 0x0009, 0x000a]),
+        h.ext(0x0023),
+        h.sigalgs([0x0601, 0x0602, 0x0603, 0x0501, 0x0502, 0x0503, 0x0401,
+                   0x0402, 0x0403, 0x0301, 0x0302, 0x0303, 0x0201, 0x0202,
+                   0x0203]),
+        h.ext(0x000f, b'\1'),
+    ]
+    return h.build(ciphers, exts, session_id=0, pad=True)
+
+
+def golang(name, host, kem):
+    h = Hello(name)
+    ciphers = [0xc02b, 0xc02f, 0xc02c, 0xc030, 0xcca9, 0xcca8, 0xc009, 0xc013,
+               0xc00a, 0xc014, 0x009c, 0x009d, 0x002f, 0x0035, 0xc012, 0x000a,
+               0x1301, 0x1302, 0x1303]
+    exts = [
+        h.sni(host),
+        h.ext(0x0005, u8(1) + u16(0) + u16(0)),
+        h.groups([kem, 0x001d, 0x0017, 0x0018, 0x0019]),
+        h.ext(0x000b, vec8(b'\0')),
+        h.sigalgs([0x0804, 0x0403, 0x0807, 0x0805, 0x0806, 0x0401, 0x0501,
+                   0x0601, 0x0503, 0x0603, 0x0203, 0x0201]),
+        h.ext(0xff01, b'\0'),
+        h.alpn(['h2', 'http/1.1']),
+        h.ext(0x0012),
+        h.versions([0x0304, 0x0303]),
+        h.key_share([(kem, MLKEM_SHARE), (0x001d, 32)]),
+        h.ext(0x0023),
+        h.ext(0x0017),
+        h.ext(0x002d, vec8(b'\1')),
+    ]
+    return h.build(ciphers, exts)
+
+
+def java(name, host):
+    h = Hello(name)
+    ciphers = [0x1302, 0x1301, 0x1303, 0xc02c, 0xc02b, 0xcca9, 0xc030, 0xcca8,
+               0xc02f, 0x009f, 0xccaa, 0x00a3, 0x009e, 0x00a2, 0xc024, 0xc028,
+               0xc023, 0xc027, 0x006b, 0x006a, 0x0067, 0x0040, 0xc02e, 0xc032,
+               0xc02d, 0xc031, 0xc026, 0xc02a, 0xc025, 0xc029, 0x009d, 0x009c,
+               0x003d, 0x003c, 0x0035, 0x002f, 0x00ff]
+    sigalgs = [0x0403, 0x0503, 0x0603, 0x0804, 0x0805, 0x0806, 0x0809, 0x080a,
+               0x080b, 0x0401, 0x0501, 0x0601, 0x0402, 0x0303, 0x0301, 0x0302,
+               0x0203, 0x0201, 0x0202]
+    exts = [
+        h.sni(host),
+        h.ext(0x0005, u8(1) + u16(0) + u16(0)),
+        h.groups([0x001d, 0x0017, 0x0018, 0x0019, 0x001e, 0x0100, 0x0101,
+                  0x0102, 0x0103, 0x0104]),
+        h.ext(0x000b, vec8(b'\0')),
+        h.sigalgs(sigalgs),
+        h.sigalgs(sigalgs, 0x0032),
+        h.ext(0x0011, vec16(u8(2) + vec16(u8(0) + u16(0) + u16(0)) +
+                            u8(1) + vec16(u8(0) + u16(0) + u16(0)))),
+        h.ext(0x0017),
+        h.ext(0x0023),
+        h.versions([0x0304, 0x0303]),
+        h.ext(0x002d, vec8(b'\1')),
+        h.key_share([(0x001d, 32), (0x0017, 65)]),
+    ]
+    # JSSE puts TLS 1.2 into the record header of the first flight
+    return h.build(ciphers, exts, record_version=0x0303)
+
+
+def okhttp(name, host):
+    h = Hello(name)
+    ciphers = [0x1301, 0x1302, 0x1303, 0xc02b, 0xc02c, 0xcca9, 0xc02f, 0xc030,
+               0xcca8, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f, 0x0035]
+    exts = [
+        h.sni(host),
+        h.ext(0x0017),
+        h.ext(0xff01, b'\0'),
+        h.groups([0x001d, 0x0017, 0x0018]),
+        h.ext(0x000b, vec8(b'\0')),
+        h.ext(0x0023),
+        h.alpn(['h2', 'http/1.1']),
+        h.ext(0x0005, u8(1) + u16(0) + u16(0)),
+        h.sigalgs([0x0403, 0x0804, 0x0401, 0x0503, 0x0805, 0x0501, 0x0806,
+                   0x0601, 0x0201]),
+        h.key_share([(0x001d, 32)]),
+        h.ext(0x002d, vec8(b'\1')),
+        h.versions([0x0304, 0x0303, 0x0302, 0x0301]),
+    ]
+    return h.build(ciphers, exts, pad=True)
+
+
+FIXTURES = {
+    'chrome-131.bin': lambda n: chrome(n, 'www.google.com'),
+    'chrome-131-ech.bin': lambda n: chrome(n, 'crypto.cloudflare.com',
+                                           ech_public='cloudflare-ech.com'),
+    'chrome-131-psk.bin': lambda n: chrome(n, 'mail.google.com', psk=True),
+    'firefox-133.bin': lambda n: firefox(n, 'www.mozilla.org'),
+    'safari-18.bin': lambda n: safari(n, 'www.apple.com'),
+    'ios-17-nsurlsession.bin': lambda n: safari(n, 'api.example.com',
+                                                alpn=('h2', 'http/1.1')),
+    'curl-8-openssl-3.0.bin': lambda n: openssl3(n, 'example.com'),
+    'openssl-3.5-mlkem.bin': lambda n: openssl3(n, 'pq.cloudflareresearch.com',
+                                                pq=True),
+    'openssl-3.0-no-sni.bin': lambda n: openssl3(n, None),
+    'openssl-1.0.2.bin': lambda n: openssl102(n, 'legacy.example.net'),
+    'go-1.23-kyber.bin': lambda n: golang(n, 'proxy.golang.org', 0x6399),
+    'go-1.24-mlkem.bin': lambda n: golang(n, 'sum.golang.org', 0x11ec),
+    'java-21.bin': lambda n: java(n, 'repo.maven.apache.org'),
+    'okhttp-android-14.bin': lambda n: okhttp(n, 'graph.facebook.com'),
+}
+
+
+def main():
+    outdir = sys.argv[1] if len(sys.argv) > 1 else os.path.dirname(
+        os.path.abspath(__file__))
+
+    for name, fn in sorted(FIXTURES.items()):
+        data = fn(name)
+        with open(os.path.join(outdir, name), 'wb') as f:
+            f.write(data)
+        print('%-28s %5d bytes' % (name, len(data)))
+
+
+if __name__ == '__main__':
+    main()
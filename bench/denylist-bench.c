@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures denylist lookups against a generated list of -n names, every
+ * 16th of them a suffix entry. Names that are not listed, listed names and
+ * names below a listed suffix are checked separately, picked at random so
+ * that lookups miss the cache the way they would with real traffic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "cmdq.h"
+#include "denylist.h"
+
+/* Replaces cmdq.c, which hands reloaded lists to the loop: none here */
+void
+cmdq_push(struct cmdq *q, cmdq_fn fn, void *arg)
+{
+	abort();
+}
+
+/* Distinct names looked up, in a loop */
+#define POOL 1000000
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n names] [-l lookups] [-b bits]\n"
+			"  -n  names in the list (default 10000000)\n"
+			"  -l  lookups per kind of name (default 10000000)\n"
+			"  -b  Bloom filter bits per name (default 10)\n",
+			prog);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+xorshift(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *s = x;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *kinds[] = {"not listed", "listed", "below suffix"};
+	static const char *formats[] = {"www.h%lu.allow.test", "h%lu.deny.test",
+			"www.h%lu.deny.test"};
+	struct denylist *dl;
+	unsigned long names = 10000000, lookups = 10000000, i, r, hits;
+	unsigned bits = 10, k;
+	char path[] = "/tmp/denylist-bench.XXXXXX", err[256], (*pool)[32];
+	uint64_t seed;
+	double start, elapsed;
+	FILE *f;
+	int ch, fd;
+
+	while ((ch = getopt(argc, argv, "n:l:b:h")) != -1) {
+		switch (ch) {
+		case 'n':
+			names = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			lookups = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bits = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (names < 16 || lookups == 0 || bits == 0) {
+		usage(argv[0]);
+	}
+
+	if ((fd = mkstemp(path)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < names; i ++) {
+		fprintf(f, "%sh%lu.deny.test\n", i % 16 == 0 ? "." : "", i);
+	}
+
+	fclose(f);
+	start = now();
+	dl = denylist_load(path, bits, err, sizeof(err));
+	elapsed = now() - start;
+	unlink(path);
+
+	if (dl == NULL) {
+		fprintf(stderr, "cannot load %s: %s\n", path, err);
+		return EXIT_FAILURE;
+	}
+
+	printf("loaded %u names in %.2fs\n", denylist_names(dl), elapsed);
+	printf("%14s %10s %10s\n", "names", "ns/lookup", "denied");
+
+	pool = malloc(POOL * sizeof(*pool));
+
+	if (pool == NULL) {
+		abort();
+	}
+
+	for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k ++) {
+		seed = 0x9e3779b97f4a7c15ULL;
+
+		/* Names are made up front, printing them costs more than a lookup */
+		for (i = 0; i < POOL; i ++) {
+			r = xorshift(&seed) % names;
+
+			/* Only every 16th name has names below it */
+			if (k == 2) {
+				r &= ~15UL;
+			}
+
+			snprintf(pool[i], sizeof(pool[i]), formats[k], r);
+		}
+
+		hits = 0;
+		start = now();
+
+		for (i = 0; i < lookups; i ++) {
+			const char *name = pool[i % POOL];
+
+			if (denylist_match(dl, name, strlen(name))) {
+				hits ++;
+			}
+		}
+
+		elapsed = now() - start;
+		printf("%14s %10.1f %9.2f%%\n", kinds[k], elapsed * 1e9 / lookups,
+				hits * 100.0 / lookups);
+	}
+
+	denylist_free(dl);
+	free(pool);
+
+	return 0;
+}
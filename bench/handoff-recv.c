@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * handoff-recv: reference origin for sni-proxy `handoff` backends.
+ *
+ * sni-proxy opens one unix stream connection per session, sends the client
+ * descriptor as SCM_RIGHTS together with the first byte of the ClientHello
+ * and the rest of the hello up to EOF. This receiver takes the client over
+ * and serves it like the sni-bench backend: echo returns everything,
+ * including the hello, sink replies with -r bytes once the hello is in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include "ev.h"
+#include "tls.h"
+
+#define HELLO_MAX 16384
+#define IOBUF_LEN 65536
+
+enum recv_mode {
+	recv_mode_sink = 0,
+	recv_mode_echo
+};
+
+/* Control connection from sni-proxy, lives until the hello is complete */
+struct ctl_conn {
+	ev_io io;
+	int fd;
+	int client;
+	unsigned char hello[HELLO_MAX];
+	size_t len;
+};
+
+struct client_conn {
+	ev_io io;
+	int fd;
+	bool eof;
+	unsigned char *out;
+	size_t out_off, out_len;
+	size_t resp_left;
+};
+
+static enum recv_mode mode = recv_mode_sink;
+static size_t response = 16384;
+static bool verbose = false;
+static unsigned long handed = 0;
+static unsigned char sink_buf[IOBUF_LEN];
+
+static int
+set_nonblock(int fd)
+{
+	int ofl;
+
+	ofl = fcntl(fd, F_GETFL, 0);
+
+	return fcntl(fd, F_SETFL, ofl | O_NONBLOCK);
+}
+
+static void
+client_close(struct ev_loop *loop, struct client_conn *c)
+{
+	ev_io_stop(loop, &c->io);
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+static void
+client_update(struct ev_loop *loop, struct client_conn *c)
+{
+	int ev = 0;
+
+	if (!c->eof && (mode == recv_mode_sink || c->out_off == c->out_len)) {
+		ev |= EV_READ;
+	}
+	if (c->resp_left > 0 || c->out_off < c->out_len) {
+		ev |= EV_WRITE;
+	}
+
+	if (ev == 0) {
+		client_close(loop, c);
+		return;
+	}
+
+	ev_io_stop(loop, &c->io);
+	ev_io_set(&c->io, c->fd, ev);
+	ev_io_start(loop, &c->io);
+}
+
+static void
+client_cb(EV_P_ ev_io *w, int revents)
+{
+	struct client_conn *c = w->data;
+	ssize_t r;
+	size_t n;
+
+	if (revents & EV_READ) {
+		if (mode == recv_mode_sink) {
+			r = read(c->fd, sink_buf, sizeof(sink_buf));
+		}
+		else {
+			r = read(c->fd, c->out, IOBUF_LEN);
+		}
+
+		if (r == -1 && errno != EAGAIN && errno != EINTR) {
+			client_close(loop, c);
+			return;
+		}
+		else if (r == 0) {
+			c->eof = true;
+		}
+		else if (r > 0 && mode == recv_mode_echo) {
+			c->out_len = r;
+			c->out_off = 0;
+		}
+	}
+
+	if (revents & EV_WRITE) {
+		if (c->out_off < c->out_len) {
+			r = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+
+			if (r > 0) {
+				c->out_off += r;
+			}
+		}
+		else if (c->resp_left > 0) {
+			n = c->resp_left < sizeof(sink_buf) ? c->resp_left : sizeof(sink_buf);
+			r = write(c->fd, sink_buf, n);
+
+			if (r > 0) {
+				c->resp_left -= r;
+			}
+		}
+		else {
+			r = 0;
+		}
+
+		if (r == -1 && errno != EAGAIN && errno != EINTR) {
+			client_close(loop, c);
+			return;
+		}
+	}
+
+	if (c->eof && c->resp_left == 0 && c->out_off == c->out_len) {
+		client_close(loop, c);
+		return;
+	}
+
+	client_update(loop, c);
+}
+
+/* Takes over the client once the whole hello has arrived */
+static void
+client_start(struct ev_loop *loop, int fd, const unsigned char *hello,
+		size_t len)
+{
+	struct client_conn *c;
+	struct tls_greeting greet;
+
+	if (verbose) {
+		memset(&greet, 0, sizeof(greet));
+
+		if (tls_parse_greeting(hello, len, &greet) == tls_greeting_complete &&
+				greet.hostname != NULL) {
+			fprintf(stderr, "fd %d: %.*s, %zu bytes of hello\n", fd,
+					(int)greet.hostlen, greet.hostname, len);
+		}
+		else {
+			fprintf(stderr, "fd %d: no server name, %zu bytes of hello\n", fd,
+					len);
+		}
+	}
+
+	set_nonblock(fd);
+	c = calloc(1, sizeof(*c));
+	c->fd = fd;
+	c->out = malloc(IOBUF_LEN);
+
+	if (mode == recv_mode_echo) {
+		/* The hello was read by the proxy, but the client still wants it */
+		memcpy(c->out, hello, len);
+		c->out_len = len;
+	}
+	else {
+		c->resp_left = response;
+	}
+
+	c->io.data = c;
+	ev_io_init(&c->io, client_cb, fd, EV_READ | EV_WRITE);
+	ev_io_start(loop, &c->io);
+	handed ++;
+}
+
+static void
+ctl_close(struct ev_loop *loop, struct ctl_conn *c)
+{
+	ev_io_stop(loop, &c->io);
+	close(c->fd);
+
+	if (c->client != -1) {
+		close(c->client);
+	}
+
+	free(c);
+}
+
+static void
+ctl_cb(EV_P_ ev_io *w, int revents)
+{
+	struct ctl_conn *c = w->data;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		unsigned char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t r;
+	int fd;
+
+	if (c->len == sizeof(c->hello)) {
+		fprintf(stderr, "handoff is longer than %d bytes\n", HELLO_MAX);
+		ctl_close(loop, c);
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = c->hello + c->len;
+	iov.iov_len = sizeof(c->hello) - c->len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	r = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+
+	if (r == -1) {
+		if (errno != EAGAIN && errno != EINTR) {
+			ctl_close(loop, c);
+		}
+		return;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+			if (c->client != -1) {
+				/* Only one descriptor per connection */
+				close(fd);
+			}
+			else {
+				c->client = fd;
+			}
+		}
+	}
+
+	if (r > 0) {
+		c->len += r;
+		return;
+	}
+
+	if (c->client == -1) {
+		fprintf(stderr, "handoff without a descriptor\n");
+	}
+	else {
+		client_start(loop, c->client, c->hello, c->len);
+		c->client = -1;
+	}
+
+	ctl_close(loop, c);
+}
+
+static void
+accept_cb(EV_P_ ev_io *w, int revents)
+{
+	struct ctl_conn *c;
+	int fd;
+
+	while ((fd = accept(w->fd, NULL, NULL)) != -1) {
+		set_nonblock(fd);
+		c = malloc(sizeof(*c));
+		c->fd = fd;
+		c->client = -1;
+		c->len = 0;
+		c->io.data = c;
+		ev_io_init(&c->io, ctl_cb, fd, EV_READ);
+		ev_io_start(loop, &c->io);
+	}
+}
+
+static void
+sigint_cb(EV_P_ ev_signal *w, int revents)
+{
+	fprintf(stderr, "%lu sessions handed off\n", handed);
+	ev_break(loop, EVBREAK_ALL);
+}
+
+/* '@' starts a Linux abstract name */
+static int
+listen_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	socklen_t slen;
+	size_t len = strlen(path);
+	int sock;
+
+	if (len == 0 || len >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, len);
+
+	if (path[0] == '@') {
+		sun.sun_path[0] = '\0';
+		slen = offsetof(struct sockaddr_un, sun_path) + len;
+	}
+	else {
+		unlink(path);
+		slen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return -1;
+	}
+
+	if (bind(sock, (struct sockaddr *)&sun, slen) == -1 ||
+			listen(sock, 65535) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	set_nonblock(sock);
+
+	return sock;
+}
+
+static void
+usage(const char *error)
+{
+	if (error) {
+		fprintf(stderr, "%s\n", error);
+	}
+
+	fprintf(stderr, "usage:"
+		"\thandoff-recv [-l path] [-m sink|echo] [-r response] [-v] [-h]\n"
+		"\n"
+		"\t-l\tunix socket to listen on, @ is abstract (default @sni-handoff)\n"
+		"\t-m\tsink replies with -r bytes, echo returns input (default sink)\n"
+		"\t-r\tbytes the sink sends back (default 16384)\n"
+		"\t-v\tlog the server name of every handed off session\n");
+
+	exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ev_loop *loop;
+	ev_io accept_ev;
+	ev_signal sigint_ev;
+	const char *path = "@sni-handoff";
+	int ch, sock;
+
+	while ((ch = getopt(argc, argv, "l:m:r:vh")) != -1) {
+		switch (ch) {
+		case 'l':
+			path = optarg;
+			break;
+		case 'm':
+			if (strcmp(optarg, "sink") == 0) {
+				mode = recv_mode_sink;
+			}
+			else if (strcmp(optarg, "echo") == 0) {
+				mode = recv_mode_echo;
+			}
+			else {
+				usage("invalid mode");
+			}
+			break;
+		case 'r':
+			response = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+		default:
+			usage(NULL);
+			break;
+		}
+	}
+
+	if (mode == recv_mode_sink && response == 0) {
+		usage("sink mode needs a non-empty response");
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	sock = listen_unix(path);
+
+	if (sock == -1) {
+		fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	loop = ev_default_loop(0);
+	ev_io_init(&accept_ev, accept_cb, sock, EV_READ);
+	ev_io_start(loop, &accept_ev);
+	ev_signal_init(&sigint_ev, sigint_cb, SIGINT);
+	ev_signal_start(loop, &sigint_ev);
+
+	ev_run(loop, 0);
+
+	close(sock);
+
+	if (path[0] != '@') {
+		unlink(path);
+	}
+
+	return 0;
+}
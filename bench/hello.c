@@ -0,0 +1,235 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hello.h"
+
+static const uint16_t hello_ciphers[] = {
+	0x1301, 0x1302, 0x1303, 0xc02b, 0xc02f, 0xc02c, 0xc030, 0xcca9,
+	0xcca8, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f, 0x0035
+};
+
+static const uint16_t hello_groups[] = {
+	0x001d, 0x0017, 0x0018
+};
+
+static const uint16_t hello_sigalgs[] = {
+	0x0403, 0x0804, 0x0401, 0x0503, 0x0805, 0x0501, 0x0806, 0x0601
+};
+
+struct hello_writer {
+	unsigned char *p;
+	unsigned char *end;
+	int overflow;
+};
+
+static void
+put8(struct hello_writer *w, unsigned int v)
+{
+	if (w->p + 1 > w->end) {
+		w->overflow = 1;
+		return;
+	}
+	*w->p++ = v & 0xff;
+}
+
+static void
+put16(struct hello_writer *w, unsigned int v)
+{
+	put8(w, v >> 8);
+	put8(w, v);
+}
+
+static void
+put24(struct hello_writer *w, unsigned int v)
+{
+	put8(w, v >> 16);
+	put16(w, v);
+}
+
+static void
+putbytes(struct hello_writer *w, const void *data, size_t len)
+{
+	if (w->p + len > w->end) {
+		w->overflow = 1;
+		return;
+	}
+	if (data != NULL) {
+		memcpy(w->p, data, len);
+	}
+	else {
+		memset(w->p, 0, len);
+	}
+	w->p += len;
+}
+
+/* Patch a big endian length placeholder at `at` */
+static void
+patch_len(unsigned char *at, size_t width, size_t len)
+{
+	while (width > 0) {
+		at[width - 1] = len & 0xff;
+		len >>= 8;
+		width --;
+	}
+}
+
+static void
+put_ext(struct hello_writer *w, unsigned int type, const void *data, size_t len)
+{
+	put16(w, type);
+	put16(w, len);
+	putbytes(w, data, len);
+}
+
+size_t
+hello_build(unsigned char *buf, size_t buflen, const char *sni,
+		size_t target_len)
+{
+	struct hello_writer w;
+	unsigned char *rec_len, *hs_len, *ext_len, *mark;
+	unsigned int i;
+	size_t slen, cur;
+	static const unsigned char alpn[] = {
+		0x00, 0x0c, 0x02, 'h', '2',
+		0x08, 'h', 't', 't', 'p', '/', '1', '.', '1'
+	};
+	static const unsigned char versions[] = {0x04, 0x03, 0x04, 0x03, 0x03};
+
+	w.p = buf;
+	w.end = buf + buflen;
+	w.overflow = 0;
+
+	/* Record layer */
+	put8(&w, 0x16);
+	put16(&w, 0x0301);
+	rec_len = w.p;
+	put16(&w, 0);
+	/* Handshake header */
+	put8(&w, 0x01);
+	hs_len = w.p;
+	put24(&w, 0);
+	put16(&w, 0x0303);
+
+	for (i = 0; i < 32; i ++) {
+		put8(&w, random());
+	}
+	/* Session id, as sent by middlebox compatibility mode */
+	put8(&w, 32);
+	for (i = 0; i < 32; i ++) {
+		put8(&w, random());
+	}
+
+	put16(&w, sizeof(hello_ciphers));
+	for (i = 0; i < sizeof(hello_ciphers) / sizeof(hello_ciphers[0]); i ++) {
+		put16(&w, hello_ciphers[i]);
+	}
+	/* Null compression only */
+	put8(&w, 1);
+	put8(&w, 0);
+
+	ext_len = w.p;
+	put16(&w, 0);
+
+	if (sni != NULL) {
+		slen = strlen(sni);
+		put16(&w, 0x0000);
+		put16(&w, slen + 5);
+		put16(&w, slen + 3);
+		put8(&w, 0);
+		put16(&w, slen);
+		putbytes(&w, sni, slen);
+	}
+
+	put_ext(&w, 0x0017, NULL, 0);
+	put16(&w, 0xff01);
+	put16(&w, 1);
+	put8(&w, 0);
+
+	put16(&w, 0x000a);
+	put16(&w, sizeof(hello_groups) + 2);
+	put16(&w, sizeof(hello_groups));
+	for (i = 0; i < sizeof(hello_groups) / sizeof(hello_groups[0]); i ++) {
+		put16(&w, hello_groups[i]);
+	}
+
+	put16(&w, 0x000b);
+	put16(&w, 2);
+	put8(&w, 1);
+	put8(&w, 0);
+
+	put_ext(&w, 0x0023, NULL, 0);
+	put_ext(&w, 0x0010, alpn, sizeof(alpn));
+
+	put16(&w, 0x0005);
+	put16(&w, 5);
+	put8(&w, 1);
+	put16(&w, 0);
+	put16(&w, 0);
+
+	put16(&w, 0x000d);
+	put16(&w, sizeof(hello_sigalgs) + 2);
+	put16(&w, sizeof(hello_sigalgs));
+	for (i = 0; i < sizeof(hello_sigalgs) / sizeof(hello_sigalgs[0]); i ++) {
+		put16(&w, hello_sigalgs[i]);
+	}
+
+	put_ext(&w, 0x0012, NULL, 0);
+
+	/* key_share with a single x25519 share */
+	put16(&w, 0x0033);
+	put16(&w, 32 + 6);
+	put16(&w, 32 + 4);
+	put16(&w, 0x001d);
+	put16(&w, 32);
+	for (i = 0; i < 32; i ++) {
+		put8(&w, random());
+	}
+
+	put16(&w, 0x002d);
+	put16(&w, 2);
+	put8(&w, 1);
+	put8(&w, 1);
+
+	put_ext(&w, 0x002b, versions, sizeof(versions));
+
+	/* Padding extension up to the requested size */
+	cur = w.p - buf;
+	if (target_len >= cur + 4) {
+		put_ext(&w, 0x0015, NULL, target_len - cur - 4);
+	}
+
+	if (w.overflow) {
+		return 0;
+	}
+
+	mark = w.p;
+	patch_len(rec_len, 2, mark - rec_len - 2);
+	patch_len(hs_len, 3, mark - hs_len - 3);
+	patch_len(ext_len, 2, mark - ext_len - 2);
+
+	return mark - buf;
+}
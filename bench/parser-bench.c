@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the cost of tls_parse_greeting() on a set of ClientHello records,
+ * by default the fixtures from bench/corpus. Every file is parsed in a tight
+ * loop and the bench prints nanoseconds and, where perf events are available,
+ * branch misses and instructions per parse.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "tls.h"
+
+#ifndef CORPUS_DIR
+#define CORPUS_DIR "corpus"
+#endif
+
+struct sample {
+	char *name;
+	unsigned char *data;
+	size_t len;
+};
+
+struct counter {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+};
+
+static struct counter counters[] = {
+#ifdef __linux__
+	{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+#endif
+	{NULL, 0, 0, -1}
+};
+
+static struct sample *samples = NULL;
+static size_t nsamples = 0, samples_alloc = 0;
+/* Prevents the compiler from dropping the parse results */
+static volatile unsigned sink;
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-v] [file|dir ...]\n"
+			"  -n  parse each greeting this many times (default 200000)\n"
+			"  -v  print the parse result of every greeting\n"
+			"Without arguments greetings are loaded from " CORPUS_DIR "\n",
+			prog);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+counters_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	struct counter *c;
+
+	for (c = counters; c->name != NULL; c ++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = c->type;
+		attr.config = c->config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		c->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+}
+
+static void
+counters_start(void)
+{
+#ifdef __linux__
+	struct counter *c;
+
+	for (c = counters; c->name != NULL; c ++) {
+		if (c->fd != -1) {
+			ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+static void
+counters_stop(uint64_t *res)
+{
+	struct counter *c;
+	int i;
+
+	for (c = counters, i = 0; c->name != NULL; c ++, i ++) {
+		res[i] = 0;
+#ifdef __linux__
+		if (c->fd != -1) {
+			ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(c->fd, &res[i], sizeof(res[i])) != sizeof(res[i])) {
+				res[i] = 0;
+			}
+		}
+#endif
+	}
+}
+
+static void
+add_sample(const char *path, const char *name)
+{
+	FILE *f;
+	struct stat st;
+	struct sample *s;
+
+	if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+		return;
+	}
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	if (nsamples == samples_alloc) {
+		samples_alloc = samples_alloc ? samples_alloc * 2 : 16;
+		samples = realloc(samples, samples_alloc * sizeof(*samples));
+		if (samples == NULL) {
+			abort();
+		}
+	}
+
+	s = &samples[nsamples];
+	s->len = st.st_size;
+	s->data = malloc(s->len ? s->len : 1);
+	s->name = strdup(name);
+
+	if (s->data == NULL || s->name == NULL) {
+		abort();
+	}
+	if (fread(s->data, 1, s->len, f) != s->len) {
+		fprintf(stderr, "cannot read %s\n", path);
+		free(s->data);
+		free(s->name);
+		fclose(f);
+		return;
+	}
+
+	fclose(f);
+	nsamples ++;
+}
+
+static int
+sample_cmp(const void *a, const void *b)
+{
+	const struct sample *s1 = a, *s2 = b;
+
+	return strcmp(s1->name, s2->name);
+}
+
+static void
+add_path(const char *path)
+{
+	DIR *d;
+	struct dirent *de;
+	char buf[PATH_MAX];
+	size_t first = nsamples;
+
+	d = opendir(path);
+	if (d == NULL) {
+		add_sample(path, path);
+		return;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		size_t nlen = strlen(de->d_name);
+
+		/* Fixtures are *.bin, skip the generator and docs */
+		if (nlen < 5 || strcmp(de->d_name + nlen - 4, ".bin") != 0) {
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%s/%s", path, de->d_name);
+		add_sample(buf, de->d_name);
+	}
+
+	closedir(d);
+	qsort(samples + first, nsamples - first, sizeof(*samples), sample_cmp);
+}
+
+static const char *
+status_str(enum tls_greeting_status st)
+{
+	switch (st) {
+	case tls_greeting_complete:
+		return "ok";
+	case tls_greeting_partial:
+		return "partial";
+	default:
+		return "invalid";
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long iters = 200000, i;
+	bool verbose = false;
+	size_t j;
+	int ch, k, ncounters;
+	uint64_t res[sizeof(counters) / sizeof(counters[0])];
+	double start, elapsed, total_ns = 0;
+
+	while ((ch = getopt(argc, argv, "n:vh")) != -1) {
+		switch (ch) {
+		case 'n':
+			iters = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (iters == 0) {
+		usage(argv[0]);
+	}
+
+	if (optind < argc) {
+		for (k = optind; k < argc; k ++) {
+			add_path(argv[k]);
+		}
+	}
+	else {
+		add_path(CORPUS_DIR);
+	}
+
+	if (nsamples == 0) {
+		fprintf(stderr, "no greetings to parse\n");
+		return EXIT_FAILURE;
+	}
+
+	counters_open();
+	ncounters = sizeof(counters) / sizeof(counters[0]) - 1;
+
+	printf("%-28s %5s %-8s %-26s %9s", "greeting", "bytes", "result",
+			"sni", "ns/parse");
+	for (k = 0; k < ncounters; k ++) {
+		printf(" %14s", counters[k].name);
+	}
+	printf("\n");
+
+	for (j = 0; j < nsamples; j ++) {
+		struct sample *s = &samples[j];
+		struct tls_greeting greet;
+		enum tls_greeting_status st;
+		char sni[27];
+
+		memset(&greet, 0, sizeof(greet));
+		st = tls_parse_greeting(s->data, s->len, &greet);
+
+		if (greet.hostname != NULL) {
+			snprintf(sni, sizeof(sni), "%.*s", (int)greet.hostlen,
+					greet.hostname);
+		}
+		else {
+			strcpy(sni, "-");
+		}
+
+		/* Warm up caches and branch predictors */
+		for (i = 0; i < iters / 10 + 1; i ++) {
+			sink += tls_parse_greeting(s->data, s->len, &greet);
+		}
+
+		counters_start();
+		start = now();
+		for (i = 0; i < iters; i ++) {
+			sink += tls_parse_greeting(s->data, s->len, &greet);
+			sink += greet.hostlen;
+		}
+		elapsed = now() - start;
+		counters_stop(res);
+		total_ns += elapsed * 1e9 / iters;
+
+		printf("%-28s %5zu %-8s %-26s %9.1f", s->name, s->len, status_str(st),
+				sni, elapsed * 1e9 / iters);
+		for (k = 0; k < ncounters; k ++) {
+			if (counters[k].fd == -1) {
+				printf(" %14s", "n/a");
+			}
+			else {
+				printf(" %14.2f", (double)res[k] / iters);
+			}
+		}
+		printf("\n");
+
+		if (verbose) {
+			printf("  version %d.%d\n", greet.ssl_version[0],
+					greet.ssl_version[1]);
+		}
+	}
+
+	printf("%-28s %5s %-8s %-26s %9.1f\n", "mean", "", "", "",
+			total_ns / nsamples);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Coverage guided fuzz target for the ClientHello parser. It is built with
+ * `make fuzz` (clang with -fsanitize=fuzzer,address):
+ *
+ *	./bench/parser-fuzz -max_len=16384 fuzz-corpus bench/corpus
+ *
+ * Without libFuzzer (-DPARSER_FUZZ_STANDALONE) it replays the given files
+ * through the same entry point, which is handy for reproducing crashes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tls.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct tls_greeting greet;
+	unsigned char *buf;
+
+	/* Exact sized copy so that ASAN catches any overread */
+	buf = malloc(size ? size : 1);
+	if (buf == NULL) {
+		abort();
+	}
+	memcpy(buf, data, size);
+
+	memset(&greet, 0, sizeof(greet));
+	(void)tls_parse_greeting(buf, size, &greet);
+
+	if (greet.hostname != NULL) {
+		if (greet.hostname < buf || greet.hostlen > size ||
+				greet.hostname + greet.hostlen > buf + size) {
+			abort();
+		}
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+#ifdef PARSER_FUZZ_STANDALONE
+int
+main(int argc, char **argv)
+{
+	FILE *f;
+	unsigned char *data;
+	long len;
+	int i;
+
+	for (i = 1; i < argc; i ++) {
+		f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			continue;
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		data = malloc(len ? len : 1);
+		if (data == NULL || fread(data, 1, len, f) != (size_t)len) {
+			abort();
+		}
+		fclose(f);
+
+		LLVMFuzzerTestOneInput(data, len);
+		free(data);
+		printf("%s: ok\n", argv[i]);
+	}
+
+	return 0;
+}
+#endif
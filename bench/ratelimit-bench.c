@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the cost of a rate limit check: hashing an SNI name and taking
+ * a token from its bucket, for growing numbers of distinct names. With few
+ * names the buckets stay in cache, with many the check is a cache miss and
+ * once the names outnumber the table entries it also evicts. Simulated time
+ * advances by one millisecond every -r checks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "ratelimit.h"
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n checks] [-s size] [-r checks_per_ms]\n"
+			"  -n  checks per key set (default 10000000)\n"
+			"  -s  table entries (default 65536)\n"
+			"  -r  checks per simulated millisecond (default 1000)\n",
+			prog);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+xorshift(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *s = x;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned nkeys[] = {1, 1000, 100000, 1000000};
+	const struct ratelimit_rule rule = {.rate = 100, .burst = 200};
+	struct ratelimit_table *t;
+	unsigned long checks = 10000000, per_ms = 1000, i, denied;
+	unsigned size = 65536, k, n, len;
+	char (*names)[32];
+	uint64_t seed;
+	double start, elapsed;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:s:r:h")) != -1) {
+		switch (ch) {
+		case 'n':
+			checks = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			per_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (checks == 0 || size < 4 || per_ms == 0) {
+		usage(argv[0]);
+	}
+
+	printf("%10s %10s %10s %10s\n", "names", "ns/check", "denied", "evicted");
+
+	for (k = 0; k < sizeof(nkeys) / sizeof(nkeys[0]); k ++) {
+		n = nkeys[k];
+		names = malloc(n * sizeof(*names));
+
+		if (names == NULL) {
+			abort();
+		}
+
+		for (i = 0; i < n; i ++) {
+			snprintf(names[i], sizeof(names[i]), "h%lu.bench.test", i);
+		}
+
+		t = ratelimit_table_create(size);
+		seed = 0x9e3779b97f4a7c15ULL;
+		denied = 0;
+		start = now();
+
+		for (i = 0; i < checks; i ++) {
+			const char *name = names[xorshift(&seed) % n];
+
+			len = strlen(name);
+
+			if (!ratelimit_take(t, ratelimit_key(t, 1, name, len), &rule,
+					i / per_ms)) {
+				denied ++;
+			}
+		}
+
+		elapsed = now() - start;
+		printf("%10u %10.1f %9.2f%% %10llu\n", n, elapsed * 1e9 / checks,
+				denied * 100.0 / checks,
+				(unsigned long long)ratelimit_table_evicted(t));
+		ratelimit_table_free(t);
+		free(names);
+	}
+
+	return 0;
+}
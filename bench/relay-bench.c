@@ -0,0 +1,1127 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * relay-bench: data path microbenchmark.
+ *
+ * Pumps a fixed amount of data through a relay engine sitting between two
+ * socketpair()s (or loopback TCP connections with -T). Producer and consumer
+ * run in their own threads with blocking I/O, so the main thread runs only
+ * the engine and its libev loop; its system calls are counted separately.
+ *
+ * Engines are described by struct relay_engine, adding a new one means
+ * writing start/stop functions and putting it into the engines[] table.
+ */
+
+#ifdef __linux__
+/* splice() and pipe sizing */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#endif
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "ringbuf.h"
+#include "shaper.h"
+#include "mirror.h"
+#include "sni-private.h"
+
+#define MAX_LIST 16
+
+extern void proxy_create(struct ssl_session *s);
+
+struct relay_engine {
+	const char *name;
+	const char *descr;
+	void *(*start)(struct ev_loop *loop, int cl_fd, int bk_fd, size_t buflen);
+	void (*stop)(struct ev_loop *loop, void *ctx);
+};
+
+struct size_list {
+	size_t v[MAX_LIST];
+	unsigned n;
+};
+
+/*
+ * System call accounting. On Linux the I/O and polling functions are
+ * interposed, so calls made from src/proxy.c and from libev are counted too.
+ * Counters are per thread: only the engine thread's numbers are reported.
+ */
+struct sys_counters {
+	uint64_t io;
+	uint64_t poll;
+};
+
+static __thread struct sys_counters sysc;
+
+#ifdef __linux__
+ssize_t
+read(int fd, void *buf, size_t count)
+{
+	sysc.io ++;
+	return syscall(SYS_read, fd, buf, count);
+}
+
+ssize_t
+write(int fd, const void *buf, size_t count)
+{
+	sysc.io ++;
+	return syscall(SYS_write, fd, buf, count);
+}
+
+ssize_t
+readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	sysc.io ++;
+	return syscall(SYS_readv, fd, iov, iovcnt);
+}
+
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	sysc.io ++;
+	return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+ssize_t
+splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+		unsigned int flags)
+{
+	sysc.io ++;
+	return syscall(SYS_splice, fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	sysc.poll ++;
+	return syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	sysc.poll ++;
+	return syscall(SYS_epoll_pwait, epfd, events, maxevents, timeout, NULL, 8);
+}
+#endif
+
+static int
+set_nonblock(int fd)
+{
+	int ofl;
+
+	ofl = fcntl(fd, F_GETFL, 0);
+
+	return fcntl(fd, F_SETFL, ofl | O_NONBLOCK);
+}
+
+static double
+now_clock(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Engine: the real relay from src/proxy.c
+ */
+static struct ssl_session *proxy_session;
+/* The relay reads its shutdown timeout from the listener */
+static struct sni_listener proxy_listener = {
+	.name = "bench",
+	.shutdown_timeout = 5.0,
+};
+/* Sessions need a worker, one without a scheduler */
+static struct sni_worker proxy_worker;
+/* Bytes/s of the global buckets of the shaped engine, -S */
+static int64_t shape_rate = 1LL << 40;
+/* Sink of the mirrored engine, -M */
+static const char *mirror_sink = "/dev/null";
+
+/* Replaces listener.c, which the relay calls to tear a session down */
+void
+terminate_session(struct ssl_session *ssl)
+{
+	if (ssl->fd != -1) {
+		ev_io_stop(ssl->loop, &ssl->io);
+		close(ssl->fd);
+	}
+	if (ssl->bk_fd != -1) {
+		ev_io_stop(ssl->loop, &ssl->bk_io);
+		close(ssl->bk_fd);
+	}
+	ev_timer_stop(ssl->loop, &ssl->tm);
+	ev_timer_stop(ssl->loop, &ssl->shape_tm);
+	mirror_session_close(ssl);
+	shaper_session_free(ssl);
+	ringbuf_destroy(ssl->bk2cl);
+	ringbuf_destroy(ssl->cl2bk);
+
+	if (ssl == proxy_session) {
+		proxy_session = NULL;
+	}
+
+	free(ssl);
+}
+
+void
+send_alert(struct ssl_session *ssl)
+{
+	terminate_session(ssl);
+}
+
+/* Used by tcpinfo.c to walk routing tables, the relay has none */
+bool
+listener_routes_first(const struct sni_listener *l)
+{
+	return true;
+}
+
+unsigned
+worker_routes_count(const struct sni_worker *worker)
+{
+	return 0;
+}
+
+const char*
+listener_routes_name(const struct sni_listener *l)
+{
+	return l->name;
+}
+
+/* Used by mirror.c for the open record, bench sessions have no peer */
+void
+session_peer_str(const struct ssl_session *ssl, char *buf, size_t len)
+{
+	snprintf(buf, len, "-");
+}
+
+static void *
+proxy_engine_start(struct ev_loop *loop, int cl_fd, int bk_fd, size_t buflen)
+{
+	struct ssl_session *s;
+
+	s = xmalloc0(sizeof(*s));
+	s->loop = loop;
+	s->worker = &proxy_worker;
+	s->listener = &proxy_listener;
+	s->fd = cl_fd;
+	s->bk_fd = bk_fd;
+	s->io.data = s;
+	s->bk_io.data = s;
+	s->tm.data = s;
+	ev_init(&s->tm, NULL);
+	s->cl2bk = ringbuf_create(buflen, NULL, 0);
+	s->bk2cl = ringbuf_create(buflen, NULL, 0);
+	proxy_session = s;
+	proxy_create(s);
+
+	return s;
+}
+
+static void
+proxy_engine_stop(struct ev_loop *loop, void *ctx)
+{
+	if (proxy_session != NULL && proxy_session == ctx) {
+		terminate_session(proxy_session);
+	}
+}
+
+/*
+ * Engine: the same relay charged to global shaping buckets, which by
+ * default are too large to ever hold it back
+ */
+static void *
+shaped_engine_start(struct ev_loop *loop, int cl_fd, int bk_fd, size_t buflen)
+{
+	struct ssl_session *s;
+	ucl_object_t *cfg;
+
+	cfg = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(cfg, ucl_object_fromint(shape_rate), "download", 0,
+			false);
+	ucl_object_insert_key(cfg, ucl_object_fromint(shape_rate), "upload", 0,
+			false);
+
+	if (!shaper_configure(cfg)) {
+		exit(EXIT_FAILURE);
+	}
+
+	shaper_commit(true);
+
+	ucl_object_unref(cfg);
+	s = xmalloc0(sizeof(*s));
+	s->loop = loop;
+	s->worker = &proxy_worker;
+	s->listener = &proxy_listener;
+	s->fd = cl_fd;
+	s->bk_fd = bk_fd;
+	s->io.data = s;
+	s->bk_io.data = s;
+	s->tm.data = s;
+	ev_init(&s->tm, NULL);
+	s->cl2bk = ringbuf_create(buflen, NULL, 0);
+	s->bk2cl = ringbuf_create(buflen, NULL, 0);
+	shaper_session(s);
+	proxy_session = s;
+	proxy_create(s);
+
+	return s;
+}
+
+/*
+ * Engine: the same relay teeing both directions to a mirror sink, drained
+ * by its own thread, which is not counted
+ */
+static void *
+mirrored_engine_start(struct ev_loop *loop, int cl_fd, int bk_fd,
+		size_t buflen)
+{
+	static bool started = false;
+	struct ssl_session *s;
+	ucl_object_t *cfg;
+
+	if (!started) {
+		cfg = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(cfg, ucl_object_fromstring(mirror_sink), "file",
+				0, false);
+
+		if (!mirror_init(cfg) || !mirror_configure(cfg)) {
+			exit(EXIT_FAILURE);
+		}
+
+		mirror_commit(true);
+
+		ucl_object_unref(cfg);
+		mirror_start(&proxy_worker);
+		started = true;
+	}
+
+	s = xmalloc0(sizeof(*s));
+	s->loop = loop;
+	s->worker = &proxy_worker;
+	s->listener = &proxy_listener;
+	s->fd = cl_fd;
+	s->bk_fd = bk_fd;
+	s->io.data = s;
+	s->bk_io.data = s;
+	s->tm.data = s;
+	ev_init(&s->tm, NULL);
+	s->cl2bk = ringbuf_create(buflen, NULL, 0);
+	s->bk2cl = ringbuf_create(buflen, NULL, 0);
+	s->mirror = true;
+	mirror_session_open(s);
+	proxy_session = s;
+	proxy_create(s);
+
+	return s;
+}
+
+/*
+ * Engine: read()/write() through a flat buffer per direction
+ */
+struct copy_dir {
+	ev_io rd;
+	ev_io wr;
+	unsigned char *buf;
+	size_t len;
+	size_t off;
+	size_t size;
+};
+
+struct copy_ctx {
+	struct copy_dir dir[2];
+	int fds[2];
+};
+
+static void copy_update(struct ev_loop *loop, struct copy_dir *d);
+
+static void
+copy_rd_cb(EV_P_ ev_io *w, int revents)
+{
+	struct copy_dir *d = w->data;
+	ssize_t r;
+
+	r = read(w->fd, d->buf, d->size);
+
+	if (r > 0) {
+		d->len = r;
+		d->off = 0;
+	}
+	else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+		ev_io_stop(loop, &d->rd);
+		shutdown(d->wr.fd, SHUT_WR);
+		return;
+	}
+
+	copy_update(loop, d);
+}
+
+static void
+copy_wr_cb(EV_P_ ev_io *w, int revents)
+{
+	struct copy_dir *d = w->data;
+	ssize_t r;
+
+	r = write(w->fd, d->buf + d->off, d->len - d->off);
+
+	if (r > 0) {
+		d->off += r;
+
+		if (d->off == d->len) {
+			d->off = d->len = 0;
+		}
+	}
+	else if (r == -1 && errno != EAGAIN && errno != EINTR) {
+		ev_io_stop(loop, &d->rd);
+		ev_io_stop(loop, &d->wr);
+		return;
+	}
+
+	copy_update(loop, d);
+}
+
+static void
+copy_update(struct ev_loop *loop, struct copy_dir *d)
+{
+	if (d->len == 0) {
+		ev_io_stop(loop, &d->wr);
+		ev_io_start(loop, &d->rd);
+	}
+	else {
+		ev_io_stop(loop, &d->rd);
+		ev_io_start(loop, &d->wr);
+	}
+}
+
+static void *
+copy_engine_start(struct ev_loop *loop, int cl_fd, int bk_fd, size_t buflen)
+{
+	struct copy_ctx *c;
+	int i, from, to;
+
+	c = xmalloc0(sizeof(*c));
+	c->fds[0] = cl_fd;
+	c->fds[1] = bk_fd;
+
+	for (i = 0; i < 2; i ++) {
+		from = c->fds[i];
+		to = c->fds[1 - i];
+		c->dir[i].buf = xmalloc(buflen);
+		c->dir[i].size = buflen;
+		c->dir[i].rd.data = &c->dir[i];
+		c->dir[i].wr.data = &c->dir[i];
+		ev_io_init(&c->dir[i].rd, copy_rd_cb, from, EV_READ);
+		ev_io_init(&c->dir[i].wr, copy_wr_cb, to, EV_WRITE);
+		ev_io_start(loop, &c->dir[i].rd);
+	}
+
+	return c;
+}
+
+static void
+copy_engine_stop(struct ev_loop *loop, void *ctx)
+{
+	struct copy_ctx *c = ctx;
+	int i;
+
+	for (i = 0; i < 2; i ++) {
+		ev_io_stop(loop, &c->dir[i].rd);
+		ev_io_stop(loop, &c->dir[i].wr);
+		free(c->dir[i].buf);
+		close(c->fds[i]);
+	}
+
+	free(c);
+}
+
+#ifdef __linux__
+/*
+ * Engine: splice() through a pipe per direction, no userspace copies
+ */
+struct splice_dir {
+	ev_io rd;
+	ev_io wr;
+	int pipe[2];
+	size_t pending;
+	size_t size;
+};
+
+struct splice_ctx {
+	struct splice_dir dir[2];
+	int fds[2];
+};
+
+static void
+splice_update(struct ev_loop *loop, struct splice_dir *d)
+{
+	if (d->pending == 0) {
+		ev_io_stop(loop, &d->wr);
+		ev_io_start(loop, &d->rd);
+	}
+	else {
+		ev_io_stop(loop, &d->rd);
+		ev_io_start(loop, &d->wr);
+	}
+}
+
+static void
+splice_rd_cb(EV_P_ ev_io *w, int revents)
+{
+	struct splice_dir *d = w->data;
+	ssize_t r;
+
+	r = splice(w->fd, NULL, d->pipe[1], NULL, d->size,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+	if (r > 0) {
+		d->pending += r;
+	}
+	else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+		ev_io_stop(loop, &d->rd);
+		shutdown(d->wr.fd, SHUT_WR);
+		return;
+	}
+
+	splice_update(loop, d);
+}
+
+static void
+splice_wr_cb(EV_P_ ev_io *w, int revents)
+{
+	struct splice_dir *d = w->data;
+	ssize_t r;
+
+	r = splice(d->pipe[0], NULL, w->fd, NULL, d->pending,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+	if (r > 0) {
+		d->pending -= r;
+	}
+	else if (r == -1 && errno != EAGAIN && errno != EINTR) {
+		ev_io_stop(loop, &d->rd);
+		ev_io_stop(loop, &d->wr);
+		return;
+	}
+
+	splice_update(loop, d);
+}
+
+static void *
+splice_engine_start(struct ev_loop *loop, int cl_fd, int bk_fd, size_t buflen)
+{
+	struct splice_ctx *c;
+	int i;
+
+	c = xmalloc0(sizeof(*c));
+	c->fds[0] = cl_fd;
+	c->fds[1] = bk_fd;
+
+	for (i = 0; i < 2; i ++) {
+		if (pipe(c->dir[i].pipe) == -1) {
+			perror("pipe");
+			exit(EXIT_FAILURE);
+		}
+		fcntl(c->dir[i].pipe[0], F_SETPIPE_SZ, (int)buflen);
+		c->dir[i].size = fcntl(c->dir[i].pipe[0], F_GETPIPE_SZ);
+		c->dir[i].rd.data = &c->dir[i];
+		c->dir[i].wr.data = &c->dir[i];
+		ev_io_init(&c->dir[i].rd, splice_rd_cb, c->fds[i], EV_READ);
+		ev_io_init(&c->dir[i].wr, splice_wr_cb, c->fds[1 - i], EV_WRITE);
+		ev_io_start(loop, &c->dir[i].rd);
+	}
+
+	return c;
+}
+
+static void
+splice_engine_stop(struct ev_loop *loop, void *ctx)
+{
+	struct splice_ctx *c = ctx;
+	int i;
+
+	for (i = 0; i < 2; i ++) {
+		ev_io_stop(loop, &c->dir[i].rd);
+		ev_io_stop(loop, &c->dir[i].wr);
+		close(c->dir[i].pipe[0]);
+		close(c->dir[i].pipe[1]);
+		close(c->fds[i]);
+	}
+
+	free(c);
+}
+#endif
+
+static const struct relay_engine engines[] = {
+	{"proxy", "src/proxy.c relay over struct ringbuf",
+			proxy_engine_start, proxy_engine_stop},
+	{"shaped", "proxy relay charged to shaping buckets (-S)",
+			shaped_engine_start, proxy_engine_stop},
+	{"mirrored", "proxy relay teed to a mirror sink (-M)",
+			mirrored_engine_start, proxy_engine_stop},
+	{"copy", "read()/write() through a flat buffer",
+			copy_engine_start, copy_engine_stop},
+#ifdef __linux__
+	{"splice", "splice() through a pipe",
+			splice_engine_start, splice_engine_stop},
+#endif
+};
+
+/*
+ * Producer and consumer threads
+ */
+struct pump {
+	pthread_t thr;
+	int fd;
+	uint64_t total;
+	const struct size_list *sizes;
+	ev_async *done;
+	struct ev_loop *loop;
+	double t_done;
+};
+
+static void *
+producer_thread(void *arg)
+{
+	struct pump *p = arg;
+	unsigned char *buf;
+	uint64_t sent = 0;
+	size_t want, max = 0;
+	unsigned i = 0;
+	ssize_t r;
+
+	for (i = 0; i < p->sizes->n; i ++) {
+		if (p->sizes->v[i] > max) {
+			max = p->sizes->v[i];
+		}
+	}
+
+	buf = xmalloc0(max);
+	i = 0;
+
+	while (sent < p->total) {
+		want = p->sizes->v[i ++ % p->sizes->n];
+
+		if (want > p->total - sent) {
+			want = p->total - sent;
+		}
+
+		r = write(p->fd, buf, want);
+
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		sent += r;
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static void *
+consumer_thread(void *arg)
+{
+	struct pump *p = arg;
+	unsigned char *buf;
+	uint64_t got = 0;
+	size_t want, max = 0;
+	unsigned i;
+	ssize_t r;
+
+	for (i = 0; i < p->sizes->n; i ++) {
+		if (p->sizes->v[i] > max) {
+			max = p->sizes->v[i];
+		}
+	}
+
+	buf = xmalloc(max);
+	i = 0;
+
+	while (got < p->total) {
+		want = p->sizes->v[i ++ % p->sizes->n];
+		r = read(p->fd, buf, want);
+
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		got += r;
+	}
+
+	p->t_done = now_clock(CLOCK_MONOTONIC);
+	free(buf);
+	ev_async_send(p->loop, p->done);
+
+	return NULL;
+}
+
+static void
+make_pair(bool tcp, int fds[2])
+{
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	int lsock;
+
+	if (!tcp) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+			perror("socketpair");
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (lsock == -1 || bind(lsock, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+			listen(lsock, 1) == -1 ||
+			getsockname(lsock, (struct sockaddr *)&sin, &slen) == -1) {
+		perror("loopback listen");
+		exit(EXIT_FAILURE);
+	}
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+			(fds[1] = accept(lsock, NULL, NULL)) == -1) {
+		perror("loopback connect");
+		exit(EXIT_FAILURE);
+	}
+
+	close(lsock);
+}
+
+static const char *
+size_list_str(const struct size_list *l)
+{
+	static char buf[128];
+	size_t off = 0;
+	unsigned i;
+
+	buf[0] = '\0';
+	for (i = 0; i < l->n && off < sizeof(buf); i ++) {
+		off += snprintf(buf + off, sizeof(buf) - off, "%s%zu",
+				i > 0 ? "," : "", l->v[i]);
+	}
+
+	return buf;
+}
+
+static unsigned running_pumps;
+
+static void
+pump_done_cb(EV_P_ ev_async *w, int revents)
+{
+	/* Consumers may finish together and coalesce into one wakeup */
+	running_pumps = 0;
+	ev_break(loop, EVBREAK_ALL);
+}
+
+struct run_opts {
+	bool tcp;
+	bool bidir;
+	uint64_t total;
+	const struct size_list *reads;
+};
+
+static void
+run_one(const struct relay_engine *e, size_t buflen,
+		const struct size_list *writes, const struct run_opts *ro)
+{
+	int cl[2], bk[2], ndirs, i;
+	struct pump prod[2], cons[2];
+	struct ev_loop *loop;
+	ev_async done;
+	void *ctx;
+	double t0, cpu0, elapsed, cpu, mb;
+
+	make_pair(ro->tcp, cl);
+	make_pair(ro->tcp, bk);
+	set_nonblock(cl[1]);
+	set_nonblock(bk[0]);
+
+	loop = ev_loop_new(EVFLAG_AUTO);
+	ev_async_init(&done, pump_done_cb);
+	ev_async_start(loop, &done);
+
+	memset(prod, 0, sizeof(prod));
+	memset(cons, 0, sizeof(cons));
+	ndirs = ro->bidir ? 2 : 1;
+
+	/* Direction 0 goes client to backend, direction 1 the other way */
+	prod[0].fd = cl[0];
+	cons[0].fd = bk[1];
+	prod[1].fd = bk[1];
+	cons[1].fd = cl[0];
+
+	memset(&sysc, 0, sizeof(sysc));
+	t0 = now_clock(CLOCK_MONOTONIC);
+	cpu0 = now_clock(CLOCK_THREAD_CPUTIME_ID);
+	ctx = e->start(loop, cl[1], bk[0], buflen);
+
+	for (i = 0; i < ndirs; i ++) {
+		prod[i].total = cons[i].total = ro->total;
+		prod[i].sizes = writes;
+		cons[i].sizes = ro->reads;
+		cons[i].done = &done;
+		cons[i].loop = loop;
+		pthread_create(&prod[i].thr, NULL, producer_thread, &prod[i]);
+		pthread_create(&cons[i].thr, NULL, consumer_thread, &cons[i]);
+	}
+
+	running_pumps = ndirs;
+	while (running_pumps > 0) {
+		ev_run(loop, 0);
+
+		for (i = 0; i < ndirs; i ++) {
+			if (cons[i].t_done == 0) {
+				running_pumps = 1;
+			}
+		}
+	}
+
+	cpu = now_clock(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+	elapsed = 0;
+	for (i = 0; i < ndirs; i ++) {
+		if (cons[i].t_done - t0 > elapsed) {
+			elapsed = cons[i].t_done - t0;
+		}
+	}
+
+	e->stop(loop, ctx);
+	close(cl[0]);
+	close(bk[1]);
+
+	for (i = 0; i < ndirs; i ++) {
+		pthread_join(prod[i].thr, NULL);
+		pthread_join(cons[i].thr, NULL);
+	}
+
+	ev_async_stop(loop, &done);
+	ev_loop_destroy(loop);
+
+	mb = (double)ro->total * ndirs / (1024.0 * 1024.0);
+	printf("%-8s %7zu %-20s %10.1f %6.1f %9.1f %9.1f\n", e->name, buflen,
+			size_list_str(writes),
+			mb / elapsed, cpu / elapsed * 100.0,
+			sysc.io / mb, sysc.poll / mb);
+}
+
+/*
+ * In-memory ringbuf exercise: no sockets, only the bookkeeping and memcpy,
+ * with chunk sizes that make the buffer wrap often.
+ */
+static void
+run_ringbuf(size_t buflen, const struct size_list *writes,
+		const struct size_list *reads, uint64_t total)
+{
+	struct ringbuf *rb;
+	const struct iovec *iov;
+	unsigned char *src, *dst;
+	uint64_t in = 0, out = 0, wraps = 0, ops = 0;
+	size_t want, n, max = 0, left;
+	unsigned wi = 0, ri = 0, i;
+	int cnt, k;
+	double t0, elapsed;
+
+	for (i = 0; i < writes->n; i ++) {
+		if (writes->v[i] > max) {
+			max = writes->v[i];
+		}
+	}
+	for (i = 0; i < reads->n; i ++) {
+		if (reads->v[i] > max) {
+			max = reads->v[i];
+		}
+	}
+
+	src = xmalloc0(max);
+	dst = xmalloc(max);
+	rb = ringbuf_create(buflen, NULL, 0);
+	t0 = now_clock(CLOCK_MONOTONIC);
+
+	while (out < total) {
+		/* Fill the way readv() would */
+		if (ringbuf_can_read(rb) && in < total) {
+			want = writes->v[wi ++ % writes->n];
+			iov = ringbuf_readvec(rb, &cnt);
+			wraps += cnt > 1;
+			left = want;
+
+			for (k = 0; k < cnt && left > 0; k ++) {
+				n = iov[k].iov_len < left ? iov[k].iov_len : left;
+				memcpy(iov[k].iov_base, src, n);
+				left -= n;
+			}
+
+			ringbuf_update_read(rb, want - left);
+			in += want - left;
+			ops ++;
+		}
+		/* Drain the way writev() would */
+		if (ringbuf_can_write(rb)) {
+			want = reads->v[ri ++ % reads->n];
+			iov = ringbuf_writevec(rb, &cnt);
+			wraps += cnt > 1;
+			left = want;
+
+			for (k = 0; k < cnt && left > 0; k ++) {
+				n = iov[k].iov_len < left ? iov[k].iov_len : left;
+				memcpy(dst, iov[k].iov_base, n);
+				left -= n;
+			}
+
+			ringbuf_update_write(rb, want - left);
+			out += want - left;
+			ops ++;
+		}
+	}
+
+	elapsed = now_clock(CLOCK_MONOTONIC) - t0;
+	ringbuf_destroy(rb);
+	free(src);
+	free(dst);
+
+	printf("%-8s %7zu %-20s %10.1f %9.1f %9.1f%%\n", "ringbuf", buflen,
+			size_list_str(writes), total / (1024.0 * 1024.0) / elapsed,
+			elapsed * 1e9 / ops, wraps * 100.0 / ops);
+}
+
+static bool
+parse_list(const char *str, struct size_list *l)
+{
+	char *end;
+
+	l->n = 0;
+
+	while (*str != '\0' && l->n < MAX_LIST) {
+		l->v[l->n] = strtoul(str, &end, 0);
+
+		switch (*end) {
+		case 'k':
+		case 'K':
+			l->v[l->n] *= 1024;
+			end ++;
+			break;
+		case 'm':
+		case 'M':
+			l->v[l->n] *= 1024 * 1024;
+			end ++;
+			break;
+		}
+
+		if (end == str || l->v[l->n] == 0 || (*end != ',' && *end != '\0')) {
+			return false;
+		}
+
+		l->n ++;
+		str = *end == ',' ? end + 1 : end;
+	}
+
+	return l->n > 0;
+}
+
+static void
+usage(const char *error)
+{
+	unsigned i;
+
+	if (error) {
+		fprintf(stderr, "%s\n", error);
+	}
+
+	fprintf(stderr, "usage:"
+		"\trelay-bench [-e engines] [-b bufsizes] [-w writes]... [-r reads]\n"
+		"\t\t[-n bytes] [-S rate] [-M sink] [-T] [-2] [-R] [-h]\n"
+		"\n"
+		"\t-e\tcomma separated engines to run (default all)\n"
+		"\t-b\tcomma separated relay buffer sizes (default 4k,16k,64k)\n"
+		"\t-w\tproducer write sizes, cycled; repeat -w for more mixes\n"
+		"\t\t(default 16k, 1460 and the wrap-heavy 5000,9973,70000)\n"
+		"\t-r\tconsumer read sizes (default 64k)\n"
+		"\t-n\tbytes per direction (default 256m)\n"
+		"\t-S\tbytes/s of the shaped engine (default 1 TB/s, never reached)\n"
+		"\t-M\tfile the mirrored engine writes to (default /dev/null)\n"
+		"\t-T\tuse loopback TCP instead of socketpair()\n"
+		"\t-2\trelay in both directions at once\n"
+		"\t-R\tonly run the in-memory ringbuf wrap test\n"
+		"\nengines:\n");
+
+	for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i ++) {
+		fprintf(stderr, "\t%-8s%s\n", engines[i].name, engines[i].descr);
+	}
+
+	exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct size_list bufs, reads, mixes[MAX_LIST], total_l;
+	struct run_opts ro;
+	const char *engine_list = NULL;
+	unsigned nmixes = 0, i, j, k;
+	bool ring_only = false;
+	char *tok, *copy;
+	int ch;
+
+	memset(&ro, 0, sizeof(ro));
+	parse_list("4k,16k,64k", &bufs);
+	parse_list("64k", &reads);
+	ro.total = 256 * 1024 * 1024;
+	ro.reads = &reads;
+
+	while ((ch = getopt(argc, argv, "e:b:w:r:n:S:M:T2Rh")) != -1) {
+		switch (ch) {
+		case 'e':
+			engine_list = optarg;
+			break;
+		case 'b':
+			if (!parse_list(optarg, &bufs)) {
+				usage("invalid buffer sizes");
+			}
+			break;
+		case 'w':
+			if (nmixes == MAX_LIST || !parse_list(optarg, &mixes[nmixes ++])) {
+				usage("invalid write sizes");
+			}
+			break;
+		case 'r':
+			if (!parse_list(optarg, &reads)) {
+				usage("invalid read sizes");
+			}
+			break;
+		case 'n':
+			if (!parse_list(optarg, &total_l)) {
+				usage("invalid byte count");
+			}
+			ro.total = total_l.v[0];
+			break;
+		case 'S':
+			if (!parse_list(optarg, &total_l)) {
+				usage("invalid shaping rate");
+			}
+			shape_rate = total_l.v[0];
+			break;
+		case 'M':
+			mirror_sink = optarg;
+			break;
+		case 'T':
+			ro.tcp = true;
+			break;
+		case '2':
+			ro.bidir = true;
+			break;
+		case 'R':
+			ring_only = true;
+			break;
+		case 'h':
+		default:
+			usage(NULL);
+			break;
+		}
+	}
+
+	if (nmixes == 0) {
+		parse_list("16k", &mixes[nmixes ++]);
+		parse_list("1460", &mixes[nmixes ++]);
+		parse_list("5000,9973,70000", &mixes[nmixes ++]);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!ring_only) {
+		printf("%-8s %7s %-20s %10s %6s %9s %9s\n", "engine", "buffer",
+				"writes", "MB/s", "cpu%", "io/MB", "poll/MB");
+
+		for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i ++) {
+			if (engine_list != NULL) {
+				copy = strdup(engine_list);
+				for (tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+					if (strcmp(tok, engines[i].name) == 0) {
+						break;
+					}
+				}
+				free(copy);
+
+				if (tok == NULL) {
+					continue;
+				}
+			}
+
+			for (j = 0; j < bufs.n; j ++) {
+				for (k = 0; k < nmixes; k ++) {
+					run_one(&engines[i], bufs.v[j], &mixes[k], &ro);
+				}
+			}
+		}
+
+		printf("\n");
+	}
+
+	printf("%-8s %7s %-20s %10s %9s %10s\n", "engine", "buffer",
+			"chunk", "MB/s", "ns/op", "wrapped");
+
+	for (j = 0; j < bufs.n; j ++) {
+		for (k = 0; k < nmixes; k ++) {
+			run_ringbuf(bufs.v[j], &mixes[k], &reads, ro.total);
+		}
+	}
+
+	return 0;
+}
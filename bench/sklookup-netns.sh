@@ -0,0 +1,98 @@
+#!/bin/sh
+# Checks sk_lookup steering in a network namespace, needs root, iproute2 and
+# Linux 5.9+.
+#
+# The namespace routes 10.99.0.0/24 and 2001:db8::/64 locally. The proxy only
+# listens on loopback port 10443, its program steers connections to those
+# prefixes on ports 8000-8099 and 9443 into its sockets. sni-bench backends
+# run on ports 8444 and 8445.
+#
+#   usage: sklookup-netns.sh [top_builddir]
+
+set -e
+
+TOP=${1:-.}
+PROXY=$TOP/src/sni-proxy
+BENCH=$TOP/bench/sni-bench
+TMP=$(mktemp -d)
+NS=snisk
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do
+		kill $pid 2>/dev/null || true
+	done
+	ip netns del $NS 2>/dev/null || true
+	rm -rf $TMP
+}
+
+trap cleanup EXIT INT TERM
+
+check() {
+	if "$@" > $TMP/out 2>&1; then
+		return 0
+	fi
+	cat $TMP/out
+	return 1
+}
+
+fails() {
+	if "$@" > $TMP/out 2>&1; then
+		cat $TMP/out
+		return 1
+	fi
+	return 0
+}
+
+ip netns add $NS
+ip -n $NS link set lo up
+ip -n $NS route add local 10.99.0.0/24 dev lo
+ip -n $NS -6 route add local 2001:db8::/64 dev lo
+
+cat > $TMP/proxy.conf <<CONF
+listeners {
+	steered {
+		listen = [ "127.0.0.1:10443", "[::1]:10443" ];
+		steer {
+			prefixes = [ "10.99.0.0/24", "2001:db8::/64" ];
+			ports = [ "8000-8099", 9443 ];
+		}
+		backends {
+			"10.99.0.9" {
+				host = 127.0.0.1;
+				port = 8445;
+			}
+			default {
+				host = 127.0.0.1;
+				port = 8444;
+			}
+		}
+	}
+}
+CONF
+
+ip netns exec $NS $BENCH -B -b 8444 &
+PIDS="$PIDS $!"
+ip netns exec $NS $BENCH -B -b 8445 &
+PIDS="$PIDS $!"
+ip netns exec $NS $PROXY -c $TMP/proxy.conf > $TMP/proxy.log 2>&1 &
+PIDS="$PIDS $!"
+sleep 0.5
+
+echo "steered IPv4 address and port"
+check ip netns exec $NS $BENCH -X -t 10.99.0.7:8005 -s steered.test -n 1000
+
+echo "steered IPv6 address and port"
+check ip netns exec $NS $BENCH -X -t '[2001:db8::7]:9443' -s steered.test \
+		-n 1000
+
+echo "route by local address"
+# Only the backend on 8445 is left
+kill $(echo $PIDS | cut -d' ' -f1)
+check ip netns exec $NS $BENCH -X -t 10.99.0.9:8099 -s steered.test -n 100
+fails ip netns exec $NS $BENCH -X -t 10.99.0.8:8099 -s steered.test -n 1
+
+echo "ports outside the ranges are not steered"
+fails ip netns exec $NS $BENCH -X -t 10.99.0.7:8100 -s steered.test -n 1
+
+echo ok
@@ -0,0 +1,1598 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sni-bench: end-to-end load generator for sni-proxy.
+ *
+ * It starts a bundled sink/echo backend in a child process, then drives
+ * many concurrent connections that send a synthetic ClientHello either
+ * through sni-proxy or (with -D) directly to the backend, so both numbers
+ * can be compared on the same box over loopback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include "ev.h"
+#include "hello.h"
+
+#define HELLO_MAX 16384
+#define IOBUF_LEN 65536
+/* Sequential round trips through idle sessions after each scale step */
+#define SCALE_PROBES 200
+
+enum bk_mode {
+	bk_mode_sink = 0,
+	bk_mode_echo
+};
+
+struct bench_opts {
+	const char *target;
+	int bk_port;
+	const char *bk_unix;
+	bool direct;
+	bool no_backend;
+	bool backend_only;
+	enum bk_mode mode;
+	unsigned concurrency;
+	unsigned long total;
+	double duration;
+	size_t upload;
+	size_t response;
+	unsigned names;
+	double zipf;
+	size_t hello_len;
+	const char *domain;
+	/* Scale test */
+	unsigned long sessions;
+	unsigned long step;
+	unsigned sources;
+	pid_t pid;
+	const char *config_out;
+};
+
+static struct bench_opts opts = {
+	.target = "127.0.0.1:8443",
+	.bk_port = 8444,
+	.mode = bk_mode_sink,
+	.concurrency = 256,
+	.total = 10000,
+	.upload = 0,
+	.response = 16384,
+	.names = 1,
+	.zipf = 0.0,
+	.hello_len = 512,
+	.domain = "bench.test",
+	.pid = -1,
+};
+
+static unsigned char zero_buf[IOBUF_LEN];
+
+static double
+now_mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+set_nonblock(int fd)
+{
+	int ofl;
+
+	ofl = fcntl(fd, F_GETFL, 0);
+
+	return fcntl(fd, F_SETFL, ofl | O_NONBLOCK);
+}
+
+static bool
+parse_hostport(const char *str, struct sockaddr_storage *ss, socklen_t *slen)
+{
+	char host[256];
+	const char *colon, *h = str;
+	size_t hlen;
+	struct addrinfo hints, *res;
+
+	colon = strrchr(str, ':');
+	if (colon == NULL) {
+		return false;
+	}
+
+	hlen = colon - str;
+	if (str[0] == '[' && hlen > 2 && str[hlen - 1] == ']') {
+		h = str + 1;
+		hlen -= 2;
+	}
+	if (hlen >= sizeof(host)) {
+		return false;
+	}
+	memcpy(host, h, hlen);
+	host[hlen] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+		return false;
+	}
+
+	memcpy(ss, res->ai_addr, res->ai_addrlen);
+	*slen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return true;
+}
+
+static void
+raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/*
+ * Bundled backend
+ */
+struct bk_conn {
+	ev_io io;
+	int fd;
+	/* ClientHello header and the number of bytes still expected */
+	unsigned char hdr[5];
+	size_t hdr_got;
+	size_t hello_left;
+	bool hello_done;
+	/* Sink: bytes of response left; echo: pending output */
+	size_t resp_left;
+	unsigned char *out;
+	size_t out_len;
+	size_t out_off;
+	bool eof;
+};
+
+static void
+bk_conn_close(struct ev_loop *loop, struct bk_conn *c)
+{
+	ev_io_stop(loop, &c->io);
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+static void
+bk_conn_update(struct ev_loop *loop, struct bk_conn *c)
+{
+	int ev = 0;
+
+	if (!c->eof && (opts.mode == bk_mode_sink || c->out_off == c->out_len)) {
+		ev |= EV_READ;
+	}
+	if (c->resp_left > 0 || c->out_off < c->out_len) {
+		ev |= EV_WRITE;
+	}
+
+	if (ev == 0) {
+		bk_conn_close(loop, c);
+		return;
+	}
+
+	ev_io_stop(loop, &c->io);
+	ev_io_set(&c->io, c->fd, ev);
+	ev_io_start(loop, &c->io);
+}
+
+/* Accounts the ClientHello bytes in a freshly read chunk */
+static void
+bk_track_hello(struct bk_conn *c, const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	while (len > 0 && !c->hello_done) {
+		if (c->hdr_got < sizeof(c->hdr)) {
+			c->hdr[c->hdr_got ++] = *p ++;
+			len --;
+
+			if (c->hdr_got == sizeof(c->hdr)) {
+				c->hello_left = (c->hdr[3] << 8) | c->hdr[4];
+			}
+			continue;
+		}
+
+		n = len < c->hello_left ? len : c->hello_left;
+		c->hello_left -= n;
+		p += n;
+		len -= n;
+
+		if (c->hello_left == 0) {
+			c->hello_done = true;
+
+			if (opts.mode == bk_mode_sink) {
+				c->resp_left = opts.response;
+			}
+		}
+	}
+}
+
+static void
+bk_conn_cb(EV_P_ ev_io *w, int revents)
+{
+	struct bk_conn *c = w->data;
+	ssize_t r;
+	size_t n;
+
+	if (revents & EV_READ) {
+		if (opts.mode == bk_mode_sink) {
+			r = read(c->fd, zero_buf, sizeof(zero_buf));
+		}
+		else {
+			r = read(c->fd, c->out, IOBUF_LEN);
+		}
+
+		if (r == -1 && errno != EAGAIN && errno != EINTR) {
+			bk_conn_close(loop, c);
+			return;
+		}
+		else if (r == 0) {
+			c->eof = true;
+		}
+		else if (r > 0) {
+			if (opts.mode == bk_mode_sink) {
+				bk_track_hello(c, zero_buf, r);
+				memset(zero_buf, 0, r);
+			}
+			else {
+				c->out_len = r;
+				c->out_off = 0;
+			}
+		}
+	}
+
+	if (revents & EV_WRITE) {
+		if (opts.mode == bk_mode_sink && c->resp_left > 0) {
+			n = c->resp_left < sizeof(zero_buf) ? c->resp_left : sizeof(zero_buf);
+			r = write(c->fd, zero_buf, n);
+
+			if (r > 0) {
+				c->resp_left -= r;
+			}
+		}
+		else if (c->out_off < c->out_len) {
+			r = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+
+			if (r > 0) {
+				c->out_off += r;
+			}
+		}
+		else {
+			r = 0;
+		}
+
+		if (r == -1 && errno != EAGAIN && errno != EINTR) {
+			bk_conn_close(loop, c);
+			return;
+		}
+	}
+
+	if (c->eof && c->resp_left == 0 && c->out_off == c->out_len) {
+		bk_conn_close(loop, c);
+		return;
+	}
+
+	bk_conn_update(loop, c);
+}
+
+static void
+bk_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	struct bk_conn *c;
+	int fd;
+
+	while ((fd = accept(w->fd, NULL, NULL)) != -1) {
+		set_nonblock(fd);
+		c = calloc(1, sizeof(*c));
+		c->fd = fd;
+		if (opts.mode == bk_mode_echo) {
+			c->out = malloc(IOBUF_LEN);
+		}
+		c->io.data = c;
+		ev_io_init(&c->io, bk_conn_cb, fd, EV_READ);
+		ev_io_start(loop, &c->io);
+	}
+}
+
+static int
+bk_listen(int port)
+{
+	struct sockaddr_in sin;
+	int sock, on = 1;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return -1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	/* Any address, so 127.x.y.z aliases work without extra setup */
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+			listen(sock, 65535) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	set_nonblock(sock);
+
+	return sock;
+}
+
+/* Unix socket listener, '@' starts a Linux abstract name */
+static int
+bk_listen_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	socklen_t slen;
+	size_t len = strlen(path);
+	int sock;
+
+	if (len == 0 || len >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, len);
+
+	if (path[0] == '@') {
+		sun.sun_path[0] = '\0';
+		slen = offsetof(struct sockaddr_un, sun_path) + len;
+	}
+	else {
+		unlink(path);
+		slen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return -1;
+	}
+
+	if (bind(sock, (struct sockaddr *)&sun, slen) == -1 ||
+			listen(sock, 65535) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	set_nonblock(sock);
+
+	return sock;
+}
+
+static void
+run_backend(int sock, int usock)
+{
+	struct ev_loop *loop;
+	ev_io accept_ev, unix_ev;
+
+	loop = ev_loop_new(EVFLAG_AUTO);
+	ev_io_init(&accept_ev, bk_accept_cb, sock, EV_READ);
+	ev_io_start(loop, &accept_ev);
+
+	if (usock != -1) {
+		ev_io_init(&unix_ev, bk_accept_cb, usock, EV_READ);
+		ev_io_start(loop, &unix_ev);
+	}
+	ev_run(loop, 0);
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Returns the backend pid, or never returns with -B */
+static pid_t
+start_backend(int port)
+{
+	int sock, usock = -1;
+	pid_t pid;
+
+	sock = bk_listen(port);
+
+	if (sock == -1) {
+		fprintf(stderr, "cannot listen on backend port %d: %s\n", port,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (opts.bk_unix) {
+		usock = bk_listen_unix(opts.bk_unix);
+
+		if (usock == -1) {
+			fprintf(stderr, "cannot listen on backend socket %s: %s\n",
+					opts.bk_unix, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (opts.backend_only) {
+		run_backend(sock, usock);
+	}
+
+	pid = fork();
+
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	else if (pid > 0) {
+		close(sock);
+		if (usock != -1) {
+			close(usock);
+		}
+		return pid;
+	}
+
+	run_backend(sock, usock);
+
+	return 0;
+}
+
+/*
+ * Client side
+ */
+struct bench_hello {
+	unsigned char *data;
+	size_t len;
+};
+
+struct bench_state {
+	struct ev_loop *loop;
+	struct sockaddr_storage target;
+	socklen_t target_len;
+	struct bench_hello *hellos;
+	double *cdf;
+	unsigned long started;
+	unsigned long completed;
+	unsigned long errors;
+	unsigned active;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	double *latencies;
+	size_t nlat;
+	size_t lat_cap;
+	double t_start;
+	double t_end;
+	bool stopping;
+};
+
+struct cl_conn {
+	ev_io io;
+	int fd;
+	const struct bench_hello *hello;
+	size_t out_total;
+	size_t out_done;
+	size_t in_expected;
+	size_t in_done;
+	double t_start;
+	bool connected;
+};
+
+static struct bench_state st;
+
+static void cl_start(void);
+
+static void
+record_latency(double v)
+{
+	if (st.nlat == st.lat_cap) {
+		st.lat_cap = st.lat_cap ? st.lat_cap * 2 : 65536;
+		st.latencies = realloc(st.latencies, st.lat_cap * sizeof(double));
+	}
+
+	st.latencies[st.nlat ++] = v;
+}
+
+static void
+cl_finish(struct cl_conn *c, bool ok)
+{
+	ev_io_stop(st.loop, &c->io);
+	close(c->fd);
+
+	if (ok) {
+		st.completed ++;
+	}
+	else {
+		st.errors ++;
+	}
+
+	st.active --;
+	free(c);
+
+	if (!st.stopping) {
+		if ((opts.total > 0 && st.started >= opts.total) ||
+				(opts.duration > 0 && now_mono() - st.t_start >= opts.duration)) {
+			st.stopping = true;
+		}
+	}
+
+	if (!st.stopping) {
+		cl_start();
+	}
+	else if (st.active == 0) {
+		st.t_end = now_mono();
+		ev_break(st.loop, EVBREAK_ALL);
+	}
+}
+
+static void
+cl_conn_cb(EV_P_ ev_io *w, int revents)
+{
+	struct cl_conn *c = w->data;
+	ssize_t r;
+	size_t n, off;
+	int err = 0, ev;
+	socklen_t elen = sizeof(err);
+
+	if (!c->connected) {
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &elen) == -1 ||
+				err != 0) {
+			cl_finish(c, false);
+			return;
+		}
+		c->connected = true;
+	}
+
+	if ((revents & EV_WRITE) && c->out_done < c->out_total) {
+		if (c->out_done < c->hello->len) {
+			off = c->out_done;
+			r = write(c->fd, c->hello->data + off, c->hello->len - off);
+		}
+		else if (c->in_done > 0) {
+			n = c->out_total - c->out_done;
+			r = write(c->fd, zero_buf, n < sizeof(zero_buf) ? n : sizeof(zero_buf));
+		}
+		else {
+			r = 0;
+		}
+
+		if (r == -1 && errno != EAGAIN && errno != EINTR) {
+			cl_finish(c, false);
+			return;
+		}
+		else if (r > 0) {
+			c->out_done += r;
+			st.bytes_out += r;
+		}
+	}
+
+	if (revents & EV_READ) {
+		r = read(c->fd, zero_buf, sizeof(zero_buf));
+
+		if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+			cl_finish(c, false);
+			return;
+		}
+		else if (r > 0) {
+			if (c->in_done == 0) {
+				record_latency(now_mono() - c->t_start);
+			}
+			c->in_done += r;
+			st.bytes_in += r;
+		}
+	}
+
+	if (c->in_done >= c->in_expected && c->out_done == c->out_total) {
+		cl_finish(c, true);
+		return;
+	}
+
+	ev = EV_READ;
+	/*
+	 * Like a real TLS client, nothing beyond the ClientHello is sent
+	 * before the first byte of the reply arrives.
+	 */
+	if (c->out_done < c->hello->len ||
+			(c->out_done < c->out_total && c->in_done > 0)) {
+		ev |= EV_WRITE;
+	}
+
+	if ((ev & EV_WRITE) != (c->io.events & EV_WRITE)) {
+		ev_io_stop(loop, &c->io);
+		ev_io_set(&c->io, c->fd, ev);
+		ev_io_start(loop, &c->io);
+	}
+}
+
+static unsigned
+pick_name(void)
+{
+	double u;
+	unsigned lo = 0, hi = opts.names - 1, mid;
+
+	if (opts.names == 1) {
+		return 0;
+	}
+	if (st.cdf == NULL) {
+		return random() % opts.names;
+	}
+
+	u = (double)random() / RAND_MAX;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (st.cdf[mid] < u) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static void
+cl_start(void)
+{
+	struct cl_conn *c;
+	int fd;
+
+	while (st.active < opts.concurrency &&
+			(opts.total == 0 || st.started < opts.total)) {
+		fd = socket(st.target.ss_family, SOCK_STREAM, 0);
+
+		if (fd == -1) {
+			st.errors ++;
+			return;
+		}
+
+		set_nonblock(fd);
+		c = calloc(1, sizeof(*c));
+		c->fd = fd;
+		c->hello = &st.hellos[pick_name()];
+		c->out_total = c->hello->len + opts.upload;
+		c->in_expected = opts.mode == bk_mode_echo ?
+				c->out_total : opts.response;
+		c->t_start = now_mono();
+		st.started ++;
+		st.active ++;
+
+		if (connect(fd, (struct sockaddr *)&st.target, st.target_len) == -1 &&
+				errno != EINPROGRESS) {
+			st.active --;
+			st.errors ++;
+			close(fd);
+			free(c);
+			continue;
+		}
+
+		c->io.data = c;
+		ev_io_init(&c->io, cl_conn_cb, fd, EV_READ|EV_WRITE);
+		ev_io_start(st.loop, &c->io);
+	}
+}
+
+static void
+prepare_hellos(void)
+{
+	char name[512];
+	unsigned i;
+	double sum = 0.0;
+
+	st.hellos = calloc(opts.names, sizeof(*st.hellos));
+
+	for (i = 0; i < opts.names; i ++) {
+		snprintf(name, sizeof(name), "h%u.%s", i, opts.domain);
+		st.hellos[i].data = malloc(HELLO_MAX);
+		st.hellos[i].len = hello_build(st.hellos[i].data, HELLO_MAX, name,
+				opts.hello_len);
+
+		if (st.hellos[i].len == 0) {
+			fprintf(stderr, "cannot build ClientHello of %zu bytes\n",
+					opts.hello_len);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (opts.zipf > 0 && opts.names > 1) {
+		st.cdf = malloc(opts.names * sizeof(double));
+
+		for (i = 0; i < opts.names; i ++) {
+			sum += 1.0 / pow(i + 1, opts.zipf);
+			st.cdf[i] = sum;
+		}
+		for (i = 0; i < opts.names; i ++) {
+			st.cdf[i] /= sum;
+		}
+	}
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static double
+percentile(double q)
+{
+	size_t idx;
+
+	if (st.nlat == 0) {
+		return 0.0;
+	}
+
+	idx = (size_t)(q * (st.nlat - 1));
+
+	return st.latencies[idx];
+}
+
+static void
+report(void)
+{
+	double elapsed = st.t_end - st.t_start;
+
+	qsort(st.latencies, st.nlat, sizeof(double), cmp_double);
+
+	printf("mode:          %s via %s\n",
+			opts.mode == bk_mode_echo ? "echo" : "sink",
+			opts.direct ? "direct backend" : "sni-proxy");
+	printf("connections:   %lu ok, %lu failed in %.3f s\n", st.completed,
+			st.errors, elapsed);
+	printf("rate:          %.1f conn/s\n", st.completed / elapsed);
+	printf("first byte:    p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+			"p99.9 %.3f ms, max %.3f ms\n",
+			percentile(0.5) * 1e3, percentile(0.9) * 1e3,
+			percentile(0.99) * 1e3, percentile(0.999) * 1e3,
+			percentile(1.0) * 1e3);
+	printf("relayed:       %.3f Gbit/s (%llu bytes out, %llu bytes in)\n",
+			(st.bytes_in + st.bytes_out) * 8.0 / elapsed / 1e9,
+			(unsigned long long)st.bytes_out,
+			(unsigned long long)st.bytes_in);
+}
+
+/*
+ * Scale test: ramps up to opts.sessions concurrent sessions which stay open
+ * and mostly idle. Every step opens opts.step connections and walks them
+ * through the session states, sampling the proxy RSS (from /proc) after each
+ * state settles:
+ *
+ *  - greeting: accepted by the proxy, waiting for a ClientHello;
+ *  - idle: ClientHello relayed to the echo backend and echoed back;
+ *  - active: opts.upload bytes pushed both ways, so the buffers are touched.
+ *
+ * Then it measures proxy CPU while everything is idle and the round trip of
+ * a single byte through random sessions, which tracks the event loop
+ * iteration time as the number of registered descriptors grows.
+ *
+ * The client side binds to opts.sources loopback addresses (127.0.0.2 and
+ * up) to get past the ephemeral port range, the proxy side needs backends on
+ * several addresses for the same reason (see -C).
+ */
+struct sc_conn {
+	ev_io io;
+	int fd;
+	bool connected;
+	bool failed;
+	const struct bench_hello *hello;
+	size_t out_total;
+	size_t out_done;
+	size_t in_expected;
+	size_t in_done;
+	double t_start;
+};
+
+struct proc_sample {
+	uint64_t rss;
+	double cpu;
+	bool valid;
+};
+
+static struct {
+	struct sc_conn *conns;
+	unsigned long pending;
+	unsigned long errors;
+	ev_timer watchdog;
+	long ticks;
+	long page_size;
+} sc;
+
+static bool
+proc_sample(pid_t pid, struct proc_sample *ps)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime, size, resident;
+	FILE *f;
+	bool ok = false;
+
+	memset(ps, 0, sizeof(*ps));
+
+	if (pid <= 0) {
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%ld/statm", (long)pid);
+	if ((f = fopen(path, "r")) != NULL) {
+		if (fscanf(f, "%lu %lu", &size, &resident) == 2) {
+			ps->rss = (uint64_t)resident * sc.page_size;
+			ok = true;
+		}
+		fclose(f);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+	if (ok && (f = fopen(path, "r")) != NULL) {
+		ok = false;
+		if (fgets(buf, sizeof(buf), f) != NULL &&
+				(p = strrchr(buf, ')')) != NULL &&
+				sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+						"%lu %lu", &utime, &stime) == 2) {
+			ps->cpu = (double)(utime + stime) / sc.ticks;
+			ok = true;
+		}
+		fclose(f);
+	}
+
+	ps->valid = ok;
+
+	return ok;
+}
+
+/* Waits until the proxy stops burning CPU, up to 3 seconds */
+static void
+proc_settle(pid_t pid, struct proc_sample *ps)
+{
+	struct proc_sample prev;
+	int i;
+
+	if (!proc_sample(pid, &prev)) {
+		memset(ps, 0, sizeof(*ps));
+		return;
+	}
+
+	for (i = 0; i < 30; i ++) {
+		usleep(100000);
+		proc_sample(pid, ps);
+
+		if (ps->cpu == prev.cpu) {
+			return;
+		}
+		prev = *ps;
+	}
+}
+
+/* Proxy CPU usage in ms per second over the given interval */
+static double
+proc_cpu_rate(pid_t pid, double interval)
+{
+	struct proc_sample s1, s2;
+
+	if (!proc_sample(pid, &s1)) {
+		return -1;
+	}
+	usleep(interval * 1e6);
+	if (!proc_sample(pid, &s2)) {
+		return -1;
+	}
+
+	return (s2.cpu - s1.cpu) * 1e3 / interval;
+}
+
+static void
+sc_done(struct ev_loop *loop, struct sc_conn *c, bool ok)
+{
+	ev_io_stop(loop, &c->io);
+
+	if (ok) {
+		record_latency(now_mono() - c->t_start);
+	}
+	else {
+		c->failed = true;
+		close(c->fd);
+		c->fd = -1;
+		sc.errors ++;
+	}
+
+	if (-- sc.pending == 0) {
+		ev_break(loop, EVBREAK_ALL);
+	}
+}
+
+static void
+sc_arm(struct ev_loop *loop, struct sc_conn *c)
+{
+	int ev = 0;
+
+	if (!c->connected) {
+		ev = EV_WRITE;
+	}
+	else {
+		if (c->out_done < c->out_total) {
+			ev |= EV_WRITE;
+		}
+		if (c->in_done < c->in_expected) {
+			ev |= EV_READ;
+		}
+	}
+
+	if (ev == 0) {
+		/* Nothing to wait for, the session goes idle */
+		sc_done(loop, c, true);
+		return;
+	}
+
+	if (!ev_is_active(&c->io) || c->io.events != ev) {
+		ev_io_stop(loop, &c->io);
+		ev_io_set(&c->io, c->fd, ev);
+		ev_io_start(loop, &c->io);
+	}
+}
+
+static void
+sc_conn_cb(EV_P_ ev_io *w, int revents)
+{
+	struct sc_conn *c = w->data;
+	ssize_t r;
+	size_t n;
+	int err = 0;
+	socklen_t elen = sizeof(err);
+
+	if (!c->connected) {
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &elen) == -1 ||
+				err != 0) {
+			sc_done(loop, c, false);
+			return;
+		}
+		c->connected = true;
+		sc_arm(loop, c);
+		return;
+	}
+
+	if ((revents & EV_WRITE) && c->out_done < c->out_total) {
+		if (c->out_done < c->hello->len) {
+			r = write(c->fd, c->hello->data + c->out_done,
+					c->hello->len - c->out_done);
+		}
+		else {
+			n = c->out_total - c->out_done;
+			r = write(c->fd, zero_buf, n < sizeof(zero_buf) ? n : sizeof(zero_buf));
+		}
+
+		if (r == -1 && errno != EAGAIN && errno != EINTR) {
+			sc_done(loop, c, false);
+			return;
+		}
+		else if (r > 0) {
+			c->out_done += r;
+		}
+	}
+
+	if (revents & EV_READ) {
+		r = read(c->fd, zero_buf, sizeof(zero_buf));
+
+		if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+			sc_done(loop, c, false);
+			return;
+		}
+		else if (r > 0) {
+			c->in_done += r;
+		}
+	}
+
+	sc_arm(loop, c);
+}
+
+/* Queues `len` bytes to be sent and echoed back through the session */
+static void
+sc_send(struct sc_conn *c, size_t len)
+{
+	if (c->failed) {
+		return;
+	}
+
+	c->out_total += len;
+	c->in_expected += len;
+	c->t_start = now_mono();
+	sc.pending ++;
+	sc_arm(st.loop, c);
+}
+
+static void
+sc_open(unsigned long from, unsigned long to)
+{
+	struct sc_conn *c;
+	struct sockaddr_in src;
+	unsigned long i;
+	int fd, on = 1;
+
+	for (i = from; i < to; i ++) {
+		c = &sc.conns[i];
+		c->hello = &st.hellos[i % opts.names];
+		c->fd = -1;
+		c->io.data = c;
+		ev_init(&c->io, sc_conn_cb);
+
+		fd = socket(st.target.ss_family, SOCK_STREAM, 0);
+
+		if (fd == -1) {
+			c->failed = true;
+			sc.errors ++;
+			continue;
+		}
+
+		set_nonblock(fd);
+		c->fd = fd;
+
+		if (opts.sources > 1) {
+#ifdef IP_BIND_ADDRESS_NO_PORT
+			/* Postpone port selection till connect, ports are per 4-tuple then */
+			setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+			memset(&src, 0, sizeof(src));
+			src.sin_family = AF_INET;
+			src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i % opts.sources);
+
+			if (bind(fd, (struct sockaddr *)&src, sizeof(src)) == -1) {
+				close(fd);
+				c->fd = -1;
+				c->failed = true;
+				sc.errors ++;
+				continue;
+			}
+		}
+
+		if (connect(fd, (struct sockaddr *)&st.target, st.target_len) == -1 &&
+				errno != EINPROGRESS) {
+			close(fd);
+			c->fd = -1;
+			c->failed = true;
+			sc.errors ++;
+			continue;
+		}
+
+		c->t_start = now_mono();
+		sc.pending ++;
+		sc_arm(st.loop, c);
+	}
+}
+
+static void
+sc_watchdog_cb(EV_P_ ev_timer *w, int revents)
+{
+	ev_break(loop, EVBREAK_ALL);
+}
+
+/* Runs the loop until sessions in [from, to) have nothing left to do */
+static void
+sc_wait(unsigned long from, unsigned long to)
+{
+	unsigned long i;
+
+	if (sc.pending > 0) {
+		ev_timer_set(&sc.watchdog, opts.duration > 0 ? opts.duration : 60.0,
+				0.0);
+		ev_timer_start(st.loop, &sc.watchdog);
+		ev_run(st.loop, 0);
+		ev_timer_stop(st.loop, &sc.watchdog);
+	}
+
+	for (i = from; i < to && sc.pending > 0; i ++) {
+		if (ev_is_active(&sc.conns[i].io)) {
+			sc_done(st.loop, &sc.conns[i], false);
+		}
+	}
+
+	sc.pending = 0;
+	qsort(st.latencies, st.nlat, sizeof(double), cmp_double);
+}
+
+static double
+per_session(const struct proc_sample *after, const struct proc_sample *before,
+		unsigned long cnt)
+{
+	if (!after->valid || !before->valid || cnt == 0) {
+		return -1;
+	}
+
+	return ((double)after->rss - (double)before->rss) / cnt;
+}
+
+static void
+print_num(const char *fmt, int width, double v)
+{
+	if (v < 0) {
+		printf(" %*s", width, "n/a");
+	}
+	else {
+		printf(fmt, width, v);
+	}
+}
+
+static void
+scale_run(void)
+{
+	struct proc_sample base, pre, greet, idle, active, cur;
+	unsigned long from, to, cnt, alive, i, errors;
+	double t0, greet_cpu, idle_cpu, hs50, hs99;
+	bool greet_valid;
+
+	sc.conns = calloc(opts.sessions, sizeof(*sc.conns));
+	if (sc.conns == NULL) {
+		fprintf(stderr, "cannot allocate %lu sessions\n", opts.sessions);
+		exit(EXIT_FAILURE);
+	}
+
+	ev_init(&sc.watchdog, sc_watchdog_cb);
+
+	if (opts.pid <= 0) {
+		fprintf(stderr, "no proxy pid given (-P), memory and CPU are not "
+				"reported\n");
+	}
+
+	proc_settle(opts.pid, &base);
+	if (base.valid) {
+		printf("baseline rss: %.1f MB\n", base.rss / 1048576.0);
+	}
+
+	printf("%9s %9s %9s %9s %9s %9s %8s %8s %8s %8s %8s %8s %7s\n",
+			"sessions", "rss MB", "B/greet", "B/idle", "B/active", "B/sess",
+			"hs p50", "hs p99", "rtt p50", "rtt p99", "cpu grt", "cpu idle",
+			"errors");
+	printf("%9s %9s %9s %9s %9s %9s %8s %8s %8s %8s %8s %8s %7s\n",
+			"", "", "", "", "", "", "ms", "ms", "us", "us", "ms/s", "ms/s",
+			"");
+
+	for (from = 0; from < opts.sessions; from = to) {
+		to = from + opts.step < opts.sessions ? from + opts.step : opts.sessions;
+		cnt = to - from;
+		errors = sc.errors;
+
+		proc_sample(opts.pid, &pre);
+
+		/* Greeting state: connected, no ClientHello yet */
+		t0 = now_mono();
+		st.nlat = 0;
+		sc_open(from, to);
+		sc_wait(from, to);
+		proc_settle(opts.pid, &greet);
+		greet_cpu = proc_cpu_rate(opts.pid, 0.25);
+		/* The proxy drops sessions without a greeting after 2 seconds */
+		greet_valid = now_mono() - t0 < 1.8;
+
+		/* Idle state: ClientHello relayed and echoed */
+		st.nlat = 0;
+		for (i = from; i < to; i ++) {
+			sc_send(&sc.conns[i], sc.conns[i].hello->len);
+		}
+		sc_wait(from, to);
+		hs50 = percentile(0.5);
+		hs99 = percentile(0.99);
+		proc_settle(opts.pid, &idle);
+
+		/* Active state: buffers used in both directions */
+		memset(&active, 0, sizeof(active));
+		if (opts.upload > 0) {
+			for (i = from; i < to; i ++) {
+				sc_send(&sc.conns[i], opts.upload);
+			}
+			sc_wait(from, to);
+			proc_settle(opts.pid, &active);
+		}
+
+		idle_cpu = proc_cpu_rate(opts.pid, 1.0);
+
+		/* Event loop latency: one byte through random sessions */
+		st.nlat = 0;
+		for (i = 0; i < SCALE_PROBES; i ++) {
+			struct sc_conn *c = &sc.conns[random() % to];
+
+			if (!c->failed) {
+				sc_send(c, 1);
+				sc_wait(0, to);
+			}
+		}
+
+		alive = to - sc.errors;
+		proc_sample(opts.pid, &cur);
+		cnt -= sc.errors - errors;
+
+		if (cur.valid) {
+			printf("%9lu %9.1f", alive, cur.rss / 1048576.0);
+		}
+		else {
+			printf("%9lu %9s", alive, "n/a");
+		}
+		print_num(" %*.0f", 9, greet_valid ? per_session(&greet, &pre, cnt) : -1);
+		print_num(" %*.0f", 9, per_session(&idle, &pre, cnt));
+		print_num(" %*.0f", 9, per_session(&active, &pre, cnt));
+		print_num(" %*.0f", 9, per_session(&cur, &base, alive));
+		printf(" %8.3f %8.3f %8.1f %8.1f", hs50 * 1e3, hs99 * 1e3,
+				percentile(0.5) * 1e6, percentile(0.99) * 1e6);
+		print_num(" %*.1f", 8, greet_valid ? greet_cpu : -1);
+		print_num(" %*.1f", 8, idle_cpu);
+		printf(" %7lu\n", sc.errors);
+		fflush(stdout);
+	}
+}
+
+/* Ephemeral ports available per source address */
+static unsigned long
+local_port_range(void)
+{
+	FILE *f;
+	unsigned long lo, hi;
+
+	f = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lu %lu", &lo, &hi) == 2 && hi > lo) {
+			fclose(f);
+			return hi - lo + 1;
+		}
+		fclose(f);
+	}
+
+	return 28232;
+}
+
+/*
+ * Writes sni-proxy configuration for the current target: name i goes to the
+ * bundled backend at 127.1.x.y, so that proxy to backend connections are
+ * spread over many destination addresses too, or to its unix socket.
+ */
+static void
+write_config(const char *path)
+{
+	FILE *f;
+	unsigned i;
+	const char *port;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (getnameinfo((struct sockaddr *)&st.target, st.target_len, host,
+			sizeof(host), serv, sizeof(serv),
+			NI_NUMERICHOST|NI_NUMERICSERV) == 0) {
+		port = serv;
+	}
+	else {
+		port = "8443";
+	}
+
+	fprintf(f, "# generated by sni-bench for %u names\n", opts.names);
+	fprintf(f, "port = %s\n\nbackends {\n", port);
+
+	for (i = 0; i < opts.names; i ++) {
+		if (opts.bk_unix) {
+			fprintf(f, "\t\"h%u.%s\" {\n\t\tunix = \"%s\"\n\t}\n",
+					i, opts.domain, opts.bk_unix);
+		}
+		else {
+			fprintf(f, "\t\"h%u.%s\" {\n\t\thost = 127.1.%u.%u\n"
+					"\t\tport = %d\n\t}\n",
+					i, opts.domain, i / 250, i % 250 + 1, opts.bk_port);
+		}
+	}
+
+	fprintf(f, "\tdefault {\n\t\thost = 127.0.0.1\n\t\tport = %d\n\t}\n}\n",
+			opts.bk_port);
+	fclose(f);
+}
+
+static void
+usage(const char *error)
+{
+	if (error) {
+		fprintf(stderr, "%s\n", error);
+	}
+
+	fprintf(stderr, "usage:"
+		"\tsni-bench [-t host:port] [-b port] [-U path] [-D] [-X|-B] [-m sink|echo]\n"
+		"\t\t[-c concurrency] [-n conns] [-d seconds] [-u upload] [-r response]\n"
+		"\t\t[-N names] [-Z zipf] [-H hello_len] [-s domain]\n"
+		"\t\t[-S sessions [-L step] [-A sources] [-P pid]] [-C config] [-h]\n"
+		"\n"
+		"\t-t\tsni-proxy address (default 127.0.0.1:8443)\n"
+		"\t-b\tbundled backend port (default 8444)\n"
+		"\t-U\tbundled backend also listens on this unix socket (@ is abstract)\n"
+		"\t-D\tconnect directly to the backend, bypassing sni-proxy\n"
+		"\t-X\tdo not start the bundled backend\n"
+		"\t-B\trun only the bundled backend, e.g. on another host\n"
+		"\t-m\tbackend mode: sink replies with -r bytes, echo returns input\n"
+		"\t-c\tconcurrent connections (default 256)\n"
+		"\t-n\ttotal connections, 0 means unlimited (default 10000)\n"
+		"\t-d\tstop after this many seconds\n"
+		"\t-u\tbytes to upload after the ClientHello (default 0)\n"
+		"\t-r\tbytes the sink backend sends back (default 16384)\n"
+		"\t-N\tnumber of distinct SNI names (default 1)\n"
+		"\t-Z\tzipf exponent for the SNI distribution, 0 is uniform\n"
+		"\t-H\tClientHello record size (default 512)\n"
+		"\t-s\tSNI domain suffix (default bench.test)\n"
+		"\t-S\tscale test: ramp up to this many idle sessions (echo backend)\n"
+		"\t-L\tsessions added per scale step (default sessions / 10)\n"
+		"\t-A\tloopback source addresses, 127.0.0.2 and up (default: enough\n"
+		"\t\tfor the ephemeral port range)\n"
+		"\t-P\tsni-proxy pid, to report its memory and CPU usage\n"
+		"\t-C\twrite sni-proxy config with a backend address per name and exit\n");
+
+	exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"target", 	required_argument, 0, 't'},
+		{"backend", 	required_argument, 0, 'b'},
+		{"unix", 	required_argument, 0, 'U'},
+		{"direct", 	no_argument, 0, 'D'},
+		{"no-backend", 	no_argument, 0, 'X'},
+		{"backend-only", 	no_argument, 0, 'B'},
+		{"mode", 	required_argument, 0, 'm'},
+		{"concurrency", required_argument, 0, 'c'},
+		{"count", 	required_argument, 0, 'n'},
+		{"duration", 	required_argument, 0, 'd'},
+		{"upload", 	required_argument, 0, 'u'},
+		{"response", 	required_argument, 0, 'r'},
+		{"names", 	required_argument, 0, 'N'},
+		{"zipf", 	required_argument, 0, 'Z'},
+		{"hello", 	required_argument, 0, 'H'},
+		{"domain", 	required_argument, 0, 's'},
+		{"scale", 	required_argument, 0, 'S'},
+		{"step", 	required_argument, 0, 'L'},
+		{"sources", 	required_argument, 0, 'A'},
+		{"pid", 	required_argument, 0, 'P'},
+		{"write-config", required_argument, 0, 'C'},
+		{"help", 	no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	char target[64];
+	pid_t bk_pid = -1;
+	int ch, status;
+	bool mode_set = false;
+	struct rlimit rl;
+
+	while ((ch = getopt_long(argc, argv, "t:b:U:DXBm:c:n:d:u:r:N:Z:H:s:S:L:A:P:C:h",
+			long_options, NULL)) != -1) {
+		switch (ch) {
+		case 't':
+			opts.target = optarg;
+			break;
+		case 'b':
+			opts.bk_port = strtoul(optarg, NULL, 0);
+			break;
+		case 'U':
+			opts.bk_unix = optarg;
+			break;
+		case 'D':
+			opts.direct = true;
+			break;
+		case 'X':
+			opts.no_backend = true;
+			break;
+		case 'B':
+			opts.backend_only = true;
+			break;
+		case 'm':
+			if (strcmp(optarg, "sink") == 0) {
+				opts.mode = bk_mode_sink;
+			}
+			else if (strcmp(optarg, "echo") == 0) {
+				opts.mode = bk_mode_echo;
+			}
+			else {
+				usage("invalid backend mode");
+			}
+			mode_set = true;
+			break;
+		case 'c':
+			opts.concurrency = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.total = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			opts.duration = strtod(optarg, NULL);
+			break;
+		case 'u':
+			opts.upload = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.response = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			opts.names = strtoul(optarg, NULL, 0);
+			break;
+		case 'Z':
+			opts.zipf = strtod(optarg, NULL);
+			break;
+		case 'H':
+			opts.hello_len = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opts.domain = optarg;
+			break;
+		case 'S':
+			opts.sessions = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			opts.step = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			opts.sources = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			opts.pid = strtol(optarg, NULL, 0);
+			break;
+		case 'C':
+			opts.config_out = optarg;
+			break;
+		case 'h':
+		default:
+			usage(NULL);
+			break;
+		}
+	}
+
+	if (opts.backend_only) {
+		if (opts.no_backend) {
+			usage("-B and -X are mutually exclusive");
+		}
+		if (opts.mode == bk_mode_sink && opts.response == 0) {
+			usage("sink mode needs a non-empty response");
+		}
+
+		signal(SIGPIPE, SIG_IGN);
+		raise_nofile();
+		start_backend(opts.bk_port);
+	}
+
+	if (opts.concurrency == 0 || opts.names == 0) {
+		usage("concurrency and names must be positive");
+	}
+	if (opts.sessions > 0) {
+		if (opts.mode != bk_mode_echo && mode_set) {
+			usage("scale test needs the echo backend");
+		}
+		opts.mode = bk_mode_echo;
+
+		if (opts.step == 0) {
+			opts.step = opts.sessions >= 10 ? opts.sessions / 10 : 1;
+		}
+		if (opts.sources == 0) {
+			opts.sources = opts.sessions / (local_port_range() * 3 / 4) + 1;
+		}
+		/* One name per source, so the proxy has as many backend addresses */
+		if (opts.names == 1) {
+			opts.names = opts.sources;
+		}
+	}
+	else if (opts.total == 0 && opts.duration <= 0 && !opts.config_out) {
+		usage("either -n or -d must limit the run");
+	}
+	if (opts.mode == bk_mode_sink && opts.response == 0) {
+		usage("sink mode needs a non-empty response");
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	raise_nofile();
+
+	if (opts.direct) {
+		snprintf(target, sizeof(target), "127.0.0.1:%d", opts.bk_port);
+		opts.target = target;
+	}
+
+	if (!parse_hostport(opts.target, &st.target, &st.target_len)) {
+		usage("invalid target address");
+	}
+
+	if (opts.config_out) {
+		write_config(opts.config_out);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.sessions > 0) {
+		if (st.target.ss_family != AF_INET && opts.sources > 1) {
+			usage("source addresses need an IPv4 loopback target");
+		}
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+				rl.rlim_cur < opts.sessions + 64) {
+			fprintf(stderr, "warning: RLIMIT_NOFILE is %lu, the client and "
+					"the bundled backend need %lu descriptors each\n",
+					(unsigned long)rl.rlim_cur, opts.sessions + 64);
+		}
+		sc.ticks = sysconf(_SC_CLK_TCK);
+		sc.page_size = sysconf(_SC_PAGESIZE);
+	}
+
+	if (!opts.no_backend) {
+		bk_pid = start_backend(opts.bk_port);
+	}
+
+	prepare_hellos();
+
+	st.loop = EV_DEFAULT;
+	st.t_start = now_mono();
+
+	if (opts.sessions > 0) {
+		scale_run();
+
+		if (bk_pid > 0) {
+			kill(bk_pid, SIGTERM);
+			waitpid(bk_pid, &status, 0);
+		}
+
+		return sc.errors < opts.sessions ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	cl_start();
+	ev_run(st.loop, 0);
+
+	if (st.t_end == 0) {
+		st.t_end = now_mono();
+	}
+
+	if (bk_pid > 0) {
+		kill(bk_pid, SIGTERM);
+		waitpid(bk_pid, &status, 0);
+	}
+
+	report();
+
+	return st.completed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,117 @@
+#!/bin/sh
+# Checks transparent mode in network namespaces, needs root and iproute2.
+#
+#   client 10.1.0.2 --- 10.1.0.1 gateway 10.2.0.1 --- 10.2.0.2, 10.2.0.3 origin
+#
+# The gateway delivers client traffic for 10.2.0.0/24 locally, which is what
+# a TPROXY rule does on a real gateway, and runs sni-proxy on port 443. The
+# origin runs sni-bench backends on ports 443 and 8444.
+#
+#   usage: tproxy-netns.sh [top_builddir]
+
+set -e
+
+TOP=${1:-.}
+PROXY=$TOP/src/sni-proxy
+BENCH=$TOP/bench/sni-bench
+TMP=$(mktemp -d)
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do
+		kill $pid 2>/dev/null || true
+	done
+	for ns in snic snigw snio; do
+		ip netns del $ns 2>/dev/null || true
+	done
+	rm -rf $TMP
+}
+
+trap cleanup EXIT INT TERM
+
+check() {
+	if "$@" > $TMP/out 2>&1; then
+		return 0
+	fi
+	cat $TMP/out
+	return 1
+}
+
+for ns in snic snigw snio; do
+	ip netns add $ns
+	ip -n $ns link set lo up
+done
+
+ip link add c0 netns snic type veth peer name g0 netns snigw
+ip link add o0 netns snio type veth peer name g1 netns snigw
+
+ip -n snic addr add 10.1.0.2/24 dev c0
+ip -n snic link set c0 up
+ip -n snic route add default via 10.1.0.1
+
+ip -n snio addr add 10.2.0.2/24 dev o0
+ip -n snio addr add 10.2.0.3/24 dev o0
+ip -n snio link set o0 up
+ip -n snio route add default via 10.2.0.1
+
+ip -n snigw addr add 10.1.0.1/24 dev g0
+ip -n snigw addr add 10.2.0.1/24 dev g1
+ip -n snigw link set g0 up
+ip -n snigw link set g1 up
+ip netns exec snigw sysctl -qw net.ipv4.ip_forward=1
+# Intercept client traffic to the origins, and replies to spoofed sources
+ip -n snigw rule add iif g0 to 10.2.0.0/24 lookup 100
+ip -n snigw rule add iif g1 to 10.1.0.0/24 lookup 100
+ip -n snigw route add local 0.0.0.0/0 dev lo table 100
+
+cat > $TMP/proxy.conf <<EOF
+port = 443;
+
+transparent {
+	spoof_source = true;
+}
+
+backends {
+	"h0.routed.test" {
+		host = 10.2.0.3;
+		port = 8444;
+	}
+}
+EOF
+
+ip netns exec snigw $PROXY -c $TMP/proxy.conf > $TMP/proxy.log 2>&1 &
+PIDS="$PIDS $!"
+ip netns exec snio $BENCH -B -b 8444 &
+PIDS="$PIDS $!"
+sleep 0.5
+
+echo "routed name goes to its backend"
+# Nothing listens on the original destination yet
+check ip netns exec snic $BENCH -X -t 10.2.0.2:443 -s routed.test -n 1000
+
+ip netns exec snio $BENCH -B -b 443 &
+PIDS="$PIDS $!"
+sleep 0.2
+
+echo "unknown name goes to the original destination"
+check ip netns exec snic $BENCH -X -t 10.2.0.2:443 -s other.test -n 1000
+
+echo "origin sees the client address"
+ip netns exec snic $BENCH -X -t 10.2.0.2:443 -s other.test -c 16 -n 16 \
+		-r 1000000000 > /dev/null 2>&1 &
+CLIENT=$!
+sleep 1
+ip netns exec snio ss -Htn state established '( sport = :443 )' > $TMP/ss
+kill $CLIENT
+if ! grep -q '10\.1\.0\.2:' $TMP/ss || grep -q '10\.2\.0\.1:' $TMP/ss; then
+	cat $TMP/ss
+	exit 1
+fi
+
+echo "connections to the gateway itself do not loop"
+if ip netns exec snic $BENCH -X -t 10.1.0.1:443 -s other.test -n 10 \
+		> /dev/null 2>&1; then
+	exit 1
+fi
+
+echo ok
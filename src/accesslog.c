@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "stats.h"
+#include "tcpinfo.h"
+#include "accesslog.h"
+#include "sni-private.h"
+
+#define ACCESSLOG_BUF (64 * 1024)
+
+static FILE *access_log = NULL;
+static ev_timer flush_timer;
+
+static void
+flush_cb(EV_P_ ev_timer *w, int revents)
+{
+	stats_cb(loop, stats_cb_timer);
+	fflush(access_log);
+}
+
+bool
+accesslog_init(struct ev_loop *loop, const ucl_object_t *cfg)
+{
+	const char *path;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	path = ucl_object_tostring_forced(cfg);
+	access_log = fopen(path, "a");
+
+	if (access_log == NULL) {
+		fprintf(stderr, "cannot open access log %s: %s\n", path,
+				strerror(errno));
+		return false;
+	}
+
+	setvbuf(access_log, NULL, _IOFBF, ACCESSLOG_BUF);
+	ev_timer_init(&flush_timer, flush_cb, 1.0, 1.0);
+	ev_timer_start(loop, &flush_timer);
+	ev_unref(loop);
+
+	return true;
+}
+
+static void
+format_tcpinfo(char *buf, size_t len, const struct tcpinfo_pair *tcpi,
+		bool backend)
+{
+	const struct tcpinfo_sample *s;
+
+	if (tcpi == NULL) {
+		snprintf(buf, len, "-");
+		return;
+	}
+
+	s = backend ? &tcpi->bk : &tcpi->cl;
+
+	if (s->when == 0) {
+		snprintf(buf, len, "-");
+		return;
+	}
+
+	snprintf(buf, len, "rtt:%u,rttvar:%u,retrans:%u,cwnd:%u,rate:%llu",
+			s->rtt, s->rttvar, s->retrans, s->cwnd,
+			(unsigned long long)s->delivery_rate);
+}
+
+/*
+ * time id client sni route duration bytes_in bytes_out cl=<tcpinfo>
+ * bk=<tcpinfo>, "-" for what is unknown
+ */
+void
+accesslog_session(const struct ssl_session *ssl)
+{
+	char peer[INET6_ADDRSTRLEN + 16], ts[32], cl[128], bk[128], name[1024];
+	struct timespec now;
+	struct tm tm;
+
+	if (access_log == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &tm);
+	strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+	session_peer_str(ssl, peer, sizeof(peer));
+	session_name_str(ssl, name, sizeof(name));
+	format_tcpinfo(cl, sizeof(cl), ssl->tcpi, false);
+	format_tcpinfo(bk, sizeof(bk), ssl->tcpi, true);
+
+	fprintf(access_log, "%s.%03ldZ %llu %s %s %s %.3f %llu %llu cl=%s bk=%s\n",
+			ts, now.tv_nsec / 1000000L, (unsigned long long)ssl->id, peer, name,
+			ssl->bk ? ucl_object_key(ssl->bk) : "-",
+			ev_now(ssl->loop) - ssl->started,
+			(unsigned long long)ssl->bytes_in,
+			(unsigned long long)ssl->bytes_out, cl, bk);
+}
@@ -0,0 +1,1412 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Admin socket: a unix socket accepting one command per line. Every command
+ * replies with zero or more lines of data followed by "ok" or "error: ...".
+ *
+ * The admin socket itself is served by one loop, commands that touch
+ * sessions or routes are sent to every worker through its command queue,
+ * run there and come back to the admin loop the same way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "cmdq.h"
+#include "stats.h"
+#include "tcpinfo.h"
+#include "greeting.h"
+#include "ratelimit.h"
+#include "denylist.h"
+#include "cidr.h"
+#include "shaper.h"
+#include "scheduler.h"
+#include "mirror.h"
+#include "sni-private.h"
+
+#define ADMIN_MAX_LINE 4096
+#define ADMIN_MAX_ARGS 16
+
+struct admin_buf {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+struct admin_conn {
+	ev_io io;
+	int fd;
+	char in[ADMIN_MAX_LINE];
+	size_t inlen;
+	struct admin_buf out;
+	size_t out_off;
+	/* Command in flight, further input waits for it */
+	bool busy;
+	bool eof;
+	bool quit;
+};
+
+/* Session selection for `sessions` and `kill` */
+struct admin_filter {
+	uint64_t id;
+	const char *sni;
+	const char *backend;
+	const char *listener;
+	double min_age;
+	uint64_t min_bytes;
+	bool all;
+};
+
+struct admin_cmd;
+
+struct admin_job {
+	struct admin_cmd *cmd;
+	struct sni_worker *worker;
+	/* Prepared on the admin loop, owned by the worker afterwards */
+	void *data;
+	struct admin_buf out;
+	char *error;
+};
+
+struct admin_command {
+	const char *name;
+	const char *args;
+	const char *descr;
+	/* Checks arguments on the admin loop, may prepare job data */
+	bool (*prepare)(struct admin_cmd *cmd, struct admin_job *job);
+	/* Runs on the worker loop, NULL for commands handled by admin itself */
+	void (*exec)(struct admin_cmd *cmd, struct admin_job *job);
+	/* Prefix output lines with the worker id when there are many workers */
+	bool per_worker;
+	/* Needs routing tables, relay threads have none and are skipped */
+	bool routing;
+};
+
+struct admin_cmd {
+	struct admin_conn *conn;
+	const struct admin_command *command;
+	int argc;
+	char *argv[ADMIN_MAX_ARGS];
+	char *line;
+	struct admin_filter filter;
+	unsigned pending;
+	struct admin_buf out;
+	char *error;
+};
+
+static struct {
+	struct ev_loop *loop;
+	struct cmdq *cmdq;
+	struct sni_worker **workers;
+	unsigned nworkers;
+	ev_io io;
+	char *path;
+} admin;
+
+static const char *state_names[] = {
+	"init",
+	"alert",
+	"alert_sent",
+	"backend_selected",
+	"backend_ready",
+	"backend_greeting",
+	"proxy",
+	"proxy_peer_closed",
+	"proxy_both_closed"
+};
+
+static void admin_conn_update(struct admin_conn *conn);
+static void admin_conn_process(struct admin_conn *conn);
+
+static void
+buf_printf(struct admin_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	for (;;) {
+		va_start(ap, fmt);
+		r = vsnprintf(b->s + b->len, b->cap - b->len, fmt, ap);
+		va_end(ap);
+
+		if (r < 0) {
+			return;
+		}
+		if (b->len + r < b->cap) {
+			b->len += r;
+			return;
+		}
+
+		b->cap = MAX(b->cap * 2, b->len + r + 256);
+		b->s = realloc(b->s, b->cap);
+
+		if (b->s == NULL) {
+			abort();
+		}
+	}
+}
+
+static void
+buf_append(struct admin_buf *b, const char *s, size_t len)
+{
+	if (b->len + len >= b->cap) {
+		b->cap = MAX(b->cap * 2, b->len + len + 256);
+		b->s = realloc(b->s, b->cap);
+
+		if (b->s == NULL) {
+			abort();
+		}
+	}
+
+	memcpy(b->s + b->len, s, len);
+	b->len += len;
+	b->s[b->len] = '\0';
+}
+
+static char*
+admin_error(const char *fmt, ...)
+{
+	va_list ap;
+	char *err;
+
+	err = xmalloc(256);
+	va_start(ap, fmt);
+	vsnprintf(err, 256, fmt, ap);
+	va_end(ap);
+
+	return err;
+}
+
+/*
+ * Upstreams are matched by the route name, by "host[:port]", "unix:path"
+ * or "handoff:path", IPv6 addresses with a port are written as [addr]:port
+ */
+static bool
+upstream_match(const ucl_object_t *be, const char *spec)
+{
+	const ucl_object_t *elt;
+	const char *host, *p;
+	char buf[300];
+	size_t hlen;
+	int port = 443;
+
+	if (strcmp(ucl_object_key(be), spec) == 0) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(be, "unix");
+	if (elt != NULL) {
+		return strncmp(spec, "unix:", 5) == 0 &&
+				strcmp(spec + 5, ucl_object_tostring(elt)) == 0;
+	}
+
+	elt = ucl_object_find_key(be, "handoff");
+	if (elt != NULL) {
+		return strncmp(spec, "handoff:", 8) == 0 &&
+				strcmp(spec + 8, ucl_object_tostring(elt)) == 0;
+	}
+
+	elt = ucl_object_find_key(be, "host");
+	if (elt == NULL) {
+		return false;
+	}
+	host = ucl_object_tostring(elt);
+
+	elt = ucl_object_find_key(be, "port");
+	if (elt != NULL) {
+		port = ucl_object_toint(elt);
+	}
+
+	if (strcmp(host, spec) == 0) {
+		return true;
+	}
+
+	hlen = strlen(host);
+	p = spec;
+
+	if (*p == '[') {
+		p ++;
+		if (strncmp(p, host, hlen) != 0 || p[hlen] != ']') {
+			return false;
+		}
+		p += hlen + 1;
+	}
+	else {
+		if (strncmp(p, host, hlen) != 0) {
+			return false;
+		}
+		p += hlen;
+	}
+
+	snprintf(buf, sizeof(buf), ":%d", port);
+
+	return strcmp(p, buf) == 0;
+}
+
+static bool
+sni_match(const char *pattern, const struct ssl_session *s)
+{
+	size_t plen;
+
+	if (s->hostname == NULL) {
+		return strcmp(pattern, "-") == 0;
+	}
+
+	/* *.example.com matches every subdomain */
+	if (pattern[0] == '*' && pattern[1] == '.') {
+		plen = strlen(pattern + 1);
+
+		return s->hostlen > plen &&
+				strcasecmp(s->hostname + s->hostlen - plen, pattern + 1) == 0;
+	}
+
+	return strcasecmp(pattern, s->hostname) == 0;
+}
+
+static bool
+filter_match(const struct admin_filter *f, const struct ssl_session *s,
+		ev_tstamp now)
+{
+	if (f->id != 0 && s->id != f->id) {
+		return false;
+	}
+	if (f->sni != NULL && !sni_match(f->sni, s)) {
+		return false;
+	}
+	if (f->backend != NULL && (s->bk == NULL ||
+			!upstream_match(s->bk, f->backend))) {
+		return false;
+	}
+	if (f->listener != NULL && (s->listener == NULL ||
+			strcmp(s->listener->name, f->listener) != 0)) {
+		return false;
+	}
+	if (f->min_age > 0 && now - s->started < f->min_age) {
+		return false;
+	}
+	if (f->min_bytes > 0 && s->bytes_in + s->bytes_out < f->min_bytes) {
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+filter_parse(struct admin_cmd *cmd, int first)
+{
+	struct admin_filter *f = &cmd->filter;
+	char *arg, *val, *end;
+	int i;
+
+	for (i = first; i < cmd->argc; i ++) {
+		arg = cmd->argv[i];
+
+		if (strcmp(arg, "all") == 0) {
+			f->all = true;
+			continue;
+		}
+
+		val = strchr(arg, '=');
+
+		if (val == NULL) {
+			/* Bare number is a session id */
+			f->id = strtoull(arg, &end, 10);
+
+			if (*end != '\0' || f->id == 0) {
+				cmd->error = admin_error("bad filter: %s", arg);
+				return false;
+			}
+			continue;
+		}
+
+		*val ++ = '\0';
+
+		if (strcmp(arg, "sni") == 0) {
+			f->sni = val;
+		}
+		else if (strcmp(arg, "backend") == 0) {
+			f->backend = val;
+		}
+		else if (strcmp(arg, "listener") == 0) {
+			f->listener = val;
+		}
+		else if (strcmp(arg, "age") == 0) {
+			f->min_age = strtod(val, &end);
+		}
+		else if (strcmp(arg, "bytes") == 0) {
+			f->min_bytes = strtoull(val, &end, 10);
+		}
+		else if (strcmp(arg, "id") == 0) {
+			f->id = strtoull(val, &end, 10);
+		}
+		else {
+			cmd->error = admin_error("unknown filter: %s", arg);
+			return false;
+		}
+
+		if (strcmp(arg, "sni") != 0 && strcmp(arg, "backend") != 0 &&
+				strcmp(arg, "listener") != 0 &&
+				(*end != '\0' || end == val)) {
+			cmd->error = admin_error("bad %s value: %s", arg, val);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Commands
+ */
+static bool
+sessions_prepare(struct admin_cmd *cmd, struct admin_job *job)
+{
+	/* Filter is parsed once, jobs only read it */
+	return job != NULL || filter_parse(cmd, 1);
+}
+
+static void
+sessions_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct ssl_session *s;
+	ev_tstamp now = ev_now(job->worker->loop);
+	char peer[INET6_ADDRSTRLEN + 16], name[1024];
+
+	for (s = job->worker->sessions; s != NULL; s = s->next) {
+		if (!filter_match(&cmd->filter, s, now)) {
+			continue;
+		}
+
+		session_peer_str(s, peer, sizeof(peer));
+		session_name_str(s, name, sizeof(name));
+		buf_printf(&job->out, "%llu %s %s %s %s %.1f %llu %llu\n",
+				(unsigned long long)s->id, peer, name,
+				s->bk ? ucl_object_key(s->bk) : "-",
+				state_names[s->state], now - s->started,
+				(unsigned long long)s->bytes_in,
+				(unsigned long long)s->bytes_out);
+	}
+}
+
+static bool
+kill_prepare(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct admin_filter *f = &cmd->filter;
+
+	if (job != NULL) {
+		return true;
+	}
+	if (!filter_parse(cmd, 1)) {
+		return false;
+	}
+	if (!f->all && f->id == 0 && f->sni == NULL && f->backend == NULL &&
+			f->listener == NULL && f->min_age == 0 && f->min_bytes == 0) {
+		cmd->error = admin_error("kill needs a filter or `all`");
+		return false;
+	}
+
+	return true;
+}
+
+static void
+kill_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct ssl_session *s, *next;
+	ev_tstamp now = ev_now(job->worker->loop);
+	unsigned killed = 0;
+
+	for (s = job->worker->sessions; s != NULL; s = next) {
+		next = s->next;
+
+		if (filter_match(&cmd->filter, s, now)) {
+			terminate_session(s);
+			killed ++;
+		}
+	}
+
+	buf_printf(&job->out, "killed %u\n", killed);
+}
+
+struct route_entry {
+	const ucl_object_t *route;
+	const struct sni_listener *owner;
+	unsigned sessions;
+};
+
+static int
+route_cmp(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t)((const struct route_entry *)a)->route,
+			pb = (uintptr_t)((const struct route_entry *)b)->route;
+
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/* Route names are prefixed with their table when there are several */
+static void
+route_name_printf(struct admin_buf *b, const struct sni_listener *l,
+		const ucl_object_t *route, bool prefix)
+{
+	if (prefix) {
+		buf_printf(b, "%s/", listener_routes_name(l));
+	}
+
+	buf_printf(b, "%s", ucl_object_key(route));
+}
+
+static void
+route_entry_printf(struct admin_buf *b, const struct route_entry *r,
+		bool prefix)
+{
+	const ucl_object_t *host, *port;
+
+	route_name_printf(b, r->owner, r->route, prefix);
+
+	if ((host = ucl_object_find_key(r->route, "unix")) != NULL ||
+			(host = ucl_object_find_key(r->route, "handoff")) != NULL) {
+		buf_printf(b, " %s:%s", ucl_object_key(host),
+				ucl_object_tostring(host));
+	}
+	else {
+		host = ucl_object_find_key(r->route, "host");
+		port = ucl_object_find_key(r->route, "port");
+		buf_printf(b, " %s:%d", host ? ucl_object_tostring(host) : "-",
+				port ? (int)ucl_object_toint(port) : 443);
+	}
+
+	buf_printf(b, " %s %u\n",
+			backend_draining(r->route) ? "draining" : "active", r->sessions);
+}
+
+/* Relay threads have no routing tables, they list the routes in use */
+static void
+relay_routes_exec(struct admin_job *job)
+{
+	struct sni_worker *w = job->worker;
+	struct route_entry *routes;
+	struct ssl_session *s;
+	unsigned n = 0, i, j;
+
+	routes = xmalloc0((w->nsessions + 1) * sizeof(*routes));
+
+	for (s = w->sessions; s != NULL; s = s->next) {
+		if (s->bk != NULL) {
+			routes[n].owner = s->listener;
+			routes[n ++].route = s->bk;
+		}
+	}
+
+	qsort(routes, n, sizeof(*routes), route_cmp);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && routes[j].route == routes[i].route; j ++);
+
+		routes[i].sessions = j - i;
+		route_entry_printf(&job->out, &routes[i],
+				__atomic_load_n(&routes[i].owner->worker->nroutes,
+						__ATOMIC_RELAXED) > 1);
+	}
+
+	free(routes);
+}
+
+static void
+routes_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct sni_worker *w = job->worker;
+	struct sni_listener *l;
+	ucl_object_iter_t it;
+	const ucl_object_t *cur;
+	struct route_entry *routes, *r, key;
+	unsigned n = 0, i;
+	struct ssl_session *s;
+	bool prefix = worker_routes_count(w) > 1;
+
+	if (w->relay) {
+		relay_routes_exec(job);
+		return;
+	}
+
+	for (l = w->listeners; l != NULL; l = l->next) {
+		if (listener_routes_first(l)) {
+			n += l->backends->len;
+		}
+	}
+
+	routes = xmalloc0((n + 1) * sizeof(*routes));
+	n = 0;
+
+	for (l = w->listeners; l != NULL; l = l->next) {
+		if (!listener_routes_first(l)) {
+			continue;
+		}
+
+		it = NULL;
+
+		while ((cur = ucl_iterate_object(l->backends, &it, true))) {
+			routes[n].owner = l;
+			routes[n ++].route = cur;
+		}
+	}
+
+	/* Count sessions per route in one pass over the sessions */
+	qsort(routes, n, sizeof(*routes), route_cmp);
+
+	for (s = w->sessions; s != NULL; s = s->next) {
+		if (s->bk != NULL) {
+			key.route = s->bk;
+			r = bsearch(&key, routes, n, sizeof(*routes), route_cmp);
+
+			if (r) {
+				r->sessions ++;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i ++) {
+		route_entry_printf(&job->out, &routes[i], prefix);
+	}
+
+	free(routes);
+}
+
+/* Use of 4-tuples per source address of every TCP route */
+static void
+sources_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct sni_listener *l;
+	ucl_object_iter_t it;
+	const ucl_object_t *cur;
+	const struct source_pool *pool;
+	const struct source_addr *src;
+	char addr[INET6_ADDRSTRLEN];
+	unsigned i;
+	bool prefix = worker_routes_count(job->worker) > 1;
+
+	for (l = job->worker->listeners; l != NULL; l = l->next) {
+		if (!listener_routes_first(l)) {
+			continue;
+		}
+
+		it = NULL;
+
+		while ((cur = ucl_iterate_object(l->backends, &it, true))) {
+			pool = backend_pool(cur);
+
+			if (pool == NULL) {
+				continue;
+			}
+
+			for (i = 0; i < pool->naddrs; i ++) {
+				src = &pool->addrs[i];
+
+				if (src->sa.sa.sa_family == AF_INET6) {
+					inet_ntop(AF_INET6, &src->sa.sin6.sin6_addr, addr,
+							sizeof(addr));
+				}
+				else if (src->sa.sa.sa_family == AF_INET) {
+					inet_ntop(AF_INET, &src->sa.sin.sin_addr, addr,
+							sizeof(addr));
+				}
+				else {
+					strcpy(addr, "-");
+				}
+
+				route_name_printf(&job->out, l, cur, prefix);
+				buf_printf(&job->out, " %s %llu %u %.1f%% %llu\n", addr,
+						(unsigned long long)src->active, pool->capacity,
+						src->active * 100.0 / pool->capacity,
+						(unsigned long long)src->exhausted);
+			}
+		}
+	}
+}
+
+/* Names would be resolved on the main loop, which accepts and greets */
+static bool
+numeric_host(const char *host)
+{
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+		return false;
+	}
+
+	freeaddrinfo(res);
+
+	return true;
+}
+
+static bool
+route_prepare(struct admin_cmd *cmd, struct admin_job *job)
+{
+	ucl_object_t *be;
+	char *end;
+	long port = 443;
+
+	if (job == NULL) {
+		if (cmd->argc == 3 && strcmp(cmd->argv[1], "del") == 0) {
+			return true;
+		}
+		if ((cmd->argc == 4 || cmd->argc == 5) &&
+				strcmp(cmd->argv[1], "set") == 0) {
+			if (cmd->argc == 5) {
+				port = strtol(cmd->argv[4], &end, 10);
+
+				if (*end != '\0' || port <= 0 || port > 65535) {
+					cmd->error = admin_error("bad port: %s", cmd->argv[4]);
+					return false;
+				}
+			}
+			if (strncmp(cmd->argv[3], "unix:", 5) != 0 &&
+					strncmp(cmd->argv[3], "handoff:", 8) != 0 &&
+					!numeric_host(cmd->argv[3])) {
+				cmd->error = admin_error("not an IP address: %s, names "
+						"are not resolved here", cmd->argv[3]);
+				return false;
+			}
+			return true;
+		}
+
+		cmd->error = admin_error("usage: route set [listener/]<sni> "
+				"<host [port]|unix:path|handoff:path> | "
+				"route del [listener/]<sni>");
+		return false;
+	}
+
+	if (strcmp(cmd->argv[1], "set") == 0) {
+		/* Every worker gets its own copy of the backend */
+		if (cmd->argc == 5) {
+			port = strtol(cmd->argv[4], NULL, 10);
+		}
+
+		be = ucl_object_typed_new(UCL_OBJECT);
+
+		if (strncmp(cmd->argv[3], "unix:", 5) == 0) {
+			ucl_object_insert_key(be, ucl_object_fromstring(cmd->argv[3] + 5),
+					"unix", 0, false);
+		}
+		else if (strncmp(cmd->argv[3], "handoff:", 8) == 0) {
+			ucl_object_insert_key(be, ucl_object_fromstring(cmd->argv[3] + 8),
+					"handoff", 0, false);
+		}
+		else {
+			ucl_object_insert_key(be, ucl_object_fromstring(cmd->argv[3]),
+					"host", 0, false);
+			ucl_object_insert_key(be, ucl_object_fromint(port), "port", 0,
+					false);
+		}
+
+		if (!backend_resolve(be)) {
+			ucl_object_unref(be);
+			cmd->error = admin_error("cannot resolve %s", cmd->argv[3]);
+			return false;
+		}
+
+		job->data = be;
+	}
+
+	return true;
+}
+
+/*
+ * Routes are named "<listener>/<sni>" or just "<sni>": then `set` needs the
+ * worker to have a single routing table and `del` removes it from all
+ */
+static void
+route_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct sni_worker *w = job->worker;
+	struct sni_listener *l;
+	const char *name = cmd->argv[2], *sep;
+	char table[256];
+	ucl_object_t *backends = NULL;
+	unsigned n = 0;
+
+	sep = strchr(name, '/');
+
+	if (sep != NULL) {
+		snprintf(table, sizeof(table), "%.*s", (int)(sep - name), name);
+		name = sep + 1;
+		backends = worker_routes_find(w, table);
+
+		if (backends == NULL) {
+			job->error = admin_error("no such listener: %s", table);
+			return;
+		}
+	}
+	else if (job->data != NULL) {
+		if (worker_routes_count(w) > 1) {
+			job->error = admin_error("several routing tables, use "
+					"<listener>/%s", name);
+			return;
+		}
+
+		backends = w->listeners->backends;
+	}
+
+	if (job->data != NULL) {
+		/* Sessions keep their reference to the replaced backend */
+		if (ucl_object_find_key(backends, name) != NULL) {
+			ucl_object_replace_key(backends, job->data, name, 0, true);
+		}
+		else {
+			ucl_object_insert_key(backends, job->data, name, 0, true);
+		}
+		job->data = NULL;
+		return;
+	}
+
+	if (backends != NULL) {
+		n = ucl_object_delete_key(backends, name);
+	}
+	else {
+		for (l = w->listeners; l != NULL; l = l->next) {
+			if (listener_routes_first(l) &&
+					ucl_object_delete_key(l->backends, name)) {
+				n ++;
+			}
+		}
+	}
+
+	if (n == 0) {
+		job->error = admin_error("no such route: %s", cmd->argv[2]);
+	}
+}
+
+static bool
+drain_prepare(struct admin_cmd *cmd, struct admin_job *job)
+{
+	if (job == NULL && cmd->argc != 2) {
+		cmd->error = admin_error("usage: %s <upstream>",
+				cmd->argv[0]);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+drain_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct sni_worker *w = job->worker;
+	struct sni_listener *l;
+	ucl_object_iter_t it;
+	const ucl_object_t *cur;
+	ucl_object_t *elt;
+	bool drain = strcmp(cmd->argv[0], "drain") == 0;
+	unsigned n = 0;
+
+	for (l = w->listeners; l != NULL; l = l->next) {
+		if (!listener_routes_first(l)) {
+			continue;
+		}
+
+		it = NULL;
+
+		while ((cur = ucl_iterate_object(l->backends, &it, true))) {
+			if (!upstream_match(cur, cmd->argv[1])) {
+				continue;
+			}
+
+			/* Set in place, relay threads may be reading the backend */
+			elt = (ucl_object_t *)ucl_object_find_key(cur, "draining");
+
+			if (elt != NULL) {
+				__atomic_store_n(&elt->value.iv, drain, __ATOMIC_RELAXED);
+			}
+			n ++;
+		}
+	}
+
+	if (n == 0) {
+		job->error = admin_error("no such upstream: %s", cmd->argv[1]);
+	}
+	else {
+		buf_printf(&job->out, "%s %u\n", drain ? "draining" : "active", n);
+	}
+}
+
+static void
+stats_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	ucl_object_t *obj, *limits, *denied, *acl, *shaped, *prio,
+			*mirrored;
+	unsigned char *out;
+
+	obj = stats_to_ucl(job->worker->loop);
+
+	if ((prio = sched_to_ucl(job->worker)) != NULL) {
+		ucl_object_insert_key(obj, prio, "scheduling", 0, false);
+	}
+
+	if ((mirrored = mirror_to_ucl(job->worker)) != NULL) {
+		ucl_object_insert_key(obj, mirrored, "mirror", 0, false);
+	}
+
+	if (!job->worker->relay) {
+		ucl_object_insert_key(obj, greeting_to_ucl(), "greeting", 0, false);
+
+		if ((limits = ratelimit_to_ucl()) != NULL) {
+			ucl_object_insert_key(obj, limits, "rate_limits", 0, false);
+		}
+
+		if ((denied = denylist_to_ucl()) != NULL) {
+			ucl_object_insert_key(obj, denied, "denylist", 0, false);
+		}
+
+		if ((acl = clients_to_ucl()) != NULL) {
+			ucl_object_insert_key(obj, acl, "clients", 0, false);
+		}
+
+		if ((shaped = shaper_to_ucl(job->worker)) != NULL) {
+			ucl_object_insert_key(obj, shaped, "shaping", 0, false);
+		}
+	}
+	out = ucl_object_emit(obj, UCL_EMIT_JSON_COMPACT);
+
+	if (out != NULL) {
+		buf_printf(&job->out, "%s\n", out);
+		free(out);
+	}
+
+	ucl_object_unref(obj);
+}
+
+static void
+load_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	struct sni_worker *w = job->worker;
+	const char *state = "ok";
+
+	if (w->accept_paused) {
+		state = "paused";
+	}
+	else if (w->shedding) {
+		state = "shedding";
+	}
+	else if (w->saturated) {
+		state = "saturated";
+	}
+
+	buf_printf(&job->out, "%u %llu %.1f %llu %llu %llu %s\n", w->nsessions,
+			(unsigned long long)w->load_rate, w->load_lag / 1000.0,
+			(unsigned long long)w->load_buffered,
+			(unsigned long long)w->moved_in,
+			(unsigned long long)w->moved_out, state);
+}
+
+static void
+tcpinfo_exec(struct admin_cmd *cmd, struct admin_job *job)
+{
+	ucl_object_t *obj;
+	unsigned char *out;
+
+	obj = tcpinfo_to_ucl(job->worker);
+	out = ucl_object_emit(obj, UCL_EMIT_JSON_COMPACT);
+
+	if (out != NULL) {
+		buf_printf(&job->out, "%s\n", out);
+		free(out);
+	}
+
+	ucl_object_unref(obj);
+}
+
+static bool help_prepare(struct admin_cmd *cmd, struct admin_job *job);
+
+static const struct admin_command commands[] = {
+	{"routes", "", "list routes: [listener/]name upstream state sessions",
+			NULL, routes_exec, true, false},
+	{"route", "set [listener/]<sni> <host [port]|unix:path|handoff:path> | "
+			"del [listener/]<sni>",
+			"add, replace or remove a route", route_prepare, route_exec, false,
+			true},
+	{"sources", "",
+			"list source addresses: route source active ports used exhausted",
+			NULL, sources_exec, true, true},
+	{"drain", "<upstream>", "send no new sessions to an upstream",
+			drain_prepare, drain_exec, false, true},
+	{"undrain", "<upstream>", "return an upstream to service",
+			drain_prepare, drain_exec, false, true},
+	{"sessions", "[filters]",
+			"list sessions: id client sni route state age in out",
+			sessions_prepare, sessions_exec, false, false},
+	{"kill", "<filters|all>", "terminate sessions", kill_prepare, kill_exec,
+			false, false},
+	{"stats", "", "event loop statistics as JSON", NULL, stats_exec, true,
+			false},
+	{"load", "", "load: sessions bytes/s lag_ms buffered moved_in moved_out "
+			"state",
+			NULL, load_exec, true, false},
+	{"tcpinfo", "", "TCP_INFO histograms per leg and backend as JSON",
+			NULL, tcpinfo_exec, true, false},
+	{"help", "", "this message", help_prepare, NULL, false, false},
+	{"quit", "", "close admin connection", NULL, NULL, false, false},
+};
+
+static bool
+help_prepare(struct admin_cmd *cmd, struct admin_job *job)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++) {
+		buf_printf(&cmd->out, "%s%s%s: %s\n", commands[i].name,
+				commands[i].args[0] ? " " : "", commands[i].args,
+				commands[i].descr);
+	}
+
+	buf_printf(&cmd->out, "upstream: <route|host[:port]|unix:path|"
+			"handoff:path>\n");
+	buf_printf(&cmd->out, "filters: <id> sni=<name|*.domain> "
+			"backend=<upstream> listener=<name> age=<seconds> bytes=<n>\n");
+
+	return true;
+}
+
+/*
+ * Command dispatch
+ */
+static void
+admin_cmd_free(struct admin_cmd *cmd)
+{
+	free(cmd->out.s);
+	free(cmd->error);
+	free(cmd->line);
+	free(cmd);
+}
+
+static void
+admin_job_free(struct admin_job *job)
+{
+	if (job->data) {
+		ucl_object_unref(job->data);
+	}
+
+	free(job->out.s);
+	free(job->error);
+	free(job);
+}
+
+static void
+admin_cmd_finish(struct admin_cmd *cmd)
+{
+	struct admin_conn *conn = cmd->conn;
+
+	if (cmd->out.len > 0) {
+		buf_append(&conn->out, cmd->out.s, cmd->out.len);
+	}
+
+	if (cmd->error) {
+		buf_printf(&conn->out, "error: %s\n", cmd->error);
+	}
+	else {
+		buf_printf(&conn->out, "ok\n");
+	}
+
+	conn->busy = false;
+	admin_cmd_free(cmd);
+	admin_conn_process(conn);
+}
+
+/* Back on the admin loop */
+static void
+admin_job_done(struct ev_loop *loop, void *arg)
+{
+	struct admin_job *job = arg;
+	struct admin_cmd *cmd = job->cmd;
+	char *line, *nl;
+
+	if (cmd->command->per_worker && admin.nworkers > 1) {
+		for (line = job->out.s; line != NULL && *line != '\0'; line = nl + 1) {
+			nl = strchr(line, '\n');
+			if (nl == NULL) {
+				break;
+			}
+			buf_printf(&cmd->out, "%u %.*s\n", job->worker->id,
+					(int)(nl - line), line);
+		}
+	}
+	else if (job->out.len > 0) {
+		buf_append(&cmd->out, job->out.s, job->out.len);
+	}
+
+	if (job->error && cmd->error == NULL) {
+		cmd->error = job->error;
+		job->error = NULL;
+	}
+
+	admin_job_free(job);
+
+	if (-- cmd->pending == 0) {
+		admin_cmd_finish(cmd);
+	}
+}
+
+/* On the worker loop */
+static void
+admin_job_run(struct ev_loop *loop, void *arg)
+{
+	struct admin_job *job = arg;
+
+	job->cmd->command->exec(job->cmd, job);
+	cmdq_push(admin.cmdq, admin_job_done, job);
+}
+
+static void
+admin_dispatch(struct admin_conn *conn, const char *line)
+{
+	struct admin_cmd *cmd;
+	struct admin_job **jobs, *job;
+	char *p, *tok;
+	unsigned i, n = 0;
+
+	cmd = xmalloc0(sizeof(*cmd));
+	cmd->conn = conn;
+	cmd->line = strdup(line);
+
+	for (p = cmd->line; (tok = strsep(&p, " \t")) != NULL;) {
+		if (*tok == '\0') {
+			continue;
+		}
+		if (cmd->argc == ADMIN_MAX_ARGS) {
+			cmd->error = admin_error("too many arguments");
+			break;
+		}
+		cmd->argv[cmd->argc ++] = tok;
+	}
+
+	conn->busy = true;
+
+	if (cmd->argc == 0 || cmd->error) {
+		if (cmd->argc == 0) {
+			/* Empty line, nothing to reply */
+			conn->busy = false;
+			admin_cmd_free(cmd);
+			return;
+		}
+		admin_cmd_finish(cmd);
+		return;
+	}
+
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++) {
+		if (strcmp(commands[i].name, cmd->argv[0]) == 0) {
+			cmd->command = &commands[i];
+			break;
+		}
+	}
+
+	if (cmd->command == NULL) {
+		cmd->error = admin_error("unknown command: %s, try `help`",
+				cmd->argv[0]);
+		admin_cmd_finish(cmd);
+		return;
+	}
+
+	if (strcmp(cmd->command->name, "quit") == 0) {
+		conn->quit = true;
+		admin_cmd_finish(cmd);
+		return;
+	}
+
+	if (cmd->command->prepare && !cmd->command->prepare(cmd, NULL)) {
+		admin_cmd_finish(cmd);
+		return;
+	}
+
+	if (cmd->command->exec == NULL) {
+		admin_cmd_finish(cmd);
+		return;
+	}
+
+	/* Prepare all jobs first, so that a failure leaves workers untouched */
+	jobs = xmalloc0(admin.nworkers * sizeof(*jobs));
+
+	for (i = 0; i < admin.nworkers; i ++) {
+		if (cmd->command->routing && admin.workers[i]->relay) {
+			continue;
+		}
+
+		job = xmalloc0(sizeof(*job));
+		job->cmd = cmd;
+		job->worker = admin.workers[i];
+		jobs[n ++] = job;
+
+		if (cmd->command->prepare && !cmd->command->prepare(cmd, job)) {
+			break;
+		}
+	}
+
+	if (i < admin.nworkers) {
+		for (i = 0; i < n; i ++) {
+			admin_job_free(jobs[i]);
+		}
+		free(jobs);
+		admin_cmd_finish(cmd);
+		return;
+	}
+
+	cmd->pending = n;
+
+	for (i = 0; i < n; i ++) {
+		cmdq_push(jobs[i]->worker->cmdq, admin_job_run, jobs[i]);
+	}
+
+	free(jobs);
+}
+
+/*
+ * Admin connections
+ */
+static void
+admin_conn_close(struct admin_conn *conn)
+{
+	ev_io_stop(admin.loop, &conn->io);
+	close(conn->fd);
+	free(conn->out.s);
+	free(conn);
+}
+
+/* Runs complete lines from the input buffer while no command is in flight */
+static void
+admin_conn_process(struct admin_conn *conn)
+{
+	char *nl;
+	size_t llen;
+
+	while (!conn->busy && !conn->quit &&
+			(nl = memchr(conn->in, '\n', conn->inlen)) != NULL) {
+		*nl = '\0';
+		llen = nl - conn->in + 1;
+
+		if (nl > conn->in && nl[-1] == '\r') {
+			nl[-1] = '\0';
+		}
+
+		admin_dispatch(conn, conn->in);
+		memmove(conn->in, conn->in + llen, conn->inlen - llen);
+		conn->inlen -= llen;
+	}
+
+	if (!conn->busy && conn->inlen == sizeof(conn->in)) {
+		buf_printf(&conn->out, "error: line too long\n");
+		conn->quit = true;
+	}
+
+	admin_conn_update(conn);
+}
+
+static void
+admin_conn_update(struct admin_conn *conn)
+{
+	int ev = 0;
+
+	if (conn->out_off < conn->out.len) {
+		ev |= EV_WRITE;
+	}
+	else if ((conn->eof || conn->quit) && !conn->busy) {
+		admin_conn_close(conn);
+		return;
+	}
+
+	if (!conn->busy && !conn->eof && !conn->quit) {
+		ev |= EV_READ;
+	}
+
+	if (ev != conn->io.events || !ev_is_active(&conn->io)) {
+		ev_io_stop(admin.loop, &conn->io);
+		if (ev != 0) {
+			ev_io_set(&conn->io, conn->fd, ev);
+			ev_io_start(admin.loop, &conn->io);
+		}
+	}
+}
+
+static void
+admin_conn_cb(EV_P_ ev_io *w, int revents)
+{
+	struct admin_conn *conn = w->data;
+	ssize_t r;
+
+	stats_cb(loop, stats_cb_admin);
+
+	if (revents & EV_READ) {
+		r = read(conn->fd, conn->in + conn->inlen,
+				sizeof(conn->in) - conn->inlen);
+
+		if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+			conn->eof = true;
+		}
+		else if (r > 0) {
+			conn->inlen += r;
+		}
+	}
+
+	if (revents & EV_WRITE) {
+		r = write(conn->fd, conn->out.s + conn->out_off,
+				conn->out.len - conn->out_off);
+
+		if (r == -1 && errno != EAGAIN && errno != EINTR) {
+			/* Peer is gone, drop the output */
+			conn->eof = true;
+			conn->out_off = conn->out.len;
+		}
+		else if (r > 0) {
+			conn->out_off += r;
+		}
+
+		if (conn->out_off == conn->out.len) {
+			conn->out_off = 0;
+			conn->out.len = 0;
+		}
+	}
+
+	admin_conn_process(conn);
+}
+
+static void
+admin_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	struct admin_conn *conn;
+	int fd, ofl;
+
+	stats_cb(loop, stats_cb_admin);
+
+	if ((fd = accept(w->fd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "admin accept failed: %s\n", strerror(errno));
+		}
+		return;
+	}
+
+	ofl = fcntl(fd, F_GETFL, 0);
+
+	if (fcntl(fd, F_SETFL, ofl | O_NONBLOCK) == -1 ||
+			fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		close(fd);
+		return;
+	}
+
+	conn = xmalloc0(sizeof(*conn));
+	conn->fd = fd;
+	conn->io.data = conn;
+	ev_io_init(&conn->io, admin_conn_cb, fd, EV_READ);
+	ev_io_start(loop, &conn->io);
+}
+
+bool
+admin_init(struct ev_loop *loop, const ucl_object_t *cfg,
+		struct sni_worker **workers, unsigned nworkers)
+{
+	const ucl_object_t *elt;
+	struct sockaddr_un sun;
+	struct stat st;
+	const char *path;
+	mode_t omask;
+	int sock, ofl, r;
+
+	elt = ucl_object_find_key(cfg, "socket");
+
+	if (elt == NULL || (path = ucl_object_tostring(elt)) == NULL) {
+		fprintf(stderr, "admin: socket path is missing\n");
+		return false;
+	}
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "admin: socket path is too long: %s\n", path);
+		return false;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (sock == -1) {
+		fprintf(stderr, "admin: socket failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* Remove stale socket left by the previous instance, nothing else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "admin: %s exists and is not a socket\n", path);
+			close(sock);
+			return false;
+		}
+
+		unlink(path);
+	}
+
+	/* Created 0600, never reachable by others even briefly */
+	omask = umask(0177);
+	r = bind(sock, (struct sockaddr *)&sun, sizeof(sun));
+	umask(omask);
+
+	if (r == -1 || listen(sock, 16) == -1) {
+		fprintf(stderr, "admin: cannot listen on %s: %s\n", path,
+				strerror(errno));
+		close(sock);
+		return false;
+	}
+
+	ofl = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, ofl | O_NONBLOCK);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	admin.loop = loop;
+	admin.cmdq = cmdq_create(loop);
+	admin.workers = workers;
+	admin.nworkers = nworkers;
+	admin.path = strdup(path);
+
+	ev_io_init(&admin.io, admin_accept_cb, sock, EV_READ);
+	ev_io_start(loop, &admin.io);
+
+	return true;
+}
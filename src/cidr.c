@@ -0,0 +1,909 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Longest prefix match of client addresses, for the `clients` rules: which
+ * clients are refused at accept and which networks have routes of their own.
+ *
+ * IPv4 uses DIR-24-8: a table of 2^24 entries indexed by the first 24 bits
+ * of the address holds the value, or the index of a group of 256 entries
+ * for the last 8 bits when longer prefixes start there. A lookup reads one
+ * or two entries. The table is a lazily mapped 64MB, only the parts some
+ * prefix covers take memory.
+ *
+ * IPv6 points directly from the first 16 bits, then walks compressed nodes
+ * of 8 bits each. A node has two bitmaps over its 256 slots: slots going on
+ * in a child node, and slots starting a run of equal values among the
+ * others. Children and runs are stored contiguously, so a slot's child or
+ * value is found by counting the bits set before it. Levels with a single
+ * child where no prefix ends are not stored: the node below keeps their
+ * bytes and compares them at once. A /48 takes at most five reads, usually
+ * three, deeper prefixes up to one more per byte.
+ *
+ * Both are built at once from the sorted prefixes and never changed, a new
+ * configuration builds new tables.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ucl.h"
+#include "util.h"
+#include "cidr.h"
+
+/* Entry points to a group or node rather than holding a value */
+#define CIDR_EXT 0x80000000U
+
+struct cidr_prefix4 {
+	uint32_t addr;
+	uint32_t value;
+	uint32_t seq;
+	uint8_t len;
+};
+
+struct cidr_prefix6 {
+	uint8_t addr[16];
+	uint32_t value;
+	uint32_t seq;
+	uint8_t len;
+};
+
+struct cidr_node6 {
+	uint32_t child_base;
+	uint32_t leaf_base;
+	/* Bytes every address below shares, the value of those that differ */
+	uint32_t miss;
+	uint8_t skip;
+	uint8_t bytes[15];
+	uint64_t child[4];
+	uint64_t leaf[4];
+};
+
+struct cidr_table {
+	/* Prefixes added, freed once built */
+	struct cidr_prefix4 *p4;
+	size_t n4, cap4;
+	struct cidr_prefix6 *p6;
+	size_t n6, cap6;
+	uint32_t seq;
+	/* IPv4 */
+	uint32_t *tbl24;
+	uint32_t *tbl8;
+	size_t ngroups, capgroups;
+	/* IPv6 */
+	uint32_t *top6;
+	struct cidr_node6 *nodes;
+	size_t nnodes, capnodes;
+	uint32_t *leaves;
+	size_t nleaves, capleaves;
+};
+
+enum {
+	client_allow = 1,
+	client_deny
+};
+
+struct client_rules {
+	struct cidr_table *acl;
+	struct cidr_table *networks;
+	/* Network names, by value - 1 */
+	char **names;
+	unsigned nnames;
+	bool deny_default;
+	unsigned refs;
+};
+
+static struct {
+	/* Rules in use, counters are shown while there are any */
+	unsigned rules;
+	uint64_t checked;
+	uint64_t denied;
+	uint64_t in_network;
+} clients;
+
+static const size_t tbl24_size = (1U << 24) * sizeof(uint32_t);
+
+static void*
+grow(void *p, size_t *cap, size_t need, size_t size)
+{
+	if (need <= *cap) {
+		return p;
+	}
+
+	*cap = MAX(need, *cap * 2);
+	p = realloc(p, *cap * size);
+
+	if (p == NULL) {
+		abort();
+	}
+
+	return p;
+}
+
+struct cidr_table*
+cidr_table_create(void)
+{
+	return xmalloc0(sizeof(struct cidr_table));
+}
+
+void
+cidr_table_free(struct cidr_table *t)
+{
+	if (t == NULL) {
+		return;
+	}
+
+	if (t->tbl24 != NULL) {
+		munmap(t->tbl24, tbl24_size);
+	}
+
+	free(t->p4);
+	free(t->p6);
+	free(t->tbl8);
+	free(t->top6);
+	free(t->nodes);
+	free(t->leaves);
+	free(t);
+}
+
+static void
+mask_bits(uint8_t *addr, unsigned bytes, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < bytes; i ++, len = len > 8 ? len - 8 : 0) {
+		if (len < 8) {
+			addr[i] &= 0xff00 >> len;
+		}
+	}
+}
+
+static void
+add4(struct cidr_table *t, uint8_t *addr, unsigned len, uint32_t value)
+{
+	struct cidr_prefix4 *p;
+
+	t->p4 = grow(t->p4, &t->cap4, t->n4 + 1, sizeof(*t->p4));
+	p = &t->p4[t->n4 ++];
+	mask_bits(addr, 4, len);
+	memcpy(&p->addr, addr, 4);
+	p->addr = ntohl(p->addr);
+	p->len = len;
+	p->value = value;
+	p->seq = t->seq ++;
+}
+
+bool
+cidr_add(struct cidr_table *t, const char *spec, uint32_t value)
+{
+	struct cidr_prefix6 *p;
+	uint8_t addr[16];
+	char buf[64], *slash, *end;
+	unsigned long len, max;
+	bool v4;
+
+	if (value == 0 || value >= CIDR_EXT ||
+			snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf)) {
+		return false;
+	}
+
+	if ((slash = strchr(buf, '/')) != NULL) {
+		*slash ++ = '\0';
+	}
+
+	if (inet_pton(AF_INET, buf, addr) == 1) {
+		v4 = true;
+		max = 32;
+	}
+	else if (inet_pton(AF_INET6, buf, addr) == 1) {
+		v4 = false;
+		max = 128;
+	}
+	else {
+		return false;
+	}
+
+	len = max;
+
+	if (slash != NULL) {
+		len = strtoul(slash, &end, 10);
+
+		if (*end != '\0' || end == slash || len > max) {
+			return false;
+		}
+	}
+
+	if (v4) {
+		add4(t, addr, len, value);
+		return true;
+	}
+
+	/* Clients come unmapped, so do mapped prefixes */
+	if (len >= 96 && IN6_IS_ADDR_V4MAPPED((struct in6_addr *)addr)) {
+		add4(t, addr + 12, len - 96, value);
+		return true;
+	}
+
+	t->p6 = grow(t->p6, &t->cap6, t->n6 + 1, sizeof(*t->p6));
+	p = &t->p6[t->n6 ++];
+	mask_bits(addr, 16, len);
+	memcpy(p->addr, addr, 16);
+	p->len = len;
+	p->value = value;
+	p->seq = t->seq ++;
+
+	return true;
+}
+
+bool
+cidr_add_file(struct cidr_table *t, const char *path, uint32_t value,
+		char *err, size_t errlen)
+{
+	FILE *f;
+	char *line = NULL, *s, *e;
+	size_t cap = 0;
+	unsigned lineno = 0;
+	bool ret = true;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		return false;
+	}
+
+	while (getline(&line, &cap, f) != -1) {
+		lineno ++;
+
+		if ((s = strchr(line, '#')) != NULL) {
+			*s = '\0';
+		}
+
+		for (s = line; *s == ' ' || *s == '\t'; s ++);
+		for (e = s; *e != '\0' && !strchr(" \t\r\n", *e); e ++);
+
+		if (e == s) {
+			continue;
+		}
+
+		*e = '\0';
+
+		if (!cidr_add(t, s, value)) {
+			snprintf(err, errlen, "line %u: bad prefix: %s", lineno, s);
+			ret = false;
+			break;
+		}
+	}
+
+	if (ret && ferror(f)) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		ret = false;
+	}
+
+	free(line);
+	fclose(f);
+
+	return ret;
+}
+
+/* Shorter prefixes first, so longer ones overwrite them; then in order */
+static int
+prefix4_cmp(const void *a, const void *b)
+{
+	const struct cidr_prefix4 *x = a, *y = b;
+
+	if (x->len != y->len) {
+		return x->len < y->len ? -1 : 1;
+	}
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void
+build4(struct cidr_table *t)
+{
+	const struct cidr_prefix4 *p;
+	uint32_t *tbl, e, first, count, i;
+	size_t k;
+
+	t->tbl24 = mmap(NULL, tbl24_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (t->tbl24 == MAP_FAILED) {
+		abort();
+	}
+
+	qsort(t->p4, t->n4, sizeof(*t->p4), prefix4_cmp);
+
+	for (k = 0; k < t->n4; k ++) {
+		p = &t->p4[k];
+
+		if (p->len <= 24) {
+			tbl = t->tbl24;
+			first = p->addr >> 8;
+			count = 1U << (24 - p->len);
+		}
+		else {
+			e = t->tbl24[p->addr >> 8];
+
+			/* A new group starts with the value it replaces */
+			if (!(e & CIDR_EXT)) {
+				t->tbl8 = grow(t->tbl8, &t->capgroups, t->ngroups + 1,
+						256 * sizeof(*t->tbl8));
+
+				for (i = 0; i < 256; i ++) {
+					t->tbl8[t->ngroups * 256 + i] = e;
+				}
+
+				e = CIDR_EXT | t->ngroups ++;
+				t->tbl24[p->addr >> 8] = e;
+			}
+
+			tbl = &t->tbl8[(e & ~CIDR_EXT) * 256];
+			first = p->addr & 0xff;
+			count = 1U << (32 - p->len);
+		}
+
+		for (i = 0; i < count; i ++) {
+			tbl[first + i] = p->value;
+		}
+	}
+}
+
+static int
+prefix6_cmp(const void *a, const void *b)
+{
+	const struct cidr_prefix6 *x = a, *y = b;
+	int r;
+
+	if ((r = memcmp(x->addr, y->addr, 16)) != 0) {
+		return r;
+	}
+	if (x->len != y->len) {
+		return x->len < y->len ? -1 : 1;
+	}
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static inline bool
+bit_test(const uint64_t *bm, unsigned s)
+{
+	return (bm[s >> 6] >> (s & 63)) & 1;
+}
+
+/* Bits set before slot `s` */
+static inline unsigned
+bit_rank(const uint64_t *bm, unsigned s)
+{
+	unsigned i, r = 0;
+
+	for (i = 0; i < s >> 6; i ++) {
+		r += __builtin_popcountll(bm[i]);
+	}
+
+	if (s & 63) {
+		r += __builtin_popcountll(bm[s >> 6] & ((1ULL << (s & 63)) - 1));
+	}
+
+	return r;
+}
+
+static uint32_t
+node_alloc(struct cidr_table *t, unsigned n)
+{
+	uint32_t first = t->nnodes;
+
+	t->nodes = grow(t->nodes, &t->capnodes, t->nnodes + n, sizeof(*t->nodes));
+	t->nnodes += n;
+
+	return first;
+}
+
+/* True if [lo, hi) go on in a single slot at depth `d` and none ends there */
+static bool
+pass_through(const struct cidr_table *t, size_t lo, size_t hi, unsigned d,
+		uint8_t *slot)
+{
+	const struct cidr_prefix6 *p;
+	bool found = false;
+	size_t i;
+
+	for (i = lo; i < hi; i ++) {
+		p = &t->p6[i];
+
+		if (p->len <= d) {
+			continue;
+		}
+		if (p->len <= d + 8 || (found && p->addr[d / 8] != *slot)) {
+			return false;
+		}
+
+		*slot = p->addr[d / 8];
+		found = true;
+	}
+
+	return found;
+}
+
+/*
+ * Fills node `idx` for the prefixes [lo, hi), which share their first `d`
+ * bits, with `inherited` as the value of slots no prefix covers
+ */
+static void
+build_node(struct cidr_table *t, uint32_t idx, size_t lo, size_t hi,
+		unsigned d, uint32_t inherited)
+{
+	struct cidr_node6 node;
+	const struct cidr_prefix6 *p;
+	uint32_t vals[256], prev = 0;
+	uint8_t lens[256];
+	unsigned byte, s, span, start, k;
+	size_t i, j;
+
+	memset(&node, 0, sizeof(node));
+	memset(lens, 0, sizeof(lens));
+	node.miss = inherited;
+
+	while (d + 8 < 128 && node.skip < sizeof(node.bytes) &&
+			pass_through(t, lo, hi, d, &node.bytes[node.skip])) {
+		node.skip ++;
+		d += 8;
+	}
+
+	byte = d / 8;
+
+	for (s = 0; s < 256; s ++) {
+		vals[s] = inherited;
+	}
+
+	for (i = lo; i < hi; i ++) {
+		p = &t->p6[i];
+
+		if (p->len <= d) {
+			continue;
+		}
+		if (p->len > d + 8) {
+			node.child[p->addr[byte] >> 6] |= 1ULL << (p->addr[byte] & 63);
+			continue;
+		}
+
+		span = 1U << (d + 8 - p->len);
+		start = p->addr[byte] & ~(span - 1);
+
+		for (s = start; s < start + span; s ++) {
+			if (p->len >= lens[s]) {
+				vals[s] = p->value;
+				lens[s] = p->len;
+			}
+		}
+	}
+
+	node.child_base = node_alloc(t, bit_rank(node.child, 256));
+	node.leaf_base = t->nleaves;
+
+	for (s = 0; s < 256; s ++) {
+		if (bit_test(node.child, s)) {
+			continue;
+		}
+
+		if (t->nleaves == node.leaf_base || vals[s] != prev) {
+			node.leaf[s >> 6] |= 1ULL << (s & 63);
+			t->leaves = grow(t->leaves, &t->capleaves, t->nleaves + 1,
+					sizeof(*t->leaves));
+			t->leaves[t->nleaves ++] = vals[s];
+			prev = vals[s];
+		}
+	}
+
+	/* Children may move the array, so the node is stored before them */
+	t->nodes[idx] = node;
+
+	for (i = lo, k = 0; i < hi; i = j) {
+		s = t->p6[i].addr[byte];
+
+		for (j = i; j < hi && t->p6[j].addr[byte] == s; j ++);
+
+		if (bit_test(node.child, s)) {
+			build_node(t, node.child_base + k ++, i, j, d + 8, vals[s]);
+		}
+	}
+}
+
+static void
+build6(struct cidr_table *t)
+{
+	const struct cidr_prefix6 *p;
+	uint8_t *lens;
+	unsigned top, span, start, s;
+	uint32_t idx;
+	size_t i, lo, hi;
+	bool deeper;
+
+	qsort(t->p6, t->n6, sizeof(*t->p6), prefix6_cmp);
+	t->top6 = xmalloc0(65536 * sizeof(*t->top6));
+	lens = xmalloc0(65536);
+
+	for (i = 0; i < t->n6; i ++) {
+		p = &t->p6[i];
+
+		if (p->len > 16) {
+			continue;
+		}
+
+		span = 1U << (16 - p->len);
+		start = ((p->addr[0] << 8) | p->addr[1]) & ~(span - 1);
+
+		for (s = start; s < start + span; s ++) {
+			if (p->len >= lens[s]) {
+				t->top6[s] = p->value;
+				lens[s] = p->len;
+			}
+		}
+	}
+
+	free(lens);
+
+	for (lo = 0; lo < t->n6; lo = hi) {
+		top = (t->p6[lo].addr[0] << 8) | t->p6[lo].addr[1];
+		deeper = false;
+
+		for (hi = lo; hi < t->n6 && ((t->p6[hi].addr[0] << 8) |
+				t->p6[hi].addr[1]) == top; hi ++) {
+			deeper |= t->p6[hi].len > 16;
+		}
+
+		if (deeper) {
+			idx = node_alloc(t, 1);
+			build_node(t, idx, lo, hi, 16, t->top6[top]);
+			t->top6[top] = CIDR_EXT | idx;
+		}
+	}
+}
+
+void
+cidr_table_build(struct cidr_table *t)
+{
+	if (t->n4 > 0) {
+		build4(t);
+	}
+	if (t->n6 > 0) {
+		build6(t);
+	}
+
+	free(t->p4);
+	free(t->p6);
+	t->p4 = NULL;
+	t->p6 = NULL;
+}
+
+unsigned
+cidr_table_prefixes(const struct cidr_table *t)
+{
+	return t->seq;
+}
+
+size_t
+cidr_table_memory(const struct cidr_table *t)
+{
+	return (t->tbl24 != NULL ? tbl24_size : 0) +
+			t->ngroups * 256 * sizeof(*t->tbl8) +
+			(t->top6 != NULL ? 65536 * sizeof(*t->top6) : 0) +
+			t->nnodes * sizeof(*t->nodes) + t->nleaves * sizeof(*t->leaves);
+}
+
+uint32_t
+cidr_lookup4(const struct cidr_table *t, uint32_t addr)
+{
+	uint32_t e;
+
+	if (t->tbl24 == NULL) {
+		return 0;
+	}
+
+	e = t->tbl24[addr >> 8];
+
+	if (e & CIDR_EXT) {
+		e = t->tbl8[(e & ~CIDR_EXT) * 256 + (addr & 0xff)];
+	}
+
+	return e;
+}
+
+uint32_t
+cidr_lookup6(const struct cidr_table *t, const uint8_t *addr)
+{
+	const struct cidr_node6 *n;
+	uint32_t e;
+	unsigned d, s;
+
+	if (t->top6 == NULL) {
+		return 0;
+	}
+
+	e = t->top6[(addr[0] << 8) | addr[1]];
+
+	for (d = 2; e & CIDR_EXT; d ++) {
+		n = &t->nodes[e & ~CIDR_EXT];
+
+		if (n->skip > 0) {
+			if (memcmp(&addr[d], n->bytes, n->skip) != 0) {
+				return n->miss;
+			}
+
+			d += n->skip;
+		}
+
+		s = addr[d];
+
+		if (!bit_test(n->child, s)) {
+			return t->leaves[n->leaf_base + bit_rank(n->leaf, s + 1) - 1];
+		}
+
+		e = CIDR_EXT | (n->child_base + bit_rank(n->child, s));
+	}
+
+	return e;
+}
+
+uint32_t
+cidr_lookup(const struct cidr_table *t, const struct sockaddr *sa)
+{
+	const struct sockaddr_in6 *sin6;
+
+	if (sa->sa_family == AF_INET) {
+		return cidr_lookup4(t,
+				ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr));
+	}
+
+	if (sa->sa_family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *)sa;
+
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			uint32_t a;
+
+			memcpy(&a, &sin6->sin6_addr.s6_addr[12], sizeof(a));
+
+			return cidr_lookup4(t, ntohl(a));
+		}
+
+		return cidr_lookup6(t, sin6->sin6_addr.s6_addr);
+	}
+
+	return 0;
+}
+
+/* A prefix, "@file" of prefixes or an array of them */
+static bool
+rules_add(struct cidr_table *t, const char *name, const ucl_object_t *obj,
+		uint32_t value)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+	const char *spec;
+	char err[256];
+
+	while ((cur = ucl_iterate_object(obj, &it, true))) {
+		spec = ucl_object_tostring_forced(cur);
+
+		if (spec[0] == '@') {
+			if (!cidr_add_file(t, spec + 1, value, err, sizeof(err))) {
+				fprintf(stderr, "%s: %s: %s\n", name, spec + 1, err);
+				return false;
+			}
+		}
+		else if (!cidr_add(t, spec, value)) {
+			fprintf(stderr, "%s: bad prefix: %s\n", name, spec);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct client_rules*
+client_rules_parse(const char *name, const ucl_object_t *obj)
+{
+	struct client_rules *r;
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	const char *key;
+
+	r = xmalloc0(sizeof(*r));
+	r->refs = 1;
+	clients.rules ++;
+	elt = ucl_object_find_key(obj, "default");
+
+	if (elt != NULL) {
+		key = ucl_object_tostring_forced(elt);
+
+		if (strcmp(key, "deny") == 0) {
+			r->deny_default = true;
+		}
+		else if (strcmp(key, "allow") != 0) {
+			fprintf(stderr, "%s: default must be allow or deny\n",
+					name);
+			goto err;
+		}
+	}
+
+	/* Allowing wins over denying the same prefix */
+	elt = ucl_object_find_key(obj, "deny");
+
+	if (elt != NULL || r->deny_default) {
+		r->acl = cidr_table_create();
+
+		if (elt != NULL && !rules_add(r->acl, name, elt, client_deny)) {
+			goto err;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "allow");
+
+	if (elt != NULL) {
+		if (r->acl == NULL) {
+			r->acl = cidr_table_create();
+		}
+		if (!rules_add(r->acl, name, elt, client_allow)) {
+			goto err;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "networks");
+
+	if (elt != NULL) {
+		r->networks = cidr_table_create();
+
+		while ((cur = ucl_iterate_object(elt, &it, true))) {
+			key = ucl_object_key(cur);
+
+			if (key == NULL || *key == '\0' || strchr(key, '@') != NULL) {
+				fprintf(stderr, "%s: bad network name: %s\n", name,
+						key ? key : "");
+				goto err;
+			}
+
+			r->names = realloc(r->names, (r->nnames + 1) * sizeof(*r->names));
+
+			if (r->names == NULL) {
+				abort();
+			}
+
+			r->names[r->nnames ++] = strdup(key);
+
+			if (!rules_add(r->networks, name, cur, r->nnames)) {
+				goto err;
+			}
+		}
+	}
+
+	if (r->acl != NULL) {
+		cidr_table_build(r->acl);
+	}
+	if (r->networks != NULL) {
+		cidr_table_build(r->networks);
+	}
+
+	return r;
+
+err:
+	client_rules_unref(r);
+
+	return NULL;
+}
+
+struct client_rules*
+client_rules_ref(struct client_rules *r)
+{
+	if (r != NULL) {
+		r->refs ++;
+	}
+
+	return r;
+}
+
+void
+client_rules_unref(struct client_rules *r)
+{
+	unsigned i;
+
+	if (r == NULL || -- r->refs > 0) {
+		return;
+	}
+
+	cidr_table_free(r->acl);
+	cidr_table_free(r->networks);
+
+	for (i = 0; i < r->nnames; i ++) {
+		free(r->names[i]);
+	}
+
+	free(r->names);
+	free(r);
+	clients.rules --;
+}
+
+bool
+client_allowed(const struct client_rules *r, const struct sockaddr *sa)
+{
+	uint32_t v;
+
+	if (r == NULL || r->acl == NULL) {
+		return true;
+	}
+
+	clients.checked ++;
+	v = cidr_lookup(r->acl, sa);
+
+	if (v == client_allow || (v == 0 && !r->deny_default)) {
+		return true;
+	}
+
+	clients.denied ++;
+
+	return false;
+}
+
+const char*
+client_network(const struct client_rules *r, const struct sockaddr *sa)
+{
+	uint32_t v;
+
+	if (r == NULL || r->networks == NULL ||
+			(v = cidr_lookup(r->networks, sa)) == 0) {
+		return NULL;
+	}
+
+	clients.in_network ++;
+
+	return r->names[v - 1];
+}
+
+ucl_object_t*
+clients_to_ucl(void)
+{
+	ucl_object_t *top;
+
+	if (clients.rules == 0) {
+		return NULL;
+	}
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, ucl_object_fromint(clients.checked),
+			"checked", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(clients.denied),
+			"denied", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(clients.in_network),
+			"in_network", 0, false);
+
+	return top;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_CIDR_H_
+#define SRC_CIDR_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ucl.h"
+
+struct cidr_table;
+struct client_rules;
+
+/*
+ * Longest prefix match from addresses to values. Prefixes are added first,
+ * then the table is built once and only read: lookups take no locks.
+ */
+struct cidr_table *cidr_table_create(void);
+void cidr_table_free(struct cidr_table *t);
+/* Adds "addr/len" or "addr" with a value from 1 to 2^31 - 1 */
+bool cidr_add(struct cidr_table *t, const char *spec, uint32_t value);
+/* Adds every prefix of a file, one per line, or fills `err` */
+bool cidr_add_file(struct cidr_table *t, const char *path, uint32_t value,
+		char *err, size_t errlen);
+void cidr_table_build(struct cidr_table *t);
+unsigned cidr_table_prefixes(const struct cidr_table *t);
+/* Bytes of the lookup structures, including the lazily mapped ones */
+size_t cidr_table_memory(const struct cidr_table *t);
+/* Value of the longest prefix containing the address, 0 if none */
+uint32_t cidr_lookup4(const struct cidr_table *t, uint32_t addr);
+uint32_t cidr_lookup6(const struct cidr_table *t, const uint8_t *addr);
+uint32_t cidr_lookup(const struct cidr_table *t, const struct sockaddr *sa);
+
+/*
+ * Client rules of a `clients` section: prefixes denied and allowed at
+ * accept, and networks that pick routes of their own. Shared by the
+ * listeners using the top level section.
+ */
+struct client_rules *client_rules_parse(const char *name,
+		const ucl_object_t *obj);
+struct client_rules *client_rules_ref(struct client_rules *r);
+void client_rules_unref(struct client_rules *r);
+/* False if the client is denied, `r` may be NULL */
+bool client_allowed(const struct client_rules *r, const struct sockaddr *sa);
+/* Name of the network of the client, NULL if in none */
+const char *client_network(const struct client_rules *r,
+		const struct sockaddr *sa);
+
+/* Counters, NULL without any rules */
+ucl_object_t *clients_to_ucl(void);
+
+#endif /* SRC_CIDR_H_ */
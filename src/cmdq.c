@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "ev.h"
+#include "util.h"
+#include "stats.h"
+#include "cmdq.h"
+
+struct cmdq_msg {
+	struct cmdq_msg *next;
+	cmdq_fn fn;
+	void *arg;
+};
+
+/*
+ * Multiple producers push messages to a lock-free stack, the owning loop
+ * takes the whole stack at once and runs it in the order of pushes
+ */
+struct cmdq {
+	ev_async async;
+	struct ev_loop *loop;
+	struct cmdq_msg *head;
+};
+
+static void
+cmdq_run(struct ev_loop *loop, struct cmdq *q)
+{
+	struct cmdq_msg *msg, *next, *rev = NULL;
+
+	msg = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+
+	while (msg != NULL) {
+		next = msg->next;
+		msg->next = rev;
+		rev = msg;
+		msg = next;
+	}
+
+	while (rev != NULL) {
+		next = rev->next;
+		rev->fn(loop, rev->arg);
+		free(rev);
+		rev = next;
+	}
+}
+
+static void
+cmdq_cb(EV_P_ ev_async *w, int revents)
+{
+	stats_cb(loop, stats_cb_admin);
+	cmdq_run(loop, w->data);
+}
+
+struct cmdq*
+cmdq_create(struct ev_loop *loop)
+{
+	struct cmdq *q;
+
+	q = xmalloc0(sizeof(*q));
+	q->loop = loop;
+	q->async.data = q;
+	ev_async_init(&q->async, cmdq_cb);
+	ev_async_start(loop, &q->async);
+	/* Pending commands alone should not keep the loop running */
+	ev_unref(loop);
+
+	return q;
+}
+
+void
+cmdq_push(struct cmdq *q, cmdq_fn fn, void *arg)
+{
+	struct cmdq_msg *msg, *old;
+
+	msg = xmalloc(sizeof(*msg));
+	msg->fn = fn;
+	msg->arg = arg;
+	old = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	do {
+		msg->next = old;
+	} while (!__atomic_compare_exchange_n(&q->head, &old, msg, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	ev_async_send(q->loop, &q->async);
+}
+
+/* Must be called from the owning loop, runs what is left in the queue */
+void
+cmdq_destroy(struct cmdq *q)
+{
+	ev_ref(q->loop);
+	ev_async_stop(q->loop, &q->async);
+	cmdq_run(q->loop, q);
+	free(q);
+}
@@ -0,0 +1,899 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * SNI name denylist, checked once the ClientHello is parsed and before the
+ * backend lookup.
+ *
+ * The list is a plain file with a name per line. A name starting with a dot
+ * (or "*.") also denies every name below it. The file text is kept as read
+ * and indexed twice: by a blocked Bloom filter, where a name sets 7 bits of
+ * a single 64 byte block, and by an open addressing table of offsets into
+ * the text, which confirms what the filter lets through. Most names are not
+ * listed and only cost a cache line of the filter; the table, several times
+ * larger, is read for listed names and false positives (about 1% with the
+ * default 10 bits per name).
+ *
+ * A name is probed whole and as each of its parent domains, but only with
+ * label counts that some listed suffix has. All hashes come from one pass
+ * over the name from its end, and their filter blocks are prefetched before
+ * the first is tested, so the cache misses overlap.
+ *
+ * Building a list of millions of names takes a while: reloads run in
+ * a thread of their own and hand the list over to the main loop, the only
+ * reader, which swaps it in. Replaced lists are freed by a thread as well.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "cmdq.h"
+#include "denylist.h"
+#include "sni-private.h"
+
+#define DENYLIST_MAX_NAME 253
+/* Suffix label counts are a bit mask */
+#define DENYLIST_MAX_LABELS 63
+#define BLOOM_PROBES 7
+
+static const unsigned default_bloom_bits = 10;
+/* A changed file may still be written to, wait this long before reading */
+static const ev_tstamp settle_delay = 1.0;
+
+struct denylist_slot {
+	uint32_t off;
+	/* Bits of the hash above the name length, 0 is a free slot */
+	uint32_t tag;
+};
+
+struct denylist {
+	char *text;
+	size_t textlen;
+	uint64_t *bloom;
+	uint64_t bloom_mask;
+	size_t bloom_size;
+	struct denylist_slot *slots;
+	uint64_t slot_mask;
+	size_t slots_size;
+	uint64_t seed;
+	/* Bit n is set if a listed suffix has n labels */
+	uint64_t suffix_labels;
+	unsigned names;
+	unsigned invalid;
+	/* Counters, updated by the main loop */
+	uint64_t probes;
+	uint64_t bloom_hits;
+	uint64_t false_hits;
+};
+
+struct denylist_job {
+	char *path;
+	unsigned bits;
+	struct cmdq *cmdq;
+	struct denylist *dl;
+	ev_tstamp started;
+	ev_tstamp finished;
+	char err[256];
+};
+
+static struct {
+	char *path;
+	unsigned bits;
+	struct denylist *cur;
+	struct sni_worker *worker;
+	ev_stat stat;
+	ev_timer settle;
+	bool building;
+	bool pending;
+	/* Counters */
+	uint64_t checked;
+	uint64_t denied;
+	uint64_t reloads;
+	uint64_t failures;
+	/* ... and those of the lists replaced so far */
+	uint64_t probes;
+	uint64_t bloom_hits;
+	uint64_t false_hits;
+} deny;
+
+/*
+ * Read by denylist_configure(), installed by denylist_commit(): no path is
+ * no list. Before the loop starts, the list is loaded right away.
+ */
+static struct {
+	char *path;
+	unsigned bits;
+	struct denylist *dl;
+} staged;
+
+static void denylist_build(void);
+
+static uint64_t
+mix64(uint64_t h)
+{
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+
+	return h ^ (h >> 31);
+}
+
+static inline unsigned char
+fold(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/*
+ * Names are hashed from their last byte, lower cased, so that the state
+ * reached at a dot is the hash of the parent domain after it
+ */
+static inline uint64_t
+hash_byte(uint64_t h, unsigned char c)
+{
+	return (h ^ fold(c)) * 0x100000001b3ULL;
+}
+
+static inline uint64_t
+hash_final(const struct denylist *dl, uint64_t h)
+{
+	return mix64(h ^ dl->seed);
+}
+
+static uint64_t
+name_hash(const struct denylist *dl, const char *name, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len > 0) {
+		h = hash_byte(h, name[-- len]);
+	}
+
+	return hash_final(dl, h);
+}
+
+/* Second hash for the bits within a filter block and the slot tag */
+static inline uint64_t
+hash2(uint64_t h)
+{
+	return (h ^ (h >> 29)) * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline const uint64_t*
+bloom_block(const struct denylist *dl, uint64_t h)
+{
+	return &dl->bloom[(h & dl->bloom_mask) * 8];
+}
+
+static void
+bloom_add(struct denylist *dl, uint64_t h)
+{
+	uint64_t *block = &dl->bloom[(h & dl->bloom_mask) * 8], h2 = hash2(h);
+	unsigned i, bit;
+
+	for (i = 0; i < BLOOM_PROBES; i ++) {
+		bit = (h2 >> (55 - 9 * i)) & 511;
+		block[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+static inline bool
+bloom_test(const struct denylist *dl, uint64_t h)
+{
+	const uint64_t *block = bloom_block(dl, h);
+	uint64_t h2 = hash2(h);
+	unsigned i, bit;
+
+	for (i = 0; i < BLOOM_PROBES; i ++) {
+		bit = (h2 >> (55 - 9 * i)) & 511;
+
+		if (!(block[bit >> 6] & (1ULL << (bit & 63)))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static inline uint32_t
+slot_tag(uint64_t h, size_t len)
+{
+	return ((uint32_t)hash2(h) & ~0xffU) | len;
+}
+
+/* A suffix entry is preceded by its dot in the text */
+static inline bool
+slot_suffix(const struct denylist *dl, const struct denylist_slot *s)
+{
+	return s->off > 0 && dl->text[s->off - 1] == '.';
+}
+
+static struct denylist_slot*
+slot_find(const struct denylist *dl, uint64_t h, const char *name,
+		size_t len)
+{
+	struct denylist_slot *s;
+	uint32_t tag = slot_tag(h, len);
+	uint64_t i;
+
+	for (i = (h >> 32) & dl->slot_mask; ; i = (i + 1) & dl->slot_mask) {
+		s = &dl->slots[i];
+
+		if (s->tag == 0) {
+			return NULL;
+		}
+
+		if (s->tag == tag && strncasecmp(dl->text + s->off, name, len) == 0) {
+			return s;
+		}
+	}
+}
+
+static unsigned
+name_labels(const char *name, size_t len)
+{
+	unsigned labels = 1;
+
+	while (len > 0) {
+		if (name[-- len] == '.') {
+			labels ++;
+		}
+	}
+
+	return labels;
+}
+
+static void
+denylist_insert(struct denylist *dl, uint32_t off, size_t len, bool suffix)
+{
+	const char *name = dl->text + off;
+	struct denylist_slot *s;
+	uint64_t h = name_hash(dl, name, len), i;
+
+	if ((s = slot_find(dl, h, name, len)) != NULL) {
+		/* Listed twice, the suffix entry covers the name as well */
+		if (suffix) {
+			s->off = off;
+			dl->suffix_labels |= 1ULL << name_labels(name, len);
+		}
+
+		return;
+	}
+
+	/* The table is sized for every line, a free slot is always found */
+	for (i = (h >> 32) & dl->slot_mask; ; i = (i + 1) & dl->slot_mask) {
+		s = &dl->slots[i];
+
+		if (s->tag == 0) {
+			break;
+		}
+	}
+
+	s->off = off;
+	s->tag = slot_tag(h, len);
+	bloom_add(dl, h);
+	dl->names ++;
+
+	if (suffix) {
+		dl->suffix_labels |= 1ULL << name_labels(name, len);
+	}
+}
+
+static inline bool
+is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void
+denylist_parse(struct denylist *dl)
+{
+	char *p, *eol, *s, *e, *end = dl->text + dl->textlen;
+	bool suffix;
+
+	for (p = dl->text; p < end; p = eol + 1) {
+		/* The text ends with a newline of its own */
+		eol = memchr(p, '\n', end + 1 - p);
+
+		for (s = p; s < eol && is_space(*s); s ++);
+
+		if (s == eol || *s == '#') {
+			continue;
+		}
+
+		for (e = s; e < eol && !is_space(*e); e ++);
+
+		if (e - s > 1 && s[0] == '*' && s[1] == '.') {
+			s ++;
+		}
+
+		if ((suffix = (*s == '.'))) {
+			s ++;
+		}
+
+		/* Fully qualified names mean the same */
+		if (e - s > 1 && e[-1] == '.') {
+			e --;
+		}
+
+		if (e == s || e - s > DENYLIST_MAX_NAME || e[-1] == '.' ||
+				(suffix && name_labels(s, e - s) > DENYLIST_MAX_LABELS)) {
+			dl->invalid ++;
+			continue;
+		}
+
+		denylist_insert(dl, s - dl->text, e - s, suffix);
+	}
+}
+
+/* Zeroed memory of its own mapping, returned to the system when freed */
+static void*
+denylist_region(size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	/* Lookups touch random lines, fewer pages mean fewer TLB misses */
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+	return p;
+}
+
+static bool
+denylist_read(struct denylist *dl, int fd, char *err, size_t errlen)
+{
+	struct stat st;
+	size_t done = 0;
+	ssize_t r;
+
+	if (fstat(fd, &st) == -1) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		return false;
+	}
+
+	/* Offsets into the text are 32 bits */
+	if (st.st_size >= UINT32_MAX) {
+		snprintf(err, errlen, "file too large");
+		return false;
+	}
+
+	dl->text = xmalloc(st.st_size + 1);
+
+	while (done < (size_t)st.st_size) {
+		r = read(fd, dl->text + done, st.st_size - done);
+
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r == -1) {
+			snprintf(err, errlen, "%s", strerror(errno));
+			return false;
+		}
+		if (r == 0) {
+			/* Truncated meanwhile */
+			break;
+		}
+
+		done += r;
+	}
+
+	dl->textlen = done;
+	dl->text[done] = '\n';
+
+	return true;
+}
+
+struct denylist*
+denylist_load(const char *path, unsigned bits, char *err, size_t errlen)
+{
+	struct denylist *dl;
+	const char *p, *end;
+	uint64_t lines = 1, nblocks = 1, nslots = 16;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		return NULL;
+	}
+
+	dl = xmalloc0(sizeof(*dl));
+
+	if (!denylist_read(dl, fd, err, errlen)) {
+		close(fd);
+		denylist_free(dl);
+		return NULL;
+	}
+
+	close(fd);
+	end = dl->text + dl->textlen;
+
+	for (p = dl->text; (p = memchr(p, '\n', end - p)) != NULL; p ++) {
+		lines ++;
+	}
+
+	/* Blocks of 512 bits, slots at most 70% used */
+	while (nblocks * 512 < lines * bits) {
+		nblocks <<= 1;
+	}
+	while (nslots * 7 < lines * 10) {
+		nslots <<= 1;
+	}
+
+	dl->bloom_size = nblocks * 64;
+	dl->slots_size = nslots * sizeof(*dl->slots);
+	dl->bloom = denylist_region(dl->bloom_size);
+	dl->slots = denylist_region(dl->slots_size);
+
+	if (dl->bloom == NULL || dl->slots == NULL) {
+		snprintf(err, errlen, "cannot allocate %zu bytes",
+				dl->bloom_size + dl->slots_size);
+		denylist_free(dl);
+		return NULL;
+	}
+
+	dl->bloom_mask = nblocks - 1;
+	dl->slot_mask = nslots - 1;
+	dl->seed = mix64((uint64_t)(ev_time() * 1e6) ^ (uintptr_t)dl);
+	denylist_parse(dl);
+
+	return dl;
+}
+
+void
+denylist_free(struct denylist *dl)
+{
+	if (dl == NULL) {
+		return;
+	}
+
+	if (dl->bloom != NULL) {
+		munmap(dl->bloom, dl->bloom_size);
+	}
+	if (dl->slots != NULL) {
+		munmap(dl->slots, dl->slots_size);
+	}
+
+	free(dl->text);
+	free(dl);
+}
+
+unsigned
+denylist_names(const struct denylist *dl)
+{
+	return dl->names;
+}
+
+bool
+denylist_match(struct denylist *dl, const char *name, size_t len)
+{
+	uint64_t hashes[DENYLIST_MAX_LABELS + 1], h = 0xcbf29ce484222325ULL;
+	size_t starts[DENYLIST_MAX_LABELS + 1], i;
+	unsigned n = 0, labels = 1, j;
+
+	if (len == 0 || len > DENYLIST_MAX_NAME) {
+		return false;
+	}
+
+	for (i = len; i -- > 0;) {
+		if (name[i] == '.') {
+			/* The parent domain after this dot */
+			if (labels <= DENYLIST_MAX_LABELS &&
+					(dl->suffix_labels & (1ULL << labels))) {
+				starts[n] = i + 1;
+				hashes[n ++] = hash_final(dl, h);
+			}
+
+			labels ++;
+		}
+
+		h = hash_byte(h, name[i]);
+	}
+
+	starts[n] = 0;
+	hashes[n ++] = hash_final(dl, h);
+
+	for (j = 0; j < n; j ++) {
+		__builtin_prefetch(bloom_block(dl, hashes[j]));
+	}
+
+	for (j = 0; j < n; j ++) {
+		struct denylist_slot *s;
+
+		dl->probes ++;
+
+		if (!bloom_test(dl, hashes[j])) {
+			continue;
+		}
+
+		dl->bloom_hits ++;
+		s = slot_find(dl, hashes[j], name + starts[j], len - starts[j]);
+
+		/* Parent domains are only denied by suffix entries */
+		if (s != NULL && (starts[j] == 0 || slot_suffix(dl, s))) {
+			return true;
+		}
+
+		dl->false_hits ++;
+	}
+
+	return false;
+}
+
+static void*
+denylist_free_thread(void *arg)
+{
+	denylist_free(arg);
+
+	return NULL;
+}
+
+/* Runs `fn` in a detached thread that takes no signals */
+static bool
+denylist_thread(void *(*fn)(void *), void *arg)
+{
+	sigset_t all, old;
+	pthread_t th;
+	int r;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	r = pthread_create(&th, NULL, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (r != 0) {
+		fprintf(stderr, "denylist: cannot start a thread: %s\n", strerror(r));
+		return false;
+	}
+
+	pthread_detach(th);
+
+	return true;
+}
+
+/* Unmapping hundreds of megabytes takes a while, keep it off the loop */
+static void
+denylist_release(struct denylist *dl)
+{
+	if (dl == NULL) {
+		return;
+	}
+
+	deny.probes += dl->probes;
+	deny.bloom_hits += dl->bloom_hits;
+	deny.false_hits += dl->false_hits;
+
+	if (!denylist_thread(denylist_free_thread, dl)) {
+		denylist_free(dl);
+	}
+}
+
+static void
+denylist_loaded(const char *path, struct denylist *dl, ev_tstamp elapsed)
+{
+	fprintf(stderr, "denylist: loaded %u names from %s in %.2fs",
+			dl->names, path, elapsed);
+
+	if (dl->invalid > 0) {
+		fprintf(stderr, ", skipped %u invalid lines", dl->invalid);
+	}
+
+	fprintf(stderr, "\n");
+}
+
+static void
+denylist_install(struct ev_loop *loop, void *arg)
+{
+	struct denylist_job *job = arg;
+
+	deny.building = false;
+
+	if (job->dl == NULL) {
+		deny.failures ++;
+		fprintf(stderr, "denylist: cannot load %s: %s, keeping the current "
+				"list\n", job->path, job->err);
+	}
+	else if (deny.path == NULL || strcmp(deny.path, job->path) != 0) {
+		/* Dropped or moved while loading */
+		denylist_release(job->dl);
+	}
+	else {
+		denylist_loaded(job->path, job->dl, job->finished - job->started);
+		denylist_release(deny.cur);
+		deny.cur = job->dl;
+		deny.reloads ++;
+	}
+
+	free(job->path);
+	free(job);
+
+	if (deny.pending && deny.path != NULL) {
+		deny.pending = false;
+		denylist_build();
+	}
+}
+
+static void*
+denylist_build_thread(void *arg)
+{
+	struct denylist_job *job = arg;
+
+	job->dl = denylist_load(job->path, job->bits, job->err, sizeof(job->err));
+	job->finished = ev_time();
+	cmdq_push(job->cmdq, denylist_install, job);
+
+	return NULL;
+}
+
+/* Loads the file in the background, once more if asked again meanwhile */
+static void
+denylist_build(void)
+{
+	struct denylist_job *job;
+
+	if (deny.building) {
+		deny.pending = true;
+		return;
+	}
+
+	job = xmalloc0(sizeof(*job));
+	job->path = strdup(deny.path);
+	job->bits = deny.bits;
+	job->cmdq = deny.worker->cmdq;
+	job->started = ev_time();
+
+	if (!denylist_thread(denylist_build_thread, job)) {
+		deny.failures ++;
+		free(job->path);
+		free(job);
+		return;
+	}
+
+	deny.building = true;
+}
+
+static void
+denylist_settle_cb(EV_P_ ev_timer *w, int revents)
+{
+	ev_timer_stop(loop, w);
+	denylist_build();
+}
+
+static void
+denylist_stat_cb(EV_P_ ev_stat *w, int revents)
+{
+	/* Restarted on every change until the writer is done */
+	ev_timer_again(loop, &deny.settle);
+}
+
+static void
+denylist_watch(void)
+{
+	struct ev_loop *loop = deny.worker->loop;
+
+	ev_stat_stop(loop, &deny.stat);
+	ev_timer_stop(loop, &deny.settle);
+
+	if (deny.path != NULL) {
+		ev_stat_set(&deny.stat, deny.path, 0.);
+		ev_stat_start(loop, &deny.stat);
+	}
+}
+
+static void
+denylist_unstage(void)
+{
+	free(staged.path);
+	denylist_free(staged.dl);
+	memset(&staged, 0, sizeof(staged));
+}
+
+bool
+denylist_configure(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt;
+	const char *path;
+	unsigned bits = default_bloom_bits;
+	char err[256];
+	ev_tstamp started;
+
+	denylist_unstage();
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "file");
+
+	if (elt == NULL || ucl_object_type(elt) != UCL_STRING) {
+		fprintf(stderr, "denylist needs a file\n");
+		return false;
+	}
+
+	path = ucl_object_tostring(elt);
+	elt = ucl_object_find_key(cfg, "bloom_bits");
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) < 1 || ucl_object_toint(elt) > 64) {
+			fprintf(stderr, "invalid denylist bloom_bits: %lld\n",
+					(long long)ucl_object_toint(elt));
+			return false;
+		}
+
+		bits = ucl_object_toint(elt);
+	}
+
+	if (deny.worker == NULL) {
+		/* Not serving yet: a list that cannot be loaded fails the start */
+		started = ev_time();
+		staged.dl = denylist_load(path, bits, err, sizeof(err));
+
+		if (staged.dl == NULL) {
+			fprintf(stderr, "cannot load denylist %s: %s\n", path, err);
+			return false;
+		}
+
+		denylist_loaded(path, staged.dl, ev_time() - started);
+	}
+
+	staged.path = strdup(path);
+	staged.bits = bits;
+
+	return true;
+}
+
+void
+denylist_commit(bool apply)
+{
+	if (!apply) {
+		denylist_unstage();
+		return;
+	}
+
+	if (staged.path == NULL) {
+		if (deny.worker != NULL) {
+			ev_stat_stop(deny.worker->loop, &deny.stat);
+		}
+
+		free(deny.path);
+		deny.path = NULL;
+
+		if (deny.worker != NULL) {
+			denylist_watch();
+			denylist_release(deny.cur);
+		}
+		else {
+			denylist_free(deny.cur);
+		}
+
+		deny.cur = NULL;
+	}
+	else if (deny.worker == NULL) {
+		denylist_free(deny.cur);
+		deny.cur = staged.dl;
+		free(deny.path);
+		deny.path = staged.path;
+		deny.bits = staged.bits;
+		staged.dl = NULL;
+		staged.path = NULL;
+	}
+	else {
+		deny.bits = staged.bits;
+
+		/* The watcher keeps a pointer to the path */
+		if (deny.path == NULL || strcmp(deny.path, staged.path) != 0) {
+			ev_stat_stop(deny.worker->loop, &deny.stat);
+			free(deny.path);
+			deny.path = staged.path;
+			staged.path = NULL;
+			denylist_watch();
+		}
+
+		/* Reloading the configuration reloads the list as well */
+		denylist_build();
+	}
+
+	denylist_unstage();
+}
+
+void
+denylist_start(struct sni_worker *worker)
+{
+	deny.worker = worker;
+	ev_stat_init(&deny.stat, denylist_stat_cb, "", 0.);
+	ev_init(&deny.settle, denylist_settle_cb);
+	deny.settle.repeat = settle_delay;
+	denylist_watch();
+}
+
+bool
+denylist_session(struct ssl_session *ssl)
+{
+	if (deny.cur == NULL || ssl->hostname == NULL) {
+		return false;
+	}
+
+	deny.checked ++;
+
+	if (!denylist_match(deny.cur, ssl->hostname, ssl->hostlen)) {
+		return false;
+	}
+
+	deny.denied ++;
+
+	return true;
+}
+
+ucl_object_t*
+denylist_to_ucl(void)
+{
+	ucl_object_t *top;
+	struct denylist *dl = deny.cur;
+
+	if (dl == NULL) {
+		return NULL;
+	}
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, ucl_object_fromint(dl->names),
+			"names", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(deny.checked),
+			"checked", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(deny.denied),
+			"denied", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(deny.probes + dl->probes),
+			"probes", 0, false);
+	ucl_object_insert_key(top,
+			ucl_object_fromint(deny.bloom_hits + dl->bloom_hits),
+			"bloom_hits", 0, false);
+	ucl_object_insert_key(top,
+			ucl_object_fromint(deny.false_hits + dl->false_hits),
+			"false_hits", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(deny.reloads),
+			"reloads", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(deny.failures),
+			"failures", 0, false);
+
+	return top;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_DENYLIST_H_
+#define SRC_DENYLIST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ucl.h"
+
+struct ssl_session;
+struct sni_worker;
+struct denylist;
+
+/*
+ * Reads the `denylist` section `cfg`, NULL drops the list once
+ * denylist_commit() installs it. The first list is loaded right away and a
+ * broken one fails the configuration; once started, the list is reloaded in
+ * the background and a broken file keeps the list that is in use.
+ */
+bool denylist_configure(const ucl_object_t *cfg);
+/* Installs the section read last if `apply`, drops it otherwise */
+void denylist_commit(bool apply);
+
+/* Watches the file and installs reloaded lists on the loop of `worker` */
+void denylist_start(struct sni_worker *worker);
+
+/* True if the SNI name of the session is denied */
+bool denylist_session(struct ssl_session *ssl);
+
+/* Counters, NULL without a list */
+ucl_object_t *denylist_to_ucl(void);
+
+/*
+ * Loads the names of `path` with `bits` of Bloom filter per name, or fills
+ * `err` and returns NULL. Safe to call from any thread.
+ */
+struct denylist *denylist_load(const char *path, unsigned bits, char *err,
+		size_t errlen);
+void denylist_free(struct denylist *dl);
+unsigned denylist_names(const struct denylist *dl);
+/* True if `name` or one of its parent domains listed as such is denied */
+bool denylist_match(struct denylist *dl, const char *name, size_t len);
+
+#endif /* SRC_DENYLIST_H_ */
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Limits for sessions that have not sent their ClientHello yet: such a
+ * session costs a descriptor and memory for nothing, and a client trickling
+ * bytes or just holding connections open can take thousands of them.
+ *
+ * Greetings in progress are counted per client address (per /64 for IPv6)
+ * in a fixed table of small buckets, a client at the limit is refused. When
+ * its bucket has no free slot a client is let through: whoever fills the
+ * table has many addresses anyway. Partial ClientHellos must arrive
+ * at some minimal rate, and deadlines shrink as greetings pile up.
+ *
+ * Only the accepting loop has sessions in the greeting phase.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "greeting.h"
+#include "sni-private.h"
+
+#define GREETING_BUCKETS 4096
+#define GREETING_WAYS 4
+
+/* Clients behind a NAT share an address, per client limits are opt-in */
+static const unsigned default_max_per_client = 0;
+static const double default_min_rate = 0;
+static const unsigned default_busy = 1024;
+static const double default_min_timeout = 0.2;
+/* Time a client gets before its rate counts */
+static const double rate_grace = 0.25;
+
+struct greeting_slot {
+	uint64_t key;
+	uint16_t count;
+	uint8_t family;
+};
+
+static struct {
+	unsigned max_per_client;
+	double min_rate;
+	unsigned busy;
+	double min_timeout;
+	uint64_t seed;
+	unsigned active;
+	/* Counters */
+	uint64_t started;
+	uint64_t rejected_client;
+	uint64_t rejected_slow;
+	uint64_t timed_out;
+	uint64_t shortened;
+	uint64_t table_full;
+	struct greeting_slot table[GREETING_BUCKETS][GREETING_WAYS];
+} greeting;
+
+/* Read by greeting_configure(), installed by greeting_commit() */
+static struct {
+	unsigned max_per_client;
+	double min_rate;
+	unsigned busy;
+	double min_timeout;
+} staged;
+
+static uint64_t
+greeting_key(const struct ssl_session *ssl)
+{
+	uint64_t key = 0;
+
+	if (ssl->peer.sa.sa_family == AF_INET) {
+		memcpy(&key, &ssl->peer.sin.sin_addr, 4);
+	}
+	else if (ssl->peer.sa.sa_family == AF_INET6) {
+		memcpy(&key, &ssl->peer.sin6.sin6_addr, 8);
+	}
+
+	return key;
+}
+
+static struct greeting_slot*
+greeting_bucket(uint64_t key, uint8_t family)
+{
+	uint64_t h = key ^ greeting.seed ^ ((uint64_t)family << 56);
+
+	/* splitmix64 finalizer */
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return greeting.table[h & (GREETING_BUCKETS - 1)];
+}
+
+/* The slot of the client, a free one if `create`, or NULL */
+static struct greeting_slot*
+greeting_slot(const struct ssl_session *ssl, bool create)
+{
+	struct greeting_slot *b, *free_slot = NULL;
+	uint64_t key = greeting_key(ssl);
+	uint8_t family = ssl->peer.sa.sa_family;
+	unsigned i;
+
+	b = greeting_bucket(key, family);
+
+	for (i = 0; i < GREETING_WAYS; i ++) {
+		if (b[i].count == 0) {
+			if (free_slot == NULL) {
+				free_slot = &b[i];
+			}
+		}
+		else if (b[i].key == key && b[i].family == family) {
+			return &b[i];
+		}
+	}
+
+	if (create && free_slot != NULL) {
+		free_slot->key = key;
+		free_slot->family = family;
+
+		return free_slot;
+	}
+
+	return NULL;
+}
+
+static void
+greeting_seed(void)
+{
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1 || read(fd, &greeting.seed, sizeof(greeting.seed)) !=
+			sizeof(greeting.seed)) {
+		greeting.seed = (uint64_t)(ev_time() * 1e6) ^ getpid();
+	}
+
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+bool
+greeting_configure(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt;
+	int64_t n;
+
+	if (greeting.seed == 0) {
+		greeting_seed();
+	}
+
+	staged.max_per_client = default_max_per_client;
+	staged.min_rate = default_min_rate;
+	staged.busy = default_busy;
+	staged.min_timeout = default_min_timeout;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "max_per_client");
+
+	if (elt != NULL) {
+		n = ucl_object_toint(elt);
+
+		/* Slot counters are 16 bits */
+		if (n < 0 || n > UINT16_MAX) {
+			fprintf(stderr, "invalid greeting max_per_client: %lld\n",
+					(long long)n);
+			return false;
+		}
+
+		staged.max_per_client = n;
+	}
+
+	elt = ucl_object_find_key(cfg, "min_rate");
+
+	if (elt != NULL) {
+		staged.min_rate = ucl_object_todouble(elt);
+
+		if (staged.min_rate < 0) {
+			fprintf(stderr, "invalid greeting min_rate: %f\n",
+					staged.min_rate);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "busy");
+
+	if (elt != NULL) {
+		n = ucl_object_toint(elt);
+
+		if (n <= 0 || n > UINT32_MAX) {
+			fprintf(stderr, "invalid greeting busy: %lld\n", (long long)n);
+			return false;
+		}
+
+		staged.busy = n;
+	}
+
+	elt = ucl_object_find_key(cfg, "min_timeout");
+
+	if (elt != NULL) {
+		staged.min_timeout = ucl_object_todouble(elt);
+
+		if (staged.min_timeout <= 0) {
+			fprintf(stderr, "invalid greeting min_timeout: %f\n",
+					staged.min_timeout);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void
+greeting_commit(bool apply)
+{
+	if (apply) {
+		greeting.max_per_client = staged.max_per_client;
+		greeting.min_rate = staged.min_rate;
+		greeting.busy = staged.busy;
+		greeting.min_timeout = staged.min_timeout;
+	}
+}
+
+bool
+greeting_start(struct ssl_session *ssl, ev_tstamp base, ev_tstamp *timeout)
+{
+	struct greeting_slot *slot;
+
+	slot = greeting_slot(ssl, true);
+
+	if (slot == NULL) {
+		greeting.table_full ++;
+	}
+	else if (greeting.max_per_client > 0 &&
+			slot->count >= greeting.max_per_client) {
+		greeting.rejected_client ++;
+		return false;
+	}
+	else if (slot->count < UINT16_MAX) {
+		slot->count ++;
+		ssl->greeting_counted = true;
+	}
+
+	greeting.started ++;
+	greeting.active ++;
+	ssl->greeting = true;
+	*timeout = base;
+
+	/* With twice the usual greetings, each gets half the time */
+	if (greeting.active > greeting.busy) {
+		*timeout = base * greeting.busy / greeting.active;
+
+		if (*timeout < greeting.min_timeout) {
+			*timeout = MIN(greeting.min_timeout, base);
+		}
+
+		greeting.shortened ++;
+	}
+
+	return true;
+}
+
+bool
+greeting_progress(struct ssl_session *ssl, int len)
+{
+	double elapsed = ev_now(ssl->loop) - ssl->started;
+
+	if (greeting.min_rate > 0 && elapsed > rate_grace &&
+			len < greeting.min_rate * elapsed) {
+		greeting.rejected_slow ++;
+		return false;
+	}
+
+	return true;
+}
+
+void
+greeting_done(struct ssl_session *ssl)
+{
+	struct greeting_slot *slot;
+
+	if (!ssl->greeting) {
+		return;
+	}
+
+	ssl->greeting = false;
+	greeting.active --;
+
+	/*
+	 * Uncounted when the table was full or the slot saturated, another
+	 * session of the client may have taken a slot since
+	 */
+	if (!ssl->greeting_counted) {
+		return;
+	}
+
+	ssl->greeting_counted = false;
+	slot = greeting_slot(ssl, false);
+
+	if (slot != NULL) {
+		slot->count --;
+	}
+}
+
+void
+greeting_timed_out(void)
+{
+	greeting.timed_out ++;
+}
+
+ucl_object_t*
+greeting_to_ucl(void)
+{
+	ucl_object_t *top;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, ucl_object_fromint(greeting.active),
+			"active", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(greeting.started),
+			"started", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(greeting.rejected_client),
+			"rejected_per_client", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(greeting.rejected_slow),
+			"rejected_slow", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(greeting.timed_out),
+			"timed_out", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(greeting.shortened),
+			"shortened", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(greeting.table_full),
+			"table_full", 0, false);
+
+	return top;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_GREETING_H_
+#define SRC_GREETING_H_
+
+#include <stdbool.h>
+
+#include "ev.h"
+#include "ucl.h"
+
+struct ssl_session;
+
+/*
+ * Reads the limits of the `greeting` section `cfg`, NULL stands for the
+ * defaults. Called on the main loop, at startup and on reload; nothing is
+ * in effect before greeting_commit().
+ */
+bool greeting_configure(const ucl_object_t *cfg);
+/* Installs the limits read last if `apply`, keeps the current ones otherwise */
+void greeting_commit(bool apply);
+
+/*
+ * Counts a new session as a greeting of its client. Returns false if the
+ * client has too many greetings in progress already; otherwise `*timeout`
+ * is the greeting deadline, `base` or less when many greetings are pending.
+ */
+bool greeting_start(struct ssl_session *ssl, ev_tstamp base,
+		ev_tstamp *timeout);
+
+/* False if `len` bytes of a partial ClientHello came too slowly */
+bool greeting_progress(struct ssl_session *ssl, int len);
+
+/* The session has left the greeting phase, called more than once is fine */
+void greeting_done(struct ssl_session *ssl);
+
+void greeting_timed_out(void);
+
+/* Counters of the greeting limits */
+ucl_object_t *greeting_to_ucl(void);
+
+#endif /* SRC_GREETING_H_ */
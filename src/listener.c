@@ -27,10 +27,13 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <ifaddrs.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -38,14 +41,22 @@
 #include "ucl.h"
 #include "util.h"
 #include "ringbuf.h"
+#include "tls.h"
+#include "stats.h"
+#include "sockopts.h"
+#include "tcpinfo.h"
+#include "sklookup.h"
+#include "accesslog.h"
+#include "cmdq.h"
+#include "greeting.h"
+#include "ratelimit.h"
+#include "denylist.h"
+#include "cidr.h"
+#include "shaper.h"
+#include "scheduler.h"
+#include "mirror.h"
 #include "sni-private.h"
 
-#if defined(__GNUC__)
-#  define _PACKED __attribute__ ((packed))
-#else
-#  define _PACKED
-#endif
-
 #if !defined(__GNUC__)
 #  ifdef __IBMC__
 #    pragma pack(1)
@@ -54,31 +65,10 @@
 #  endif
 #endif
 
-static const unsigned char tls_magic[3] = {0x16, 0x3, 0x1};
-static const unsigned int tls_greeting = 0x1;
-static const unsigned int sni_type = 0x0;
-static const unsigned int sni_host = 0x0;
 static const unsigned int tls_alert = 0x15;
 static const unsigned int tls_alert_level = 0x2;
 static const unsigned int tls_alert_description = 0x28;
 
-struct ssl_header {
-	uint8_t tls_type;
-	uint8_t ssl_version[2]; /* 3 bytes of magic we'd expect */
-	uint8_t len[2];
-	uint8_t type;
-	uint8_t greeting_len[3];
-	uint16_t tls_version;
-	uint8_t random[32];
-} _PACKED;
-
-struct sni_ext {
-	uint8_t slen[2];
-	uint8_t type;
-	uint8_t hlen[2];
-	uint8_t host[1]; /* Extended */
-} _PACKED;
-
 struct ssl_alert {
 	uint8_t type;
 	uint8_t version[2];
@@ -87,27 +77,183 @@ struct ssl_alert {
 	uint8_t description;
 } _PACKED;
 
+#if defined(__linux__) && !defined(SO_ORIGINAL_DST)
+/* linux/netfilter_ipv4.h, the same value for IPv6 */
+#define SO_ORIGINAL_DST 80
+#endif
+
 extern int buflen;
+extern bool spoof_source;
+extern int backend_mark;
+extern unsigned fd_headroom;
 extern void proxy_create(struct ssl_session *s);
 
-static inline unsigned int
-int_3byte_be(const unsigned char *p) {
-	return
-	(((unsigned int)(p[2])      ) |
-	 ((unsigned int)(p[1]) <<  8) |
-	 ((unsigned int)(p[0]) << 16));
+/* Addresses of this host, transparent sessions must not loop back to us */
+static struct ifaddrs *local_addrs = NULL;
+
+/* One TLS record, the ClientHello must fit in it */
+static const int greeting_max = 16384 + 5;
+static const double fd_backoff_min = 0.01;
+static const double fd_backoff_max = 1.0;
+
+/*
+ * Descriptors: every session may need two, the client and the backend, so
+ * new clients are only accepted while both fit under the limit. When accept
+ * fails anyway, the spare descriptor is given up to accept and drop one
+ * client, and accepting pauses for a while.
+ */
+static struct {
+	rlim_t limit;
+	int spare;
+	/* Sessions of all threads, from accept to terminate_session */
+	unsigned sessions;
+	double backoff;
+	ev_timer timer;
+} fds = {
+	.spare = -1
+};
+
+static void
+listener_unref(struct sni_listener *l)
+{
+	if (-- l->refs == 0) {
+		listener_free(l);
+	}
+}
+
+void
+session_attach(struct sni_worker *worker, struct ssl_session *ssl)
+{
+	ssl->worker = worker;
+	ssl->loop = worker->loop;
+	ssl->prev = NULL;
+	ssl->next = worker->sessions;
+
+	if (worker->sessions) {
+		worker->sessions->prev = ssl;
+	}
+
+	worker->sessions = ssl;
+	/* Read by the accepting thread to choose a relay */
+	__atomic_add_fetch(&worker->nsessions, 1, __ATOMIC_RELAXED);
+}
+
+static void
+session_link(struct sni_listener *l, struct ssl_session *ssl)
+{
+	struct sni_worker *worker = l->worker;
+
+	ssl->listener = l;
+	l->refs ++;
+	ssl->id = ((uint64_t)worker->id << 48) | ++ worker->next_session_id;
+	session_attach(worker, ssl);
+}
+
+void
+session_unlink(struct ssl_session *ssl)
+{
+	struct sni_worker *worker = ssl->worker;
+
+	if (worker == NULL) {
+		return;
+	}
+
+	tcpinfo_session_unlink(ssl);
+	sched_cancel(ssl);
+
+	if (ssl->prev) {
+		ssl->prev->next = ssl->next;
+	}
+	else {
+		worker->sessions = ssl->next;
+	}
+
+	if (ssl->next) {
+		ssl->next->prev = ssl->prev;
+	}
+
+	__atomic_sub_fetch(&worker->nsessions, 1, __ATOMIC_RELAXED);
+}
+
+/* The listener and the route are only released by their own worker */
+static void
+session_free(struct ev_loop *loop, void *arg)
+{
+	struct ssl_session *ssl = arg;
+
+	if (ssl->bk) {
+		ucl_object_unref(ssl->bk);
+	}
+
+	if (ssl->listener) {
+		listener_unref(ssl->listener);
+	}
+
+	shaper_session_free(ssl);
+	free(ssl);
+}
+
+void
+sockaddr_str(const union sni_sockaddr *sa, char *buf, size_t len)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	switch (sa->sa.sa_family) {
+	case AF_INET:
+		inet_ntop(AF_INET, &sa->sin.sin_addr, addr, sizeof(addr));
+		snprintf(buf, len, "%s:%d", addr, ntohs(sa->sin.sin_port));
+		break;
+	case AF_INET6:
+		inet_ntop(AF_INET6, &sa->sin6.sin6_addr, addr, sizeof(addr));
+		snprintf(buf, len, "[%s]:%d", addr, ntohs(sa->sin6.sin6_port));
+		break;
+	default:
+		snprintf(buf, len, "-");
+		break;
+	}
+}
+
+void
+session_peer_str(const struct ssl_session *ssl, char *buf, size_t len)
+{
+	sockaddr_str(&ssl->peer, buf, len);
 }
 
-static inline unsigned int
-int_2byte_be(const unsigned char *p) {
-	return
-	(((unsigned int)(p[1])      ) |
-	 ((unsigned int)(p[0]) <<  8));
+/* Names are not checked by the parser, they must not break lines or fields */
+void
+session_name_str(const struct ssl_session *ssl, char *buf, size_t len)
+{
+	unsigned char c;
+	size_t i, o = 0;
+
+	if (ssl->hostname == NULL) {
+		snprintf(buf, len, "-");
+		return;
+	}
+
+	for (i = 0; i < ssl->hostlen && o + 5 <= len; i ++) {
+		c = ssl->hostname[i];
+
+		if (c > ' ' && c < 0x7f && c != '\\') {
+			buf[o ++] = c;
+		}
+		else {
+			o += snprintf(buf + o, len - o, "\\x%02x", c);
+		}
+	}
+
+	buf[o] = '\0';
 }
 
 void
 terminate_session(struct ssl_session *ssl)
 {
+	greeting_done(ssl);
+	tcpinfo_session_close(ssl);
+	accesslog_session(ssl);
+	mirror_session_close(ssl);
+	session_unlink(ssl);
+
 	if (ssl->fd != -1) {
 		ev_io_stop(ssl->loop, &ssl->io);
 		close(ssl->fd);
@@ -116,12 +262,27 @@ terminate_session(struct ssl_session *ssl)
 		ev_io_stop(ssl->loop, &ssl->bk_io);
 		close(ssl->bk_fd);
 	}
+
+	__atomic_sub_fetch(&fds.sessions, 1, __ATOMIC_RELAXED);
 	ev_timer_stop(ssl->loop, &ssl->tm);
+	ev_timer_stop(ssl->loop, &ssl->shape_tm);
+
+	if (ssl->src) {
+		__atomic_sub_fetch(&ssl->src->active, 1, __ATOMIC_RELAXED);
+	}
+
 	free(ssl->hostname);
 	free(ssl->saved_buf);
+	free(ssl->tcpi);
 	ringbuf_destroy(ssl->bk2cl);
 	ringbuf_destroy(ssl->cl2bk);
-	free(ssl);
+
+	if (ssl->listener && ssl->listener->worker != ssl->worker) {
+		cmdq_push(ssl->listener->worker->cmdq, session_free, ssl);
+	}
+	else {
+		session_free(ssl->loop, ssl);
+	}
 }
 
 static void
@@ -130,6 +291,8 @@ alert_cb(EV_P_ ev_io *w, int revents)
 	struct ssl_alert alert;
 	struct ssl_session *ssl = w->data;
 
+	stats_cb(loop, stats_cb_alert);
+
 	if (ssl->state == ssl_state_alert) {
 		alert.type = tls_alert;
 		memcpy (alert.version, ssl->ssl_version, 2);
@@ -158,265 +321,722 @@ backend_connect_cb(EV_P_ ev_io *w, int revents)
 {
 	struct ssl_session *ssl = w->data;
 
+	stats_cb(loop, stats_cb_connect);
 	ev_io_stop(ssl->loop, &ssl->bk_io);
 	//printf("connected to hostname: %s\n", ssl->hostname);
 	ssl->cl2bk = ringbuf_create(buflen, ssl->saved_buf, ssl->buflen);
 	ssl->bk2cl = ringbuf_create(buflen, NULL, 0);
+	mirror_session_open(ssl);
 	proxy_create(ssl);
 }
 
-static void
-connect_backend(struct ssl_session *ssl, const struct addrinfo *ai)
+static int
+set_transparent(int sock, int af, int on)
 {
-	int sock, ofl;
-
-	/* TODO: Need upstreams support here */
-	sock = socket(ai->ai_family, SOCK_STREAM, 0);
-
-	if (sock == -1) {
-		goto err;
+#if defined(IP_TRANSPARENT) && defined(IPV6_TRANSPARENT)
+	if (af == AF_INET6) {
+		return setsockopt(sock, IPPROTO_IPV6, IPV6_TRANSPARENT, &on,
+				sizeof(on));
 	}
 
-	if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
-		close(sock);
-
-		goto err;
-	}
+	return setsockopt(sock, IPPROTO_IP, IP_TRANSPARENT, &on, sizeof(on));
+#else
+	errno = ENOTSUP;
 
-	ofl = fcntl(sock, F_GETFL, 0);
+	return -1;
+#endif
+}
 
-	if (fcntl(sock, F_SETFL, ofl | O_NONBLOCK) == -1) {
-		close(sock);
+static bool
+spoofing(const struct ssl_session *ssl, int af)
+{
+	/* IPv6 clients of IPv4 backends and vice versa keep our address */
+	return __atomic_load_n(&spoof_source, __ATOMIC_RELAXED) &&
+			ssl->peer.sa.sa_family == af;
+}
 
-		goto err;
+/*
+ * Sets the routing mark and binds a backend socket either to the client
+ * address, so that the backend sees the real client, or to `pool_src`
+ */
+static bool
+backend_source(struct ssl_session *ssl, int sock, int af,
+		const struct source_addr *pool_src)
+{
+	union sni_sockaddr src;
+	socklen_t slen;
+	int on = 1;
+#ifdef SO_MARK
+	int mark;
+
+	/* Stored by the main thread on reload */
+	mark = __atomic_load_n(&backend_mark, __ATOMIC_RELAXED);
+
+	if (mark != 0 && setsockopt(sock, SOL_SOCKET, SO_MARK,
+			&mark, sizeof(mark)) == -1) {
+		fprintf(stderr, "cannot set SO_MARK: %s\n", strerror(errno));
+		return false;
 	}
+#endif
 
-	while (connect (sock, ai->ai_addr, ai->ai_addrlen) == -1) {
-
-		if (errno == EINTR) {
-			continue;
+	if (!spoofing(ssl, af)) {
+		if (pool_src == NULL || pool_src->sa.sa.sa_family == AF_UNSPEC) {
+			return true;
 		}
 
-		if (errno != EINPROGRESS) {
-			close(sock);
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		/* Pick the port at connect, then it only has to be free per 4-tuple */
+		setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+		slen = af == AF_INET6 ? sizeof(src.sin6) : sizeof(src.sin);
 
-			goto err;
-		}
-		else {
-			break;
+		if (bind(sock, &pool_src->sa.sa, slen) == -1) {
+			fprintf(stderr, "cannot bind to source address: %s\n",
+					strerror(errno));
+			return false;
 		}
+
+		return true;
 	}
 
-	ssl->bk_fd = sock;
-	ssl->state = ssl_state_backend_ready;
+	memcpy(&src, &ssl->peer, sizeof(src));
 
-	ssl->bk_io.data = ssl;
-	ev_io_init(&ssl->bk_io, backend_connect_cb, sock, EV_WRITE);
-	ev_io_start(ssl->loop, &ssl->bk_io);
+	if (af == AF_INET6) {
+		src.sin6.sin6_port = 0;
+		slen = sizeof(src.sin6);
+	}
+	else {
+		src.sin.sin_port = 0;
+		slen = sizeof(src.sin);
+	}
 
-	return;
+	if (set_transparent(sock, af, 1) == -1 ||
+			bind(sock, &src.sa, slen) == -1) {
+		fprintf(stderr, "cannot bind to client address: %s\n",
+				strerror(errno));
+		return false;
+	}
 
-err:
-	send_alert(ssl);
+	return true;
 }
 
 static int
-parse_extension(struct ssl_session *ssl, const unsigned char *pos, int remain)
+backend_socket(struct ssl_session *ssl, const struct addrinfo *ai,
+		const struct source_addr *src)
 {
-	unsigned int tlen, type, hlen;
-	const struct sni_ext *sni;
+	const struct sockopt_profile *so = NULL;
+	int sock, ofl;
+
+	sock = socket(ai->ai_family, SOCK_STREAM, 0);
 
-	if (remain < 0) {
+	if (sock == -1) {
 		return -1;
 	}
-	if (remain < 4) {
-		return 0;
+
+	if (ssl->bk != NULL) {
+		so = backend_sockopts(ssl->bk, false);
+	}
+
+	/* Before connect, buffer sizes affect the window scale */
+	if (so != NULL && !sockopts_apply(sock, ai->ai_family, so, NULL)) {
+		fprintf(stderr, "cannot set socket options for backend %s: %s\n",
+				ucl_object_key(ssl->bk), strerror(errno));
 	}
 
-	type = int_2byte_be(pos);
-	tlen = int_2byte_be(pos + 2);
+	if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
+		close(sock);
 
-	if (tlen > remain) {
 		return -1;
 	}
 
-	if (type == sni_type) {
-		if (tlen < sizeof(*sni)) {
-			return -1;
-		}
+	ofl = fcntl(sock, F_GETFL, 0);
 
-		sni = (const struct sni_ext *)(pos + 4);
-		if (int_2byte_be(sni->slen) != tlen - 2 ||
-			sni->type != sni_host ||
-			int_2byte_be(sni->hlen) != tlen - 5) {
-			return -1;
-		}
+	if (fcntl(sock, F_SETFL, ofl | O_NONBLOCK) == -1) {
+		close(sock);
 
-		hlen = int_2byte_be(sni->hlen);
-		ssl->hostname = xmalloc(hlen + 1);
-		memcpy(ssl->hostname, sni->host, hlen);
-		ssl->hostlen = hlen;
-		ssl->hostname[hlen] = '\0';
+		return -1;
+	}
+
+	if (ai->ai_family != AF_UNIX &&
+			!backend_source(ssl, sock, ai->ai_family, src)) {
+		close(sock);
+
+		return -1;
 	}
 
-	return tlen + 4;
+	return sock;
 }
 
 static void
-parse_ssl_greeting(struct ssl_session *ssl, const unsigned char *buf, int len)
+source_exhausted(struct ssl_session *ssl, struct source_pool *pool)
 {
-	const unsigned char *p = buf;
-	int remain = len, ret;
-	unsigned int tlen;
-	const struct ssl_header *sslh;
-	const ucl_object_t *bk = NULL, *sa = NULL;
-
-	ev_io_stop(ssl->loop, &ssl->io);
+	ev_tstamp now = ev_now(ssl->loop);
 
-	if (len <= sizeof(struct ssl_header)) {
-		send_alert(ssl);
-		return;
+	/* Once a second is enough when every connect fails */
+	if (now - pool->last_warn >= 1.0) {
+		pool->last_warn = now;
+		fprintf(stderr, "no free source ports for backend %s, %u source "
+				"addresses in use\n", ucl_object_key(ssl->bk), pool->naddrs);
 	}
+}
 
-	sslh = (const struct ssl_header *)p;
-	memcpy (ssl->ssl_version, sslh->ssl_version, 2);
+static void
+fds_exhausted(struct ssl_session *ssl)
+{
+	static __thread ev_tstamp last_warn;
+	ev_tstamp now = ev_now(ssl->loop);
 
-	/* Not an SSL packet */
-	if (memcmp(&sslh->tls_type, tls_magic, sizeof(tls_magic)) != 0 ||
-		sslh->type != tls_greeting ||
-		int_2byte_be(sslh->len) != len - 5 ||
-		int_3byte_be(sslh->greeting_len) != len - 5 - 4) {
-		goto err;
+	if (now - last_warn >= 1.0) {
+		last_warn = now;
+		fprintf(stderr, "no descriptor for backend connect: %s, "
+				"fd_headroom may be too low\n", strerror(errno));
 	}
+}
 
-	p = p + sizeof(*sslh);
-	remain -= sizeof(*sslh);
+static void
+connect_backend(struct ssl_session *ssl, const struct addrinfo *ai)
+{
+	struct source_pool *pool = NULL;
+	struct source_addr *src = NULL;
+	unsigned tries = 1, i;
+	int sock = -1, r;
 
-	/* Session id */
-	tlen = *p;
-	if (tlen >= remain + 4) {
-		goto err;
+	if (ssl->bk != NULL && !spoofing(ssl, ai->ai_family)) {
+		pool = backend_pool(ssl->bk);
 	}
-	p = p + tlen + 1;
-	remain -= tlen + 1;
 
-	/* Cipher suite */
-	tlen = int_2byte_be(p);
-	if (tlen >= remain + 4) {
-		goto err;
+	if (pool != NULL) {
+		tries = pool->naddrs;
 	}
-	p = p + tlen + 2;
-	remain -= tlen + 2;
 
-	/* Compression methods */
-	tlen = *p;
-	if (tlen >= remain + 4) {
-		goto err;
-	}
-	p = p + tlen + 1;
-	remain -= tlen + 1;
+	/* Every source address has its own ports, try them all before failing */
+	for (i = 0; i < tries; i ++) {
+		if (pool != NULL) {
+			/* Relay threads share the pool */
+			src = &pool->addrs[__atomic_fetch_add(&pool->next, 1,
+					__ATOMIC_RELAXED) % pool->naddrs];
+		}
 
-	/* Now extensions */
-	tlen = int_2byte_be(p);
-	if (tlen > remain) {
-		goto err;
-	}
+		sock = backend_socket(ssl, ai, src);
 
-	p += 2;
-	remain -= 2;
+		if (sock == -1) {
+			if (errno == EMFILE || errno == ENFILE) {
+				fds_exhausted(ssl);
+			}
+			goto err;
+		}
 
-	while ((ret = parse_extension(ssl, p, remain)) > 0) {
-		p += ret;
-		remain -= ret;
-	}
+		while ((r = connect(sock, ai->ai_addr, ai->ai_addrlen)) == -1 &&
+				errno == EINTR);
 
-	if (ret == 0) {
-		/* Here we can select a backend */
-		if (ssl->hostname != NULL) {
-			bk = ucl_object_find_keyl(ssl->backends, ssl->hostname, ssl->hostlen);
+		if (r == 0 || errno == EINPROGRESS) {
+			break;
 		}
 
-		if (bk == NULL) {
-			/* Try to select default backend */
-			bk = ucl_object_find_key(ssl->backends, "default");
-		}
+		r = errno;
+		close(sock);
+		sock = -1;
 
-		if (bk == NULL) {
-			/* Cowardly give up */
-			fprintf(stderr, "cannot found hostname: %s\n", ssl->hostname);
-			send_alert(ssl);
-			return;
+		if (r != EADDRNOTAVAIL || src == NULL) {
+			goto err;
 		}
-		else {
-			sa = ucl_object_find_key(bk, "ai");
 
-			if (sa == NULL) {
-				/* Should not happen */
-				send_alert(ssl);
-				return;
-			}
+		__atomic_add_fetch(&src->exhausted, 1, __ATOMIC_RELAXED);
+	}
 
-			ssl->state = ssl_state_backend_selected;
-			ssl->saved_buf = xmalloc(len);
-			memcpy(ssl->saved_buf, buf, len);
-			ssl->buflen = len;
-			connect_backend(ssl, sa->value.ud);
+	if (sock == -1) {
+		source_exhausted(ssl, pool);
+		goto err;
+	}
 
-			return;
-		}
+	if (src != NULL) {
+		__atomic_add_fetch(&src->active, 1, __ATOMIC_RELAXED);
+		ssl->src = src;
 	}
+
+	ssl->bk_fd = sock;
+	ssl->state = ssl_state_backend_ready;
+
+	ssl->bk_io.data = ssl;
+	ev_io_init(&ssl->bk_io, backend_connect_cb, sock, EV_WRITE);
+	ev_io_start(ssl->loop, &ssl->bk_io);
+
+	return;
+
 err:
 	send_alert(ssl);
 }
 
+/*
+ * Passes the client socket and the bytes read so far to a local origin. Each
+ * session is one unix stream connection: the descriptor comes as SCM_RIGHTS
+ * with the first data byte, then the ClientHello follows up to EOF. After
+ * that the session is none of our business.
+ */
 static void
-greet_cb(EV_P_ ev_io *w, int revents)
+handoff_client(struct ssl_session *ssl, const struct addrinfo *ai,
+		const unsigned char *buf, int len)
 {
-	unsigned char buf[8192];
-	int r;
-	struct ssl_session *ssl = w->data;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		unsigned char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	int sock;
+	ssize_t r;
+
+	/* Unix connect either completes at once or fails, never blocks here */
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
 
-	ev_timer_stop(loop, &ssl->tm);
-	r = read(w->fd, buf, sizeof (buf));
+	if (sock == -1) {
+		goto err;
+	}
 
-	if (r <= 0) {
-		terminate_session(ssl);
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) == -1) {
+		fprintf(stderr, "cannot connect to handoff socket for %s: %s\n",
+				ssl->hostname ? ssl->hostname : "default", strerror(errno));
+		close(sock);
+		goto err;
 	}
-	else {
-		parse_ssl_greeting(ssl, buf, r);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &ssl->fd, sizeof(int));
+
+	while ((r = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR);
+
+	close(sock);
+
+	if (r != len) {
+		/* The origin drops truncated handoffs */
+		fprintf(stderr, "handoff failed for %s: %s\n",
+				ssl->hostname ? ssl->hostname : "default",
+				r == -1 ? strerror(errno) : "short write");
+		goto err;
 	}
+
+	/* The origin owns the client now, drop our descriptor */
+	terminate_session(ssl);
+
+	return;
+
+err:
+	send_alert(ssl);
 }
 
-/*
- * Called if client failed to send SSL greeting in time
- */
+/* Keeps the greeting to replay it to the backend once connected */
 static void
-timer_cb(EV_P_ ev_timer *w, int revents)
+save_greeting(struct ssl_session *ssl, const unsigned char *buf, int len)
 {
-	struct ssl_session *ssl = w->data;
+	ssl->state = ssl_state_backend_selected;
 
-	ev_timer_stop(loop, &ssl->tm);
-	terminate_session(ssl);
+	/* Partial greetings are kept there already */
+	if (buf != ssl->saved_buf) {
+		ssl->saved_buf = xmalloc(len);
+		memcpy(ssl->saved_buf, buf, len);
+	}
+
+	ssl->buflen = len;
+	ssl->bytes_in = len;
 }
 
-static int
-accept_from_socket(int sock)
+static void
+connect_original(struct ssl_session *ssl)
 {
-	int nfd, serrno, ofl;
+	struct addrinfo ai;
 
-	if ((nfd = accept (sock, NULL, 0)) == -1) {
-		if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK) {
-			return 0;
-		}
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family = ssl->orig_dst.sa.sa_family;
+	ai.ai_socktype = SOCK_STREAM;
+	ai.ai_addr = &ssl->orig_dst.sa;
+	ai.ai_addrlen = ai.ai_family == AF_INET6 ?
+			sizeof(ssl->orig_dst.sin6) : sizeof(ssl->orig_dst.sin);
 
-		return -1;
-	}
+	connect_backend(ssl, &ai);
+}
 
-	ofl = fcntl(sock, F_GETFL, 0);
+void
+session_connect(struct ssl_session *ssl)
+{
+	const ucl_object_t *ai;
 
-	if (fcntl(sock, F_SETFL, ofl | O_NONBLOCK) == -1) {
-		close(sock);
+	if (ssl->bk == NULL) {
+		connect_original(ssl);
+		return;
+	}
+
+	ai = ucl_object_find_key(ssl->bk, "ai");
+	connect_backend(ssl, ai->value.ud);
+}
+
+/*
+ * Steered connections come to many addresses, those may be routed by
+ * "addr:port" or by "addr" alone when the name is unknown
+ */
+static const ucl_object_t*
+local_route(const struct ssl_session *ssl, const ucl_object_t *backends)
+{
+	const ucl_object_t *bk;
+	char addr[INET6_ADDRSTRLEN + 8], *end;
+
+	sockaddr_str(&ssl->local, addr, sizeof(addr));
+	bk = ucl_object_find_key(backends, addr);
+
+	if (bk == NULL || backend_draining(bk)) {
+		/* Strip the port, and the brackets of IPv6 */
+		end = strrchr(addr, ':');
+
+		if (end == NULL) {
+			/* Not an inet address, sockaddr_str gave "-" */
+			return bk;
+		}
+
+		*end = '\0';
+
+		if (addr[0] == '[') {
+			end[-1] = '\0';
+			bk = ucl_object_find_key(backends, addr + 1);
+		}
+		else {
+			bk = ucl_object_find_key(backends, addr);
+		}
+	}
+
+	return bk;
+}
+
+/* Routes of a client network are named "name@network" */
+static const ucl_object_t*
+network_route(const ucl_object_t *backends, const char *name, size_t len,
+		const char *net)
+{
+	char key[512];
+	int n;
+
+	n = snprintf(key, sizeof(key), "%.*s@%s", (int)len, name, net);
+
+	if (n < 0 || n >= (int)sizeof(key)) {
+		return NULL;
+	}
+
+	return ucl_object_find_keyl(backends, key, n);
+}
+
+static void
+parse_ssl_greeting(struct ssl_session *ssl, const unsigned char *buf, int len)
+{
+	struct tls_greeting greet;
+	enum tls_greeting_status ret;
+	const ucl_object_t *bk = NULL, *sa = NULL;
+	const ucl_object_t *backends = ssl->listener->backends;
+	const struct sockopt_profile *so;
+	const char *net;
+
+	ret = tls_parse_greeting(buf, len, &greet);
+
+	if (greet.ssl_version[0] != 0) {
+		memcpy(ssl->ssl_version, greet.ssl_version, 2);
+	}
+
+	if (ret == tls_greeting_partial && len < greeting_max) {
+		if (!greeting_progress(ssl, len)) {
+			ev_io_stop(ssl->loop, &ssl->io);
+			terminate_session(ssl);
+			return;
+		}
+
+		/* Wait for the rest, the greeting deadline still runs */
+		if (buf != ssl->saved_buf) {
+			ssl->saved_buf = xmalloc(greeting_max);
+			memcpy(ssl->saved_buf, buf, len);
+		}
+
+		ssl->buflen = len;
+
+		return;
+	}
+
+	ev_io_stop(ssl->loop, &ssl->io);
+	ev_timer_stop(ssl->loop, &ssl->tm);
+	greeting_done(ssl);
+
+	if (ret != tls_greeting_complete) {
+		send_alert(ssl);
+		return;
+	}
+
+	if (greet.hostname != NULL) {
+		ssl->hostname = xmalloc(greet.hostlen + 1);
+		memcpy(ssl->hostname, greet.hostname, greet.hostlen);
+		ssl->hostlen = greet.hostlen;
+		ssl->hostname[greet.hostlen] = '\0';
+	}
+
+	if (denylist_session(ssl) || !ratelimit_session(ssl)) {
+		send_alert(ssl);
+		return;
+	}
+
+	/* Here we can select a backend, the client network's first */
+	net = client_network(ssl->listener->clients, &ssl->peer.sa);
+
+	if (ssl->hostname != NULL) {
+		if (net != NULL) {
+			bk = network_route(backends, ssl->hostname, ssl->hostlen, net);
+		}
+		if (bk == NULL || backend_draining(bk)) {
+			bk = ucl_object_find_keyl(backends, ssl->hostname, ssl->hostlen);
+		}
+	}
+
+	if ((bk == NULL || backend_draining(bk)) &&
+			ssl->local.sa.sa_family != AF_UNSPEC) {
+		bk = local_route(ssl, backends);
+	}
+
+	if ((bk == NULL || backend_draining(bk)) &&
+			ssl->orig_dst.sa.sa_family != AF_UNSPEC) {
+		/* Transparent mode: pass unknown names where they were going */
+		if (ssl->worker->shedding && sched_shed(NULL)) {
+			send_alert(ssl);
+			return;
+		}
 
+		save_greeting(ssl, buf, len);
+		shaper_session(ssl);
+		mirror_session(ssl);
+		session_relay(ssl);
+		return;
+	}
+
+	if ((bk == NULL || backend_draining(bk)) && net != NULL) {
+		bk = network_route(backends, "default", strlen("default"), net);
+	}
+
+	if (bk == NULL || backend_draining(bk)) {
+		/* Try to select default backend */
+		bk = ucl_object_find_key(backends, "default");
+	}
+
+	if (bk == NULL || backend_draining(bk)) {
+		/* Cowardly give up */
+		fprintf(stderr, "cannot found hostname: %s\n", ssl->hostname);
+		send_alert(ssl);
+		return;
+	}
+
+	sa = ucl_object_find_key(bk, "ai");
+
+	if (sa == NULL) {
+		/* Should not happen */
+		send_alert(ssl);
+		return;
+	}
+
+	if (backend_handoff(bk)) {
+		handoff_client(ssl, sa->value.ud, buf, len);
+		return;
+	}
+
+	if (ssl->worker->shedding && sched_shed(bk)) {
+		/* Overloaded, only classes that are not shed get in */
+		send_alert(ssl);
+		return;
+	}
+
+	ssl->bk = ucl_object_ref(bk);
+	so = backend_sockopts(bk, true);
+
+	if (so != NULL && !sockopts_apply(ssl->fd, ssl->peer.sa.sa_family, so,
+			ssl->listener->sockopts)) {
+		fprintf(stderr, "cannot set client socket options for %s: %s\n",
+				ucl_object_key(bk), strerror(errno));
+	}
+
+	save_greeting(ssl, buf, len);
+	shaper_session(ssl);
+	mirror_session(ssl);
+	session_relay(ssl);
+}
+
+static void
+greet_cb(EV_P_ ev_io *w, int revents)
+{
+	unsigned char buf[8192];
+	int r;
+	struct ssl_session *ssl = w->data;
+
+	stats_cb(loop, stats_cb_greet);
+
+	if (ssl->saved_buf != NULL) {
+		/* The rest of a partial ClientHello */
+		r = read(w->fd, ssl->saved_buf + ssl->buflen,
+				MIN(sizeof(buf), greeting_max - ssl->buflen));
+
+		if (r > 0) {
+			parse_ssl_greeting(ssl, ssl->saved_buf, ssl->buflen + r);
+			return;
+		}
+	}
+	else {
+		r = read(w->fd, buf, sizeof (buf));
+
+		if (r > 0) {
+			parse_ssl_greeting(ssl, buf, r);
+			return;
+		}
+	}
+
+	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+
+	ev_timer_stop(loop, &ssl->tm);
+	terminate_session(ssl);
+}
+
+/*
+ * Called if client failed to send SSL greeting in time
+ */
+static void
+timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct ssl_session *ssl = w->data;
+
+	stats_cb(loop, stats_cb_timer);
+	ev_timer_stop(loop, &ssl->tm);
+	greeting_timed_out();
+	terminate_session(ssl);
+}
+
+/* Dual stack listeners see IPv4 clients as ::ffff:a.b.c.d */
+static void
+sockaddr_unmap(union sni_sockaddr *addr)
+{
+	struct in_addr in;
+	in_port_t port;
+
+	if (addr->sa.sa_family != AF_INET6 ||
+			!IN6_IS_ADDR_V4MAPPED(&addr->sin6.sin6_addr)) {
+		return;
+	}
+
+	memcpy(&in, &addr->sin6.sin6_addr.s6_addr[12], sizeof(in));
+	port = addr->sin6.sin6_port;
+	memset(addr, 0, sizeof(*addr));
+	addr->sin.sin_family = AF_INET;
+	addr->sin.sin_addr = in;
+	addr->sin.sin_port = port;
+}
+
+static bool
+addr_is_local(const union sni_sockaddr *addr)
+{
+	const struct ifaddrs *ifa;
+	const union sni_sockaddr *cur;
+
+	if (addr->sa.sa_family == AF_INET) {
+		if (addr->sin.sin_addr.s_addr == htonl(INADDR_ANY) ||
+				(ntohl(addr->sin.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET) {
+			return true;
+		}
+	}
+	else if (addr->sa.sa_family == AF_INET6) {
+		if (IN6_IS_ADDR_UNSPECIFIED(&addr->sin6.sin6_addr) ||
+				IN6_IS_ADDR_LOOPBACK(&addr->sin6.sin6_addr)) {
+			return true;
+		}
+	}
+	else {
+		return true;
+	}
+
+	for (ifa = local_addrs; ifa != NULL; ifa = ifa->ifa_next) {
+		cur = (const union sni_sockaddr *)ifa->ifa_addr;
+
+		if (cur == NULL || cur->sa.sa_family != addr->sa.sa_family) {
+			continue;
+		}
+
+		if (addr->sa.sa_family == AF_INET &&
+				cur->sin.sin_addr.s_addr == addr->sin.sin_addr.s_addr) {
+			return true;
+		}
+		else if (addr->sa.sa_family == AF_INET6 &&
+				IN6_ARE_ADDR_EQUAL(&cur->sin6.sin6_addr,
+						&addr->sin6.sin6_addr)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Finds out where a transparent client was going. TPROXY and local routes
+ * deliver the connection to the original address, so it is our local
+ * address; REDIRECT and DNAT keep it in conntrack. Connections made to this
+ * host itself get no original destination, passing them on would loop.
+ */
+static void
+original_dst(struct ssl_session *ssl)
+{
+	union sni_sockaddr dst;
+	socklen_t slen = sizeof(dst);
+
+	if (getsockname(ssl->fd, &dst.sa, &slen) == -1) {
+		return;
+	}
+
+#ifdef SO_ORIGINAL_DST
+	{
+		union sni_sockaddr nat;
+
+		slen = sizeof(nat);
+
+		if (getsockopt(ssl->fd,
+				dst.sa.sa_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP,
+				SO_ORIGINAL_DST, &nat, &slen) == 0) {
+			memcpy(&dst, &nat, sizeof(dst));
+		}
+	}
+#endif
+
+	sockaddr_unmap(&dst);
+
+	if (!addr_is_local(&dst)) {
+		memcpy(&ssl->orig_dst, &dst, sizeof(dst));
+	}
+}
+
+static int
+accept_from_socket(int sock, struct sockaddr *sa, socklen_t *slen)
+{
+	int nfd, serrno, ofl;
+
+	if ((nfd = accept (sock, sa, slen)) == -1) {
+		if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK) {
+			return 0;
+		}
+
+		return -1;
+	}
+
+	ofl = fcntl(nfd, F_GETFL, 0);
+
+	if (fcntl(nfd, F_SETFL, ofl | O_NONBLOCK) == -1) {
 		goto out;
 	}
 
@@ -437,109 +1057,552 @@ out:
 
 }
 
+static void
+fds_resume_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct sni_worker *worker = w->data;
+
+	stats_cb(loop, stats_cb_timer);
+	listeners_pause(worker, accept_pause_fds, false);
+}
+
+/* Stops accepting for a while, longer each time it does not help */
+static void
+fds_backoff(struct sni_worker *worker, const char *why)
+{
+	if (fds.backoff == 0) {
+		fprintf(stderr, "accept paused: %s\n", why);
+		fds.backoff = fd_backoff_min;
+	}
+	else {
+		fds.backoff = MIN(fds.backoff * 2, fd_backoff_max);
+	}
+
+	listeners_pause(worker, accept_pause_fds, true);
+	fds.timer.data = worker;
+	ev_timer_stop(worker->loop, &fds.timer);
+	ev_timer_init(&fds.timer, fds_resume_cb, fds.backoff, 0.0);
+	ev_timer_start(worker->loop, &fds.timer);
+}
+
+/* Accepts and closes one client, so that it is refused rather than left */
+static void
+fds_shed(int sock)
+{
+	int nfd;
+
+	if (fds.spare != -1) {
+		close(fds.spare);
+		fds.spare = -1;
+	}
+
+	if ((nfd = accept(sock, NULL, NULL)) != -1) {
+		close(nfd);
+	}
+
+	fds.spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* Room for the client and its backend connection of one more session */
+static bool
+fds_available(void)
+{
+	rlim_t need;
+
+	if (fds.limit == RLIM_INFINITY) {
+		return true;
+	}
+
+	need = (rlim_t)__atomic_load_n(&fds.sessions, __ATOMIC_RELAXED) * 2 + 2 +
+			__atomic_load_n(&fd_headroom, __ATOMIC_RELAXED);
+
+	return need <= fds.limit;
+}
+
+static void
+fds_init(void)
+{
+	struct rlimit rl;
+
+	fds.limit = RLIM_INFINITY;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		fds.limit = rl.rlim_cur;
+	}
+
+	fds.spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
 static void
 accept_cb(EV_P_ ev_io *w, int revents)
 {
+	struct listen_sock *ls = w->data;
+	struct sni_listener *l = ls->listener;
 	int nfd;
 	struct ssl_session *ssl;
+	struct sockaddr_storage ss;
+	socklen_t slen = sizeof(ss);
+	ev_tstamp timeout;
 
-	if ((nfd = accept_from_socket(w->fd)) > 0) {
+	stats_cb(loop, stats_cb_accept);
+
+	if (!fds_available()) {
+		/* Clients wait in the backlog until sessions end */
+		fds_backoff(l->worker, "descriptors are kept for backend connects");
+		return;
+	}
+
+	if ((nfd = accept_from_socket(w->fd, (struct sockaddr *)&ss, &slen)) > 0) {
+		if (fds.backoff != 0) {
+			fprintf(stderr, "accept resumed\n");
+			fds.backoff = 0;
+		}
+
+		if (!client_allowed(l->clients, (struct sockaddr *)&ss)) {
+			close(nfd);
+			return;
+		}
+
+		__atomic_add_fetch(&fds.sessions, 1, __ATOMIC_RELAXED);
 		ssl = xmalloc0(sizeof(*ssl));
 		ssl->io.data = ssl;
-		ssl->backends = w->data;
 		ssl->loop = loop;
+		ssl->started = ev_now(loop);
+		memcpy(&ssl->peer, &ss, MIN(slen, sizeof(ssl->peer)));
+		sockaddr_unmap(&ssl->peer);
+		session_link(l, ssl);
 		ssl->fd = nfd;
 		ssl->bk_fd = -1;
+
+		if (!greeting_start(ssl, l->greeting_timeout, &timeout)) {
+			terminate_session(ssl);
+			return;
+		}
+
+		if (l->transparent) {
+			original_dst(ssl);
+		}
+
+		if (l->steer != NULL) {
+			slen = sizeof(ssl->local);
+
+			if (getsockname(nfd, &ssl->local.sa, &slen) == 0) {
+				sockaddr_unmap(&ssl->local);
+			}
+			else {
+				/* Not routed by local address then */
+				ssl->local.sa.sa_family = AF_UNSPEC;
+			}
+		}
+
+#ifndef __linux__
+		/* Linux copies them from the listening socket */
+		if (l->sockopts != NULL) {
+			sockopts_apply(nfd, ssl->peer.sa.sa_family, l->sockopts, NULL);
+		}
+#endif
+
 		/* TLS 1.0 (SSL 3.1) */
 		ssl->ssl_version[0] = 0x3;
 		ssl->ssl_version[0] = 0x1;
 		ev_io_init(&ssl->io, greet_cb, nfd, EV_READ);
 		ev_io_start(loop, &ssl->io);
 		ssl->tm.data = ssl;
-		ev_timer_init(&ssl->tm, timer_cb, 2.0, 1);
+		ev_timer_init(&ssl->tm, timer_cb, timeout, 1);
 		ev_timer_start(loop, &ssl->tm);
 	}
-	else {
+	else if (nfd == -1 && (errno == EMFILE || errno == ENFILE)) {
+		const char *why = strerror(errno);
+
+		/* The socket stays readable, accepting again at once would spin */
+		fds_shed(w->fd);
+		fds_backoff(l->worker, why);
+	}
+	else if (nfd == -1) {
 		fprintf(stderr, "accept failed: %d, '%s'\n", errno, strerror (errno));
 	}
 }
 
+/*
+ * Listener sockets
+ */
 static int
-listen_on(const struct sockaddr *sa, socklen_t slen)
+listen_on(const struct sni_listener *l, const union sni_sockaddr *sa)
 {
 	int sock, on = 1, ofl;
+	socklen_t slen;
 
-	sock = socket(sa->sa_family, SOCK_STREAM, 0);
+	sock = socket(sa->sa.sa_family, SOCK_STREAM, 0);
 
 	if (sock == -1) {
 		return -1;
 	}
 
 	if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
-		close(sock);
-
-		return -1;
+		goto err;
 	}
 
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (int));
+
+	if (sa->sa.sa_family == AF_INET6) {
+		/* IPv4 has sockets of its own, "*" binds both */
+		if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &on,
+				sizeof(on)) == -1) {
+			goto err;
+		}
+		slen = sizeof(sa->sin6);
+	}
+	else {
+		slen = sizeof(sa->sin);
+	}
+
+	if (l->sockopts != NULL &&
+			!sockopts_apply(sock, sa->sa.sa_family, l->sockopts, NULL)) {
+		goto err;
+	}
+
+	/* Accept connections to any address, needs CAP_NET_ADMIN */
+	if (l->transparent && set_transparent(sock, sa->sa.sa_family, 1) == -1) {
+		goto err;
+	}
+
 	ofl = fcntl(sock, F_GETFL, 0);
 
 	if (fcntl(sock, F_SETFL, ofl | O_NONBLOCK) == -1) {
-		close(sock);
+		goto err;
+	}
 
-		return -1;
+	if (bind(sock, &sa->sa, slen) == -1) {
+		goto err;
 	}
 
-	if (bind(sock, sa, slen) == -1) {
-		close(sock);
+	if (listen(sock, -1) == -1) {
+		goto err;
+	}
 
-		return -1;
+	return sock;
+
+err:
+	ofl = errno;
+	close(sock);
+	errno = ofl;
+
+	return -1;
+}
+
+static bool
+sockaddr_equal(const union sni_sockaddr *a, const union sni_sockaddr *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family) {
+		return false;
 	}
 
-	if (listen(sock, -1) == -1) {
-		close(sock);
+	if (a->sa.sa_family == AF_INET6) {
+		return a->sin6.sin6_port == b->sin6.sin6_port &&
+				IN6_ARE_ADDR_EQUAL(&a->sin6.sin6_addr, &b->sin6.sin6_addr);
+	}
 
-		return -1;
+	return a->sin.sin_port == b->sin.sin_port &&
+			a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+}
+
+static void
+listen_sock_close(struct ev_loop *loop, struct listen_sock *ls)
+{
+	ev_io_stop(loop, &ls->io);
+	close(ls->io.fd);
+	free(ls);
+}
+
+/* Takes the socket bound to `sa` out of `list`, if there is one */
+static struct listen_sock*
+listen_sock_take(struct listen_sock **list, const union sni_sockaddr *sa)
+{
+	struct listen_sock *ls, **prev;
+
+	for (prev = list; (ls = *prev) != NULL; prev = &ls->next) {
+		if (sockaddr_equal(&ls->addr, sa)) {
+			*prev = ls->next;
+			ls->next = NULL;
+
+			return ls;
+		}
 	}
 
-	return sock;
+	return NULL;
+}
+
+/*
+ * Gives listener `l` a socket for each of its addresses, reusing those from
+ * `old` so that their backlog is kept
+ */
+static bool
+listener_bind(struct sni_listener *l, struct listen_sock **old)
+{
+	struct listen_sock *ls;
+	char addr[INET6_ADDRSTRLEN + 16];
+	unsigned i;
+	int sock;
+	bool ret = true;
+
+	if (l->transparent && local_addrs == NULL &&
+			getifaddrs(&local_addrs) == -1) {
+		fprintf(stderr, "getifaddrs: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < l->naddrs; i ++) {
+		ls = listen_sock_take(old, &l->addrs[i]);
+
+		if (ls != NULL) {
+			/* Options are set over the old ones, not reset */
+			if (l->sockopts != NULL && !sockopts_apply(ls->io.fd,
+					ls->addr.sa.sa_family, l->sockopts, NULL)) {
+				sockaddr_str(&ls->addr, addr, sizeof(addr));
+				fprintf(stderr, "listener %s: cannot set socket options on "
+						"%s: %s\n", l->name, addr, strerror(errno));
+			}
+			if (ls->transparent != l->transparent) {
+				set_transparent(ls->io.fd, ls->addr.sa.sa_family,
+						l->transparent);
+			}
+		}
+		else {
+			sock = listen_on(l, &l->addrs[i]);
+
+			if (sock == -1) {
+				sockaddr_str(&l->addrs[i], addr, sizeof(addr));
+				fprintf(stderr, "listener %s: cannot listen on %s: %s\n",
+						l->name, addr, strerror(errno));
+				ret = false;
+				continue;
+			}
+
+			ls = xmalloc0(sizeof(*ls));
+			memcpy(&ls->addr, &l->addrs[i], sizeof(ls->addr));
+			ev_io_init(&ls->io, accept_cb, sock, EV_READ);
+
+			if (!l->worker->accept_paused) {
+				ev_io_start(l->worker->loop, &ls->io);
+			}
+		}
+
+		ls->io.data = ls;
+		ls->listener = l;
+		ls->transparent = l->transparent;
+		ls->next = l->socks;
+		l->socks = ls;
+	}
+
+	return ret;
+}
+
+void
+listeners_pause(struct sni_worker *worker, unsigned reason, bool pause)
+{
+	struct sni_listener *l;
+	struct listen_sock *ls;
+	bool was = worker->accept_paused != 0;
+
+	if (pause) {
+		worker->accept_paused |= reason;
+	}
+	else {
+		worker->accept_paused &= ~reason;
+	}
+
+	pause = worker->accept_paused != 0;
+
+	if (pause == was) {
+		return;
+	}
+
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		for (ls = l->socks; ls != NULL; ls = ls->next) {
+			if (pause) {
+				ev_io_stop(worker->loop, &ls->io);
+			}
+			else {
+				ev_io_start(worker->loop, &ls->io);
+			}
+		}
+	}
+}
+
+void
+listener_free(struct sni_listener *l)
+{
+	if (l->backends) {
+		ucl_object_unref(l->backends);
+	}
+
+	free(l->name);
+	free(l->addrs);
+	free(l->tcpi);
+	sockopts_unref(l->sockopts);
+	sklookup_set_free(l->steer);
+	client_rules_unref(l->clients);
+	free(l);
+}
+
+struct sni_listener*
+listener_find(struct sni_worker *worker, const char *name)
+{
+	struct sni_listener *l;
+
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		if (strcmp(l->name, name) == 0) {
+			return l;
+		}
+	}
+
+	return NULL;
 }
 
 bool
-start_listen(struct ev_loop *loop, int port, const ucl_object_t *backends)
+listener_routes_first(const struct sni_listener *l)
 {
-	struct addrinfo ai, *res, *cur_ai;
-	int sock, r;
-	ev_io *watcher;
-	bool ret = false;
+	const struct sni_listener *cur;
 
-	memset(&ai, 0, sizeof(ai));
-	ai.ai_family = AF_UNSPEC;
-	ai.ai_flags = AI_PASSIVE|AI_NUMERICSERV;
-	ai.ai_socktype = SOCK_STREAM;
+	for (cur = l->worker->listeners; cur != NULL && cur != l;
+			cur = cur->next) {
+		if (cur->backends == l->backends) {
+			return false;
+		}
+	}
 
-	if ((r = getaddrinfo(NULL, port_to_str(port), &ai, &res)) != 0) {
-		fprintf(stderr, "getaddrinfo: *:%d: %s\n", port, gai_strerror(r));
-		return false;
+	return true;
+}
+
+unsigned
+worker_routes_count(const struct sni_worker *worker)
+{
+	const struct sni_listener *l;
+	unsigned n = 0;
+
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		if (listener_routes_first(l)) {
+			n ++;
+		}
 	}
 
-	cur_ai = res;
+	return n;
+}
+
+const char*
+listener_routes_name(const struct sni_listener *l)
+{
+	return l->shared_routes ? "*" : l->name;
+}
 
-	while (cur_ai != NULL) {
-		sock = listen_on(cur_ai->ai_addr, cur_ai->ai_addrlen);
+ucl_object_t*
+worker_routes_find(struct sni_worker *worker, const char *name)
+{
+	struct sni_listener *l;
 
-		if (sock == -1) {
-			fprintf(stderr, "socket listen: %s\n", strerror(errno));
-			cur_ai = cur_ai->ai_next;
-			continue;
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		if (strcmp(l->name, name) == 0 ||
+				(l->shared_routes && strcmp(name, "*") == 0)) {
+			return l->backends;
+		}
+	}
+
+	return NULL;
+}
+
+bool
+listeners_update(struct sni_worker *worker, struct sni_listener *fresh)
+{
+	struct sni_listener *l, *cur, *next, *list = NULL, **tail = &list;
+	struct sni_listener **gone;
+	struct listen_sock *old = NULL, *ls;
+	unsigned n = 0, i;
+	bool ret = true;
+
+	if (fds.limit == 0) {
+		fds_init();
+	}
+
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		n ++;
+	}
+
+	/* Listeners are relinked below, remember the old ones */
+	gone = xmalloc((n + 1) * sizeof(*gone));
+	n = 0;
+
+	/* Every socket is up for grabs, listeners may even trade addresses */
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		gone[n ++] = l;
+
+		while ((ls = l->socks) != NULL) {
+			l->socks = ls->next;
+			ls->next = old;
+			old = ls;
 		}
+	}
+
+	for (l = fresh; l != NULL; l = next) {
+		next = l->next;
+		cur = listener_find(worker, l->name);
+
+		if (cur != NULL) {
+			/* Sessions keep their backends, new ones get the new table */
+			ucl_object_unref(cur->backends);
+			cur->backends = l->backends;
+			cur->shared_routes = l->shared_routes;
+			cur->transparent = l->transparent;
+			sockopts_unref(cur->sockopts);
+			cur->sockopts = l->sockopts;
+			cur->greeting_timeout = l->greeting_timeout;
+			cur->shutdown_timeout = l->shutdown_timeout;
+			free(cur->addrs);
+			cur->addrs = l->addrs;
+			cur->naddrs = l->naddrs;
+			sklookup_set_free(cur->steer);
+			cur->steer = l->steer;
+			client_rules_unref(cur->clients);
+			cur->clients = l->clients;
+			l->backends = NULL;
+			l->addrs = NULL;
+			l->sockopts = NULL;
+			l->steer = NULL;
+			l->clients = NULL;
+			listener_free(l);
+			l = cur;
+			/* Taken out of the old list, which is then dropped */
+			cur->refs ++;
+		}
+		else {
+			l->worker = worker;
+			l->refs = 1;
+		}
+
+		l->next = NULL;
+		*tail = l;
+		tail = &l->next;
+	}
+
+	/* Listeners that are gone stay with their sessions */
+	for (i = 0; i < n; i ++) {
+		listener_unref(gone[i]);
+	}
+
+	free(gone);
+
+	worker->listeners = list;
+	__atomic_store_n(&worker->nroutes, worker_routes_count(worker),
+			__ATOMIC_RELAXED);
+
+	for (l = list; l != NULL; l = l->next) {
+		if (!listener_bind(l, &old)) {
+			ret = false;
+		}
+	}
 
-		watcher = xmalloc0(sizeof(*watcher));
-		watcher->data = (void *)backends;
-		ev_io_init(watcher, accept_cb, sock, EV_READ);
-		ev_io_start(loop, watcher);
-		ret = true;
-		cur_ai = cur_ai->ai_next;
+	while ((ls = old) != NULL) {
+		old = ls->next;
+		listen_sock_close(worker->loop, ls);
 	}
 
 	return ret;
@@ -0,0 +1,797 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Mirroring of the relayed bytes of selected sessions to an analysis sink.
+ *
+ * A mirrored session copies what its loop reads from either socket into the
+ * queue of that loop, a ring of records with the loop as its only writer.
+ * The loop never waits for the queue: a record that does not fit is dropped
+ * and counted. One thread drains the queues of every loop into the sink, a
+ * file or a unix stream socket, with blocking writes, so a slow sink fills
+ * the queues and costs records rather than relay time.
+ *
+ * Records carry the offset of their data in its stream. Once rebalanced, a
+ * session has records in two queues, which may reach the sink out of order.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "mirror.h"
+#include "sni-private.h"
+
+/* The main loop and up to 1024 relays */
+#define MIRROR_QUEUES_MAX 1025
+
+static const size_t default_queue = 4 * 1024 * 1024;
+static const size_t min_queue = 64 * 1024;
+static const size_t max_queue = 1024 * 1024 * 1024;
+
+struct mirror_queue {
+	unsigned char *buf;
+	uint64_t mask;
+	/* Written by the loop */
+	uint64_t head __attribute__((aligned(64)));
+	/* Tail as last read by the loop, spares it the drainer's cache line */
+	uint64_t tail_seen;
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t dropped;
+	uint64_t dropped_bytes;
+	/* Written by the drain thread */
+	uint64_t tail __attribute__((aligned(64)));
+};
+
+static struct {
+	bool enabled;
+	size_t queue;
+	/* The sink, `fd` is only used by the drain thread once started */
+	char *path;
+	bool sock;
+	struct sockaddr_un sun;
+	socklen_t sunlen;
+	int fd;
+	time_t retry;
+	bool failing;
+	/* A full file fails now and then, it is reported once a second */
+	time_t warned;
+	/* Registered by the main thread, then read by the drain thread */
+	struct mirror_queue *queues[MIRROR_QUEUES_MAX];
+	unsigned nqueues;
+	/* Drain thread counters: bytes written, bytes lost with the sink */
+	uint64_t written;
+	uint64_t lost;
+	uint64_t errors;
+	/* Set while the drain thread waits for records on `wake` */
+	bool sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	/* Selection, main loop only: lower cased names, NULL for any */
+	bool select;
+	ucl_object_t *names;
+	double sample;
+} mirror = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+/* Selection read by mirror_configure(), installed by mirror_commit() */
+static struct {
+	bool select;
+	ucl_object_t *names;
+	double sample;
+} staged;
+
+static bool
+sink_connect(void)
+{
+	time_t now = time(NULL);
+	int fd;
+
+	if (now < mirror.retry) {
+		return false;
+	}
+
+	mirror.retry = now + 1;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd == -1) {
+		return false;
+	}
+
+	if (connect(fd, (struct sockaddr *)&mirror.sun, mirror.sunlen) == -1) {
+		if (!mirror.failing) {
+			fprintf(stderr, "mirror: cannot connect to %s: %s\n", mirror.path,
+					strerror(errno));
+			mirror.failing = true;
+		}
+
+		close(fd);
+
+		return false;
+	}
+
+	if (mirror.failing) {
+		fprintf(stderr, "mirror: connected to %s\n", mirror.path);
+		mirror.failing = false;
+	}
+
+	mirror.fd = fd;
+
+	return true;
+}
+
+static void
+sink_error(void)
+{
+	time_t now = time(NULL);
+
+	__atomic_add_fetch(&mirror.errors, 1, __ATOMIC_RELAXED);
+
+	if (!mirror.failing && now != mirror.warned) {
+		fprintf(stderr, "mirror: cannot write to %s: %s\n", mirror.path,
+				strerror(errno));
+		mirror.warned = now;
+	}
+
+	mirror.failing = true;
+
+	if (mirror.sock) {
+		/* Reconnected later, the stream starts over at a record */
+		close(mirror.fd);
+		mirror.fd = -1;
+	}
+}
+
+/* Size of the record at position `pos` of queue `q`, header included */
+static uint64_t
+queue_record_size(const struct mirror_queue *q, uint64_t pos)
+{
+	struct mirror_record rec;
+	uint64_t off = pos & q->mask;
+	size_t n = MIN(sizeof(rec), q->mask + 1 - off);
+
+	memcpy(&rec, q->buf + off, n);
+	memcpy((unsigned char *)&rec + n, q->buf, sizeof(rec) - n);
+
+	return sizeof(rec) + rec.len;
+}
+
+/*
+ * A file keeps what was written before an error: cuts the record written in
+ * part off, so that readers of the file never see a torn one. `start` is a
+ * record boundary, `end` is how far the queue was written.
+ */
+static void
+sink_trim(const struct mirror_queue *q, uint64_t start, uint64_t end)
+{
+	struct stat st;
+	uint64_t pos = start, size;
+
+	while (pos < end) {
+		size = queue_record_size(q, pos);
+
+		if (pos + size > end) {
+			break;
+		}
+
+		pos += size;
+	}
+
+	if (pos == end) {
+		return;
+	}
+
+	if (fstat(mirror.fd, &st) == -1 ||
+			ftruncate(mirror.fd, st.st_size - (end - pos)) == -1) {
+		fprintf(stderr, "mirror: cannot truncate %s: %s\n", mirror.path,
+				strerror(errno));
+		return;
+	}
+
+	__atomic_sub_fetch(&mirror.written, end - pos, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mirror.lost, end - pos, __ATOMIC_RELAXED);
+}
+
+/* Writes out what queue `q` holds, true if anything was written */
+static bool
+queue_drain(struct mirror_queue *q)
+{
+	struct iovec iov[2];
+	uint64_t head, tail, start, off;
+	ssize_t r;
+	int cnt;
+
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	start = tail = q->tail;
+
+	if (head == tail) {
+		return false;
+	}
+
+	if (mirror.fd == -1 && !sink_connect()) {
+		/* Nowhere to write to, make room for new records and sleep */
+		__atomic_add_fetch(&mirror.lost, head - tail, __ATOMIC_RELAXED);
+		__atomic_store_n(&q->tail, head, __ATOMIC_RELEASE);
+
+		return false;
+	}
+
+	while (tail != head) {
+		off = tail & q->mask;
+		iov[0].iov_base = q->buf + off;
+		iov[0].iov_len = MIN(head - tail, q->mask + 1 - off);
+		iov[1].iov_base = q->buf;
+		iov[1].iov_len = head - tail - iov[0].iov_len;
+		cnt = iov[1].iov_len > 0 ? 2 : 1;
+
+		if ((r = writev(mirror.fd, iov, cnt)) == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (r <= 0) {
+			sink_error();
+
+			if (!mirror.sock && tail != start) {
+				sink_trim(q, start, tail);
+			}
+			/* Up to the head, a record boundary */
+			__atomic_add_fetch(&mirror.lost, head - tail, __ATOMIC_RELAXED);
+			tail = head;
+			break;
+		}
+
+		mirror.failing = false;
+		__atomic_add_fetch(&mirror.written, r, __ATOMIC_RELAXED);
+		tail += r;
+		__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static bool
+queues_drain(void)
+{
+	unsigned i, n;
+	bool busy = false;
+
+	n = __atomic_load_n(&mirror.nqueues, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i ++) {
+		busy |= queue_drain(mirror.queues[i]);
+	}
+
+	return busy;
+}
+
+static bool
+queues_empty(void)
+{
+	struct mirror_queue *q;
+	unsigned i, n;
+
+	n = __atomic_load_n(&mirror.nqueues, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i ++) {
+		q = mirror.queues[i];
+
+		if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != q->tail) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Polls every millisecond while records come in, so that loops do not wake
+ * the thread for each of them, and sleeps until the next one once idle
+ */
+static void *
+mirror_drain(void *arg)
+{
+	const struct timespec pause = {0, 1000000};
+
+	for (;;) {
+		if (queues_drain()) {
+			continue;
+		}
+
+		/* Queues are sized to hold much more than a millisecond */
+		nanosleep(&pause, NULL);
+
+		if (queues_drain()) {
+			continue;
+		}
+
+		pthread_mutex_lock(&mirror.lock);
+		__atomic_store_n(&mirror.sleeping, true, __ATOMIC_RELAXED);
+		/* Pairs with queue_push: either it sees the flag or we its record */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		while (queues_empty()) {
+			pthread_cond_wait(&mirror.wake, &mirror.lock);
+		}
+
+		__atomic_store_n(&mirror.sleeping, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&mirror.lock);
+	}
+
+	return NULL;
+}
+
+static bool
+sink_unix(const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len == 0 || len >= sizeof(mirror.sun.sun_path)) {
+		return false;
+	}
+
+#ifndef __linux__
+	if (path[0] == '@') {
+		return false;
+	}
+#endif
+
+	mirror.sun.sun_family = AF_UNIX;
+	memcpy(mirror.sun.sun_path, path, len);
+
+	if (path[0] == '@') {
+		/* Abstract names are not NUL terminated */
+		mirror.sun.sun_path[0] = '\0';
+		mirror.sunlen = offsetof(struct sockaddr_un, sun_path) + len;
+	}
+	else {
+		mirror.sunlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	}
+
+	mirror.sock = true;
+
+	return true;
+}
+
+bool
+mirror_init(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt, *file, *sock;
+	sigset_t all, old;
+	pthread_t th;
+	int64_t size;
+	int r;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "enabled");
+
+	if (elt != NULL && !ucl_object_toboolean(elt)) {
+		return true;
+	}
+
+	file = ucl_object_find_key(cfg, "file");
+	sock = ucl_object_find_key(cfg, "unix");
+
+	if ((file == NULL) == (sock == NULL)) {
+		fprintf(stderr, "mirror: exactly one of file and unix must be set\n");
+		return false;
+	}
+
+	mirror.queue = default_queue;
+	elt = ucl_object_find_key(cfg, "queue");
+
+	if (elt != NULL) {
+		size = ucl_object_toint(elt);
+
+		if (size < (int64_t)min_queue || size > (int64_t)max_queue) {
+			fprintf(stderr, "mirror: invalid queue size: %lld\n",
+					(long long)size);
+			return false;
+		}
+
+		/* A power of two, positions are masked */
+		for (mirror.queue = min_queue; mirror.queue < (size_t)size;
+				mirror.queue <<= 1);
+	}
+
+	if (file != NULL) {
+		mirror.path = strdup(ucl_object_tostring_forced(file));
+		mirror.fd = open(mirror.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+				0600);
+
+		if (mirror.fd == -1) {
+			fprintf(stderr, "mirror: cannot open %s: %s\n", mirror.path,
+					strerror(errno));
+			return false;
+		}
+	}
+	else {
+		mirror.path = strdup(ucl_object_tostring_forced(sock));
+
+		if (!sink_unix(mirror.path)) {
+			fprintf(stderr, "mirror: invalid unix socket: %s\n", mirror.path);
+			return false;
+		}
+	}
+
+	/* The drain thread takes no signals */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	r = pthread_create(&th, NULL, mirror_drain, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (r != 0) {
+		fprintf(stderr, "mirror: cannot start a thread: %s\n", strerror(r));
+		return false;
+	}
+
+	pthread_detach(th);
+	mirror.enabled = true;
+
+	return true;
+}
+
+bool
+mirror_configure(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	ucl_object_t *names = NULL;
+	double sample = 1.0;
+	const char *name;
+	char lc[256];
+	size_t len, i;
+
+	if (staged.names != NULL) {
+		ucl_object_unref(staged.names);
+	}
+
+	memset(&staged, 0, sizeof(staged));
+	elt = cfg ? ucl_object_find_key(cfg, "enabled") : NULL;
+
+	if (cfg == NULL || (elt != NULL && !ucl_object_toboolean(elt))) {
+		return true;
+	}
+
+	if (!mirror.enabled) {
+		fprintf(stderr, "mirror: the sink is opened at startup only, "
+				"sessions are not mirrored until restart\n");
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "sample");
+
+	if (elt != NULL) {
+		sample = ucl_object_todouble(elt);
+
+		if (sample <= 0 || sample > 1.0) {
+			fprintf(stderr, "mirror: invalid sample: %.3f\n", sample);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "names");
+
+	if (elt != NULL) {
+		names = ucl_object_typed_new(UCL_OBJECT);
+
+		while ((cur = ucl_iterate_object(elt, &it, true))) {
+			name = ucl_object_tostring_forced(cur);
+			len = strlen(name);
+
+			if (len == 0 || len >= sizeof(lc)) {
+				fprintf(stderr, "mirror: invalid name: %s\n", name);
+				ucl_object_unref(names);
+				return false;
+			}
+
+			for (i = 0; i < len; i ++) {
+				lc[i] = tolower((unsigned char)name[i]);
+			}
+
+			ucl_object_insert_key(names, ucl_object_frombool(true), lc, len,
+					true);
+		}
+	}
+
+	staged.names = names;
+	staged.sample = sample;
+	staged.select = true;
+
+	return true;
+}
+
+void
+mirror_commit(bool apply)
+{
+	if (!apply) {
+		if (staged.names != NULL) {
+			ucl_object_unref(staged.names);
+		}
+
+		memset(&staged, 0, sizeof(staged));
+
+		return;
+	}
+
+	if (mirror.names != NULL) {
+		ucl_object_unref(mirror.names);
+	}
+
+	mirror.names = staged.names;
+	mirror.sample = staged.sample;
+	mirror.select = staged.select;
+	memset(&staged, 0, sizeof(staged));
+}
+
+void
+mirror_start(struct sni_worker *worker)
+{
+	struct mirror_queue *q;
+
+	if (!mirror.enabled) {
+		return;
+	}
+
+	q = xmalloc0(sizeof(*q));
+	q->buf = xmalloc(mirror.queue);
+	q->mask = mirror.queue - 1;
+	worker->mirror = q;
+
+	mirror.queues[mirror.nqueues] = q;
+	__atomic_store_n(&mirror.nqueues, mirror.nqueues + 1, __ATOMIC_RELEASE);
+}
+
+void
+mirror_session(struct ssl_session *ssl)
+{
+	char lc[256];
+	uint64_t h;
+	size_t i;
+
+	if (!mirror.select) {
+		return;
+	}
+
+	if (mirror.names != NULL) {
+		if (ssl->hostname == NULL || ssl->hostlen >= sizeof(lc)) {
+			return;
+		}
+
+		for (i = 0; i < ssl->hostlen; i ++) {
+			lc[i] = tolower((unsigned char)ssl->hostname[i]);
+		}
+
+		if (ucl_object_find_keyl(mirror.names, lc, ssl->hostlen) == NULL) {
+			return;
+		}
+	}
+
+	if (mirror.sample < 1.0) {
+		/* Session ids are sequential, spread them over [0, 1) */
+		h = ssl->id * 0x9e3779b97f4a7c15ULL;
+
+		if ((double)(h >> 11) * 0x1p-53 >= mirror.sample) {
+			return;
+		}
+	}
+
+	ssl->mirror = true;
+}
+
+static uint64_t
+queue_copy(struct mirror_queue *q, uint64_t pos, const void *src, size_t len)
+{
+	uint64_t off = pos & q->mask;
+	size_t n = MIN(len, q->mask + 1 - off);
+
+	memcpy(q->buf + off, src, n);
+
+	if (n < len) {
+		memcpy(q->buf, (const unsigned char *)src + n, len - n);
+	}
+
+	return pos + len;
+}
+
+/* Queues record `rec` and its payload, or drops it if the queue is full */
+static void
+queue_push(struct mirror_queue *q, const struct mirror_record *rec,
+		const struct iovec *iov, int cnt)
+{
+	uint64_t need = sizeof(*rec) + rec->len, head = q->head;
+	size_t left, n;
+	int i;
+
+	if (head + need - q->tail_seen > q->mask + 1) {
+		q->tail_seen = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+		if (head + need - q->tail_seen > q->mask + 1) {
+			q->dropped ++;
+			q->dropped_bytes += rec->len;
+			return;
+		}
+	}
+
+	head = queue_copy(q, head, rec, sizeof(*rec));
+
+	for (i = 0, left = rec->len; i < cnt && left > 0; i ++) {
+		n = MIN(iov[i].iov_len, left);
+		head = queue_copy(q, head, iov[i].iov_base, n);
+		left -= n;
+	}
+
+	q->records ++;
+	q->bytes += rec->len;
+	__atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&mirror.sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&mirror.lock);
+		pthread_cond_signal(&mirror.wake);
+		pthread_mutex_unlock(&mirror.lock);
+	}
+}
+
+static void
+record_init(struct mirror_record *rec, const struct ssl_session *ssl,
+		enum mirror_type type, uint64_t offset, size_t len)
+{
+	rec->session = ssl->id;
+	rec->offset = offset;
+	rec->time = ev_now(ssl->loop) * 1e6;
+	rec->len = len;
+	rec->type = type;
+	rec->reserved = 0;
+}
+
+void
+mirror_session_open(struct ssl_session *ssl)
+{
+	struct mirror_record rec;
+	struct iovec iov;
+	char buf[320], peer[64];
+	int len;
+
+	if (!ssl->mirror || ssl->worker->mirror == NULL) {
+		return;
+	}
+
+	session_peer_str(ssl, peer, sizeof(peer));
+	len = snprintf(buf, sizeof(buf), "%s %.*s", peer,
+			ssl->hostname ? (int)ssl->hostlen : 1,
+			ssl->hostname ? ssl->hostname : "-");
+	iov.iov_base = buf;
+	iov.iov_len = MIN(len, (int)sizeof(buf) - 1);
+	record_init(&rec, ssl, mirror_open, 0, iov.iov_len);
+	queue_push(ssl->worker->mirror, &rec, &iov, 1);
+
+	/* The greeting was read before the session was relayed */
+	iov.iov_base = ssl->saved_buf;
+	iov.iov_len = ssl->buflen;
+	record_init(&rec, ssl, mirror_client, 0, iov.iov_len);
+	queue_push(ssl->worker->mirror, &rec, &iov, 1);
+
+	ssl->mirror_started = true;
+}
+
+void
+mirror_data(struct ssl_session *ssl, enum mirror_type type,
+		const struct iovec *iov, int cnt, size_t len)
+{
+	struct mirror_record rec;
+	uint64_t end;
+
+	if (!ssl->mirror_started) {
+		return;
+	}
+
+	end = type == mirror_client ? ssl->bytes_in : ssl->bytes_out;
+	record_init(&rec, ssl, type, end - len, len);
+	queue_push(ssl->worker->mirror, &rec, iov, cnt);
+}
+
+void
+mirror_session_close(struct ssl_session *ssl)
+{
+	struct mirror_record rec;
+	struct iovec iov;
+	uint64_t counts[2];
+
+	if (!ssl->mirror_started) {
+		return;
+	}
+
+	counts[0] = ssl->bytes_in;
+	counts[1] = ssl->bytes_out;
+	iov.iov_base = counts;
+	iov.iov_len = sizeof(counts);
+	record_init(&rec, ssl, mirror_close, 0, sizeof(counts));
+	queue_push(ssl->worker->mirror, &rec, &iov, 1);
+	ssl->mirror_started = false;
+}
+
+ucl_object_t *
+mirror_to_ucl(struct sni_worker *worker)
+{
+	struct mirror_queue *q = worker->mirror;
+	ucl_object_t *obj, *sink;
+
+	if (q == NULL) {
+		return NULL;
+	}
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(obj, ucl_object_fromint(q->records), "records", 0,
+			false);
+	ucl_object_insert_key(obj, ucl_object_fromint(q->bytes), "bytes", 0,
+			false);
+	ucl_object_insert_key(obj, ucl_object_fromint(q->dropped), "dropped", 0,
+			false);
+	ucl_object_insert_key(obj, ucl_object_fromint(q->dropped_bytes),
+			"dropped_bytes", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(q->head -
+			__atomic_load_n(&q->tail, __ATOMIC_RELAXED)), "queued", 0, false);
+
+	if (!worker->relay) {
+		sink = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(sink, ucl_object_fromint(
+				__atomic_load_n(&mirror.written, __ATOMIC_RELAXED)),
+				"written", 0, false);
+		ucl_object_insert_key(sink, ucl_object_fromint(
+				__atomic_load_n(&mirror.lost, __ATOMIC_RELAXED)),
+				"lost", 0, false);
+		ucl_object_insert_key(sink, ucl_object_fromint(
+				__atomic_load_n(&mirror.errors, __ATOMIC_RELAXED)),
+				"errors", 0, false);
+		ucl_object_insert_key(obj, sink, "sink", 0, false);
+	}
+
+	return obj;
+}
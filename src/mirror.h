@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_MIRROR_H_
+#define SRC_MIRROR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "ucl.h"
+
+struct ssl_session;
+struct sni_worker;
+struct mirror_queue;
+
+/* Records written to the sink, by type */
+enum mirror_type {
+	/* Payload: client address and SNI name, separated by a space */
+	mirror_open = 1,
+	/* Payload: bytes from the client, then from the backend */
+	mirror_client,
+	mirror_backend,
+	/* Payload: two uint64_t, bytes read from the client and the backend */
+	mirror_close
+};
+
+/*
+ * Header of every record, in host byte order. `offset` is where the data
+ * starts in the stream of its direction, so that a gap tells dropped data.
+ */
+struct mirror_record {
+	uint64_t session;
+	uint64_t offset;
+	/* Wall clock, microseconds */
+	uint64_t time;
+	uint32_t len;
+	uint16_t type;
+	uint16_t reserved;
+};
+
+/*
+ * Opens the sink of the `mirror` section `cfg` and starts the thread that
+ * drains the queues into it. Called once at startup, NULL disables mirroring.
+ */
+bool mirror_init(const ucl_object_t *cfg);
+/* Reads which sessions are mirrored, on startup and reload */
+bool mirror_configure(const ucl_object_t *cfg);
+/* Installs the selection read last if `apply`, drops it otherwise */
+void mirror_commit(bool apply);
+/* Gives the loop of `worker` a queue if mirroring is enabled */
+void mirror_start(struct sni_worker *worker);
+
+/* On the main loop, once routed: marks the session if it is to be mirrored */
+void mirror_session(struct ssl_session *ssl);
+/* On the session's loop: the open record and the greeting, once connected */
+void mirror_session_open(struct ssl_session *ssl);
+/* Queues `len` bytes just read into `iov` from the client or the backend */
+void mirror_data(struct ssl_session *ssl, enum mirror_type type,
+		const struct iovec *iov, int cnt, size_t len);
+/* The close record of a session that was opened */
+void mirror_session_close(struct ssl_session *ssl);
+
+/* Counters of the worker's queue and of the sink, NULL without mirroring */
+ucl_object_t *mirror_to_ucl(struct sni_worker *worker);
+
+#endif /* SRC_MIRROR_H_ */
@@ -39,6 +39,11 @@
 #include "util.h"
 #include "ringbuf.h"
 #include "sni-private.h"
+#include "stats.h"
+#include "tcpinfo.h"
+#include "shaper.h"
+#include "mirror.h"
+#include "scheduler.h"
 
 static void proxy_state_machine(struct ssl_session *s);
 
@@ -47,6 +52,7 @@ timer_cb(EV_P_ ev_timer *w, int revents)
 {
 	struct ssl_session *ssl = w->data;
 
+	stats_cb(loop, stats_cb_timer);
 	ev_timer_stop(loop, &ssl->tm);
 	terminate_session(ssl);
 }
@@ -55,6 +61,8 @@ static void
 close_backend(struct ssl_session *s)
 {
 	if (s->bk_fd != -1) {
+		/* The first leg to close ends the sampling of both */
+		tcpinfo_session_close(s);
 		ev_io_stop(s->loop, &s->bk_io);
 		close(s->bk_fd);
 		s->bk_fd = -1;
@@ -62,7 +70,8 @@ close_backend(struct ssl_session *s)
 		if (ringbuf_can_write(s->bk2cl)) {
 			/* We have some more data in bk2cl buffer */
 			shutdown(s->fd, SHUT_RD);
-			ev_timer_init(&s->tm, timer_cb, 5.0, 1);
+			ev_timer_init(&s->tm, timer_cb, s->listener->shutdown_timeout,
+					1);
 			ev_timer_start(s->loop, &s->tm);
 		}
 		else {
@@ -77,6 +86,7 @@ static void
 close_client(struct ssl_session *s)
 {
 	if (s->fd != -1) {
+		tcpinfo_session_close(s);
 		ev_io_stop(s->loop, &s->io);
 		close(s->fd);
 		s->fd = -1;
@@ -84,7 +94,8 @@ close_client(struct ssl_session *s)
 		if (ringbuf_can_write(s->cl2bk)) {
 			/* We have some more data in cl2bk buffer */
 			shutdown(s->bk_fd, SHUT_RD);
-			ev_timer_init(&s->tm, timer_cb, 5.0, 1);
+			ev_timer_init(&s->tm, timer_cb, s->listener->shutdown_timeout,
+					1);
 			ev_timer_start(s->loop, &s->tm);
 		}
 		else {
@@ -95,11 +106,67 @@ close_client(struct ssl_session *s)
 	}
 }
 
+static void
+shape_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct ssl_session *s = w->data;
+
+	stats_cb(loop, stats_cb_shaper);
+	s->parked = 0;
+	proxy_state_machine(s);
+}
+
+/*
+ * Clips the read vector `iov` of direction `dir` to what the shaper allows,
+ * into `lim`. With nothing allowed the direction is parked: it is not read
+ * until the timer wakes it up, and the returned vector is empty.
+ */
+static const struct iovec*
+proxy_shape(struct ssl_session *s, enum shaper_dir dir,
+		const struct iovec *iov, int *cnt, struct iovec *lim)
+{
+	size_t want, allow;
+	ev_tstamp wait;
+
+	want = iov[0].iov_len + (*cnt > 1 ? iov[1].iov_len : 0);
+	allow = shaper_allow(s->shape, dir, want, &wait);
+
+	if (allow == want) {
+		return iov;
+	}
+
+	lim[0] = iov[0];
+	lim[1] = iov[1];
+	*cnt = 1;
+
+	if (allow == 0) {
+		s->parked |= 1u << dir;
+		lim[0].iov_len = 0;
+
+		if (!ev_is_active(&s->shape_tm) ||
+				ev_timer_remaining(s->loop, &s->shape_tm) > wait) {
+			ev_timer_stop(s->loop, &s->shape_tm);
+			ev_timer_set(&s->shape_tm, wait, 0.0);
+			ev_timer_start(s->loop, &s->shape_tm);
+		}
+	}
+	else if (allow <= lim[0].iov_len) {
+		lim[0].iov_len = allow;
+	}
+	else {
+		lim[1].iov_len = allow - lim[0].iov_len;
+		*cnt = 2;
+	}
+
+	return lim;
+}
+
 static void
 proxy_cl_bk(EV_P_ ev_io *w, int revents)
 {
 	ssize_t r;
 	const struct iovec *iov;
+	struct iovec lim[2];
 	struct ssl_session *s = w->data;
 	int cnt = 0;
 
@@ -107,6 +174,10 @@ proxy_cl_bk(EV_P_ ev_io *w, int revents)
 		/* Can read from client fd to cl2bk buffer */
 		iov = ringbuf_readvec(s->cl2bk, &cnt);
 
+		if (s->shape != NULL && iov[0].iov_len > 0) {
+			iov = proxy_shape(s, shaper_upload, iov, &cnt, lim);
+		}
+
 		if (iov[0].iov_len > 0) {
 			while ((r = readv(s->fd, iov, cnt)) == -1) {
 				if (errno == EINTR) {
@@ -129,6 +200,14 @@ proxy_cl_bk(EV_P_ ev_io *w, int revents)
 			}
 
 			ringbuf_update_read(s->cl2bk, r);
+			s->bytes_in += r;
+
+			if (s->shape != NULL) {
+				shaper_charge(s->shape, shaper_upload, r);
+			}
+			if (s->mirror) {
+				mirror_data(s, mirror_client, iov, cnt, r);
+			}
 		}
 	}
 	if (revents & EV_WRITE) {
@@ -166,6 +245,7 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 {
 	ssize_t r;
 	const struct iovec *iov;
+	struct iovec lim[2];
 	struct ssl_session *s = w->data;
 	int cnt = 0;
 
@@ -173,6 +253,10 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 		/* Can read from backend fd to bk2cl buffer */
 		iov = ringbuf_readvec(s->bk2cl, &cnt);
 
+		if (s->shape != NULL && iov[0].iov_len > 0) {
+			iov = proxy_shape(s, shaper_download, iov, &cnt, lim);
+		}
+
 		if (iov[0].iov_len > 0) {
 			while ((r = readv(s->bk_fd, iov, cnt)) == -1) {
 				if (errno == EINTR) {
@@ -193,6 +277,14 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 			}
 
 			ringbuf_update_read(s->bk2cl, r);
+			s->bytes_out += r;
+
+			if (s->shape != NULL) {
+				shaper_charge(s->shape, shaper_download, r);
+			}
+			if (s->mirror) {
+				mirror_data(s, mirror_backend, iov, cnt, r);
+			}
 		}
 	}
 	if (revents & EV_WRITE) {
@@ -225,34 +317,61 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 }
 
 static void
-proxy_bk_cb(EV_P_ ev_io *w, int revents)
+proxy_bk_io(struct ssl_session *s, int revents)
 {
-	struct ssl_session *s = w->data;
-
 	if (s->bk_fd != -1 && (revents & EV_READ)) {
 		/* Backend to client */
-		proxy_bk_cl(loop, w, revents);
+		proxy_bk_cl(s->loop, &s->bk_io, revents);
 	}
 	if (s->bk_fd != -1 && (revents & EV_WRITE)) {
 		/* Buffer to backend */
-		proxy_cl_bk(loop, w, revents);
+		proxy_cl_bk(s->loop, &s->bk_io, revents);
 	}
-	proxy_state_machine(s);
 }
 
 static void
-proxy_cl_cb(EV_P_ ev_io *w, int revents)
+proxy_cl_io(struct ssl_session *s, int revents)
 {
-	struct ssl_session *s = w->data;
-
 	if (s->fd != -1 && (revents & EV_READ)) {
 		/* Client to backend */
-		proxy_cl_bk(loop, w, revents);
+		proxy_cl_bk(s->loop, &s->io, revents);
 	}
 	if (s->fd != -1 && (revents & EV_WRITE)) {
 		/* Buffer to client */
-		proxy_bk_cl(loop, w, revents);
+		proxy_bk_cl(s->loop, &s->io, revents);
+	}
+}
+
+static void
+proxy_bk_cb(EV_P_ ev_io *w, int revents)
+{
+	struct ssl_session *s = w->data;
+
+	if (s->worker->sched != NULL) {
+		/* Handled when the scheduler gets to the session */
+		s->sched_bk |= revents;
+		sched_ready(s->worker->sched, s);
+		return;
+	}
+
+	stats_cb(loop, stats_cb_relay);
+	proxy_bk_io(s, revents);
+	proxy_state_machine(s);
+}
+
+static void
+proxy_cl_cb(EV_P_ ev_io *w, int revents)
+{
+	struct ssl_session *s = w->data;
+
+	if (s->worker->sched != NULL) {
+		s->sched_cl |= revents;
+		sched_ready(s->worker->sched, s);
+		return;
 	}
+
+	stats_cb(loop, stats_cb_relay);
+	proxy_cl_io(s, revents);
 	proxy_state_machine(s);
 }
 
@@ -266,8 +385,9 @@ proxy_state_machine(struct ssl_session *s)
 		terminate_session(s);
 		return;
 	}
-	/* Client to backend */
-	if (ringbuf_can_read(s->cl2bk)) {
+	/* Client to backend, unless waiting for tokens */
+	if (ringbuf_can_read(s->cl2bk) &&
+			!(s->parked & (1u << shaper_upload))) {
 		/* Read data from client to cl2bk buffer */
 		cl_ev |= EV_READ;
 	}
@@ -276,7 +396,8 @@ proxy_state_machine(struct ssl_session *s)
 		bk_ev |= EV_WRITE;
 	}
 	/* Backend to client */
-	if (ringbuf_can_read(s->bk2cl)) {
+	if (ringbuf_can_read(s->bk2cl) &&
+			!(s->parked & (1u << shaper_download))) {
 		/* Read data from backend to bk2cl buffer */
 		bk_ev |= EV_READ;
 	}
@@ -310,5 +431,29 @@ proxy_create(struct ssl_session *s)
 
 	ev_io_init(&s->bk_io, proxy_bk_cb, s->bk_fd, EV_READ|EV_WRITE);
 	ev_io_init(&s->io, proxy_cl_cb, s->fd, EV_READ|EV_WRITE);
+	s->shape_tm.data = s;
+	ev_init(&s->shape_tm, shape_cb);
+	s->sched_class = sched_backend_class(s->bk);
+	proxy_state_machine(s);
+}
+
+/* Arms the watchers of a session that has been moved to another loop */
+void
+proxy_resume(struct ssl_session *s)
+{
+	proxy_state_machine(s);
+}
+
+/* Handles the events noted while the session waited for the scheduler */
+void
+proxy_serve(struct ssl_session *s)
+{
+	int bk = s->sched_bk, cl = s->sched_cl;
+
+	s->sched_bk = 0;
+	s->sched_cl = 0;
+	stats_cb(s->loop, stats_cb_relay);
+	proxy_bk_io(s, bk);
+	proxy_cl_io(s, cl);
 	proxy_state_machine(s);
 }
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Rate limits for new sessions, per SNI name and per client prefix, checked
+ * once the ClientHello is parsed and before the backend is connected.
+ *
+ * Every name or prefix has a token bucket in a fixed hash table. A table
+ * bucket is one cache line holding four entries, so a check reads a single
+ * line, and when all four are taken the entry idle for the longest time is
+ * replaced: by then its bucket would have filled up anyway, unless the
+ * table is much too small for the number of active keys.
+ *
+ * Sessions are parsed on the accepting loop only, so the table has a single
+ * writer and needs no atomics.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "ratelimit.h"
+#include "sni-private.h"
+
+#define RATELIMIT_WAYS 4
+
+static const unsigned default_size = 65536;
+static const unsigned default_ipv4_prefix = 32;
+static const unsigned default_ipv6_prefix = 64;
+/* Tokens are kept in thousandths, a rate per second is then per ms */
+static const uint64_t token = 1000;
+
+enum {
+	ratelimit_kind_sni = 1,
+	ratelimit_kind_client
+};
+
+struct ratelimit_entry {
+	uint64_t key;
+	uint32_t last;
+	uint32_t tokens;
+};
+
+struct ratelimit_bucket {
+	struct ratelimit_entry e[RATELIMIT_WAYS];
+} __attribute__((aligned(64)));
+
+struct ratelimit_table {
+	struct ratelimit_bucket *buckets;
+	uint64_t mask;
+	uint64_t seed;
+	unsigned size;
+	uint64_t evicted;
+};
+
+static struct {
+	bool enabled;
+	struct ratelimit_rule sni;
+	struct ratelimit_rule client;
+	unsigned ipv4_prefix;
+	unsigned ipv6_prefix;
+	struct ratelimit_table *table;
+	/* Counters */
+	uint64_t checked;
+	uint64_t denied_sni;
+	uint64_t denied_client;
+} limits;
+
+/* Read by ratelimit_configure(), installed by ratelimit_commit() */
+static struct {
+	struct ratelimit_rule sni;
+	struct ratelimit_rule client;
+	unsigned ipv4_prefix;
+	unsigned ipv6_prefix;
+	unsigned size;
+} staged;
+
+static uint64_t
+mix64(uint64_t h)
+{
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+
+	return h ^ (h >> 31);
+}
+
+/* FNV-1a over the bytes, optionally lower cased, then mixed with the seed */
+static uint64_t
+table_key(const struct ratelimit_table *t, unsigned kind, const void *data,
+		size_t len, bool fold)
+{
+	const unsigned char *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL ^ kind;
+	size_t i;
+
+	for (i = 0; i < len; i ++) {
+		h ^= fold ? tolower(p[i]) : p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	h = mix64(h ^ t->seed);
+
+	/* Zero marks a free entry */
+	return h != 0 ? h : 1;
+}
+
+uint64_t
+ratelimit_key(const struct ratelimit_table *t, unsigned kind,
+		const void *data, size_t len)
+{
+	return table_key(t, kind, data, len, false);
+}
+
+struct ratelimit_table*
+ratelimit_table_create(unsigned size)
+{
+	struct ratelimit_table *t;
+	unsigned nbuckets = 1;
+	int fd;
+
+	while (nbuckets * RATELIMIT_WAYS < size) {
+		nbuckets <<= 1;
+	}
+
+	t = xmalloc0(sizeof(*t));
+	t->size = size;
+	t->mask = nbuckets - 1;
+
+	if (posix_memalign((void **)&t->buckets, 64,
+			nbuckets * sizeof(*t->buckets)) != 0) {
+		abort();
+	}
+
+	memset(t->buckets, 0, nbuckets * sizeof(*t->buckets));
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1 || read(fd, &t->seed, sizeof(t->seed)) != sizeof(t->seed)) {
+		t->seed = (uint64_t)(ev_time() * 1e6) ^ getpid();
+	}
+
+	if (fd != -1) {
+		close(fd);
+	}
+
+	return t;
+}
+
+void
+ratelimit_table_free(struct ratelimit_table *t)
+{
+	if (t != NULL) {
+		free(t->buckets);
+		free(t);
+	}
+}
+
+uint64_t
+ratelimit_table_evicted(const struct ratelimit_table *t)
+{
+	return t->evicted;
+}
+
+bool
+ratelimit_take(struct ratelimit_table *t, uint64_t key,
+		const struct ratelimit_rule *rule, uint32_t now_ms)
+{
+	struct ratelimit_bucket *b = &t->buckets[key & t->mask];
+	struct ratelimit_entry *e = NULL, *victim = &b->e[0];
+	uint64_t tokens, max = rule->burst * token;
+	unsigned i;
+
+	for (i = 0; i < RATELIMIT_WAYS; i ++) {
+		if (b->e[i].key == key) {
+			e = &b->e[i];
+			break;
+		}
+		/* A free entry, or else the one idle for the longest time */
+		if (victim->key != 0 && (b->e[i].key == 0 ||
+				now_ms - b->e[i].last > now_ms - victim->last)) {
+			victim = &b->e[i];
+		}
+	}
+
+	if (e == NULL) {
+		if (victim->key != 0) {
+			t->evicted ++;
+		}
+
+		/* A new key starts with a full bucket */
+		e = victim;
+		e->key = key;
+		e->last = now_ms;
+		e->tokens = max;
+	}
+
+	tokens = e->tokens + (uint64_t)(now_ms - e->last) * rule->rate;
+	e->last = now_ms;
+
+	if (tokens > max) {
+		tokens = max;
+	}
+
+	if (tokens < token) {
+		e->tokens = tokens;
+		return false;
+	}
+
+	e->tokens = tokens - token;
+
+	return true;
+}
+
+static bool
+rule_configure(const ucl_object_t *cfg, const char *name,
+		struct ratelimit_rule *rule)
+{
+	const ucl_object_t *elt;
+	int64_t rate, burst;
+
+	memset(rule, 0, sizeof(*rule));
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "rate");
+	rate = elt ? ucl_object_toint(elt) : 0;
+	elt = ucl_object_find_key(cfg, "burst");
+	burst = elt ? ucl_object_toint(elt) : rate;
+
+	/* Thousandths of the burst must fit in 32 bits */
+	if (rate <= 0 || rate > 1000000 || burst < 1 || burst > 4000000) {
+		fprintf(stderr, "invalid %s rate limit: rate %lld, burst %lld\n",
+				name, (long long)rate, (long long)burst);
+		return false;
+	}
+
+	rule->rate = rate;
+	rule->burst = burst;
+
+	return true;
+}
+
+static bool
+prefix_configure(const ucl_object_t *cfg, const char *name, unsigned max,
+		unsigned *prefix)
+{
+	const ucl_object_t *elt;
+
+	if (cfg == NULL || (elt = ucl_object_find_key(cfg, name)) == NULL) {
+		return true;
+	}
+
+	if (ucl_object_toint(elt) < 1 || ucl_object_toint(elt) > max) {
+		fprintf(stderr, "invalid rate limit %s: %lld\n", name,
+				(long long)ucl_object_toint(elt));
+		return false;
+	}
+
+	*prefix = ucl_object_toint(elt);
+
+	return true;
+}
+
+bool
+ratelimit_configure(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt, *client;
+	struct ratelimit_rule sni_rule, client_rule;
+	unsigned ipv4_prefix = default_ipv4_prefix,
+			ipv6_prefix = default_ipv6_prefix, size = default_size;
+
+	client = cfg ? ucl_object_find_key(cfg, "client") : NULL;
+
+	if (!rule_configure(cfg ? ucl_object_find_key(cfg, "sni") : NULL, "sni",
+			&sni_rule) ||
+			!rule_configure(client, "client", &client_rule) ||
+			!prefix_configure(client, "ipv4_prefix", 32, &ipv4_prefix) ||
+			!prefix_configure(client, "ipv6_prefix", 128, &ipv6_prefix)) {
+		return false;
+	}
+
+	elt = cfg ? ucl_object_find_key(cfg, "size") : NULL;
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) < RATELIMIT_WAYS ||
+				ucl_object_toint(elt) > (1 << 26)) {
+			fprintf(stderr, "invalid rate limit table size: %lld\n",
+					(long long)ucl_object_toint(elt));
+			return false;
+		}
+
+		size = ucl_object_toint(elt);
+	}
+
+	staged.sni = sni_rule;
+	staged.client = client_rule;
+	staged.ipv4_prefix = ipv4_prefix;
+	staged.ipv6_prefix = ipv6_prefix;
+	staged.size = size;
+
+	return true;
+}
+
+void
+ratelimit_commit(bool apply)
+{
+	if (!apply) {
+		return;
+	}
+
+	limits.sni = staged.sni;
+	limits.client = staged.client;
+	limits.ipv4_prefix = staged.ipv4_prefix;
+	limits.ipv6_prefix = staged.ipv6_prefix;
+	limits.enabled = staged.sni.rate > 0 || staged.client.rate > 0;
+
+	if (!limits.enabled) {
+		ratelimit_table_free(limits.table);
+		limits.table = NULL;
+	}
+	else if (limits.table == NULL || limits.table->size != staged.size) {
+		ratelimit_table_free(limits.table);
+		limits.table = ratelimit_table_create(staged.size);
+	}
+}
+
+/* The client address with the host bits cleared */
+static size_t
+client_prefix(const struct ssl_session *ssl, unsigned char *buf)
+{
+	const unsigned char *addr;
+	unsigned bits, len, i;
+
+	if (ssl->peer.sa.sa_family == AF_INET) {
+		addr = (const unsigned char *)&ssl->peer.sin.sin_addr;
+		bits = limits.ipv4_prefix;
+		len = 4;
+	}
+	else if (ssl->peer.sa.sa_family == AF_INET6) {
+		addr = (const unsigned char *)&ssl->peer.sin6.sin6_addr;
+		bits = limits.ipv6_prefix;
+		len = 16;
+	}
+	else {
+		return 0;
+	}
+
+	for (i = 0; i < len; i ++) {
+		if (bits >= 8) {
+			buf[i] = addr[i];
+			bits -= 8;
+		}
+		else {
+			buf[i] = addr[i] & (0xff00 >> bits);
+			bits = 0;
+		}
+	}
+
+	return len;
+}
+
+bool
+ratelimit_session(struct ssl_session *ssl)
+{
+	struct ratelimit_table *t = limits.table;
+	unsigned char prefix[16];
+	uint32_t now;
+	size_t len;
+
+	if (!limits.enabled) {
+		return true;
+	}
+
+	now = (uint64_t)(ev_now(ssl->loop) * 1000.0);
+	limits.checked ++;
+
+	if (limits.client.rate > 0 && (len = client_prefix(ssl, prefix)) > 0 &&
+			!ratelimit_take(t, table_key(t, ratelimit_kind_client, prefix,
+			len, false), &limits.client, now)) {
+		limits.denied_client ++;
+		return false;
+	}
+
+	/* Otherwise a client would get a new bucket by changing the case */
+	if (limits.sni.rate > 0 && ssl->hostname != NULL &&
+			!ratelimit_take(t, table_key(t, ratelimit_kind_sni,
+			ssl->hostname, ssl->hostlen, true), &limits.sni, now)) {
+		limits.denied_sni ++;
+		return false;
+	}
+
+	return true;
+}
+
+ucl_object_t*
+ratelimit_to_ucl(void)
+{
+	ucl_object_t *top;
+
+	if (!limits.enabled) {
+		return NULL;
+	}
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, ucl_object_fromint(limits.checked),
+			"checked", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(limits.denied_client),
+			"denied_client", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(limits.denied_sni),
+			"denied_sni", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(limits.table->evicted),
+			"evicted", 0, false);
+
+	return top;
+}
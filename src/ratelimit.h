@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_RATELIMIT_H_
+#define SRC_RATELIMIT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ucl.h"
+
+struct ssl_session;
+struct ratelimit_table;
+
+/* Token bucket: `rate` new connections per second, up to `burst` at once */
+struct ratelimit_rule {
+	uint32_t rate;
+	uint32_t burst;
+};
+
+/*
+ * Reads the limits of the `rate_limits` section `cfg`, NULL disables them,
+ * once ratelimit_commit() installs them. The bucket table is kept on reload
+ * unless its size changes.
+ */
+bool ratelimit_configure(const ucl_object_t *cfg);
+/* Installs the limits read last if `apply`, keeps the current ones otherwise */
+void ratelimit_commit(bool apply);
+
+/* Takes a token for the client and SNI name of the session, false if denied */
+bool ratelimit_session(struct ssl_session *ssl);
+
+/* Counters, NULL if rate limits are disabled */
+ucl_object_t *ratelimit_to_ucl(void);
+
+/* A table of `size` buckets, rounded up to a power of 2 */
+struct ratelimit_table *ratelimit_table_create(unsigned size);
+void ratelimit_table_free(struct ratelimit_table *t);
+/* Entries replaced by other keys so far */
+uint64_t ratelimit_table_evicted(const struct ratelimit_table *t);
+/* Key of `len` bytes of `data` in the namespace `kind` */
+uint64_t ratelimit_key(const struct ratelimit_table *t, unsigned kind,
+		const void *data, size_t len);
+/* Takes a token from the bucket of `key` at `now_ms`, false if empty */
+bool ratelimit_take(struct ratelimit_table *t, uint64_t key,
+		const struct ratelimit_rule *rule, uint32_t now_ms);
+
+#endif /* SRC_RATELIMIT_H_ */
@@ -0,0 +1,776 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Relay threads: the worker that accepts connections parses the ClientHello
+ * and picks the route, then hands the session to one of the relay threads,
+ * each running its own loop, which connects to the backend and relays the
+ * session until it ends. Routing tables, listeners, source pools and TCP_INFO
+ * histograms stay shared in one process, sessions go through the command
+ * queue of the relay (ev_async, an eventfd on Linux) and only come back to
+ * the accepting worker to drop their references to the listener and route.
+ *
+ * Long sessions that carry most of the bytes may still pile up on a few
+ * relays. With rebalancing each relay measures its relay rate and loop lag,
+ * and the main loop moves established sessions, with their sockets and
+ * buffered data, from the busiest relay to the least loaded one.
+ *
+ * With accept throttling a loop over its lag, session or buffer limits takes
+ * no new sessions until it recovers, and the main loop stops accepting while
+ * no loop has room, leaving new connections in the listen backlog.
+ */
+
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "stats.h"
+#include "cmdq.h"
+#include "tcpinfo.h"
+#include "scheduler.h"
+#include "mirror.h"
+#include "sni-private.h"
+
+extern void proxy_resume(struct ssl_session *s);
+
+static const double default_interval = 1.0;
+static const double default_threshold = 1.5;
+static const uint64_t default_min_rate = 1024 * 1024;
+static const double default_max_lag = 0.05;
+static const unsigned default_max_sessions = 64;
+/* Weight of the last tick in the published load */
+static const double load_smoothing = 0.5;
+static const double default_throttle_interval = 0.1;
+static const double default_throttle_lag = 0.02;
+static const double default_throttle_resume = 0.8;
+
+struct relay_load {
+	ev_timer tick;
+	struct sni_worker *worker;
+	double interval;
+	ev_tstamp last;
+	ev_tstamp due;
+	double rate;
+	double lag;
+};
+
+static struct {
+	bool enabled;
+	double interval;
+	/* Busiest relay rate over the mean that starts a move */
+	double threshold;
+	/* Rate difference below which moves are not worth it */
+	uint64_t min_rate;
+	double max_lag;
+	unsigned max_sessions;
+	/* Ticks to wait after a move for the loads to show it */
+	unsigned cooldown;
+	ev_timer timer;
+	struct sni_worker *home;
+} rebalance;
+
+static struct {
+	bool enabled;
+	double interval;
+	double max_lag;
+	/* No limit if 0 */
+	unsigned max_sessions;
+	uint64_t max_buffered;
+	/* Share of the limits a saturated loop must get under to resume */
+	double resume;
+} throttle;
+
+struct rebalance_job {
+	struct sni_worker *from;
+	struct sni_worker *to;
+	uint64_t amount;
+};
+
+static void*
+relay_run(void *arg)
+{
+	struct sni_worker *w = arg;
+
+	ev_run(w->loop, 0);
+
+	return NULL;
+}
+
+static bool
+rebalance_configure(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt;
+	int64_t n;
+
+	rebalance.interval = default_interval;
+	rebalance.threshold = default_threshold;
+	rebalance.min_rate = default_min_rate;
+	rebalance.max_lag = default_max_lag;
+	rebalance.max_sessions = default_max_sessions;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "enabled");
+	rebalance.enabled = elt == NULL || ucl_object_toboolean(elt);
+
+	elt = ucl_object_find_key(cfg, "interval");
+
+	if (elt != NULL) {
+		rebalance.interval = ucl_object_todouble(elt);
+
+		if (rebalance.interval < 0.01) {
+			fprintf(stderr, "invalid rebalance interval: %f\n",
+					rebalance.interval);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "threshold");
+
+	if (elt != NULL) {
+		rebalance.threshold = ucl_object_todouble(elt);
+
+		if (rebalance.threshold <= 1.0) {
+			fprintf(stderr, "invalid rebalance threshold: %f\n",
+					rebalance.threshold);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "min_rate");
+
+	if (elt != NULL) {
+		n = ucl_object_toint(elt);
+
+		if (n < 0) {
+			fprintf(stderr, "invalid rebalance min_rate: %lld\n",
+					(long long)n);
+			return false;
+		}
+
+		rebalance.min_rate = n;
+	}
+
+	elt = ucl_object_find_key(cfg, "max_lag");
+
+	if (elt != NULL) {
+		rebalance.max_lag = ucl_object_todouble(elt);
+
+		if (rebalance.max_lag <= 0) {
+			fprintf(stderr, "invalid rebalance max_lag: %f\n",
+					rebalance.max_lag);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "max_sessions");
+
+	if (elt != NULL) {
+		n = ucl_object_toint(elt);
+
+		if (n <= 0 || n > 65536) {
+			fprintf(stderr, "invalid rebalance max_sessions: %lld\n",
+					(long long)n);
+			return false;
+		}
+
+		rebalance.max_sessions = n;
+	}
+
+	return true;
+}
+
+static bool
+throttle_configure(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt;
+	int64_t n;
+
+	throttle.interval = default_throttle_interval;
+	throttle.max_lag = default_throttle_lag;
+	throttle.resume = default_throttle_resume;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "enabled");
+	throttle.enabled = elt == NULL || ucl_object_toboolean(elt);
+
+	elt = ucl_object_find_key(cfg, "interval");
+
+	if (elt != NULL) {
+		throttle.interval = ucl_object_todouble(elt);
+
+		if (throttle.interval < 0.01) {
+			fprintf(stderr, "invalid accept_throttle interval: %f\n",
+					throttle.interval);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "max_lag");
+
+	if (elt != NULL) {
+		throttle.max_lag = ucl_object_todouble(elt);
+
+		if (throttle.max_lag <= 0) {
+			fprintf(stderr, "invalid accept_throttle max_lag: %f\n",
+					throttle.max_lag);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "max_sessions");
+
+	if (elt != NULL) {
+		n = ucl_object_toint(elt);
+
+		if (n < 0 || n > UINT32_MAX) {
+			fprintf(stderr, "invalid accept_throttle max_sessions: %lld\n",
+					(long long)n);
+			return false;
+		}
+
+		throttle.max_sessions = n;
+	}
+
+	elt = ucl_object_find_key(cfg, "max_buffered");
+
+	if (elt != NULL) {
+		n = ucl_object_toint(elt);
+
+		if (n < 0) {
+			fprintf(stderr, "invalid accept_throttle max_buffered: %lld\n",
+					(long long)n);
+			return false;
+		}
+
+		throttle.max_buffered = n;
+	}
+
+	elt = ucl_object_find_key(cfg, "resume");
+
+	if (elt != NULL) {
+		throttle.resume = ucl_object_todouble(elt);
+
+		if (throttle.resume <= 0 || throttle.resume > 1.0) {
+			fprintf(stderr, "invalid accept_throttle resume: %f\n",
+					throttle.resume);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Loops measure their load as often as the faster user of it needs */
+static double
+load_interval(void)
+{
+	if (throttle.enabled && rebalance.enabled) {
+		return MIN(throttle.interval, rebalance.interval);
+	}
+
+	return throttle.enabled ? throttle.interval : rebalance.interval;
+}
+
+/* Whether new sessions still go to the worker, with some hysteresis */
+static bool
+throttle_saturated(const struct sni_worker *w, double lag, uint64_t buffered)
+{
+	double k = w->saturated ? throttle.resume : 1.0;
+
+	if (lag >= throttle.max_lag * k) {
+		return true;
+	}
+	if (throttle.max_sessions > 0 &&
+			w->nsessions >= throttle.max_sessions * k) {
+		return true;
+	}
+	if (throttle.max_buffered > 0 && buffered >= throttle.max_buffered * k) {
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * On the main loop: accepts while the loop itself has room and, with relays,
+ * while some relay has. With classes that may be shed, it keeps accepting
+ * and refuses their new sessions instead, so that the others still get in.
+ */
+static void
+throttle_accept(struct sni_worker *home)
+{
+	bool pause = home->saturated, shed;
+	unsigned i;
+
+	if (!pause && home->nrelays > 0) {
+		pause = true;
+
+		for (i = 0; i < home->nrelays; i ++) {
+			if (!__atomic_load_n(&home->relays[i]->saturated,
+					__ATOMIC_RELAXED)) {
+				pause = false;
+				break;
+			}
+		}
+	}
+
+	shed = pause && sched_sheds();
+
+	if (shed != home->shedding) {
+		home->shedding = shed;
+		fprintf(stderr, "accept shedding %s: %s\n", shed ? "started" : "stopped",
+				home->saturated ? "main loop saturated" :
+				(shed ? "all relays saturated" : "load is down"));
+	}
+
+	if (shed) {
+		pause = false;
+	}
+
+	if (pause != !!(home->accept_paused & accept_pause_load)) {
+		listeners_pause(home, accept_pause_load, pause);
+		fprintf(stderr, "accept %s: %s\n", pause ? "paused" : "resumed",
+				home->saturated ? "main loop saturated" :
+				(pause ? "all relays saturated" : "load is down"));
+	}
+}
+
+/*
+ * On the relay loop: rates of the sessions since the previous tick, their
+ * sum, the bytes waiting in their buffers and how late the tick itself ran,
+ * which is how long any event waits on this loop. The main loop runs it too
+ * when accept throttling is on.
+ */
+static void
+relay_load_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct relay_load *ld = w->data;
+	struct sni_worker *worker = ld->worker;
+	struct ssl_session *ssl;
+	ev_tstamp now = ev_now(loop);
+	double dt, lag, sum = 0;
+	uint64_t bytes, buffered = 0;
+	bool saturated;
+
+	stats_cb(loop, stats_cb_rebalance);
+	dt = now - ld->last;
+	lag = ev_time() - ld->due;
+
+	if (lag < 0) {
+		lag = 0;
+	}
+
+	if (dt > 0) {
+		for (ssl = worker->sessions; ssl != NULL; ssl = ssl->next) {
+			bytes = ssl->bytes_in + ssl->bytes_out;
+			ssl->rate = (bytes - ssl->rate_mark) / dt;
+			ssl->rate_mark = bytes;
+			sum += ssl->rate;
+
+			if (ssl->cl2bk != NULL) {
+				buffered += ssl->cl2bk->wr_avail + ssl->bk2cl->wr_avail;
+			}
+		}
+
+		ld->rate += (sum - ld->rate) * load_smoothing;
+	}
+
+	ld->lag += (lag - ld->lag) * load_smoothing;
+	ld->last = now;
+	__atomic_store_n(&worker->load_rate, (uint64_t)ld->rate,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&worker->load_lag, (uint64_t)(ld->lag * 1e6),
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&worker->load_buffered, buffered, __ATOMIC_RELAXED);
+
+	if (throttle.enabled) {
+		saturated = throttle_saturated(worker, ld->lag, buffered);
+		__atomic_store_n(&worker->saturated, saturated, __ATOMIC_RELAXED);
+
+		if (!worker->relay) {
+			throttle_accept(worker);
+		}
+	}
+
+	ld->due = now + ld->interval;
+	ev_timer_set(w, ld->interval, 0.0);
+	ev_timer_start(loop, w);
+}
+
+static void
+relay_load_start(struct sni_worker *w)
+{
+	struct relay_load *ld;
+
+	ld = xmalloc0(sizeof(*ld));
+	ld->worker = w;
+	ld->interval = load_interval();
+	ld->last = ev_now(w->loop);
+	ld->due = ld->last + ld->interval;
+	ld->tick.data = ld;
+	ev_timer_init(&ld->tick, relay_load_cb, ld->interval, 0.0);
+	ev_timer_start(w->loop, &ld->tick);
+	/* Relays live by their command queue, the main loop by its listeners */
+	ev_unref(w->loop);
+	w->load = ld;
+}
+
+/* On the destination relay loop */
+static void
+session_arrive(struct ev_loop *loop, void *arg)
+{
+	struct ssl_session *ssl = arg;
+
+	stats_cb(loop, stats_cb_handoff);
+	session_attach(ssl->worker, ssl);
+	__atomic_add_fetch(&ssl->worker->moved_in, 1, __ATOMIC_RELAXED);
+	proxy_resume(ssl);
+}
+
+static int
+session_rate_cmp(const void *a, const void *b)
+{
+	const struct ssl_session *sa = *(struct ssl_session * const *)a,
+			*sb = *(struct ssl_session * const *)b;
+
+	if (sa->rate != sb->rate) {
+		return sa->rate < sb->rate ? 1 : -1;
+	}
+
+	return 0;
+}
+
+/*
+ * On the busiest relay loop: moves sessions carrying up to `amount` bytes/s,
+ * the largest first. A session that alone is above what is left stays, so
+ * that one hot session does not bounce between relays.
+ */
+static void
+rebalance_exec(struct ev_loop *loop, void *arg)
+{
+	struct rebalance_job *job = arg;
+	struct sni_worker *worker = job->from, *to = job->to;
+	struct ssl_session *ssl, **cand;
+	uint64_t moved = 0;
+	unsigned i, n = 0, nmoved = 0;
+
+	stats_cb(loop, stats_cb_rebalance);
+
+	if (worker->nsessions == 0) {
+		free(job);
+		return;
+	}
+
+	cand = xmalloc(worker->nsessions * sizeof(*cand));
+
+	for (ssl = worker->sessions; ssl != NULL; ssl = ssl->next) {
+		/*
+		 * Only sessions with both legs open and nothing but I/O watched.
+		 * An expired shaping timer is no longer active but its callback
+		 * may still be pending on this loop.
+		 */
+		if (ssl->state == ssl_state_proxy && ssl->rate > 0 &&
+				!ev_is_active(&ssl->tm) && !ev_is_active(&ssl->shape_tm) &&
+				!ev_is_pending(&ssl->shape_tm)) {
+			cand[n ++] = ssl;
+		}
+	}
+
+	qsort(cand, n, sizeof(*cand), session_rate_cmp);
+
+	for (i = 0; i < n && nmoved < rebalance.max_sessions; i ++) {
+		ssl = cand[i];
+
+		if (moved + ssl->rate > job->amount) {
+			continue;
+		}
+
+		ev_io_stop(loop, &ssl->io);
+		ev_io_stop(loop, &ssl->bk_io);
+		session_unlink(ssl);
+		/*
+		 * Buffered data stays in the ring buffers, unread data in the
+		 * sockets; the destination picks up both when it arms the
+		 * watchers. As on handoff, our loop may see one stale event.
+		 */
+		ssl->worker = to;
+		cmdq_push(to->cmdq, session_arrive, ssl);
+		moved += ssl->rate;
+		nmoved ++;
+	}
+
+	free(cand);
+
+	if (nmoved > 0) {
+		__atomic_add_fetch(&worker->moved_out, nmoved, __ATOMIC_RELAXED);
+		fprintf(stderr, "rebalance: moved %u sessions (%llu bytes/s) from "
+				"worker %u to worker %u\n", nmoved,
+				(unsigned long long)moved, worker->id, to->id);
+	}
+
+	free(job);
+}
+
+/*
+ * On the main loop: compares the loads published by the relays and asks the
+ * busiest one to move part of its sessions to the least loaded one. A relay
+ * lagging behind max_lag is the busiest whatever its rate.
+ */
+static void
+rebalance_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct sni_worker *home = rebalance.home, *r, *busy = NULL, *idle = NULL;
+	struct rebalance_job *job;
+	uint64_t rate, lag, busy_rate = 0, busy_lag = 0, idle_rate = 0,
+			sum = 0, mean, amount, max_lag;
+	unsigned i;
+
+	stats_cb(loop, stats_cb_rebalance);
+
+	if (rebalance.cooldown > 0) {
+		rebalance.cooldown --;
+		return;
+	}
+
+	max_lag = rebalance.max_lag * 1e6;
+
+	for (i = 0; i < home->nrelays; i ++) {
+		r = home->relays[i];
+		rate = __atomic_load_n(&r->load_rate, __ATOMIC_RELAXED);
+		lag = __atomic_load_n(&r->load_lag, __ATOMIC_RELAXED);
+		sum += rate;
+
+		if (busy == NULL || (lag > max_lag) > (busy_lag > max_lag) ||
+				((lag > max_lag) == (busy_lag > max_lag) &&
+				rate > busy_rate)) {
+			busy = r;
+			busy_rate = rate;
+			busy_lag = lag;
+		}
+
+		if (lag < max_lag / 2 && (idle == NULL || rate < idle_rate)) {
+			idle = r;
+			idle_rate = rate;
+		}
+	}
+
+	if (busy == NULL || idle == NULL || busy == idle) {
+		return;
+	}
+
+	mean = sum / home->nrelays;
+	amount = busy_rate > idle_rate ? (busy_rate - idle_rate) / 2 : 0;
+
+	if (busy_lag > max_lag) {
+		if (amount == 0) {
+			amount = busy_rate / 4;
+		}
+	}
+	else if (busy_rate < mean * rebalance.threshold ||
+			amount * 2 < rebalance.min_rate) {
+		return;
+	}
+
+	if (amount == 0) {
+		return;
+	}
+
+	job = xmalloc(sizeof(*job));
+	job->from = busy;
+	job->to = idle;
+	job->amount = amount;
+	cmdq_push(busy->cmdq, rebalance_exec, job);
+	/* Both relays publish their new loads after a full tick */
+	rebalance.cooldown = 2;
+}
+
+bool
+relays_start(struct sni_worker *home, unsigned n, const ucl_object_t *cfg)
+{
+	struct sni_worker *w;
+	pthread_t th;
+	sigset_t all, old;
+	unsigned i;
+	int r;
+
+	if (!rebalance_configure(ucl_object_find_key(cfg, "rebalance")) ||
+			!throttle_configure(ucl_object_find_key(cfg,
+			"accept_throttle"))) {
+		return false;
+	}
+
+	if (throttle.enabled) {
+		relay_load_start(home);
+	}
+
+	if (n == 0) {
+		return true;
+	}
+
+	home->relays = xmalloc0(n * sizeof(*home->relays));
+
+	/* Signals are handled by the main loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < n; i ++) {
+		w = xmalloc0(sizeof(*w));
+		w->loop = ev_loop_new(EVFLAG_AUTO);
+
+		if (w->loop == NULL) {
+			fprintf(stderr, "cannot create loop for relay thread %u\n", i);
+			goto err;
+		}
+
+		w->id = home->id + 1 + i;
+		w->relay = true;
+		w->cmdq = cmdq_create(w->loop);
+		/* Unlike other loops, this one lives by its command queue */
+		ev_ref(w->loop);
+
+		if (!stats_init(w->loop, ucl_object_find_key(cfg, "stats")) ||
+				!tcpinfo_init(w, ucl_object_find_key(cfg, "tcp_info"))) {
+			goto err;
+		}
+
+		if (rebalance.enabled || throttle.enabled) {
+			relay_load_start(w);
+		}
+
+		sched_start(w);
+		mirror_start(w);
+
+		if ((r = pthread_create(&th, NULL, relay_run, w)) != 0) {
+			fprintf(stderr, "cannot start relay thread %u: %s\n", i,
+					strerror(r));
+			goto err;
+		}
+
+		pthread_detach(th);
+		home->relays[home->nrelays ++] = w;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rebalance.enabled && n > 1) {
+		rebalance.home = home;
+		ev_timer_init(&rebalance.timer, rebalance_cb, rebalance.interval,
+				rebalance.interval);
+		ev_timer_start(home->loop, &rebalance.timer);
+		ev_unref(home->loop);
+	}
+
+	return true;
+
+err:
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return false;
+}
+
+/* On the relay loop */
+static void
+session_adopt(struct ev_loop *loop, void *arg)
+{
+	struct ssl_session *ssl = arg;
+
+	stats_cb(loop, stats_cb_handoff);
+	session_attach(ssl->worker, ssl);
+	session_connect(ssl);
+}
+
+/*
+ * The less busy of the next two relays in turn: turns spread bursts that
+ * have not reached their relays yet, the choice evens out long sessions.
+ * Saturated relays are passed over while others have room.
+ */
+static struct sni_worker*
+relay_choose(struct sni_worker *home)
+{
+	struct sni_worker *a, *b, *r;
+	bool sa, sb;
+	unsigned i;
+
+	a = home->relays[home->next_relay ++ % home->nrelays];
+	b = home->relays[home->next_relay % home->nrelays];
+	sa = __atomic_load_n(&a->saturated, __ATOMIC_RELAXED);
+	sb = __atomic_load_n(&b->saturated, __ATOMIC_RELAXED);
+
+	if (sa != sb) {
+		return sa ? b : a;
+	}
+
+	if (sa) {
+		for (i = 0; i < home->nrelays; i ++) {
+			r = home->relays[(home->next_relay + i) % home->nrelays];
+
+			if (!__atomic_load_n(&r->saturated, __ATOMIC_RELAXED)) {
+				return r;
+			}
+		}
+
+		/* Accepting stops at the next tick of the main loop */
+		return a;
+	}
+
+	return __atomic_load_n(&b->nsessions, __ATOMIC_RELAXED) <
+			__atomic_load_n(&a->nsessions, __ATOMIC_RELAXED) ? b : a;
+}
+
+void
+session_relay(struct ssl_session *ssl)
+{
+	struct sni_worker *home = ssl->worker, *relay;
+
+	if (home->nrelays == 0) {
+		session_connect(ssl);
+		return;
+	}
+
+	relay = relay_choose(home);
+	tcpinfo_session_prepare(ssl);
+	session_unlink(ssl);
+	/*
+	 * No watcher is active, the session belongs to the relay from now on.
+	 * Our loop may still see one stale event for the client socket, which
+	 * libev drops as nobody watches it.
+	 */
+	ssl->worker = relay;
+	cmdq_push(relay->cmdq, session_adopt, ssl);
+}
@@ -72,7 +72,8 @@ ringbuf_can_write(struct ringbuf *r)
 const struct iovec*
 ringbuf_readvec(struct ringbuf *r, int *cnt)
 {
-	static struct iovec iov[2];
+	/* Per thread, relay threads fill their vectors concurrently */
+	static __thread struct iovec iov[2];
 	int p1;
 
 	p1 = MIN(r->rd_avail, (r->end - r->buf) - r->read_pos);
@@ -95,7 +96,8 @@ ringbuf_readvec(struct ringbuf *r, int *cnt)
 const struct iovec*
 ringbuf_writevec(struct ringbuf *r, int *cnt)
 {
-	static struct iovec iov[2];
+	/* Per thread, relay threads fill their vectors concurrently */
+	static __thread struct iovec iov[2];
 	int p1;
 
 	/* write_pos to end + start to read_pos */
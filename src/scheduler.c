@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Weighted fair scheduling of relay work.
+ *
+ * libev runs the callbacks of ready sockets in the order the kernel reports
+ * them, so on a loop that has more work than time a flood of bulk sessions
+ * delays everything else. With scheduling the relay I/O callbacks only note
+ * the events and queue the session in the queue of its class. Before the
+ * loop polls again, up to `budget` sessions are served, the class with the
+ * least virtual time first (stride scheduling): a class is charged its
+ * stride, the inverse of its weight, per session served. A class that had
+ * nothing queued starts at the current virtual time rather than with the
+ * credit of its idle time.
+ *
+ * Sessions left over wait for the next iteration, which does not block in
+ * poll while any are queued. Their sockets stay readable or writable, the
+ * level triggered watchers report them again and they keep their place.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "scheduler.h"
+#include "sni-private.h"
+
+#define SCHED_CLASSES_MAX 8
+/* Virtual time a class of weight 1 is charged per session served */
+#define SCHED_STRIDE (1u << 20)
+
+extern void proxy_serve(struct ssl_session *s);
+
+static const unsigned default_budget = 256;
+static const unsigned max_weight = 1000;
+
+struct sched_class {
+	char *name;
+	unsigned weight;
+	uint64_t stride;
+	/* Refused under overload, counted on the main loop */
+	bool shed;
+	uint64_t refused;
+};
+
+static struct {
+	bool enabled;
+	unsigned budget;
+	struct sched_class classes[SCHED_CLASSES_MAX];
+	unsigned nclasses;
+	unsigned def;
+	bool sheds;
+} sched;
+
+struct sched_queue {
+	struct ssl_session *head;
+	struct ssl_session *tail;
+	unsigned len;
+	uint64_t pass;
+	/* Sessions served, and left waiting at the end of an iteration */
+	uint64_t served;
+	uint64_t deferred;
+};
+
+/* Per worker, used by its loop only */
+struct relay_sched {
+	ev_prepare prepare;
+	/* Keeps the loop from blocking while sessions wait */
+	ev_idle idle;
+	uint64_t vtime;
+	unsigned queued;
+	/* Iterations that ended with sessions waiting */
+	uint64_t overruns;
+	struct sched_queue q[SCHED_CLASSES_MAX];
+};
+
+static bool
+class_configure(struct sched_class *cls, const char *name,
+		const ucl_object_t *obj)
+{
+	const ucl_object_t *elt;
+	int64_t weight = 1;
+
+	elt = obj ? ucl_object_find_key(obj, "weight") : NULL;
+
+	if (elt != NULL) {
+		weight = ucl_object_toint(elt);
+
+		if (weight < 1 || weight > max_weight) {
+			fprintf(stderr, "invalid scheduling class %s weight: %lld\n", name,
+					(long long)weight);
+			return false;
+		}
+	}
+
+	elt = obj ? ucl_object_find_key(obj, "shed") : NULL;
+
+	cls->name = xmalloc(strlen(name) + 1);
+	strcpy(cls->name, name);
+	cls->weight = weight;
+	cls->stride = SCHED_STRIDE / weight;
+	cls->shed = elt != NULL && ucl_object_toboolean(elt);
+
+	return true;
+}
+
+bool
+sched_configure(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	int64_t budget;
+	int def;
+	unsigned i;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "enabled");
+
+	if (elt != NULL && !ucl_object_toboolean(elt)) {
+		return true;
+	}
+
+	sched.budget = default_budget;
+	elt = ucl_object_find_key(cfg, "budget");
+
+	if (elt != NULL) {
+		budget = ucl_object_toint(elt);
+
+		if (budget < 1 || budget > 65536) {
+			fprintf(stderr, "invalid scheduling budget: %lld\n",
+					(long long)budget);
+			return false;
+		}
+
+		sched.budget = budget;
+	}
+
+	elt = ucl_object_find_key(cfg, "classes");
+
+	if (elt != NULL) {
+		while ((cur = ucl_iterate_object(elt, &it, true))) {
+			if (sched.nclasses == SCHED_CLASSES_MAX) {
+				fprintf(stderr, "too many scheduling classes, at most %d\n",
+						SCHED_CLASSES_MAX);
+				return false;
+			}
+
+			if (!class_configure(&sched.classes[sched.nclasses],
+					ucl_object_key(cur), cur)) {
+				return false;
+			}
+
+			sched.nclasses ++;
+		}
+	}
+
+	if (sched.nclasses == 0) {
+		/* Only the budget, sessions are served in turn */
+		class_configure(&sched.classes[sched.nclasses ++], "default", NULL);
+	}
+
+	elt = ucl_object_find_key(cfg, "default");
+
+	if (elt != NULL) {
+		def = sched_class_find(ucl_object_tostring_forced(elt));
+
+		if (def < 0) {
+			fprintf(stderr, "invalid scheduling default class: %s\n",
+					ucl_object_tostring_forced(elt));
+			return false;
+		}
+
+		sched.def = def;
+	}
+	else if (sched.nclasses > 1) {
+		fprintf(stderr, "scheduling: default class is not set\n");
+		return false;
+	}
+
+	for (i = 0; i < sched.nclasses; i ++) {
+		if (sched.classes[i].shed) {
+			sched.sheds = true;
+		}
+	}
+
+	sched.enabled = true;
+
+	return true;
+}
+
+int
+sched_class_find(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < sched.nclasses; i ++) {
+		if (strcmp(sched.classes[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+unsigned
+sched_backend_class(const ucl_object_t *bk)
+{
+	const ucl_object_t *elt;
+
+	if (!sched.enabled) {
+		return 0;
+	}
+
+	if (bk != NULL && (elt = ucl_object_find_key(bk, "class")) != NULL) {
+		return ucl_object_toint(elt);
+	}
+
+	return sched.def;
+}
+
+static void
+sched_idle_cb(EV_P_ ev_idle *w, int revents)
+{
+}
+
+static void
+sched_prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct relay_sched *rs = w->data;
+	struct sched_queue *q;
+	struct ssl_session *s;
+	unsigned i, best, n;
+
+	for (n = 0; rs->queued > 0 && n < sched.budget; n ++) {
+		best = SCHED_CLASSES_MAX;
+
+		for (i = 0; i < sched.nclasses; i ++) {
+			if (rs->q[i].head == NULL) {
+				continue;
+			}
+			if (best == SCHED_CLASSES_MAX || rs->q[i].pass < rs->q[best].pass) {
+				best = i;
+			}
+		}
+
+		q = &rs->q[best];
+		s = q->head;
+		q->head = s->sched_next;
+
+		if (q->head != NULL) {
+			q->head->sched_prev = NULL;
+		}
+		else {
+			q->tail = NULL;
+		}
+
+		q->len --;
+		rs->queued --;
+		s->sched_queued = false;
+		rs->vtime = q->pass;
+		q->pass += sched.classes[best].stride;
+		q->served ++;
+		/* May end the session */
+		proxy_serve(s);
+	}
+
+	if (rs->queued > 0) {
+		rs->overruns ++;
+
+		for (i = 0; i < sched.nclasses; i ++) {
+			rs->q[i].deferred += rs->q[i].len;
+		}
+
+		if (!ev_is_active(&rs->idle)) {
+			ev_idle_start(loop, &rs->idle);
+		}
+	}
+	else if (ev_is_active(&rs->idle)) {
+		ev_idle_stop(loop, &rs->idle);
+	}
+}
+
+void
+sched_start(struct sni_worker *worker)
+{
+	struct relay_sched *rs;
+
+	if (!sched.enabled) {
+		return;
+	}
+
+	rs = xmalloc0(sizeof(*rs));
+	rs->prepare.data = rs;
+	ev_prepare_init(&rs->prepare, sched_prepare_cb);
+	ev_prepare_start(worker->loop, &rs->prepare);
+	/* Sessions keep the loop alive, not the scheduler */
+	ev_unref(worker->loop);
+	ev_idle_init(&rs->idle, sched_idle_cb);
+	worker->sched = rs;
+}
+
+void
+sched_ready(struct relay_sched *rs, struct ssl_session *ssl)
+{
+	struct sched_queue *q;
+
+	if (ssl->sched_queued) {
+		return;
+	}
+
+	q = &rs->q[ssl->sched_class];
+
+	if (q->head == NULL) {
+		/* An idle class does not save up its share */
+		if (q->pass < rs->vtime) {
+			q->pass = rs->vtime;
+		}
+
+		q->head = ssl;
+	}
+	else {
+		q->tail->sched_next = ssl;
+	}
+
+	ssl->sched_prev = q->tail;
+	ssl->sched_next = NULL;
+	ssl->sched_queued = true;
+	q->tail = ssl;
+	q->len ++;
+	rs->queued ++;
+}
+
+void
+sched_cancel(struct ssl_session *ssl)
+{
+	struct relay_sched *rs;
+	struct sched_queue *q;
+
+	if (!ssl->sched_queued) {
+		return;
+	}
+
+	rs = ssl->worker->sched;
+	q = &rs->q[ssl->sched_class];
+
+	if (ssl->sched_prev != NULL) {
+		ssl->sched_prev->sched_next = ssl->sched_next;
+	}
+	else {
+		q->head = ssl->sched_next;
+	}
+
+	if (ssl->sched_next != NULL) {
+		ssl->sched_next->sched_prev = ssl->sched_prev;
+	}
+	else {
+		q->tail = ssl->sched_prev;
+	}
+
+	q->len --;
+	rs->queued --;
+	ssl->sched_queued = false;
+	/* Watchers are armed afresh, they report what is still ready */
+	ssl->sched_bk = 0;
+	ssl->sched_cl = 0;
+}
+
+bool
+sched_sheds(void)
+{
+	return sched.sheds;
+}
+
+bool
+sched_shed(const ucl_object_t *bk)
+{
+	struct sched_class *cls;
+
+	if (!sched.sheds) {
+		return false;
+	}
+
+	cls = &sched.classes[sched_backend_class(bk)];
+
+	if (cls->shed) {
+		cls->refused ++;
+	}
+
+	return cls->shed;
+}
+
+ucl_object_t*
+sched_to_ucl(struct sni_worker *worker)
+{
+	struct relay_sched *rs = worker->sched;
+	ucl_object_t *top, *classes, *obj;
+	unsigned i;
+
+	if (rs == NULL) {
+		return NULL;
+	}
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	classes = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, ucl_object_fromint(sched.budget), "budget", 0,
+			false);
+	ucl_object_insert_key(top, ucl_object_fromint(rs->overruns), "overruns", 0,
+			false);
+
+	for (i = 0; i < sched.nclasses; i ++) {
+		obj = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(obj, ucl_object_fromint(sched.classes[i].weight),
+				"weight", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(rs->q[i].served),
+				"served", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(rs->q[i].deferred),
+				"deferred", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(rs->q[i].len),
+				"queued", 0, false);
+
+		if (!worker->relay && sched.classes[i].shed) {
+			ucl_object_insert_key(obj,
+					ucl_object_fromint(sched.classes[i].refused), "refused", 0,
+					false);
+		}
+
+		ucl_object_insert_key(classes, obj, sched.classes[i].name, 0, false);
+	}
+
+	ucl_object_insert_key(top, classes, "classes", 0, false);
+
+	return top;
+}
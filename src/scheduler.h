@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_SCHEDULER_H_
+#define SRC_SCHEDULER_H_
+
+#include <stdbool.h>
+
+#include "ucl.h"
+
+struct ssl_session;
+struct sni_worker;
+struct relay_sched;
+
+/*
+ * Reads the priority classes and the budget of the `scheduling` section
+ * `cfg`, NULL disables scheduling. Called once at startup, before backends
+ * are resolved.
+ */
+bool sched_configure(const ucl_object_t *cfg);
+
+/* Index of priority class `name`, -1 if there is no such class */
+int sched_class_find(const char *name);
+/* Class of the sessions of backend `bk`, NULL is the original destination */
+unsigned sched_backend_class(const ucl_object_t *bk);
+
+/* Runs the relay callbacks of `worker` through a scheduler if enabled */
+void sched_start(struct sni_worker *worker);
+
+/* Queues a session with events to handle, at most once */
+void sched_ready(struct relay_sched *rs, struct ssl_session *ssl);
+/* Drops a session from the queue of its worker, if it is queued */
+void sched_cancel(struct ssl_session *ssl);
+
+/* True if some class is refused rather than accept paused under overload */
+bool sched_sheds(void);
+/* True if new sessions of backend `bk` are refused under overload, counts them */
+bool sched_shed(const ucl_object_t *bk);
+
+/* Counters of the worker's queues, NULL without scheduling */
+ucl_object_t *sched_to_ucl(struct sni_worker *worker);
+
+#endif /* SRC_SCHEDULER_H_ */
@@ -0,0 +1,655 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Bandwidth shaping of relayed sessions: globally, per SNI name and per
+ * backend, separately for each direction.
+ *
+ * A session is charged to up to three buckets per direction and may move
+ * what the emptiest one allows. Buckets are GCRA ones: the state is a single
+ * time, when the bucket would be full again, and `burst` is how far ahead of
+ * now that time may run. Relay threads share the buckets, so taking from one
+ * is a compare and swap of that time. Two threads checking a bucket at once
+ * may both move data, and the excess is paid back by waiting longer: reads
+ * are clipped to what is allowed, never rejected halfway.
+ *
+ * The relay loop only asks for an allowance before reading from a socket
+ * and pays for what it has read. With nothing allowed it stops reading that
+ * direction until the time returned here, and TCP flow control pushes back
+ * on the sender meanwhile. Unshaped sessions have no chain and never get
+ * here.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "shaper.h"
+#include "sni-private.h"
+
+#define SHAPER_CHAIN_MAX 3
+
+static const double default_burst = 0.1;
+static const double max_burst = 10.0;
+/* Bytes per second, the cost of a byte is kept in 1/65536 ns */
+static const int64_t min_rate = 1024;
+static const int64_t max_rate = 1LL << 40;
+/* Reads smaller than this wait for tokens, unless the buffer has less room */
+static const uint64_t max_chunk = 65536;
+
+static const char *dir_names[shaper_dirs] = {
+	[shaper_download] = "download",
+	[shaper_upload] = "upload",
+};
+
+struct shaper_bucket {
+	/* When the bucket is full again, monotonic ns */
+	uint64_t tat;
+	/* Cost of a byte in 1/65536 ns, none without a limit */
+	uint64_t cost;
+	/* Burst as time, and the smallest read worth waking up for */
+	uint64_t tau;
+	uint64_t chunk;
+	int64_t rate;
+	/* Counters */
+	uint64_t bytes;
+	uint64_t parked;
+} __attribute__((aligned(64)));
+
+struct shaper_class {
+	char *name;
+	struct shaper_bucket dir[shaper_dirs];
+	/* Backend classes are listed to carry their buckets over reloads */
+	struct shaper_class *prev, *next;
+};
+
+/* The `shaping` section, referenced by the chains of its sessions */
+struct shaper_set {
+	struct shaper_class global;
+	struct shaper_class *names;
+	unsigned nnames;
+	/* Lower cased name -> index in `names` */
+	ucl_object_t *index;
+	unsigned refs;
+};
+
+struct shaper_chain {
+	struct shaper_set *set;
+	struct shaper_bucket *b[shaper_dirs][SHAPER_CHAIN_MAX];
+	unsigned n[shaper_dirs];
+	/* Time of the last allowance, what is read after it is charged at */
+	uint64_t now[shaper_dirs];
+};
+
+static struct shaper_set *shaping;
+/* Read by shaper_configure(), NULL is no shaping, until shaper_commit() */
+static struct shaper_set *staged;
+/* Classes of live backends, the newest first */
+static struct shaper_class *backend_classes;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bucket_init(struct shaper_bucket *b, int64_t rate, double burst)
+{
+	uint64_t size;
+
+	b->rate = rate;
+	b->cost = (1000000000ULL << 16) / rate;
+	b->tau = burst * 1e9;
+	size = rate * burst;
+	b->chunk = size > 0 ? MIN(size, max_chunk) : 1;
+}
+
+static bool
+class_parse(struct shaper_class *cls, const char *what,
+		const ucl_object_t *obj, double burst)
+{
+	const ucl_object_t *elt;
+	int64_t rate;
+	unsigned i;
+
+	elt = ucl_object_find_key(obj, "burst");
+
+	if (elt != NULL) {
+		burst = ucl_object_todouble(elt);
+
+		if (burst <= 0 || burst > max_burst) {
+			fprintf(stderr, "%s: invalid burst: %.3f\n", what, burst);
+			return false;
+		}
+	}
+
+	for (i = 0; i < shaper_dirs; i ++) {
+		elt = ucl_object_find_key(obj, dir_names[i]);
+
+		if (elt == NULL) {
+			continue;
+		}
+
+		rate = ucl_object_toint(elt);
+
+		if (rate < min_rate || rate > max_rate) {
+			fprintf(stderr, "%s: invalid %s rate: %lld\n", what, dir_names[i],
+					(long long)rate);
+			return false;
+		}
+
+		bucket_init(&cls->dir[i], rate, burst);
+	}
+
+	return true;
+}
+
+static bool
+class_limited(const struct shaper_class *cls)
+{
+	unsigned i;
+
+	for (i = 0; i < shaper_dirs; i ++) {
+		if (cls->dir[i].cost != 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Keeps the tokens and the counters of a bucket that survives a reload */
+static void
+class_carry(struct shaper_class *to, const struct shaper_class *from)
+{
+	unsigned i;
+
+	for (i = 0; i < shaper_dirs; i ++) {
+		if (to->dir[i].cost == 0 || from->dir[i].cost == 0) {
+			continue;
+		}
+
+		to->dir[i].tat = __atomic_load_n(&from->dir[i].tat, __ATOMIC_RELAXED);
+		to->dir[i].bytes = __atomic_load_n(&from->dir[i].bytes,
+				__ATOMIC_RELAXED);
+		to->dir[i].parked = __atomic_load_n(&from->dir[i].parked,
+				__ATOMIC_RELAXED);
+	}
+}
+
+static struct shaper_class*
+set_find(const struct shaper_set *set, const char *name, size_t len)
+{
+	char lc[256];
+	const ucl_object_t *elt;
+	size_t i;
+
+	if (set->index == NULL || len >= sizeof(lc)) {
+		return NULL;
+	}
+
+	for (i = 0; i < len; i ++) {
+		lc[i] = tolower((unsigned char)name[i]);
+	}
+
+	elt = ucl_object_find_keyl(set->index, lc, len);
+
+	return elt != NULL ? &set->names[ucl_object_toint(elt)] : NULL;
+}
+
+static void
+set_unref(struct shaper_set *set)
+{
+	unsigned i;
+
+	if (set == NULL || -- set->refs > 0) {
+		return;
+	}
+
+	for (i = 0; i < set->nnames; i ++) {
+		free(set->names[i].name);
+	}
+
+	if (set->index != NULL) {
+		ucl_object_unref(set->index);
+	}
+
+	free(set->names);
+	free(set);
+}
+
+bool
+shaper_configure(const ucl_object_t *cfg)
+{
+	struct shaper_set *set;
+	struct shaper_class *cls;
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	double burst = default_burst;
+	char what[300];
+	const char *key;
+	size_t len, i;
+
+	set_unref(staged);
+	staged = NULL;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "burst");
+
+	if (elt != NULL) {
+		burst = ucl_object_todouble(elt);
+
+		if (burst <= 0 || burst > max_burst) {
+			fprintf(stderr, "shaping: invalid burst: %.3f\n", burst);
+			return false;
+		}
+	}
+
+	set = xmalloc0(sizeof(*set));
+	set->refs = 1;
+
+	if (!class_parse(&set->global, "shaping", cfg, burst)) {
+		goto err;
+	}
+
+	elt = ucl_object_find_key(cfg, "names");
+
+	if (elt != NULL) {
+		set->names = xmalloc0(elt->len * sizeof(*set->names));
+		set->index = ucl_object_typed_new(UCL_OBJECT);
+
+		while ((cur = ucl_iterate_object(elt, &it, true))) {
+			key = ucl_object_key(cur);
+			len = strlen(key);
+
+			if (len == 0 || len > 255 || set_find(set, key, len) != NULL) {
+				fprintf(stderr, "shaping: invalid name: %s\n", key);
+				goto err;
+			}
+
+			cls = &set->names[set->nnames];
+			cls->name = xmalloc(len + 1);
+
+			for (i = 0; i <= len; i ++) {
+				cls->name[i] = tolower((unsigned char)key[i]);
+			}
+
+			snprintf(what, sizeof(what), "shaping: %s", key);
+
+			if (!class_parse(cls, what, cur, burst)) {
+				free(cls->name);
+				goto err;
+			}
+
+			ucl_object_insert_key(set->index,
+					ucl_object_fromint(set->nnames), cls->name, len, true);
+			set->nnames ++;
+		}
+	}
+
+	staged = set;
+
+	return true;
+
+err:
+	set_unref(set);
+
+	return false;
+}
+
+void
+shaper_commit(bool apply)
+{
+	struct shaper_class *cls, *old;
+	unsigned i;
+
+	if (!apply) {
+		set_unref(staged);
+		staged = NULL;
+
+		return;
+	}
+
+	if (staged != NULL && shaping != NULL) {
+		class_carry(&staged->global, &shaping->global);
+
+		for (i = 0; i < staged->nnames; i ++) {
+			cls = &staged->names[i];
+			old = set_find(shaping, cls->name, strlen(cls->name));
+
+			if (old != NULL) {
+				class_carry(cls, old);
+			}
+		}
+	}
+
+	set_unref(shaping);
+	shaping = staged;
+	staged = NULL;
+}
+
+struct shaper_class*
+shaper_class_create(const char *name, const ucl_object_t *obj)
+{
+	struct shaper_class *cls, *old;
+	char what[300];
+
+	cls = xmalloc0(sizeof(*cls));
+	snprintf(what, sizeof(what), "backend %s: shaping", name);
+
+	if (!class_parse(cls, what, obj, default_burst)) {
+		free(cls);
+		return NULL;
+	}
+
+	cls->name = xmalloc(strlen(name) + 1);
+	strcpy(cls->name, name);
+
+	/* A reloaded backend goes on with the tokens of its predecessor */
+	for (old = backend_classes; old != NULL; old = old->next) {
+		if (strcmp(old->name, name) == 0) {
+			class_carry(cls, old);
+			break;
+		}
+	}
+
+	cls->next = backend_classes;
+
+	if (backend_classes != NULL) {
+		backend_classes->prev = cls;
+	}
+
+	backend_classes = cls;
+
+	return cls;
+}
+
+void
+shaper_class_free(struct shaper_class *cls)
+{
+	if (cls->prev != NULL) {
+		cls->prev->next = cls->next;
+	}
+	else {
+		backend_classes = cls->next;
+	}
+
+	if (cls->next != NULL) {
+		cls->next->prev = cls->prev;
+	}
+
+	free(cls->name);
+	free(cls);
+}
+
+void
+shaper_session(struct ssl_session *ssl)
+{
+	struct shaper_class *cls[SHAPER_CHAIN_MAX];
+	struct shaper_chain *c;
+	const ucl_object_t *elt;
+	unsigned i, j, n = 0;
+
+	if (shaping != NULL && ssl->hostname != NULL &&
+			(cls[n] = set_find(shaping, ssl->hostname, ssl->hostlen)) != NULL) {
+		n ++;
+	}
+	if (ssl->bk != NULL && (elt = ucl_object_find_key(ssl->bk, "shape"))) {
+		cls[n ++] = elt->value.ud;
+	}
+	if (shaping != NULL) {
+		cls[n ++] = &shaping->global;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (class_limited(cls[i])) {
+			break;
+		}
+	}
+
+	if (i == n) {
+		/* Nothing limits this session, it is relayed as usual */
+		return;
+	}
+
+	c = xmalloc0(sizeof(*c));
+
+	for (i = 0; i < n; i ++) {
+		for (j = 0; j < shaper_dirs; j ++) {
+			if (cls[i]->dir[j].cost != 0) {
+				c->b[j][c->n[j] ++] = &cls[i]->dir[j];
+			}
+		}
+	}
+
+	c->set = shaping;
+
+	if (shaping != NULL) {
+		shaping->refs ++;
+	}
+
+	ssl->shape = c;
+}
+
+void
+shaper_session_free(struct ssl_session *ssl)
+{
+	if (ssl->shape != NULL) {
+		set_unref(ssl->shape->set);
+		free(ssl->shape);
+		ssl->shape = NULL;
+	}
+}
+
+size_t
+shaper_allow(struct shaper_chain *c, enum shaper_dir dir, size_t want,
+		ev_tstamp *wait)
+{
+	struct shaper_bucket *b, *blocked = NULL;
+	uint64_t now, tat, room, avail, chunk, late = 0;
+	size_t allow = want;
+	unsigned i;
+
+	if (c->n[dir] == 0) {
+		return want;
+	}
+
+	now = now_ns();
+	c->now[dir] = now;
+
+	for (i = 0; i < c->n[dir]; i ++) {
+		b = c->b[dir][i];
+		tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+
+		if (tat < now) {
+			tat = now;
+		}
+
+		room = now + b->tau > tat ? now + b->tau - tat : 0;
+		avail = (room << 16) / b->cost;
+		chunk = MIN(want, b->chunk);
+
+		if (avail < chunk) {
+			/* Time until `chunk` bytes fit, the longest wait wins */
+			room = tat + ((chunk * b->cost) >> 16) - b->tau - now;
+
+			if (room >= late) {
+				late = room;
+				blocked = b;
+			}
+		}
+		else if (avail < allow) {
+			allow = avail;
+		}
+	}
+
+	if (blocked != NULL) {
+		__atomic_add_fetch(&blocked->parked, 1, __ATOMIC_RELAXED);
+		*wait = late / 1e9;
+
+		return 0;
+	}
+
+	return allow;
+}
+
+void
+shaper_charge(struct shaper_chain *c, enum shaper_dir dir, size_t bytes)
+{
+	struct shaper_bucket *b;
+	uint64_t now = c->now[dir], tat, next, cost;
+	unsigned i;
+
+	for (i = 0; i < c->n[dir]; i ++) {
+		b = c->b[dir][i];
+		cost = (bytes * b->cost) >> 16;
+		tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+
+		do {
+			next = MAX(tat, now) + cost;
+		} while (!__atomic_compare_exchange_n(&b->tat, &tat, next, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		__atomic_add_fetch(&b->bytes, bytes, __ATOMIC_RELAXED);
+	}
+}
+
+static ucl_object_t*
+class_to_ucl(const struct shaper_class *cls)
+{
+	const struct shaper_bucket *b;
+	ucl_object_t *top, *obj;
+	unsigned i;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+
+	for (i = 0; i < shaper_dirs; i ++) {
+		b = &cls->dir[i];
+
+		if (b->cost == 0) {
+			continue;
+		}
+
+		obj = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(obj, ucl_object_fromint(b->rate), "rate", 0,
+				false);
+		ucl_object_insert_key(obj, ucl_object_fromint(
+				__atomic_load_n(&b->bytes, __ATOMIC_RELAXED)), "bytes", 0,
+				false);
+		ucl_object_insert_key(obj, ucl_object_fromint(
+				__atomic_load_n(&b->parked, __ATOMIC_RELAXED)), "parked", 0,
+				false);
+		ucl_object_insert_key(top, obj, dir_names[i], 0, false);
+	}
+
+	return top;
+}
+
+ucl_object_t*
+shaper_to_ucl(struct sni_worker *worker)
+{
+	struct sni_listener *l;
+	ucl_object_t *top, *names, *backends;
+	ucl_object_iter_t it;
+	const ucl_object_t *cur, *elt;
+	const struct shaper_class *cls;
+	char key[256];
+	bool prefix = worker_routes_count(worker) > 1;
+	unsigned i;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	backends = ucl_object_typed_new(UCL_OBJECT);
+
+	if (shaping != NULL) {
+		if (class_limited(&shaping->global)) {
+			ucl_object_insert_key(top, class_to_ucl(&shaping->global),
+					"global", 0, false);
+		}
+
+		if (shaping->nnames > 0) {
+			names = ucl_object_typed_new(UCL_OBJECT);
+
+			for (i = 0; i < shaping->nnames; i ++) {
+				cls = &shaping->names[i];
+				ucl_object_insert_key(names, class_to_ucl(cls), cls->name, 0,
+						true);
+			}
+
+			ucl_object_insert_key(top, names, "names", 0, false);
+		}
+	}
+
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		if (!listener_routes_first(l)) {
+			continue;
+		}
+
+		it = NULL;
+
+		while ((cur = ucl_iterate_object(l->backends, &it, true))) {
+			elt = ucl_object_find_key(cur, "shape");
+
+			if (elt == NULL) {
+				continue;
+			}
+
+			snprintf(key, sizeof(key), "%s%s%s",
+					prefix ? listener_routes_name(l) : "", prefix ? "/" : "",
+					ucl_object_key(cur));
+			ucl_object_insert_key(backends, class_to_ucl(elt->value.ud), key,
+					0, true);
+		}
+	}
+
+	if (backends->len > 0) {
+		ucl_object_insert_key(top, backends, "backends", 0, false);
+	}
+	else {
+		ucl_object_unref(backends);
+	}
+
+	if (top->len == 0) {
+		ucl_object_unref(top);
+		return NULL;
+	}
+
+	return top;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_SHAPER_H_
+#define SRC_SHAPER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ev.h"
+#include "ucl.h"
+
+struct ssl_session;
+struct sni_worker;
+struct shaper_class;
+struct shaper_chain;
+
+/* Directions, by who receives the bytes */
+enum shaper_dir {
+	shaper_download = 0,
+	shaper_upload,
+	shaper_dirs
+};
+
+/*
+ * Reads the global and per name limits of the `shaping` section `cfg`, NULL
+ * removes them once shaper_commit() installs them. Sessions keep the buckets
+ * they started with, buckets that stay are carried over with the tokens they
+ * have.
+ */
+bool shaper_configure(const ucl_object_t *cfg);
+/* Installs the limits read last if `apply`, drops them otherwise */
+void shaper_commit(bool apply);
+
+/*
+ * Limits of the `shaping` section of backend `name`. Buckets of a live
+ * backend class of the same name are carried over, as those of reloaded
+ * names are. Freed with the backend, on the main loop.
+ */
+struct shaper_class *shaper_class_create(const char *name,
+		const ucl_object_t *obj);
+void shaper_class_free(struct shaper_class *cls);
+
+/*
+ * Picks the buckets of a routed session: its SNI name, its backend and the
+ * global ones. Called on the accepting loop, the chain is released by
+ * shaper_session_free on the same loop.
+ */
+void shaper_session(struct ssl_session *ssl);
+void shaper_session_free(struct ssl_session *ssl);
+
+/*
+ * Bytes up to `want` that the chain lets through in direction `dir`, 0 if
+ * it has to wait, then `*wait` is the time until it may go on. Safe to call
+ * from any relay thread, buckets are shared.
+ */
+size_t shaper_allow(struct shaper_chain *c, enum shaper_dir dir, size_t want,
+		ev_tstamp *wait);
+/* Takes `bytes` moved after shaper_allow from every bucket of the chain */
+void shaper_charge(struct shaper_chain *c, enum shaper_dir dir, size_t bytes);
+
+/* Counters of the global, per name and per backend buckets, NULL if none */
+ucl_object_t *shaper_to_ucl(struct sni_worker *worker);
+
+#endif /* SRC_SHAPER_H_ */
@@ -0,0 +1,744 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Steering with BPF sk_lookup (Linux 5.9+): a program attached to the network
+ * namespace runs for every incoming connection before the socket lookup and
+ * may hand it to any listening socket. Connections to whole prefixes and port
+ * ranges are thus accepted by a couple of sockets per listener instead of a
+ * socket per address and port.
+ *
+ * The program is assembled here, so that neither clang nor libbpf is needed:
+ *
+ *	mask = prefixes[longest match of local address]
+ *	mask &= ports[local port]
+ *	sk = sockets[{mask, is_ipv6}]
+ *	if (sk) bpf_sk_assign(ctx, sk)
+ *
+ * where masks have a bit per steered listener. Every prefix entry includes
+ * the bits of the prefixes containing it, as the trie returns the longest
+ * match only. Connections nothing matches go through the usual lookup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined(__linux__) && defined(HAVE_DECL_BPF_SK_LOOKUP) && \
+		HAVE_DECL_BPF_SK_LOOKUP
+#define SKLOOKUP_SUPPORTED 1
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#endif
+
+#include "ucl.h"
+#include "util.h"
+#include "sni-private.h"
+#include "sklookup.h"
+
+/* One bit of the masks per steered listener */
+#define SKLOOKUP_MAX_LISTENERS 64
+
+struct sklookup_set*
+sklookup_parse(const char *name, const ucl_object_t *obj)
+{
+	struct sklookup_set *set;
+	const ucl_object_t *prefixes, *ports, *cur;
+	ucl_object_iter_t it = NULL;
+	struct sklookup_prefix *p;
+	struct sklookup_ports *r;
+	char buf[INET6_ADDRSTRLEN + 8], *slash, *end;
+	struct in_addr in;
+	unsigned long first, last, len;
+	bool v4;
+
+	prefixes = ucl_object_find_key(obj, "prefixes");
+	ports = ucl_object_find_key(obj, "ports");
+
+	if (prefixes == NULL || ports == NULL) {
+		fprintf(stderr, "listener %s: steer needs prefixes and ports\n", name);
+		return NULL;
+	}
+
+	set = xmalloc0(sizeof(*set));
+
+	while ((cur = ucl_iterate_object(prefixes, &it, true))) {
+		set->prefixes = realloc(set->prefixes,
+				(set->nprefixes + 1) * sizeof(*set->prefixes));
+
+		if (set->prefixes == NULL) {
+			abort();
+		}
+
+		p = &set->prefixes[set->nprefixes ++];
+		memset(p, 0, sizeof(*p));
+		snprintf(buf, sizeof(buf), "%s", ucl_object_tostring_forced(cur));
+		slash = strchr(buf, '/');
+
+		if (slash != NULL) {
+			*slash ++ = '\0';
+		}
+
+		if (inet_pton(AF_INET, buf, &in) == 1) {
+			p->addr[10] = 0xff;
+			p->addr[11] = 0xff;
+			memcpy(&p->addr[12], &in, sizeof(in));
+			len = 32;
+			v4 = true;
+			set->inet = true;
+		}
+		else if (inet_pton(AF_INET6, buf, p->addr) == 1) {
+			len = 128;
+			v4 = false;
+			set->inet6 = true;
+		}
+		else {
+			goto bad_prefix;
+		}
+
+		if (slash != NULL) {
+			first = strtoul(slash, &end, 10);
+
+			if (*end != '\0' || end == slash || first > len) {
+				goto bad_prefix;
+			}
+
+			len = first;
+		}
+
+		p->len = v4 ? len + 96 : len;
+		continue;
+
+bad_prefix:
+		fprintf(stderr, "listener %s: bad steer prefix: %s\n", name,
+				ucl_object_tostring_forced(cur));
+		sklookup_set_free(set);
+		return NULL;
+	}
+
+	it = NULL;
+
+	while ((cur = ucl_iterate_object(ports, &it, true))) {
+		set->ports = realloc(set->ports, (set->nports + 1) * sizeof(*set->ports));
+
+		if (set->ports == NULL) {
+			abort();
+		}
+
+		r = &set->ports[set->nports ++];
+		snprintf(buf, sizeof(buf), "%s", ucl_object_tostring_forced(cur));
+		first = strtoul(buf, &end, 10);
+		last = first;
+
+		if (*end == '-') {
+			slash = end + 1;
+			last = strtoul(slash, &end, 10);
+
+			if (end == slash) {
+				last = 0;
+			}
+		}
+
+		if (*end != '\0' || first == 0 || last < first || last > 65535) {
+			fprintf(stderr, "listener %s: bad steer ports: %s\n", name, buf);
+			sklookup_set_free(set);
+			return NULL;
+		}
+
+		r->first = first;
+		r->last = last;
+	}
+
+	if (set->nprefixes == 0 || set->nports == 0) {
+		fprintf(stderr, "listener %s: steer needs prefixes and ports\n", name);
+		sklookup_set_free(set);
+		return NULL;
+	}
+
+#ifndef SKLOOKUP_SUPPORTED
+	fprintf(stderr, "listener %s: sk_lookup is not supported on this "
+			"platform\n", name);
+	sklookup_set_free(set);
+	return NULL;
+#endif
+
+	return set;
+}
+
+void
+sklookup_set_free(struct sklookup_set *set)
+{
+	if (set != NULL) {
+		free(set->prefixes);
+		free(set->ports);
+		free(set);
+	}
+}
+
+/* True if `a` contains `b` */
+static bool
+prefix_contains(const struct sklookup_prefix *a, const struct sklookup_prefix *b)
+{
+	unsigned bytes = a->len / 8, bits = a->len % 8;
+
+	if (a->len > b->len || memcmp(a->addr, b->addr, bytes) != 0) {
+		return false;
+	}
+
+	return bits == 0 ||
+			((a->addr[bytes] ^ b->addr[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+static bool
+sets_overlap(const struct sklookup_set *a, const struct sklookup_set *b)
+{
+	unsigned i, j;
+	bool ports = false;
+
+	for (i = 0; i < a->nports && !ports; i ++) {
+		for (j = 0; j < b->nports && !ports; j ++) {
+			ports = a->ports[i].first <= b->ports[j].last &&
+					b->ports[j].first <= a->ports[i].last;
+		}
+	}
+
+	if (!ports) {
+		return false;
+	}
+
+	for (i = 0; i < a->nprefixes; i ++) {
+		for (j = 0; j < b->nprefixes; j ++) {
+			if (prefix_contains(&a->prefixes[i], &b->prefixes[j]) ||
+					prefix_contains(&b->prefixes[j], &a->prefixes[i])) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static bool
+listener_has_family(const struct sni_listener *l, int af)
+{
+	unsigned i;
+
+	for (i = 0; i < l->naddrs; i ++) {
+		if (l->addrs[i].sa.sa_family == af) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+sklookup_sane(const struct sni_listener *list)
+{
+	const struct sni_listener *a, *b;
+	unsigned n = 0;
+
+	for (a = list; a != NULL; a = a->next) {
+		if (a->steer == NULL) {
+			continue;
+		}
+
+		if (++ n > SKLOOKUP_MAX_LISTENERS) {
+			fprintf(stderr, "more than %d listeners steer connections\n",
+					SKLOOKUP_MAX_LISTENERS);
+			return false;
+		}
+
+		if (a->steer->inet && !listener_has_family(a, AF_INET)) {
+			fprintf(stderr, "listener %s: steers IPv4 connections but has no "
+					"IPv4 address to listen on\n", a->name);
+			return false;
+		}
+
+		if (a->steer->inet6 && !listener_has_family(a, AF_INET6)) {
+			fprintf(stderr, "listener %s: steers IPv6 connections but has no "
+					"IPv6 address to listen on\n", a->name);
+			return false;
+		}
+
+		for (b = a->next; b != NULL; b = b->next) {
+			if (b->steer != NULL && sets_overlap(a->steer, b->steer)) {
+				fprintf(stderr, "listeners %s and %s steer the same addresses "
+						"and ports\n", a->name, b->name);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+#ifdef SKLOOKUP_SUPPORTED
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn) { \
+	.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)		INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)		INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)		INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND64_REG(d, s)		INSN(BPF_ALU64 | BPF_AND | BPF_X, d, s, 0, 0)
+#define LDX_W(d, s, o)		INSN(BPF_LDX | BPF_W | BPF_MEM, d, s, o, 0)
+#define LDX_DW(d, s, o)		INSN(BPF_LDX | BPF_DW | BPF_MEM, d, s, o, 0)
+#define STX_W(d, s, o)		INSN(BPF_STX | BPF_W | BPF_MEM, d, s, o, 0)
+#define STX_DW(d, s, o)		INSN(BPF_STX | BPF_DW | BPF_MEM, d, s, o, 0)
+#define ST_W(d, o, i)		INSN(BPF_ST | BPF_W | BPF_MEM, d, 0, o, i)
+#define JEQ_IMM(d, i, o)	INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define JNE_IMM(d, i, o)	INSN(BPF_JMP | BPF_JNE | BPF_K, d, 0, o, i)
+#define JA(o)				INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define CALL(f)				INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()				INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD(d, fd) \
+	INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+	INSN(0, 0, 0, 0, 0)
+
+#define CTX(field)	offsetof(struct bpf_sk_lookup, field)
+
+/* Jumps to the final `return SK_PASS` are patched once its place is known */
+#define PASS	0x7fff
+
+/* Stack layout: trie key, port key and socket key */
+#define FP_PREFIX	(-24)
+#define FP_PORT		(-28)
+#define FP_SOCK		(-48)
+
+struct sklookup_state {
+	int link;
+	int prog;
+	int prefixes;
+	int ports;
+	int socks;
+};
+
+static struct sklookup_state current = {-1, -1, -1, -1, -1};
+
+/* Key of the prefixes trie */
+struct sklookup_trie_key {
+	uint32_t len;
+	uint8_t addr[16];
+};
+
+struct sklookup_sock_key {
+	uint64_t mask;
+	uint64_t inet6;
+};
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+map_create(int type, unsigned key, unsigned value, unsigned max, int flags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key;
+	attr.value_size = value;
+	attr.max_entries = max;
+	attr.map_flags = flags;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int
+map_update(int fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int
+prog_load(const struct sklookup_state *st)
+{
+	struct bpf_insn insns[] = {
+		MOV64_REG(BPF_REG_6, BPF_REG_1),
+		LDX_W(BPF_REG_2, BPF_REG_6, CTX(protocol)),
+		JNE_IMM(BPF_REG_2, IPPROTO_TCP, PASS),
+		ST_W(BPF_REG_10, FP_PREFIX, 128),
+		LDX_W(BPF_REG_2, BPF_REG_6, CTX(family)),
+		JEQ_IMM(BPF_REG_2, AF_INET6, 7),
+		/* IPv4: ::ffff:a.b.c.d */
+		ST_W(BPF_REG_10, FP_PREFIX + 4, 0),
+		ST_W(BPF_REG_10, FP_PREFIX + 8, 0),
+		ST_W(BPF_REG_10, FP_PREFIX + 12, htonl(0xffff)),
+		LDX_W(BPF_REG_3, BPF_REG_6, CTX(local_ip4)),
+		STX_W(BPF_REG_10, BPF_REG_3, FP_PREFIX + 16),
+		MOV64_IMM(BPF_REG_8, 0),
+		JA(9),
+		/* IPv6 */
+		LDX_W(BPF_REG_3, BPF_REG_6, CTX(local_ip6[0])),
+		STX_W(BPF_REG_10, BPF_REG_3, FP_PREFIX + 4),
+		LDX_W(BPF_REG_3, BPF_REG_6, CTX(local_ip6[1])),
+		STX_W(BPF_REG_10, BPF_REG_3, FP_PREFIX + 8),
+		LDX_W(BPF_REG_3, BPF_REG_6, CTX(local_ip6[2])),
+		STX_W(BPF_REG_10, BPF_REG_3, FP_PREFIX + 12),
+		LDX_W(BPF_REG_3, BPF_REG_6, CTX(local_ip6[3])),
+		STX_W(BPF_REG_10, BPF_REG_3, FP_PREFIX + 16),
+		MOV64_IMM(BPF_REG_8, 1),
+		/* mask = prefixes[address] */
+		LD_MAP_FD(BPF_REG_1, st->prefixes),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, FP_PREFIX),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, PASS),
+		LDX_DW(BPF_REG_7, BPF_REG_0, 0),
+		/* mask &= ports[port] */
+		LDX_W(BPF_REG_2, BPF_REG_6, CTX(local_port)),
+		STX_W(BPF_REG_10, BPF_REG_2, FP_PORT),
+		LD_MAP_FD(BPF_REG_1, st->ports),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, FP_PORT),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, PASS),
+		LDX_DW(BPF_REG_3, BPF_REG_0, 0),
+		AND64_REG(BPF_REG_7, BPF_REG_3),
+		JEQ_IMM(BPF_REG_7, 0, PASS),
+		/* sk = sockets[{mask, family}] */
+		STX_DW(BPF_REG_10, BPF_REG_7, FP_SOCK),
+		STX_DW(BPF_REG_10, BPF_REG_8, FP_SOCK + 8),
+		LD_MAP_FD(BPF_REG_1, st->socks),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, FP_SOCK),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, PASS),
+		/* The lookup holds a reference to the socket */
+		MOV64_REG(BPF_REG_7, BPF_REG_0),
+		MOV64_REG(BPF_REG_1, BPF_REG_6),
+		MOV64_REG(BPF_REG_2, BPF_REG_7),
+		MOV64_IMM(BPF_REG_3, 0),
+		CALL(BPF_FUNC_sk_assign),
+		MOV64_REG(BPF_REG_1, BPF_REG_7),
+		CALL(BPF_FUNC_sk_release),
+		/* Not assigned means the usual lookup */
+		MOV64_IMM(BPF_REG_0, SK_PASS),
+		EXIT(),
+	};
+	unsigned n = sizeof(insns) / sizeof(insns[0]), i;
+	union bpf_attr attr;
+	static char log[65536];
+	int fd;
+
+	for (i = 0; i < n; i ++) {
+		if (BPF_CLASS(insns[i].code) == BPF_JMP && insns[i].off == PASS) {
+			insns[i].off = (n - 2) - (i + 1);
+		}
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_LOOKUP;
+	attr.expected_attach_type = BPF_SK_LOOKUP;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = n;
+	attr.license = (uintptr_t)"Dual BSD/GPL";
+	strncpy(attr.prog_name, "sni_steer", sizeof(attr.prog_name) - 1);
+
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+
+	if (fd == -1 && errno == EACCES) {
+		/* Load again for the verifier's reasons */
+		attr.log_buf = (uintptr_t)log;
+		attr.log_size = sizeof(log);
+		attr.log_level = 1;
+		fd = sys_bpf(BPF_PROG_LOAD, &attr);
+
+		if (fd == -1) {
+			fprintf(stderr, "sk_lookup: verifier log:\n%s\n", log);
+			errno = EACCES;
+		}
+	}
+
+	return fd;
+}
+
+static void
+state_close(struct sklookup_state *st)
+{
+	int *fds[] = {&st->link, &st->prog, &st->prefixes, &st->ports, &st->socks};
+	unsigned i;
+
+	for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i ++) {
+		if (*fds[i] != -1) {
+			close(*fds[i]);
+			*fds[i] = -1;
+		}
+	}
+}
+
+static bool
+fill_prefixes(struct sklookup_state *st, struct sni_worker *worker)
+{
+	const struct sni_listener *l, *o;
+	const struct sklookup_prefix *p, *q;
+	struct sklookup_trie_key key;
+	uint64_t mask, bit, obit;
+	unsigned i, j;
+
+	for (l = worker->listeners, bit = 1; l != NULL; l = l->next) {
+		if (l->steer == NULL) {
+			continue;
+		}
+
+		for (i = 0; i < l->steer->nprefixes; i ++) {
+			p = &l->steer->prefixes[i];
+			mask = bit;
+
+			/* Longer prefixes inherit the listeners of shorter ones */
+			for (o = worker->listeners, obit = 1; o != NULL; o = o->next) {
+				if (o->steer == NULL) {
+					continue;
+				}
+
+				for (j = 0; j < o->steer->nprefixes; j ++) {
+					q = &o->steer->prefixes[j];
+
+					if (prefix_contains(q, p)) {
+						mask |= obit;
+					}
+				}
+
+				obit <<= 1;
+			}
+
+			memset(&key, 0, sizeof(key));
+			key.len = p->len;
+			memcpy(key.addr, p->addr, sizeof(key.addr));
+
+			if (map_update(st->prefixes, &key, &mask) == -1) {
+				return false;
+			}
+		}
+
+		bit <<= 1;
+	}
+
+	return true;
+}
+
+static bool
+fill_ports(struct sklookup_state *st, struct sni_worker *worker)
+{
+	const struct sni_listener *l;
+	uint64_t *masks, bit;
+	uint32_t port;
+	unsigned i;
+	bool ret = true;
+
+	masks = xmalloc0(65536 * sizeof(*masks));
+
+	for (l = worker->listeners, bit = 1; l != NULL; l = l->next) {
+		if (l->steer == NULL) {
+			continue;
+		}
+
+		for (i = 0; i < l->steer->nports; i ++) {
+			for (port = l->steer->ports[i].first;
+					port <= l->steer->ports[i].last; port ++) {
+				masks[port] |= bit;
+			}
+		}
+
+		bit <<= 1;
+	}
+
+	for (port = 0; port < 65536 && ret; port ++) {
+		if (masks[port] != 0 && map_update(st->ports, &port,
+				&masks[port]) == -1) {
+			ret = false;
+		}
+	}
+
+	free(masks);
+
+	return ret;
+}
+
+/* The first socket of each family of a listener takes its connections */
+static bool
+fill_socks(struct sklookup_state *st, struct sni_worker *worker)
+{
+	const struct sni_listener *l;
+	const struct listen_sock *ls;
+	struct sklookup_sock_key key;
+	uint64_t bit, fd, done;
+
+	for (l = worker->listeners, bit = 1; l != NULL; l = l->next) {
+		if (l->steer == NULL) {
+			continue;
+		}
+
+		done = 0;
+
+		for (ls = l->socks; ls != NULL; ls = ls->next) {
+			key.mask = bit;
+			key.inet6 = ls->addr.sa.sa_family == AF_INET6;
+
+			if (done & (1 << key.inet6)) {
+				continue;
+			}
+
+			fd = ls->io.fd;
+
+			if (map_update(st->socks, &key, &fd) == -1) {
+				return false;
+			}
+
+			done |= 1 << key.inet6;
+		}
+
+		bit <<= 1;
+	}
+
+	return true;
+}
+
+bool
+sklookup_apply(struct sni_worker *worker)
+{
+	struct sklookup_state st = {-1, -1, -1, -1, -1};
+	const struct sni_listener *l;
+	union bpf_attr attr;
+	unsigned nprefixes = 0;
+	int netns;
+
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		if (l->steer != NULL) {
+			nprefixes += l->steer->nprefixes;
+		}
+	}
+
+	if (nprefixes == 0) {
+		/* Closing the link detaches the program */
+		state_close(&current);
+		return true;
+	}
+
+	st.prefixes = map_create(BPF_MAP_TYPE_LPM_TRIE,
+			sizeof(struct sklookup_trie_key), sizeof(uint64_t), nprefixes,
+			BPF_F_NO_PREALLOC);
+	st.ports = map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+			sizeof(uint64_t), 65536, 0);
+	st.socks = map_create(BPF_MAP_TYPE_SOCKHASH,
+			sizeof(struct sklookup_sock_key), sizeof(uint64_t),
+			SKLOOKUP_MAX_LISTENERS * 2, 0);
+
+	if (st.prefixes == -1 || st.ports == -1 || st.socks == -1) {
+		fprintf(stderr, "sk_lookup: cannot create maps: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (!fill_prefixes(&st, worker) || !fill_ports(&st, worker) ||
+			!fill_socks(&st, worker)) {
+		fprintf(stderr, "sk_lookup: cannot fill maps: %s\n", strerror(errno));
+		goto err;
+	}
+
+	st.prog = prog_load(&st);
+
+	if (st.prog == -1) {
+		fprintf(stderr, "sk_lookup: cannot load program: %s\n",
+				strerror(errno));
+		goto err;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+
+	if (current.link != -1) {
+		/* Atomic, connections are never left without a program */
+		attr.link_update.link_fd = current.link;
+		attr.link_update.new_prog_fd = st.prog;
+
+		if (sys_bpf(BPF_LINK_UPDATE, &attr) == -1) {
+			fprintf(stderr, "sk_lookup: cannot replace program: %s\n",
+					strerror(errno));
+			goto err;
+		}
+
+		st.link = current.link;
+		current.link = -1;
+	}
+	else {
+		netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+
+		if (netns == -1) {
+			fprintf(stderr, "sk_lookup: cannot open network namespace: %s\n",
+					strerror(errno));
+			goto err;
+		}
+
+		attr.link_create.prog_fd = st.prog;
+		attr.link_create.target_fd = netns;
+		attr.link_create.attach_type = BPF_SK_LOOKUP;
+		st.link = sys_bpf(BPF_LINK_CREATE, &attr);
+		close(netns);
+
+		if (st.link == -1) {
+			fprintf(stderr, "sk_lookup: cannot attach program: %s\n",
+					strerror(errno));
+			goto err;
+		}
+	}
+
+	state_close(&current);
+	current = st;
+
+	return true;
+
+err:
+	state_close(&st);
+
+	return false;
+}
+
+#else
+
+bool
+sklookup_apply(struct sni_worker *worker)
+{
+	return true;
+}
+
+#endif
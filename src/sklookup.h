@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_SKLOOKUP_H_
+#define SRC_SKLOOKUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ucl.h"
+
+struct sni_worker;
+struct sni_listener;
+
+/*
+ * Address prefixes and port ranges whose connections a BPF sk_lookup program
+ * steers into the sockets of a listener, whatever address they are bound to
+ */
+struct sklookup_prefix {
+	/* IPv4 is stored mapped to IPv6, ::ffff:a.b.c.d */
+	uint8_t addr[16];
+	unsigned len;
+};
+
+struct sklookup_ports {
+	uint16_t first;
+	uint16_t last;
+};
+
+struct sklookup_set {
+	struct sklookup_prefix *prefixes;
+	unsigned nprefixes;
+	struct sklookup_ports *ports;
+	unsigned nports;
+	/* Families present among the prefixes */
+	bool inet;
+	bool inet6;
+};
+
+/* Parses the `steer` section of listener `name`, NULL on error */
+struct sklookup_set *sklookup_parse(const char *name, const ucl_object_t *obj);
+void sklookup_set_free(struct sklookup_set *set);
+
+/*
+ * Checks that the steered listeners are few enough, have sockets for the
+ * families they steer and do not claim the same address and port
+ */
+bool sklookup_sane(const struct sni_listener *list);
+
+/*
+ * Loads a program for the current listeners of `worker` and attaches it to
+ * the network namespace, replacing the previous one; detaches it if no
+ * listener steers any more
+ */
+bool sklookup_apply(struct sni_worker *worker);
+
+#endif /* SRC_SKLOOKUP_H_ */
@@ -25,15 +25,194 @@
 #ifndef SNI_PRIVATE_H_
 #define SNI_PRIVATE_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
 #include "ev.h"
 #include "ucl.h"
 #include "ringbuf.h"
 
+struct cmdq;
+struct ssl_session;
+struct sockopt_profile;
+struct tcpinfo_state;
+struct tcpinfo_pair;
+struct tcpinfo_hists;
+struct sklookup_set;
+struct client_rules;
+struct shaper_chain;
+struct relay_load;
+struct relay_sched;
+struct mirror_queue;
+
+union sni_sockaddr {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+};
+
+struct source_addr {
+	/* AF_UNSPEC leaves the choice to the kernel */
+	union sni_sockaddr sa;
+	/* Connections from this address to the backend */
+	uint64_t active;
+	/* Connects that found no free port */
+	uint64_t exhausted;
+};
+
+/*
+ * Source addresses for connections to one TCP backend, used in turn. Ports
+ * are chosen at connect time, so each address has the whole ephemeral range
+ * for this destination.
+ */
+struct source_pool {
+	unsigned naddrs;
+	unsigned next;
+	/* Ephemeral ports per address */
+	unsigned capacity;
+	ev_tstamp last_warn;
+	struct source_addr addrs[];
+};
+
+struct sni_listener;
+
+/* A listening socket bound to one address of a listener */
+struct listen_sock {
+	ev_io io;
+	struct sni_listener *listener;
+	union sni_sockaddr addr;
+	bool transparent;
+	struct listen_sock *next;
+};
+
+/*
+ * Addresses sharing socket options, timeouts and a routing table. Sessions
+ * hold a reference, so a listener removed on reload lives until its last
+ * session ends.
+ */
+struct sni_listener {
+	struct sni_worker *worker;
+	char *name;
+	/* Routing table: SNI name -> backend, may be shared by listeners */
+	ucl_object_t *backends;
+	/* Uses the top level `backends` rather than its own */
+	bool shared_routes;
+	bool transparent;
+	const struct sockopt_profile *sockopts;
+	ev_tstamp greeting_timeout;
+	/* How long a half-closed session may flush its buffer */
+	ev_tstamp shutdown_timeout;
+	/* Configured addresses and the sockets bound to them */
+	union sni_sockaddr *addrs;
+	unsigned naddrs;
+	struct listen_sock *socks;
+	/* Other addresses and ports handed to the sockets by sk_lookup */
+	struct sklookup_set *steer;
+	/* Clients refused at accept and client networks, NULL if none */
+	struct client_rules *clients;
+	/* TCP_INFO of client legs, allocated on the first session closed */
+	struct tcpinfo_hists *tcpi;
+	unsigned refs;
+	struct sni_listener *next;
+};
+
+/*
+ * Everything owned by one event loop. Other threads (e.g. the admin socket)
+ * reach it only through the command queue.
+ */
+struct sni_worker {
+	struct ev_loop *loop;
+	struct sni_listener *listeners;
+	struct cmdq *cmdq;
+	/* Live sessions */
+	struct ssl_session *sessions;
+	unsigned nsessions;
+	unsigned id;
+	uint64_t next_session_id;
+	/* TCP_INFO sampling, NULL if disabled */
+	struct tcpinfo_state *tcpi;
+	/* Threads taking over routed sessions, none in the single loop mode */
+	struct sni_worker **relays;
+	unsigned nrelays;
+	unsigned next_relay;
+	/* Has no listeners, only relays the sessions of another worker */
+	bool relay;
+	/* Distinct routing tables, read by relays to name routes */
+	unsigned nroutes;
+	/* Relay load state, NULL unless rebalancing is enabled */
+	struct relay_load *load;
+	/* Published by relays each load tick for the rebalancer: bytes/s, us */
+	uint64_t load_rate;
+	uint64_t load_lag;
+	/* Sessions moved in and out of this relay by rebalancing */
+	uint64_t moved_in;
+	uint64_t moved_out;
+	/* Bytes queued in the session buffers at the last load tick */
+	uint64_t load_buffered;
+	/* Over its accept throttling limits, read by the accepting worker */
+	bool saturated;
+	/* Refuses sessions of classes that are shed rather than pause accept */
+	bool shedding;
+	/* Relay callbacks served by priority, NULL without scheduling */
+	struct relay_sched *sched;
+	/* Records of mirrored sessions, NULL without mirroring */
+	struct mirror_queue *mirror;
+	/* Reasons not to accept, listening sockets are not watched if any */
+	unsigned accept_paused;
+};
+
+/* Reasons for listeners_pause */
+enum {
+	accept_pause_load = 1 << 0,
+	accept_pause_fds = 1 << 1
+};
+
 struct ssl_session {
-	const ucl_object_t *backends;
+	struct sni_worker *worker;
+	/* Where the session was accepted, referenced while it is alive */
+	struct sni_listener *listener;
+	/* Selected backend, referenced while the session is alive */
+	ucl_object_t *bk;
+	/* Source address of the backend connection, NULL if not from a pool */
+	struct source_addr *src;
+	struct ssl_session *prev, *next;
+	uint64_t id;
+	ev_tstamp started;
+	/* Bytes read from the client and from the backend */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	/* Bytes/s over the last load tick of a relay and the count it started at */
+	uint64_t rate;
+	uint64_t rate_mark;
+	union sni_sockaddr peer;
+	/* Where the client was going, set in transparent mode only */
+	union sni_sockaddr orig_dst;
+	/* Address the client connected to, set for steered listeners only */
+	union sni_sockaddr local;
+	/* Counted as a greeting of its client until the ClientHello is parsed */
+	bool greeting;
+	/* Holds one count of its client's greeting slot */
+	bool greeting_counted;
+	/* Latest TCP_INFO readings, allocated on the first one */
+	struct tcpinfo_pair *tcpi;
+	/* Buckets the relayed bytes are taken from, NULL if unshaped */
+	struct shaper_chain *shape;
 	ev_io io;
 	ev_io bk_io;
 	ev_timer tm;
+	/* Wakes up directions that wait for tokens, set in `parked` */
+	ev_timer shape_tm;
+	unsigned parked;
+	/* Scheduler queue of the worker, events noted until the session is served */
+	struct ssl_session *sched_prev, *sched_next;
+	unsigned sched_class;
+	int sched_bk;
+	int sched_cl;
+	bool sched_queued;
+	/* Teed to the mirror sink, from the open record to the close record */
+	bool mirror;
+	bool mirror_started;
 	struct ev_loop *loop;
 	char *hostname;
 	struct ringbuf *cl2bk;
@@ -59,5 +238,58 @@ struct ssl_session {
 
 void send_alert(struct ssl_session *ssl);
 void terminate_session(struct ssl_session *ssl);
+/* Adds a session to the session list of `worker` and moves it to its loop */
+void session_attach(struct sni_worker *worker, struct ssl_session *ssl);
+void session_unlink(struct ssl_session *ssl);
+/* Connects a routed session to its backend or original destination */
+void session_connect(struct ssl_session *ssl);
+
+/*
+ * Starts `n` relay threads for `home`, possibly none, with the `stats`,
+ * `tcp_info`, `rebalance` and `accept_throttle` settings of `cfg`
+ */
+bool relays_start(struct sni_worker *home, unsigned n, const ucl_object_t *cfg);
+/*
+ * Connects a routed session from its loop, or hands it to a relay thread
+ * that does so when there are any
+ */
+void session_relay(struct ssl_session *ssl);
+void session_peer_str(const struct ssl_session *ssl, char *buf, size_t len);
+/* SNI name of `ssl` or "-", with spaces and non printable bytes as \xNN */
+void session_name_str(const struct ssl_session *ssl, char *buf, size_t len);
+
+/*
+ * Makes `fresh` (a list of unbound listeners) the listeners of `worker`:
+ * listeners with a known name are updated in place and keep their sessions,
+ * sockets are kept for addresses that stay, the rest are bound or closed.
+ * Returns false if some address could not be bound.
+ */
+bool listeners_update(struct sni_worker *worker, struct sni_listener *fresh);
+/*
+ * Sets or clears one reason not to accept connections on the listeners of
+ * `worker`, they are watched again once no reason is left
+ */
+void listeners_pause(struct sni_worker *worker, unsigned reason, bool pause);
+/* Frees a listener that has never been passed to listeners_update */
+void listener_free(struct sni_listener *l);
+struct sni_listener *listener_find(struct sni_worker *worker,
+		const char *name);
+/* True if no earlier listener of the worker uses the same routing table */
+bool listener_routes_first(const struct sni_listener *l);
+/* Number of distinct routing tables of the worker */
+unsigned worker_routes_count(const struct sni_worker *worker);
+/* The listener name, or "*" for the top level routing table */
+const char *listener_routes_name(const struct sni_listener *l);
+/* Routing table of listener `name`, "*" is the top level one, or NULL */
+ucl_object_t *worker_routes_find(struct sni_worker *worker, const char *name);
+void sockaddr_str(const union sni_sockaddr *addr, char *buf, size_t len);
+
+bool backend_resolve(ucl_object_t *be);
+bool backend_draining(const ucl_object_t *be);
+bool backend_handoff(const ucl_object_t *be);
+struct source_pool *backend_pool(const ucl_object_t *be);
+/* Profile for the backend connection or, with `client`, the client one */
+const struct sockopt_profile *backend_sockopts(const ucl_object_t *be,
+		bool client);
 
 #endif /* SNI_PRIVATE_H_ */
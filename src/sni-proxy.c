@@ -22,6 +22,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -29,6 +30,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -40,15 +42,57 @@
 #include "ev.h"
 #include "ucl.h"
 #include "util.h"
+#include "stats.h"
+#include "cmdq.h"
+#include "sockopts.h"
+#include "tcpinfo.h"
+#include "accesslog.h"
+#include "sklookup.h"
+#include "greeting.h"
+#include "ratelimit.h"
+#include "denylist.h"
+#include "cidr.h"
+#include "shaper.h"
+#include "scheduler.h"
+#include "mirror.h"
+#include "sni-private.h"
 
 static const int default_backend_port = 443;
+static const int default_port = 443;
+static const double default_greeting_timeout = 2.0;
+static const double default_shutdown_timeout = 5.0;
+/* Used when ip_local_port_range cannot be read, the Linux default */
+static const unsigned default_port_range = 28232;
 
 int buflen = 16384;
-static int port = 443;
+/* Read by relay threads, only stored atomically once a reload is valid */
+bool spoof_source = false;
+int backend_mark = 0;
+/* Descriptors kept for everything but sessions: listeners, logs, admin */
+unsigned fd_headroom = 64;
+/* The values above, and the default transparent mode of listeners, as read */
+static struct {
+	bool transparent;
+	bool spoof_source;
+	int backend_mark;
+	unsigned fd_headroom;
+} staged;
 static const char *cf_name = "/etc/sni-proxy.conf";
+/* The running configuration, replaced on reload */
+static ucl_object_t *config = NULL;
+/* Source addresses for backends without their own */
+static const ucl_object_t *default_source = NULL;
+/* Socket options for backends without their own */
+static const char *default_sockopts = NULL;
 
-extern bool start_listen(struct ev_loop *loop, int port,
-		const ucl_object_t *backends);
+extern bool admin_init(struct ev_loop *loop, const ucl_object_t *cfg,
+		struct sni_worker **workers, unsigned nworkers);
+
+static void
+stats_sig_cb(EV_P_ ev_signal *w, int revents)
+{
+	stats_dump(loop);
+}
 
 static void
 usage(const char *error)
@@ -68,57 +112,1000 @@ usage(const char *error)
 	}
 }
 
-static bool
-backends_sane(ucl_object_t *obj)
+/*
+ * Builds addrinfo for a unix socket backend, names starting with '@' are
+ * Linux abstract sockets
+ */
+static struct addrinfo*
+backend_unix_ai(const char *path)
+{
+	struct addrinfo *ai;
+	struct sockaddr_un *sun;
+	size_t len = strlen(path);
+
+	if (len == 0 || len >= sizeof(sun->sun_path)) {
+		return NULL;
+	}
+
+#ifndef __linux__
+	if (path[0] == '@') {
+		return NULL;
+	}
+#endif
+
+	ai = xmalloc0(sizeof(*ai) + sizeof(*sun));
+	sun = (struct sockaddr_un *)(ai + 1);
+	sun->sun_family = AF_UNIX;
+	memcpy(sun->sun_path, path, len);
+
+	if (path[0] == '@') {
+		/* Abstract names are not NUL terminated */
+		sun->sun_path[0] = '\0';
+		ai->ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+	}
+	else {
+		ai->ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	}
+
+	ai->ai_family = AF_UNIX;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_addr = (struct sockaddr *)sun;
+
+	return ai;
+}
+
+static unsigned
+local_port_range(void)
+{
+	static unsigned range = 0;
+	FILE *f;
+	unsigned lo, hi;
+
+	if (range != 0) {
+		return range;
+	}
+
+	range = default_port_range;
+	f = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+
+	if (f != NULL) {
+		if (fscanf(f, "%u %u", &lo, &hi) == 2 && hi >= lo) {
+			range = hi - lo + 1;
+		}
+		fclose(f);
+	}
+
+	return range;
+}
+
+/*
+ * Builds the source pool for a backend of family `af` from `source`, which is
+ * an address or a list of them. Without `source` the pool has one entry that
+ * leaves the address to the kernel, so every backend is accounted.
+ */
+static struct source_pool*
+source_pool_create(const ucl_object_t *source, int af)
 {
+	struct source_pool *pool;
+	struct source_addr *src;
 	ucl_object_iter_t it = NULL;
-	const ucl_object_t *cur, *elt;
+	const ucl_object_t *cur;
+	unsigned n = 1;
+	const char *str;
+	void *dst;
+
+	if (source != NULL) {
+		n = 0;
+
+		while (ucl_iterate_object(source, &it, true)) {
+			n ++;
+		}
+
+		if (n == 0) {
+			fprintf(stderr, "bad backend: empty source list\n");
+			return NULL;
+		}
+
+		it = NULL;
+	}
+
+	pool = xmalloc0(sizeof(*pool) + n * sizeof(*src));
+	pool->naddrs = n;
+	pool->capacity = local_port_range();
+
+	if (source == NULL) {
+		return pool;
+	}
+
+	src = pool->addrs;
+
+	while ((cur = ucl_iterate_object(source, &it, true))) {
+		str = ucl_object_tostring_forced(cur);
+		src->sa.sa.sa_family = af;
+
+		if (af == AF_INET6) {
+			dst = &src->sa.sin6.sin6_addr;
+		}
+		else {
+			dst = &src->sa.sin.sin_addr;
+		}
+
+		if (inet_pton(af, str, dst) != 1) {
+			fprintf(stderr, "bad backend: source %s is not an %s address\n",
+					str, af == AF_INET6 ? "IPv6" : "IPv4");
+			free(pool);
+			return NULL;
+		}
+
+		src ++;
+	}
+
+	return pool;
+}
+
+/* Destructors of the backend userdata, run when its last user is gone */
+static void
+backend_ai_free(void *ud)
+{
+	if (ud != NULL) {
+		freeaddrinfo(ud);
+	}
+}
+
+static void
+backend_so_free(void *ud)
+{
+	sockopts_unref(ud);
+}
+
+static void
+backend_shape_free(void *ud)
+{
+	if (ud != NULL) {
+		shaper_class_free(ud);
+	}
+}
+
+/* Attaches socket option profile `key` of a backend as userdata `ud_key` */
+static bool
+backend_sockopts_resolve(ucl_object_t *be, const char *key,
+		const char *ud_key, const char *def)
+{
+	const ucl_object_t *elt;
+	const struct sockopt_profile *p;
+	const char *name = def;
+	ucl_object_t *ud;
+
+	elt = ucl_object_find_key(be, key);
+
+	if (elt != NULL) {
+		name = ucl_object_tostring_forced(elt);
+	}
+	if (name == NULL) {
+		return true;
+	}
+
+	p = sockopts_find(name);
+
+	if (p == NULL) {
+		fprintf(stderr, "bad backend: no such sockopts profile: %s\n", name);
+		return false;
+	}
+
+	ud = ucl_object_new_userdata(backend_so_free, NULL,
+			(void *)sockopts_ref(p));
+	ucl_object_replace_key(be, ud, ud_key, 0, false);
+
+	return true;
+}
+
+/*
+ * Resolves backend `be` and attaches the resulting addrinfo as "ai", for
+ * TCP backends the source pool as "pool", socket option profiles as "so"
+ * and "client_so", its bandwidth limits as "shape" and the index of its
+ * priority class as "class". The userdata goes with the backend: sessions
+ * hold a reference to the backend they were routed to, so backends replaced
+ * by a reload or the admin socket are freed once their last session ends.
+ *
+ * Relay threads look keys up in backends of their sessions, so every key
+ * that changes later ("draining" and "tcpi") is inserted here and only its
+ * value changes afterwards.
+ */
+bool
+backend_resolve(ucl_object_t *be)
+{
+	const ucl_object_t *elt;
 	struct addrinfo ai, *res;
 	int port = default_backend_port, ret;
-	ucl_object_t *be, *ai_obj;
+	ucl_object_t *ai_obj, *pool_obj, *shape_obj;
+	struct source_pool *pool;
+	struct shaper_class *shape;
+	int cls;
 
 	memset(&ai, 0, sizeof(ai));
 
+	elt = ucl_object_find_key(be, "draining");
+	ucl_object_replace_key(be, ucl_object_frombool(elt != NULL &&
+			ucl_object_toboolean(elt)), "draining", 0, false);
+	ucl_object_replace_key(be, ucl_object_new_userdata(free, NULL, NULL),
+			"tcpi", 0, false);
+
 	ai.ai_family = AF_UNSPEC;
 	ai.ai_socktype = SOCK_STREAM;
 	ai.ai_flags = AI_NUMERICSERV;
 
-	while ((cur = ucl_iterate_object(obj, &it, true))) {
-		be = ucl_object_ref(cur);
-		elt = ucl_object_find_key(cur, "port");
+	if (!backend_sockopts_resolve(be, "sockopts", "so", default_sockopts) ||
+			!backend_sockopts_resolve(be, "client_sockopts", "client_so",
+					NULL)) {
+		return false;
+	}
 
-		if (elt != NULL) {
-			port = ucl_object_toint(elt);
-			if (port <= 0 || port > 65535) {
-				return false;
-			}
+	elt = ucl_object_find_key(be, "shaping");
+
+	if (elt != NULL) {
+		shape = shaper_class_create(ucl_object_key(be), elt);
+
+		if (shape == NULL) {
+			return false;
+		}
+
+		shape_obj = ucl_object_new_userdata(backend_shape_free, NULL, shape);
+		ucl_object_replace_key(be, shape_obj, "shape", 0, false);
+	}
+
+	elt = ucl_object_find_key(be, "priority");
+
+	if (elt != NULL) {
+		cls = sched_class_find(ucl_object_tostring_forced(elt));
+
+		if (cls < 0) {
+			fprintf(stderr, "bad backend: no such priority class: %s\n",
+					ucl_object_tostring_forced(elt));
+			return false;
 		}
 
-		elt = ucl_object_find_key(cur, "host");
+		ucl_object_replace_key(be, ucl_object_fromint(cls), "class", 0,
+				false);
+	}
+
+	/* Handoff backends take the client socket over a unix socket */
+	elt = ucl_object_find_key(be, "handoff");
+
+	if (elt == NULL) {
+		elt = ucl_object_find_key(be, "unix");
+	}
+	else if (ucl_object_find_key(be, "unix") != NULL) {
+		fprintf(stderr, "bad backend: both unix and handoff are set\n");
+		return false;
+	}
+
+	if (elt != NULL) {
+		if (ucl_object_find_key(be, "host") != NULL) {
+			fprintf(stderr, "bad backend: both %s and host are set\n",
+					ucl_object_key(elt));
+			return false;
+		}
 
-		if (elt == NULL) {
+		if (ucl_object_find_key(be, "source") != NULL) {
+			fprintf(stderr, "bad backend: both %s and source are set\n",
+					ucl_object_key(elt));
 			return false;
 		}
 
-		res = NULL;
-		if ((ret = getaddrinfo(ucl_object_tostring(elt), port_to_str(port),
-				&ai, &res)) != 0) {
-			fprintf(stderr, "bad backend: %s:%d: %s\n", ucl_object_tostring(elt),
-					port, gai_strerror(ret));
+		res = backend_unix_ai(ucl_object_tostring_forced(elt));
+
+		if (res == NULL) {
+			fprintf(stderr, "bad backend: invalid unix socket: %s\n",
+					ucl_object_tostring_forced(elt));
 			return false;
 		}
 
-		/* Insert addrinfo as userdata */
-		ai_obj = ucl_object_typed_new(UCL_USERDATA);
-		ai_obj->value.ud = res;
+		/* A single allocation, not from getaddrinfo */
+		ai_obj = ucl_object_new_userdata(free, NULL, res);
+		ucl_object_replace_key(be, ai_obj, "ai", 0, false);
+
+		return true;
+	}
 
-		ucl_object_insert_key(be, ai_obj, "ai", 0, false);
+	elt = ucl_object_find_key(be, "port");
+
+	if (elt != NULL) {
+		port = ucl_object_toint(elt);
+		if (port <= 0 || port > 65535) {
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(be, "host");
+
+	if (elt == NULL) {
+		return false;
+	}
+
+	res = NULL;
+	if ((ret = getaddrinfo(ucl_object_tostring(elt), port_to_str(port),
+			&ai, &res)) != 0) {
+		fprintf(stderr, "bad backend: %s:%d: %s\n", ucl_object_tostring(elt),
+				port, gai_strerror(ret));
+		return false;
+	}
+
+	elt = ucl_object_find_key(be, "source");
+	pool = source_pool_create(elt ? elt : default_source, res->ai_family);
+
+	if (pool == NULL) {
+		freeaddrinfo(res);
+		return false;
+	}
+
+	pool_obj = ucl_object_new_userdata(free, NULL, pool);
+	ucl_object_replace_key(be, pool_obj, "pool", 0, false);
+
+	/* Insert addrinfo as userdata */
+	ai_obj = ucl_object_new_userdata(backend_ai_free, NULL, res);
+	ucl_object_replace_key(be, ai_obj, "ai", 0, false);
+
+	return true;
+}
+
+struct source_pool*
+backend_pool(const ucl_object_t *be)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_find_key(be, "pool");
+
+	return elt != NULL ? elt->value.ud : NULL;
+}
+
+const struct sockopt_profile*
+backend_sockopts(const ucl_object_t *be, bool client)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_find_key(be, client ? "client_so" : "so");
+
+	return elt != NULL ? elt->value.ud : NULL;
+}
+
+bool
+backend_handoff(const ucl_object_t *be)
+{
+	return ucl_object_find_key(be, "handoff") != NULL;
+}
+
+/* Draining backends keep their sessions but get no new ones */
+bool
+backend_draining(const ucl_object_t *be)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_find_key(be, "draining");
+
+	/* A boolean since backend_resolve(), flipped in place by the admin */
+	return elt != NULL &&
+			__atomic_load_n(&elt->value.iv, __ATOMIC_RELAXED) != 0;
+}
+
+static bool
+transparent_config(const ucl_object_t *obj)
+{
+	const ucl_object_t *elt;
+	int64_t mark;
+
+	elt = ucl_object_find_key(obj, "enabled");
+	staged.transparent = elt == NULL || ucl_object_toboolean(elt);
+
+	elt = ucl_object_find_key(obj, "spoof_source");
+	staged.spoof_source = elt != NULL && ucl_object_toboolean(elt);
+
+	elt = ucl_object_find_key(obj, "mark");
+
+	if (elt != NULL) {
+		mark = ucl_object_toint(elt);
+
+		if (mark < 0 || mark > UINT32_MAX) {
+			fprintf(stderr, "invalid mark: %lld\n", (long long)mark);
+			return false;
+		}
+
+		staged.backend_mark = (uint32_t)mark;
+	}
+
+#if !defined(IP_TRANSPARENT) || !defined(IPV6_TRANSPARENT)
+	if (staged.transparent || staged.spoof_source) {
+		fprintf(stderr, "transparent mode is not supported on this platform\n");
+		return false;
+	}
+#endif
+#ifndef SO_MARK
+	if (staged.backend_mark != 0) {
+		fprintf(stderr, "mark is not supported on this platform\n");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+static bool
+backends_sane(ucl_object_t *obj)
+{
+	ucl_object_iter_t it = NULL;
+	const ucl_object_t *cur;
+	ucl_object_t *be;
+	bool ret;
+
+	while ((cur = ucl_iterate_object(obj, &it, true))) {
+		be = ucl_object_ref(cur);
+		ret = backend_resolve(be);
 		ucl_object_unref(be);
+
+		if (!ret) {
+			return false;
+		}
 	}
 
 	return true;
 }
 
+static bool
+port_parse(const char *str, char **end, int *port)
+{
+	long p;
+
+	p = strtol(str, end, 10);
+
+	if (*end == str || p <= 0 || p > 65535) {
+		return false;
+	}
+
+	*port = p;
+
+	return true;
+}
+
+static void
+listener_add_addr(struct sni_listener *l, int af, const void *addr, int port)
+{
+	union sni_sockaddr *sa;
+
+	l->addrs = realloc(l->addrs, (l->naddrs + 1) * sizeof(*l->addrs));
+
+	if (l->addrs == NULL) {
+		abort();
+	}
+
+	sa = &l->addrs[l->naddrs ++];
+	memset(sa, 0, sizeof(*sa));
+	sa->sa.sa_family = af;
+
+	if (af == AF_INET6) {
+		memcpy(&sa->sin6.sin6_addr, addr, sizeof(sa->sin6.sin6_addr));
+		sa->sin6.sin6_port = htons(port);
+	}
+	else {
+		memcpy(&sa->sin.sin_addr, addr, sizeof(sa->sin.sin_addr));
+		sa->sin.sin_port = htons(port);
+	}
+}
+
+/*
+ * Parses a listen address: "port", "*:port", "a.b.c.d:port" or
+ * "[ipv6]:port", where port may be a range "first-last". "*" stands for
+ * both 0.0.0.0 and [::], an IPv6 address binds IPv6 only.
+ */
+static bool
+listen_addr_parse(struct sni_listener *l, const char *spec)
+{
+	char host[INET6_ADDRSTRLEN];
+	const char *p, *ports;
+	char *end;
+	struct in_addr in;
+	struct in6_addr in6;
+	int af = AF_UNSPEC, first, last, port;
+	size_t hlen;
+
+	if (spec[0] == '[') {
+		p = strchr(spec, ']');
+
+		if (p == NULL || p[1] != ':') {
+			goto err;
+		}
+
+		hlen = p - spec - 1;
+		ports = p + 2;
+		spec ++;
+	}
+	else if ((p = strrchr(spec, ':')) != NULL) {
+		hlen = p - spec;
+		ports = p + 1;
+	}
+	else {
+		hlen = 0;
+		ports = spec;
+	}
+
+	if (hlen >= sizeof(host)) {
+		goto err;
+	}
+
+	memcpy(host, spec, hlen);
+	host[hlen] = '\0';
+
+	if (hlen == 0 || strcmp(host, "*") == 0) {
+		af = AF_UNSPEC;
+	}
+	else if (inet_pton(AF_INET, host, &in) == 1) {
+		af = AF_INET;
+	}
+	else if (inet_pton(AF_INET6, host, &in6) == 1) {
+		af = AF_INET6;
+	}
+	else {
+		goto err;
+	}
+
+	if (!port_parse(ports, &end, &first)) {
+		goto err;
+	}
+
+	last = first;
+
+	if (*end == '-' && !port_parse(end + 1, &end, &last)) {
+		goto err;
+	}
+
+	if (*end != '\0' || last < first) {
+		goto err;
+	}
+
+	for (port = first; port <= last; port ++) {
+		if (af == AF_UNSPEC) {
+			in.s_addr = htonl(INADDR_ANY);
+			listener_add_addr(l, AF_INET, &in, port);
+			listener_add_addr(l, AF_INET6, &in6addr_any, port);
+		}
+		else {
+			listener_add_addr(l, af, af == AF_INET ? (void *)&in : (void *)&in6,
+					port);
+		}
+	}
+
+	return true;
+
+err:
+	fprintf(stderr, "listener %s: bad address: %s\n", l->name, spec);
+
+	return false;
+}
+
+static bool
+listener_timeout(struct sni_listener *l, const ucl_object_t *obj,
+		const char *key, ev_tstamp *val)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_find_key(obj, key);
+
+	if (elt != NULL) {
+		*val = ucl_object_todouble(elt);
+
+		if (*val <= 0) {
+			fprintf(stderr, "listener %s: bad %s\n", l->name, key);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Builds a listener from its section: `listen` addresses, `sockopts`,
+ * `transparent`, `greeting_timeout`, `shutdown_timeout` and its own
+ * `backends` and `clients`, or the top level ones
+ */
+static struct sni_listener*
+listener_create(const char *name, const ucl_object_t *obj,
+		ucl_object_t *shared, struct client_rules *shared_clients)
+{
+	struct sni_listener *l;
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	char what[128];
+
+	l = xmalloc0(sizeof(*l));
+	l->name = strdup(name);
+	l->transparent = staged.transparent;
+	l->greeting_timeout = default_greeting_timeout;
+	l->shutdown_timeout = default_shutdown_timeout;
+
+	elt = ucl_object_find_key(obj, "listen");
+
+	if (elt == NULL) {
+		fprintf(stderr, "listener %s: no listen addresses\n", name);
+		goto err;
+	}
+
+	while ((cur = ucl_iterate_object(elt, &it, true))) {
+		if (!listen_addr_parse(l, ucl_object_tostring_forced(cur))) {
+			goto err;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "sockopts");
+
+	if (elt != NULL) {
+		l->sockopts = sockopts_ref(
+				sockopts_find(ucl_object_tostring_forced(elt)));
+
+		if (l->sockopts == NULL) {
+			fprintf(stderr, "listener %s: no such sockopts profile: %s\n",
+					name, ucl_object_tostring_forced(elt));
+			goto err;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "transparent");
+
+	if (elt != NULL) {
+		l->transparent = ucl_object_toboolean(elt);
+#if !defined(IP_TRANSPARENT) || !defined(IPV6_TRANSPARENT)
+		if (l->transparent) {
+			fprintf(stderr, "transparent mode is not supported on this "
+					"platform\n");
+			goto err;
+		}
+#endif
+	}
+
+	if (!listener_timeout(l, obj, "greeting_timeout", &l->greeting_timeout) ||
+			!listener_timeout(l, obj, "shutdown_timeout",
+					&l->shutdown_timeout)) {
+		goto err;
+	}
+
+	elt = ucl_object_find_key(obj, "steer");
+
+	if (elt != NULL) {
+		l->steer = sklookup_parse(name, elt);
+
+		if (l->steer == NULL) {
+			goto err;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "backends");
+
+	if (elt != NULL) {
+		l->backends = ucl_object_ref(elt);
+
+		if (!backends_sane(l->backends)) {
+			fprintf(stderr, "listener %s: invalid backends configuration\n",
+					name);
+			goto err;
+		}
+	}
+	else if (shared != NULL) {
+		l->backends = ucl_object_ref(shared);
+		l->shared_routes = true;
+	}
+	else {
+		fprintf(stderr, "listener %s: no backends\n", name);
+		goto err;
+	}
+
+	elt = ucl_object_find_key(obj, "clients");
+
+	if (elt != NULL) {
+		snprintf(what, sizeof(what), "listener %s: clients", name);
+		l->clients = client_rules_parse(what, elt);
+
+		if (l->clients == NULL) {
+			goto err;
+		}
+	}
+	else {
+		l->clients = client_rules_ref(shared_clients);
+	}
+
+	return l;
+
+err:
+	listener_free(l);
+
+	return NULL;
+}
+
+static void
+listeners_free(struct sni_listener *list)
+{
+	struct sni_listener *l;
+
+	while ((l = list) != NULL) {
+		list = l->next;
+		listener_free(l);
+	}
+}
+
+/* An address may belong to one listener only */
+static bool
+listeners_sane(const struct sni_listener *list)
+{
+	const struct sni_listener *a, *b;
+	const union sni_sockaddr *sa, *sb;
+	char addr[INET6_ADDRSTRLEN + 16];
+	unsigned i, j;
+
+	for (a = list; a != NULL; a = a->next) {
+		for (b = a->next; b != NULL; b = b->next) {
+			if (strcmp(a->name, b->name) == 0) {
+				fprintf(stderr, "duplicate listener %s\n", a->name);
+				return false;
+			}
+		}
+
+		for (i = 0; i < a->naddrs; i ++) {
+			sa = &a->addrs[i];
+
+			for (b = a; b != NULL; b = b->next) {
+				for (j = (b == a ? i + 1 : 0); j < b->naddrs; j ++) {
+					sb = &b->addrs[j];
+
+					if (sa->sa.sa_family == sb->sa.sa_family &&
+							memcmp(sa, sb, sa->sa.sa_family == AF_INET6 ?
+									sizeof(sa->sin6) : sizeof(sa->sin)) == 0) {
+						sockaddr_str(sa, addr, sizeof(addr));
+						fprintf(stderr, "listeners %s and %s both listen on %s\n",
+								a->name, b->name, addr);
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Installs or drops what the sections read by config_listeners() staged */
+static void
+config_commit(bool apply)
+{
+	if (apply) {
+		__atomic_store_n(&spoof_source, staged.spoof_source, __ATOMIC_RELAXED);
+		__atomic_store_n(&backend_mark, staged.backend_mark, __ATOMIC_RELAXED);
+		__atomic_store_n(&fd_headroom, staged.fd_headroom, __ATOMIC_RELAXED);
+	}
+
+	sockopts_commit(apply);
+	greeting_commit(apply);
+	ratelimit_commit(apply);
+	denylist_commit(apply);
+	shaper_commit(apply);
+	mirror_commit(apply);
+}
+
+/*
+ * Reads everything that can change on reload and builds the listeners,
+ * unbound. Without a `listeners` section there is one listener, "default",
+ * on `port` of every address. Limits, lists and profiles only take effect
+ * once the whole configuration is fine.
+ */
+static struct sni_listener*
+config_listeners(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt, *cur;
+	ucl_object_t *shared, *compat;
+	ucl_object_iter_t it = NULL;
+	struct sni_listener *list = NULL, *l, **tail = &list;
+	struct client_rules *clients = NULL;
+	char buf[32];
+
+	if (!sockopts_init(ucl_object_find_key(cfg, "sockopts"))) {
+		fprintf(stderr, "invalid sockopts configuration\n");
+		goto err;
+	}
+
+	if (!greeting_configure(ucl_object_find_key(cfg, "greeting"))) {
+		fprintf(stderr, "invalid greeting configuration\n");
+		goto err;
+	}
+
+	if (!ratelimit_configure(ucl_object_find_key(cfg, "rate_limits"))) {
+		fprintf(stderr, "invalid rate_limits configuration\n");
+		goto err;
+	}
+
+	if (!denylist_configure(ucl_object_find_key(cfg, "denylist"))) {
+		fprintf(stderr, "invalid denylist configuration\n");
+		goto err;
+	}
+
+	if (!shaper_configure(ucl_object_find_key(cfg, "shaping"))) {
+		fprintf(stderr, "invalid shaping configuration\n");
+		goto err;
+	}
+
+	if (!mirror_configure(ucl_object_find_key(cfg, "mirror"))) {
+		fprintf(stderr, "invalid mirror configuration\n");
+		goto err;
+	}
+
+	elt = ucl_object_find_key(cfg, "backend_sockopts");
+	default_sockopts = elt ? ucl_object_tostring_forced(elt) : NULL;
+	default_source = ucl_object_find_key(cfg, "source");
+
+	staged.fd_headroom = fd_headroom;
+	elt = ucl_object_find_key(cfg, "fd_headroom");
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) < 0 || ucl_object_toint(elt) > 65536) {
+			fprintf(stderr, "invalid fd_headroom: %lld\n",
+					(long long)ucl_object_toint(elt));
+			goto err;
+		}
+
+		staged.fd_headroom = ucl_object_toint(elt);
+	}
+
+	staged.transparent = false;
+	staged.spoof_source = false;
+	staged.backend_mark = 0;
+	elt = ucl_object_find_key(cfg, "transparent");
+
+	if (elt && !transparent_config(elt)) {
+		fprintf(stderr, "invalid transparent configuration\n");
+		goto err;
+	}
+
+	shared = (ucl_object_t *)ucl_object_find_key(cfg, "backends");
+
+	if (shared != NULL && !backends_sane(shared)) {
+		fprintf(stderr, "invalid backends configuration\n");
+		goto err;
+	}
+
+	elt = ucl_object_find_key(cfg, "clients");
+
+	if (elt != NULL && (clients = client_rules_parse("clients", elt)) == NULL) {
+		goto err;
+	}
+
+	elt = ucl_object_find_key(cfg, "listeners");
+
+	if (elt != NULL) {
+		while ((cur = ucl_iterate_object(elt, &it, true))) {
+			l = listener_create(ucl_object_key(cur), cur, shared, clients);
+
+			if (l == NULL) {
+				client_rules_unref(clients);
+				listeners_free(list);
+				goto err;
+			}
+
+			*tail = l;
+			tail = &l->next;
+		}
+
+		if (list == NULL) {
+			fprintf(stderr, "no listeners configured\n");
+			client_rules_unref(clients);
+			goto err;
+		}
+	}
+	else {
+		/* Build the section from the top level settings */
+		compat = ucl_object_typed_new(UCL_OBJECT);
+		elt = ucl_object_find_key(cfg, "port");
+		snprintf(buf, sizeof(buf), "*:%d",
+				elt ? (int)ucl_object_toint(elt) : default_port);
+		ucl_object_insert_key(compat, ucl_object_fromstring(buf), "listen", 0,
+				false);
+		elt = ucl_object_find_key(cfg, "listen_sockopts");
+
+		if (elt != NULL) {
+			ucl_object_insert_key(compat,
+					ucl_object_fromstring(ucl_object_tostring_forced(elt)),
+					"sockopts", 0, false);
+		}
+
+		list = listener_create("default", compat, shared, clients);
+		ucl_object_unref(compat);
+
+		if (list == NULL) {
+			client_rules_unref(clients);
+			goto err;
+		}
+	}
+
+	/* Held by the listeners using them */
+	client_rules_unref(clients);
+
+	if (!listeners_sane(list) || !sklookup_sane(list)) {
+		listeners_free(list);
+		goto err;
+	}
+
+	config_commit(true);
+
+	return list;
+
+err:
+	config_commit(false);
+
+	return NULL;
+}
+
+static ucl_object_t*
+config_read(void)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *cfg;
+
+	parser = ucl_parser_new(0);
+
+	if (!ucl_parser_add_file(parser, cf_name)) {
+		fprintf(stderr, "cannot open file %s: %s\n", cf_name,
+				ucl_parser_get_error(parser));
+		ucl_parser_free(parser);
+		return NULL;
+	}
+
+	cfg = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	return cfg;
+}
+
+/*
+ * SIGHUP: re-reads listeners, routes, socket option profiles, source
+ * addresses and transparent mode settings. Sessions are not affected, a bad
+ * configuration leaves everything as it was.
+ */
+static void
+reload_sig_cb(EV_P_ ev_signal *w, int revents)
+{
+	struct sni_worker *worker = w->data;
+	struct sni_listener *fresh;
+	ucl_object_t *cfg;
+	/* Read by backend_resolve() at any time, restored on failure */
+	const ucl_object_t *old_source = default_source;
+	const char *old_sockopts = default_sockopts;
+
+	cfg = config_read();
+
+	if (cfg == NULL) {
+		fprintf(stderr, "reload failed, keeping the current configuration\n");
+		return;
+	}
+
+	fresh = config_listeners(cfg);
+
+	if (fresh == NULL) {
+		default_source = old_source;
+		default_sockopts = old_sockopts;
+		ucl_object_unref(cfg);
+		fprintf(stderr, "reload failed, keeping the current configuration\n");
+		return;
+	}
+
+	if (!listeners_update(worker, fresh)) {
+		fprintf(stderr, "reloaded %s, some addresses are not listened on\n",
+				cf_name);
+	}
+	else if (!sklookup_apply(worker)) {
+		fprintf(stderr, "reloaded %s, steering is left as it was\n",
+				cf_name);
+	}
+	else {
+		fprintf(stderr, "reloaded %s\n", cf_name);
+	}
+
+	ucl_object_unref(config);
+	config = cfg;
+}
+
 int
 main(int argc, char **argv) {
 	static struct option long_options[] = {
@@ -127,10 +1114,12 @@ main(int argc, char **argv) {
 			{"help", 	no_argument, 0,  'h' },
 			{0,         0,                 0,  0 }
 	};
-	struct ucl_parser *parser;
-	ucl_object_t *cfg, *backends;
 	const ucl_object_t *elt;
 	struct ev_loop *loop = EV_DEFAULT;
+	ev_signal stats_sig, reload_sig;
+	struct sni_worker *worker, **workers;
+	struct sni_listener *listeners;
+	int64_t nrelays = 0;
 
 	char ch;
 
@@ -151,32 +1140,92 @@ main(int argc, char **argv) {
 	argc -= optind;
 	argv += optind;
 
-	parser = ucl_parser_new(0);
+	config = config_read();
 
-	if (!ucl_parser_add_file(parser, cf_name)) {
-		fprintf(stderr, "cannot open file %s: %s\n", cf_name,
-				ucl_parser_get_error(parser));
+	if (config == NULL) {
 		exit(EXIT_FAILURE);
 	}
 
-	cfg = ucl_parser_get_object(parser);
-	ucl_parser_free(parser);
-
-	backends = ucl_object_ref(ucl_object_find_key(cfg, "backends"));
+	/* Not changed on reload, backends refer to the classes */
+	if (!sched_configure(ucl_object_find_key(config, "scheduling"))) {
+		fprintf(stderr, "invalid scheduling configuration\n");
+		exit(EXIT_FAILURE);
+	}
 
-	if (backends == NULL || !backends_sane(backends)) {
-		fprintf(stderr, "invalid or absent backends configuration\n");
+	/* The sink and the queues are not changed on reload either */
+	if (!mirror_init(ucl_object_find_key(config, "mirror"))) {
+		fprintf(stderr, "invalid mirror configuration\n");
 		exit(EXIT_FAILURE);
 	}
 
-	elt = ucl_object_find_key(cfg, "port");
-	if (elt) {
-		port = ucl_object_toint(elt);
+	listeners = config_listeners(config);
+
+	if (listeners == NULL) {
+		exit(EXIT_FAILURE);
 	}
 
 	signal(SIGPIPE, SIG_IGN);
 
-	if (!start_listen(loop, port, backends)) {
+	if (!stats_init(loop, ucl_object_find_key(config, "stats"))) {
+		fprintf(stderr, "invalid stats configuration\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Dump event loop statistics on SIGUSR1 */
+	ev_signal_init(&stats_sig, stats_sig_cb, SIGUSR1);
+	ev_signal_start(loop, &stats_sig);
+
+	worker = xmalloc0(sizeof(*worker));
+	worker->loop = loop;
+	worker->cmdq = cmdq_create(loop);
+	denylist_start(worker);
+	sched_start(worker);
+	mirror_start(worker);
+
+	if (!tcpinfo_init(worker, ucl_object_find_key(config, "tcp_info"))) {
+		fprintf(stderr, "invalid tcp_info configuration\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!accesslog_init(loop, ucl_object_find_key(config, "access_log"))) {
+		exit(EXIT_FAILURE);
+	}
+
+	elt = ucl_object_find_key(config, "relay_threads");
+
+	if (elt != NULL) {
+		nrelays = ucl_object_toint(elt);
+
+		if (nrelays < 0 || nrelays > 1024) {
+			fprintf(stderr, "invalid relay_threads: %lld\n",
+					(long long)nrelays);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!relays_start(worker, nrelays, config)) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (!listeners_update(worker, listeners) || !sklookup_apply(worker)) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Reload listeners and routes on SIGHUP */
+	reload_sig.data = worker;
+	ev_signal_init(&reload_sig, reload_sig_cb, SIGHUP);
+	ev_signal_start(loop, &reload_sig);
+
+	/* The admin socket sees the relays as workers of their own */
+	workers = xmalloc((nrelays + 1) * sizeof(*workers));
+	workers[0] = worker;
+
+	if (nrelays > 0) {
+		memcpy(&workers[1], worker->relays, nrelays * sizeof(*workers));
+	}
+
+	elt = ucl_object_find_key(config, "admin");
+	if (elt && !admin_init(loop, elt, workers, nrelays + 1)) {
 		exit(EXIT_FAILURE);
 	}
 
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "ucl.h"
+#include "util.h"
+#include "sockopts.h"
+
+/* TCP_CA_NAME_MAX in the kernel */
+#define SOCKOPT_STRING_MAX 16
+
+enum sockopt_type {
+	sockopt_bool = 0,
+	sockopt_int,
+	sockopt_bytes,
+	sockopt_seconds,
+	sockopt_msec,
+	sockopt_string,
+	/* IP_TOS, and IPV6_TCLASS as well on IPv6 sockets */
+	sockopt_tos
+};
+
+struct sockopt_def {
+	const char *name;
+	int level;
+	int opt;
+	enum sockopt_type type;
+};
+
+static const struct sockopt_def sockopt_defs[] = {
+	{"nodelay", IPPROTO_TCP, TCP_NODELAY, sockopt_bool},
+	{"sndbuf", SOL_SOCKET, SO_SNDBUF, sockopt_bytes},
+	{"rcvbuf", SOL_SOCKET, SO_RCVBUF, sockopt_bytes},
+#ifdef TCP_NOTSENT_LOWAT
+	{"notsent_lowat", IPPROTO_TCP, TCP_NOTSENT_LOWAT, sockopt_bytes},
+#endif
+#ifdef TCP_CONGESTION
+	{"congestion", IPPROTO_TCP, TCP_CONGESTION, sockopt_string},
+#endif
+#ifdef SO_MARK
+	{"mark", SOL_SOCKET, SO_MARK, sockopt_int},
+#endif
+	{"tos", IPPROTO_IP, IP_TOS, sockopt_tos},
+	{"keepalive", SOL_SOCKET, SO_KEEPALIVE, sockopt_bool},
+#ifdef TCP_KEEPIDLE
+	{"keepidle", IPPROTO_TCP, TCP_KEEPIDLE, sockopt_seconds},
+	{"keepintvl", IPPROTO_TCP, TCP_KEEPINTVL, sockopt_seconds},
+	{"keepcnt", IPPROTO_TCP, TCP_KEEPCNT, sockopt_int},
+#endif
+#ifdef TCP_USER_TIMEOUT
+	{"user_timeout", IPPROTO_TCP, TCP_USER_TIMEOUT, sockopt_msec},
+#endif
+};
+
+struct sockopt {
+	const struct sockopt_def *def;
+	int ival;
+	char sval[SOCKOPT_STRING_MAX];
+};
+
+struct sockopt_profile {
+	char *name;
+	/* The profile list, listeners and backends holding it */
+	unsigned refs;
+	unsigned nopts;
+	struct sockopt opts[];
+};
+
+static struct sockopt_profile **profiles = NULL;
+static unsigned nprofiles = 0;
+/* Read by sockopts_init(), what sockopts_find() sees until sockopts_commit() */
+static struct sockopt_profile **staged = NULL;
+static unsigned nstaged = 0;
+static bool staging = false;
+
+static void
+profiles_free(struct sockopt_profile **list, unsigned n)
+{
+	while (n > 0) {
+		sockopts_unref(list[-- n]);
+	}
+
+	free(list);
+}
+
+static const struct sockopt_def*
+sockopt_def_find(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(sockopt_defs) / sizeof(sockopt_defs[0]); i ++) {
+		if (strcmp(sockopt_defs[i].name, name) == 0) {
+			return &sockopt_defs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool
+sockopt_parse(struct sockopt *o, const ucl_object_t *obj)
+{
+	const char *str;
+	double t;
+	int64_t v;
+
+	switch (o->def->type) {
+	case sockopt_bool:
+		o->ival = ucl_object_toboolean(obj) ? 1 : 0;
+		return true;
+	case sockopt_string:
+		str = ucl_object_tostring_forced(obj);
+
+		if (strlen(str) == 0 || strlen(str) >= sizeof(o->sval)) {
+			return false;
+		}
+
+		strcpy(o->sval, str);
+		return true;
+	case sockopt_seconds:
+	case sockopt_msec:
+		/* UCL times are seconds, e.g. 30s or 1.5 */
+		t = ucl_object_todouble(obj);
+
+		if (o->def->type == sockopt_msec) {
+			t *= 1000.0;
+		}
+		if (t < 0 || t > INT_MAX) {
+			return false;
+		}
+
+		o->ival = (int)t;
+		return true;
+	default:
+		v = ucl_object_toint(obj);
+
+		if (v < 0 || v > INT_MAX ||
+				(o->def->type == sockopt_tos && v > 255)) {
+			return false;
+		}
+
+		o->ival = (int)v;
+		return true;
+	}
+}
+
+static int
+sockopt_set(int fd, int af, const struct sockopt *o)
+{
+	if (af == AF_UNIX && o->def->level != SOL_SOCKET) {
+		return 0;
+	}
+
+	switch (o->def->type) {
+	case sockopt_string:
+		return setsockopt(fd, o->def->level, o->def->opt, o->sval,
+				strlen(o->sval));
+	case sockopt_tos:
+		if (af == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS,
+				&o->ival, sizeof(o->ival)) == -1) {
+			return -1;
+		}
+		/* Also for IPv4 clients of dual stack sockets */
+		return setsockopt(fd, IPPROTO_IP, IP_TOS, &o->ival, sizeof(o->ival));
+	default:
+		return setsockopt(fd, o->def->level, o->def->opt, &o->ival,
+				sizeof(o->ival));
+	}
+}
+
+static bool
+sockopt_equal(const struct sockopt *a, const struct sockopt *b)
+{
+	if (a->def != b->def) {
+		return false;
+	}
+	if (a->def->type == sockopt_string) {
+		return strcmp(a->sval, b->sval) == 0;
+	}
+
+	return a->ival == b->ival;
+}
+
+static struct sockopt_profile*
+profile_parse(const ucl_object_t *obj)
+{
+	struct sockopt_profile *p;
+	struct sockopt *o;
+	ucl_object_iter_t it = NULL;
+	const ucl_object_t *cur;
+	unsigned n = 0;
+
+	while (ucl_iterate_object(obj, &it, true)) {
+		n ++;
+	}
+
+	p = xmalloc0(sizeof(*p) + n * sizeof(*o));
+	p->name = strdup(ucl_object_key(obj));
+	p->refs = 1;
+	it = NULL;
+
+	while ((cur = ucl_iterate_object(obj, &it, true))) {
+		o = &p->opts[p->nopts];
+		o->def = sockopt_def_find(ucl_object_key(cur));
+
+		if (o->def == NULL) {
+			fprintf(stderr, "sockopts %s: unknown or unsupported option %s\n",
+					p->name, ucl_object_key(cur));
+			goto err;
+		}
+		if (!sockopt_parse(o, cur)) {
+			fprintf(stderr, "sockopts %s: bad %s value: %s\n", p->name,
+					o->def->name, ucl_object_tostring_forced(cur));
+			goto err;
+		}
+
+		p->nopts ++;
+	}
+
+	return p;
+
+err:
+	free(p->name);
+	free(p);
+
+	return NULL;
+}
+
+/* Tries the profile on a scratch socket, e.g. to catch a missing bbr module */
+static bool
+profile_check(const struct sockopt_profile *p)
+{
+	unsigned i;
+	int fd;
+	bool ret = true;
+
+	fd = socket(AF_INET6, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+	}
+	if (fd == -1) {
+		return true;
+	}
+
+	for (i = 0; i < p->nopts; i ++) {
+		if (sockopt_set(fd, AF_INET6, &p->opts[i]) == -1) {
+			fprintf(stderr, "sockopts %s: cannot set %s: %s\n", p->name,
+					p->opts[i].def->name, strerror(errno));
+			ret = false;
+		}
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+bool
+sockopts_init(const ucl_object_t *cfg)
+{
+	ucl_object_iter_t it = NULL;
+	const ucl_object_t *cur;
+	struct sockopt_profile *p, **fresh = NULL;
+	unsigned n = 0;
+
+	while (cfg != NULL && (cur = ucl_iterate_object(cfg, &it, true))) {
+		if (cur->type != UCL_OBJECT) {
+			fprintf(stderr, "sockopts %s: not a section\n", ucl_object_key(cur));
+			goto err;
+		}
+
+		p = profile_parse(cur);
+
+		if (p == NULL) {
+			goto err;
+		}
+
+		fresh = realloc(fresh, (n + 1) * sizeof(*fresh));
+
+		if (fresh == NULL) {
+			abort();
+		}
+
+		fresh[n ++] = p;
+
+		if (!profile_check(p)) {
+			goto err;
+		}
+	}
+
+	sockopts_commit(false);
+	staged = fresh;
+	nstaged = n;
+	staging = true;
+
+	return true;
+
+err:
+	profiles_free(fresh, n);
+
+	return false;
+}
+
+void
+sockopts_commit(bool apply)
+{
+	if (apply && staging) {
+		/* Profiles in use stay until their listeners and backends go */
+		profiles_free(profiles, nprofiles);
+		profiles = staged;
+		nprofiles = nstaged;
+	}
+	else {
+		profiles_free(staged, nstaged);
+	}
+
+	staged = NULL;
+	nstaged = 0;
+	staging = false;
+}
+
+const struct sockopt_profile*
+sockopts_ref(const struct sockopt_profile *p)
+{
+	struct sockopt_profile *mp = (struct sockopt_profile *)p;
+
+	if (mp != NULL) {
+		mp->refs ++;
+	}
+
+	return p;
+}
+
+void
+sockopts_unref(const struct sockopt_profile *p)
+{
+	struct sockopt_profile *mp = (struct sockopt_profile *)p;
+
+	if (mp == NULL || -- mp->refs > 0) {
+		return;
+	}
+
+	free(mp->name);
+	free(mp);
+}
+
+const struct sockopt_profile*
+sockopts_find(const char *name)
+{
+	struct sockopt_profile **list = staging ? staged : profiles;
+	unsigned i, n = staging ? nstaged : nprofiles;
+
+	for (i = 0; i < n; i ++) {
+		if (strcmp(list[i]->name, name) == 0) {
+			return list[i];
+		}
+	}
+
+	return NULL;
+}
+
+bool
+sockopts_apply(int fd, int af, const struct sockopt_profile *p,
+		const struct sockopt_profile *inherited)
+{
+	unsigned i, j;
+	bool ret = true, skip;
+
+	for (i = 0; i < p->nopts; i ++) {
+		skip = false;
+
+		if (inherited != NULL) {
+			for (j = 0; j < inherited->nopts && !skip; j ++) {
+				skip = sockopt_equal(&p->opts[i], &inherited->opts[j]);
+			}
+		}
+
+		if (!skip && sockopt_set(fd, af, &p->opts[i]) == -1) {
+			ret = false;
+		}
+	}
+
+	return ret;
+}
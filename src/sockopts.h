@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_SOCKOPTS_H_
+#define SRC_SOCKOPTS_H_
+
+#include <stdbool.h>
+
+#include "ucl.h"
+
+/*
+ * Named socket option profiles from the `sockopts` section. A profile is a
+ * list of options resolved to setsockopt arguments at startup.
+ */
+struct sockopt_profile;
+
+/*
+ * Parses and checks every profile of the `sockopts` section (may be NULL).
+ * If all of them are fine, sockopts_find() looks them up instead of the
+ * current ones until sockopts_commit().
+ */
+bool sockopts_init(const ucl_object_t *cfg);
+/* Keeps the profiles read last if `apply`, goes back to the current ones otherwise */
+void sockopts_commit(bool apply);
+
+/* Returns the profile called `name` or NULL, held until the next commit */
+const struct sockopt_profile* sockopts_find(const char *name);
+
+/*
+ * Listeners and backends keeping a profile past a reload hold a reference.
+ * Taken and dropped on the main loop only.
+ */
+const struct sockopt_profile* sockopts_ref(const struct sockopt_profile *p);
+void sockopts_unref(const struct sockopt_profile *p);
+
+/*
+ * Sets the options of `p` on socket `fd` of family `af`, skipping those that
+ * `inherited` (may be NULL) has already set to the same value, e.g. on the
+ * listening socket an accepted one comes from.
+ */
+bool sockopts_apply(int fd, int af, const struct sockopt_profile *p,
+		const struct sockopt_profile *inherited);
+
+#endif /* SRC_SOCKOPTS_H_ */
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "stats.h"
+
+static const char *cb_class_names[stats_cb_max] = {
+	[stats_cb_accept] = "accept",
+	[stats_cb_greet] = "greet",
+	[stats_cb_connect] = "connect",
+	[stats_cb_relay] = "relay",
+	[stats_cb_timer] = "timer",
+	[stats_cb_alert] = "alert",
+	[stats_cb_admin] = "admin",
+	[stats_cb_handoff] = "handoff",
+	[stats_cb_rebalance] = "rebalance",
+	[stats_cb_shaper] = "shaper",
+};
+
+static const double default_slow_iteration = 0.1;
+
+struct loop_stats {
+	double slow_iteration;
+	double started;
+	double busy;
+	/* Current iteration */
+	int cb_class;
+	double cb_start;
+	/* ev_iteration() at the last invoke, and whether one is accounted */
+	unsigned iter_seen;
+	bool iter_open;
+	double iter_busy;
+	unsigned iter_pending;
+	unsigned iter_callbacks;
+	unsigned iter_cnt[stats_cb_max];
+	double iter_time[stats_cb_max];
+	/* Totals */
+	uint64_t iterations;
+	uint64_t slow_iterations;
+	struct stats_hist iteration;
+	struct stats_hist callbacks;
+	struct stats_hist backlog;
+	struct stats_hist cb_time[stats_cb_max];
+};
+
+static inline double
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned
+stats_hist_bucket(uint64_t v)
+{
+	unsigned b;
+
+#if defined(__GNUC__)
+	b = v == 0 ? 0 : 64 - __builtin_clzll(v);
+#else
+	for (b = 0; v >> b != 0 && b < 64; b ++);
+#endif
+
+	if (b >= STATS_HIST_BUCKETS) {
+		b = STATS_HIST_BUCKETS - 1;
+	}
+
+	return b;
+}
+
+void
+stats_hist_add(struct stats_hist *h, uint64_t v)
+{
+	h->buckets[stats_hist_bucket(v)] ++;
+	h->count ++;
+	h->sum += v;
+
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+void
+stats_hist_add_shared(struct stats_hist *h, uint64_t v)
+{
+	uint64_t max;
+
+	__atomic_add_fetch(&h->buckets[stats_hist_bucket(v)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, v, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * {count, sum, max, buckets: {"<upper bound>": count}}, only non-empty
+ * buckets are emitted and bucket "1" holds zeroes
+ */
+ucl_object_t*
+stats_hist_to_ucl(const struct stats_hist *h)
+{
+	ucl_object_t *top, *buckets;
+	char key[32];
+	unsigned i;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	buckets = ucl_object_typed_new(UCL_OBJECT);
+
+	ucl_object_insert_key(top, ucl_object_fromint(h->count), "count", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(h->sum), "sum", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(h->max), "max", 0, false);
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i ++) {
+		if (h->buckets[i] > 0) {
+			snprintf(key, sizeof(key), "%llu", 1ULL << i);
+			ucl_object_insert_key(buckets, ucl_object_fromint(h->buckets[i]),
+					key, 0, true);
+		}
+	}
+
+	ucl_object_insert_key(top, buckets, "buckets", 0, false);
+
+	return top;
+}
+
+static void
+stats_cb_close(struct loop_stats *st, double now)
+{
+	double d;
+
+	if (st->cb_class >= 0) {
+		d = now - st->cb_start;
+		st->iter_time[st->cb_class] += d;
+		stats_hist_add(&st->cb_time[st->cb_class], d * 1e6);
+		st->cb_class = -1;
+	}
+}
+
+void
+stats_cb(struct ev_loop *loop, enum stats_cb_class cls)
+{
+	struct loop_stats *st = ev_userdata(loop);
+	double now;
+
+	if (st == NULL) {
+		return;
+	}
+
+	now = stats_now();
+	stats_cb_close(st, now);
+	st->cb_class = cls;
+	st->cb_start = now;
+	st->iter_cnt[cls] ++;
+	st->iter_callbacks ++;
+}
+
+static void
+stats_log_slow(struct loop_stats *st, double elapsed, unsigned pending)
+{
+	int i;
+
+	fprintf(stderr, "slow loop iteration: %.3f ms, %u callbacks, %u pending:",
+			elapsed * 1e3, st->iter_callbacks, pending);
+
+	for (i = 0; i < stats_cb_max; i ++) {
+		if (st->iter_cnt[i] > 0) {
+			fprintf(stderr, " %s %u in %.3f ms", cb_class_names[i],
+					st->iter_cnt[i], st->iter_time[i] * 1e3);
+		}
+	}
+
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Replaces ev_invoke_pending. libev calls it after polling with the watchers
+ * that became pending, and with prepare watchers active (the scheduler's)
+ * once more before polling. The loop counter only moves on when polling, so
+ * a call with the counter unchanged runs prepare watchers, which are
+ * accounted with the callbacks after the poll of the same iteration.
+ */
+static void
+stats_invoke_pending(struct ev_loop *loop)
+{
+	struct loop_stats *st = ev_userdata(loop);
+	unsigned pending, iter;
+	bool prepare;
+	double start, end;
+
+	pending = ev_pending_count(loop);
+	iter = ev_iteration(loop);
+	prepare = iter == st->iter_seen;
+	st->iter_seen = iter;
+
+	if (pending == 0 && !st->iter_open) {
+		return;
+	}
+
+	if (!st->iter_open) {
+		st->iter_open = true;
+		st->iter_busy = 0;
+		st->iter_pending = 0;
+		st->cb_class = -1;
+		st->iter_callbacks = 0;
+		memset(st->iter_cnt, 0, sizeof(st->iter_cnt));
+		memset(st->iter_time, 0, sizeof(st->iter_time));
+	}
+
+	if (pending > 0) {
+		start = stats_now();
+		ev_invoke_pending(loop);
+		end = stats_now();
+		stats_cb_close(st, end);
+		st->iter_busy += end - start;
+		st->iter_pending += pending;
+	}
+
+	if (prepare) {
+		return;
+	}
+
+	st->iter_open = false;
+	st->iterations ++;
+	st->busy += st->iter_busy;
+	stats_hist_add(&st->iteration, st->iter_busy * 1e6);
+	stats_hist_add(&st->callbacks, st->iter_callbacks);
+	stats_hist_add(&st->backlog, st->iter_pending);
+
+	if (st->slow_iteration > 0 && st->iter_busy >= st->slow_iteration) {
+		st->slow_iterations ++;
+		stats_log_slow(st, st->iter_busy, st->iter_pending);
+	}
+}
+
+bool
+stats_init(struct ev_loop *loop, const ucl_object_t *cfg)
+{
+	struct loop_stats *st;
+	const ucl_object_t *elt;
+	double slow = default_slow_iteration;
+
+	if (cfg != NULL) {
+		elt = ucl_object_find_key(cfg, "enabled");
+
+		if (elt != NULL && !ucl_object_toboolean(elt)) {
+			return true;
+		}
+
+		elt = ucl_object_find_key(cfg, "slow_iteration");
+
+		if (elt != NULL) {
+			slow = ucl_object_todouble(elt);
+
+			if (slow < 0) {
+				fprintf(stderr, "invalid slow_iteration: %f\n", slow);
+				return false;
+			}
+		}
+	}
+
+	st = xmalloc0(sizeof(*st));
+	st->slow_iteration = slow;
+	st->started = stats_now();
+	st->cb_class = -1;
+	st->iter_seen = ev_iteration(loop);
+
+	ev_set_userdata(loop, st);
+	ev_set_invoke_pending_cb(loop, stats_invoke_pending);
+
+	return true;
+}
+
+ucl_object_t*
+stats_to_ucl(struct ev_loop *loop)
+{
+	struct loop_stats *st = ev_userdata(loop);
+	ucl_object_t *top, *cbs;
+	double uptime;
+	int i;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+
+	if (st == NULL) {
+		ucl_object_insert_key(top, ucl_object_frombool(false), "enabled", 0,
+				false);
+		return top;
+	}
+
+	uptime = stats_now() - st->started;
+
+	ucl_object_insert_key(top, ucl_object_fromdouble(uptime), "uptime", 0,
+			false);
+	ucl_object_insert_key(top, ucl_object_fromint(st->iterations),
+			"iterations", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(st->slow_iterations),
+			"slow_iterations", 0, false);
+	/* Share of wall time spent in callbacks, 1.0 is a saturated loop */
+	ucl_object_insert_key(top,
+			ucl_object_fromdouble(uptime > 0 ? st->busy / uptime : 0),
+			"utilization", 0, false);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&st->iteration),
+			"iteration_us", 0, false);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&st->callbacks),
+			"callbacks_per_iteration", 0, false);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&st->backlog),
+			"pending", 0, false);
+
+	cbs = ucl_object_typed_new(UCL_OBJECT);
+
+	for (i = 0; i < stats_cb_max; i ++) {
+		ucl_object_insert_key(cbs, stats_hist_to_ucl(&st->cb_time[i]),
+				cb_class_names[i], 0, false);
+	}
+
+	ucl_object_insert_key(top, cbs, "callback_us", 0, false);
+
+	return top;
+}
+
+void
+stats_dump(struct ev_loop *loop)
+{
+	ucl_object_t *obj;
+	unsigned char *out;
+
+	obj = stats_to_ucl(loop);
+	out = ucl_object_emit(obj, UCL_EMIT_JSON_COMPACT);
+
+	if (out != NULL) {
+		fprintf(stderr, "%s\n", out);
+		free(out);
+	}
+
+	ucl_object_unref(obj);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_STATS_H_
+#define SRC_STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ev.h"
+#include "ucl.h"
+
+/* Log2 buckets: bucket 0 is 0, bucket i holds values in [2^(i-1), 2^i) */
+#define STATS_HIST_BUCKETS 32
+
+struct stats_hist {
+	uint64_t buckets[STATS_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/* Callback classes accounted by the event loop instrumentation */
+enum stats_cb_class {
+	stats_cb_accept = 0,
+	stats_cb_greet,
+	stats_cb_connect,
+	stats_cb_relay,
+	stats_cb_timer,
+	stats_cb_alert,
+	stats_cb_admin,
+	stats_cb_handoff,
+	stats_cb_rebalance,
+	stats_cb_shaper,
+	stats_cb_max
+};
+
+void stats_hist_add(struct stats_hist *h, uint64_t v);
+/* The same for histograms updated by several threads */
+void stats_hist_add_shared(struct stats_hist *h, uint64_t v);
+ucl_object_t* stats_hist_to_ucl(const struct stats_hist *h);
+
+/*
+ * Attaches loop instrumentation to `loop` according to the `stats` section
+ * of the configuration (may be NULL). Uses ev_userdata and the invoke
+ * pending callback of the loop.
+ */
+bool stats_init(struct ev_loop *loop, const ucl_object_t *cfg);
+
+/*
+ * Marks the start of a callback of class `cls`, the time until the next
+ * callback or the end of the loop iteration is accounted to it. No-op for
+ * loops without stats.
+ */
+void stats_cb(struct ev_loop *loop, enum stats_cb_class cls);
+
+/* Returns a new UCL object with all loop statistics */
+ucl_object_t* stats_to_ucl(struct ev_loop *loop);
+
+/* Dumps statistics as JSON to stderr */
+void stats_dump(struct ev_loop *loop);
+
+#endif /* SRC_STATS_H_ */
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * TCP_INFO telemetry: RTT, retransmits, congestion window and delivery rate
+ * of both legs of a session, taken when a leg closes and, optionally, every
+ * `interval` for long sessions. Every reading is a system call, so a token
+ * bucket per worker limits them to `rate` per second; readings over the
+ * budget are skipped, not delayed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+/* Not netinet/tcp.h, its struct tcp_info lacks the delivery rate */
+#include <linux/tcp.h>
+#endif
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "stats.h"
+#include "tcpinfo.h"
+#include "sni-private.h"
+
+static const double default_rate = 5000;
+/* Periodic sampling walks the sessions once a second */
+static const double periodic_tick = 1.0;
+
+struct tcpinfo_state {
+	struct sni_worker *worker;
+	/* Readings per second and the bucket, with a second worth of burst */
+	double rate;
+	double tokens;
+	ev_tstamp last_refill;
+	/* Age and period of periodic readings, 0 if only at close */
+	ev_tstamp interval;
+	ev_timer periodic;
+	/* Next session to look at in the periodic walk */
+	struct ssl_session *cursor;
+	/* Transparent sessions sent to their original destination */
+	struct tcpinfo_hists original;
+	uint64_t samples;
+	uint64_t skipped;
+};
+
+static void
+tcpinfo_refill(struct tcpinfo_state *st, ev_tstamp now)
+{
+	st->tokens += (now - st->last_refill) * st->rate;
+	st->last_refill = now;
+
+	if (st->tokens > st->rate) {
+		st->tokens = st->rate;
+	}
+}
+
+/* Both legs of a session are read or none, so that they can be compared */
+static bool
+tcpinfo_take(struct tcpinfo_state *st, ev_tstamp now, unsigned n)
+{
+	tcpinfo_refill(st, now);
+
+	if (st->tokens < n) {
+		st->skipped += n;
+		return false;
+	}
+
+	st->tokens -= n;
+
+	return true;
+}
+
+static bool
+tcpinfo_read(struct tcpinfo_state *st, int fd, ev_tstamp now,
+		struct tcpinfo_sample *s)
+{
+#ifdef __linux__
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	/* Older kernels fill less, the rest stays zero */
+	memset(&ti, 0, sizeof(ti));
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1) {
+		return false;
+	}
+
+	st->samples ++;
+	s->when = now;
+	s->rtt = ti.tcpi_rtt;
+	s->rttvar = ti.tcpi_rttvar;
+	s->retrans = ti.tcpi_total_retrans;
+	s->cwnd = ti.tcpi_snd_cwnd;
+	s->delivery_rate = ti.tcpi_delivery_rate;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool
+backend_is_tcp(const struct ssl_session *ssl)
+{
+	return ssl->bk == NULL || ucl_object_find_key(ssl->bk, "unix") == NULL;
+}
+
+void
+tcpinfo_sample_session(struct ssl_session *ssl)
+{
+	struct tcpinfo_state *st;
+	ev_tstamp now;
+	bool client, backend;
+
+	if (ssl->worker == NULL || ssl->worker->tcpi == NULL ||
+			ssl->state < ssl_state_proxy) {
+		return;
+	}
+
+	st = ssl->worker->tcpi;
+	now = ev_now(ssl->loop);
+	client = ssl->fd != -1;
+	backend = ssl->bk_fd != -1 && backend_is_tcp(ssl);
+
+	if ((!client && !backend) || !tcpinfo_take(st, now, client + backend)) {
+		return;
+	}
+
+	if (ssl->tcpi == NULL) {
+		ssl->tcpi = xmalloc0(sizeof(*ssl->tcpi));
+	}
+
+	if (client) {
+		tcpinfo_read(st, ssl->fd, now, &ssl->tcpi->cl);
+	}
+	if (backend) {
+		tcpinfo_read(st, ssl->bk_fd, now, &ssl->tcpi->bk);
+	}
+}
+
+/* Listener and backend histograms are shared by relay threads */
+static void
+hists_add(struct tcpinfo_hists *h, const struct tcpinfo_sample *s)
+{
+	stats_hist_add_shared(&h->rtt, s->rtt);
+	stats_hist_add_shared(&h->rttvar, s->rttvar);
+	stats_hist_add_shared(&h->retrans, s->retrans);
+	stats_hist_add_shared(&h->cwnd, s->cwnd);
+	stats_hist_add_shared(&h->delivery_rate, s->delivery_rate);
+}
+
+static ucl_object_t*
+hists_to_ucl(const struct tcpinfo_hists *h)
+{
+	ucl_object_t *top;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&h->rtt), "rtt_us", 0, false);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&h->rttvar), "rttvar_us", 0,
+			false);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&h->retrans), "retrans", 0,
+			false);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&h->cwnd), "cwnd", 0, false);
+	ucl_object_insert_key(top, stats_hist_to_ucl(&h->delivery_rate),
+			"delivery_rate", 0, false);
+
+	return top;
+}
+
+/*
+ * Backend histograms live with the backend as "tcpi", which backend_resolve
+ * inserts empty, so that the backend object never changes shape once it is
+ * routed to. They are created on demand by the worker owning the route.
+ */
+static struct tcpinfo_hists*
+backend_hists(ucl_object_t *bk)
+{
+	ucl_object_t *elt;
+
+	elt = (ucl_object_t *)ucl_object_find_key(bk, "tcpi");
+
+	if (elt == NULL) {
+		elt = ucl_object_new_userdata(free, NULL, NULL);
+		ucl_object_insert_key(bk, elt, "tcpi", 0, false);
+	}
+
+	if (elt->value.ud == NULL) {
+		elt->value.ud = xmalloc0(sizeof(struct tcpinfo_hists));
+	}
+
+	return elt->value.ud;
+}
+
+void
+tcpinfo_session_prepare(struct ssl_session *ssl)
+{
+	if (ssl->worker->tcpi == NULL) {
+		return;
+	}
+
+	if (ssl->listener->tcpi == NULL) {
+		ssl->listener->tcpi = xmalloc0(sizeof(*ssl->listener->tcpi));
+	}
+	if (ssl->bk != NULL) {
+		backend_hists(ssl->bk);
+	}
+}
+
+void
+tcpinfo_session_close(struct ssl_session *ssl)
+{
+	struct tcpinfo_state *st;
+
+	if (ssl->tcpi != NULL && ssl->tcpi->closed) {
+		return;
+	}
+
+	tcpinfo_sample_session(ssl);
+
+	if (ssl->tcpi == NULL) {
+		return;
+	}
+
+	st = ssl->worker->tcpi;
+	ssl->tcpi->closed = true;
+
+	if (ssl->tcpi->cl.when != 0) {
+		if (ssl->listener->tcpi == NULL) {
+			ssl->listener->tcpi = xmalloc0(sizeof(*ssl->listener->tcpi));
+		}
+		hists_add(ssl->listener->tcpi, &ssl->tcpi->cl);
+	}
+	if (ssl->tcpi->bk.when != 0) {
+		hists_add(ssl->bk ? backend_hists(ssl->bk) : &st->original,
+				&ssl->tcpi->bk);
+	}
+}
+
+void
+tcpinfo_session_unlink(struct ssl_session *ssl)
+{
+	struct tcpinfo_state *st = ssl->worker->tcpi;
+
+	if (st != NULL && st->cursor == ssl) {
+		st->cursor = ssl->next;
+	}
+}
+
+/*
+ * Walks a slice of the sessions every tick, so that all of them are visited
+ * twice per interval, and samples those due until the budget is spent
+ */
+static void
+tcpinfo_periodic_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct tcpinfo_state *st = w->data;
+	struct sni_worker *worker = st->worker;
+	struct ssl_session *ssl;
+	ev_tstamp now = ev_now(loop);
+	unsigned long steps;
+
+	stats_cb(loop, stats_cb_timer);
+	tcpinfo_refill(st, now);
+	steps = worker->nsessions * 2 * periodic_tick / st->interval + 64;
+	ssl = st->cursor ? st->cursor : worker->sessions;
+
+	while (ssl != NULL && steps -- > 0 && st->tokens >= 2.0) {
+		if (ssl->state >= ssl_state_proxy &&
+				now - ssl->started >= st->interval &&
+				(ssl->tcpi == NULL || now - ssl->tcpi->cl.when >= st->interval)) {
+			tcpinfo_sample_session(ssl);
+		}
+
+		ssl = ssl->next;
+	}
+
+	st->cursor = ssl;
+}
+
+bool
+tcpinfo_init(struct sni_worker *worker, const ucl_object_t *cfg)
+{
+	struct tcpinfo_state *st;
+	const ucl_object_t *elt;
+	double rate = default_rate, interval = 0;
+
+	if (cfg == NULL) {
+		return true;
+	}
+
+	elt = ucl_object_find_key(cfg, "enabled");
+
+	if (elt != NULL && !ucl_object_toboolean(elt)) {
+		return true;
+	}
+
+#ifndef __linux__
+	fprintf(stderr, "tcp_info is not supported on this platform\n");
+	return false;
+#endif
+
+	elt = ucl_object_find_key(cfg, "rate");
+
+	if (elt != NULL) {
+		rate = ucl_object_todouble(elt);
+
+		if (rate <= 0) {
+			fprintf(stderr, "invalid tcp_info rate: %f\n", rate);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(cfg, "interval");
+
+	if (elt != NULL) {
+		interval = ucl_object_todouble(elt);
+
+		if (interval < 0) {
+			fprintf(stderr, "invalid tcp_info interval: %f\n", interval);
+			return false;
+		}
+	}
+
+	st = xmalloc0(sizeof(*st));
+	st->worker = worker;
+	st->rate = rate;
+	st->tokens = rate;
+	st->last_refill = ev_now(worker->loop);
+	st->interval = interval;
+	worker->tcpi = st;
+
+	if (interval > 0) {
+		st->periodic.data = st;
+		ev_timer_init(&st->periodic, tcpinfo_periodic_cb, periodic_tick,
+				periodic_tick);
+		ev_timer_start(worker->loop, &st->periodic);
+		ev_unref(worker->loop);
+	}
+
+	return true;
+}
+
+ucl_object_t*
+tcpinfo_to_ucl(struct sni_worker *worker)
+{
+	struct tcpinfo_state *st = worker->tcpi;
+	struct sni_listener *l;
+	ucl_object_t *top, *clients, *backends;
+	ucl_object_iter_t it;
+	const ucl_object_t *cur, *elt;
+	char key[256];
+	bool prefix = worker_routes_count(worker) > 1;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+
+	if (st == NULL) {
+		return top;
+	}
+
+	ucl_object_insert_key(top, ucl_object_fromint(st->samples), "samples", 0,
+			false);
+	ucl_object_insert_key(top, ucl_object_fromint(st->skipped), "skipped", 0,
+			false);
+
+	clients = ucl_object_typed_new(UCL_OBJECT);
+	backends = ucl_object_typed_new(UCL_OBJECT);
+
+	for (l = worker->listeners; l != NULL; l = l->next) {
+		if (l->tcpi != NULL) {
+			ucl_object_insert_key(clients, hists_to_ucl(l->tcpi), l->name, 0,
+					true);
+		}
+
+		if (!listener_routes_first(l)) {
+			continue;
+		}
+
+		it = NULL;
+
+		/* Routes of different listeners may share names */
+		while ((cur = ucl_iterate_object(l->backends, &it, true))) {
+			elt = ucl_object_find_key(cur, "tcpi");
+
+			if (elt == NULL || elt->value.ud == NULL) {
+				continue;
+			}
+
+			snprintf(key, sizeof(key), "%s%s%s",
+					prefix ? listener_routes_name(l) : "", prefix ? "/" : "",
+					ucl_object_key(cur));
+			ucl_object_insert_key(backends, hists_to_ucl(elt->value.ud), key,
+					0, true);
+		}
+	}
+
+	ucl_object_insert_key(top, clients, "listeners", 0, false);
+
+	if (st->original.rtt.count > 0) {
+		ucl_object_insert_key(backends, hists_to_ucl(&st->original),
+				"original_dst", 0, false);
+	}
+
+	ucl_object_insert_key(top, backends, "backends", 0, false);
+
+	return top;
+}
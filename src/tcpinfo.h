@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_TCPINFO_H_
+#define SRC_TCPINFO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "stats.h"
+
+struct sni_worker;
+struct ssl_session;
+
+/* One TCP_INFO reading of a socket */
+struct tcpinfo_sample {
+	/* 0 if the socket has not been sampled */
+	ev_tstamp when;
+	/* Smoothed RTT and its variance, microseconds */
+	uint32_t rtt;
+	uint32_t rttvar;
+	/* Segments retransmitted over the connection lifetime */
+	uint32_t retrans;
+	/* Congestion window, segments */
+	uint32_t cwnd;
+	/* Most recent delivery rate, bytes per second */
+	uint64_t delivery_rate;
+};
+
+/* The latest readings of both legs of a session */
+struct tcpinfo_pair {
+	struct tcpinfo_sample cl;
+	struct tcpinfo_sample bk;
+	/* The final samples are taken, when the first leg closes */
+	bool closed;
+};
+
+struct tcpinfo_hists {
+	struct stats_hist rtt;
+	struct stats_hist rttvar;
+	struct stats_hist retrans;
+	struct stats_hist cwnd;
+	struct stats_hist delivery_rate;
+};
+
+/*
+ * Enables sampling on `worker` according to the `tcp_info` section of the
+ * configuration (may be NULL, then sampling is off)
+ */
+bool tcpinfo_init(struct sni_worker *worker, const ucl_object_t *cfg);
+
+/*
+ * Samples both legs of a session that reached the backend, unless the worker
+ * is out of its sampling budget
+ */
+void tcpinfo_sample_session(struct ssl_session *ssl);
+
+/*
+ * Takes the final samples of a closing session and adds its latest ones to
+ * the client and backend histograms, only the first call has effect
+ */
+void tcpinfo_session_close(struct ssl_session *ssl);
+
+/*
+ * Creates the histograms a session adds to when it closes, before it is
+ * handed to a relay thread
+ */
+void tcpinfo_session_prepare(struct ssl_session *ssl);
+
+/* Must be called for every session leaving the worker's session list */
+void tcpinfo_session_unlink(struct ssl_session *ssl);
+
+/* Returns a new UCL object with the client and per-backend histograms */
+ucl_object_t* tcpinfo_to_ucl(struct sni_worker *worker);
+
+#endif /* SRC_TCPINFO_H_ */
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "tls.h"
+
+#if !defined(__GNUC__)
+#  ifdef __IBMC__
+#    pragma pack(1)
+#  else
+#    pragma pack(push, 1)
+#  endif
+#endif
+
+static const unsigned int tls_handshake = 0x16;
+static const unsigned int tls_major = 0x3;
+static const unsigned int tls_max_minor = 0x4;
+static const unsigned int tls_greeting = 0x1;
+static const unsigned int sni_type = 0x0;
+static const unsigned int sni_host = 0x0;
+
+struct ssl_header {
+	uint8_t tls_type;
+	uint8_t ssl_version[2];
+	uint8_t len[2];
+	uint8_t type;
+	uint8_t greeting_len[3];
+	uint16_t tls_version;
+	uint8_t random[32];
+} _PACKED;
+
+struct sni_ext {
+	uint8_t slen[2];
+	uint8_t type;
+	uint8_t hlen[2];
+	uint8_t host[1]; /* Extended */
+} _PACKED;
+
+static inline unsigned int
+int_3byte_be(const unsigned char *p) {
+	return
+	(((unsigned int)(p[2])      ) |
+	 ((unsigned int)(p[1]) <<  8) |
+	 ((unsigned int)(p[0]) << 16));
+}
+
+static inline unsigned int
+int_2byte_be(const unsigned char *p) {
+	return
+	(((unsigned int)(p[1])      ) |
+	 ((unsigned int)(p[0]) <<  8));
+}
+
+static int
+parse_extension(struct tls_greeting *greet, const unsigned char *pos,
+		size_t remain)
+{
+	unsigned int tlen, type;
+	const struct sni_ext *sni;
+
+	if (remain < 4) {
+		return remain == 0 ? 0 : -1;
+	}
+
+	type = int_2byte_be(pos);
+	tlen = int_2byte_be(pos + 2);
+
+	if (tlen + 4 > remain) {
+		return -1;
+	}
+
+	if (type == sni_type) {
+		if (tlen < sizeof(*sni)) {
+			return -1;
+		}
+
+		sni = (const struct sni_ext *)(pos + 4);
+		if (int_2byte_be(sni->slen) != tlen - 2 ||
+			sni->type != sni_host ||
+			int_2byte_be(sni->hlen) != tlen - 5) {
+			return -1;
+		}
+
+		greet->hostname = sni->host;
+		greet->hostlen = tlen - 5;
+	}
+
+	return tlen + 4;
+}
+
+enum tls_greeting_status
+tls_parse_greeting(const unsigned char *buf, size_t len,
+		struct tls_greeting *greet)
+{
+	const unsigned char *p = buf;
+	const struct ssl_header *sslh;
+	size_t remain, reclen, tlen;
+	int ret;
+
+	memset(greet, 0, sizeof(*greet));
+
+	/* Wait for the record header */
+	if (len < 5) {
+		if ((len > 0 && buf[0] != tls_handshake) ||
+				(len > 1 && buf[1] != tls_major)) {
+			return tls_greeting_invalid;
+		}
+
+		return tls_greeting_partial;
+	}
+
+	sslh = (const struct ssl_header *)p;
+	memcpy(greet->ssl_version, sslh->ssl_version, 2);
+
+	/* Not an SSL packet */
+	if (sslh->tls_type != tls_handshake ||
+		sslh->ssl_version[0] != tls_major ||
+		sslh->ssl_version[1] > tls_max_minor) {
+		return tls_greeting_invalid;
+	}
+
+	reclen = int_2byte_be(sslh->len);
+
+	if (reclen + 5 <= sizeof(*sslh)) {
+		return tls_greeting_invalid;
+	}
+	if (len < reclen + 5) {
+		return tls_greeting_partial;
+	}
+
+	/*
+	 * The ClientHello must fit in the first record, anything after it
+	 * (e.g. TLS 1.3 early data) is not our business
+	 */
+	if (sslh->type != tls_greeting ||
+		int_3byte_be(sslh->greeting_len) != reclen - 4) {
+		return tls_greeting_invalid;
+	}
+
+	p = p + sizeof(*sslh);
+	remain = reclen + 5 - sizeof(*sslh);
+
+	/* Session id */
+	tlen = *p;
+	if (tlen + 1 > remain) {
+		return tls_greeting_invalid;
+	}
+	p = p + tlen + 1;
+	remain -= tlen + 1;
+
+	/* Cipher suite */
+	if (remain < 2) {
+		return tls_greeting_invalid;
+	}
+	tlen = int_2byte_be(p);
+	if (tlen + 2 > remain) {
+		return tls_greeting_invalid;
+	}
+	p = p + tlen + 2;
+	remain -= tlen + 2;
+
+	/* Compression methods */
+	if (remain < 1) {
+		return tls_greeting_invalid;
+	}
+	tlen = *p;
+	if (tlen + 1 > remain) {
+		return tls_greeting_invalid;
+	}
+	p = p + tlen + 1;
+	remain -= tlen + 1;
+
+	/* No extensions at all, so no SNI either */
+	if (remain == 0) {
+		return tls_greeting_complete;
+	}
+
+	/* Now extensions */
+	if (remain < 2) {
+		return tls_greeting_invalid;
+	}
+	tlen = int_2byte_be(p);
+	if (tlen + 2 > remain) {
+		return tls_greeting_invalid;
+	}
+
+	p += 2;
+	remain = tlen;
+
+	while ((ret = parse_extension(greet, p, remain)) > 0) {
+		p += ret;
+		remain -= ret;
+	}
+
+	return ret == 0 ? tls_greeting_complete : tls_greeting_invalid;
+}